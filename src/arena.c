@@ -0,0 +1,96 @@
+/* Copyright 2014-2015 David Pearson.
+ * All rights reserved.
+ *
+ * The bump allocator for per-image temporaries, see arena.h.
+ */
+
+// posix_memalign() is POSIX rather than C99
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+
+#include "arena.h"
+
+// Function definitions
+void free_overflow(arena_t *arena);
+
+/* Allocates memory from an arena, which stays valid until the arena is next reset
+ *
+ * arena - The arena
+ * size - The number of bytes needed
+ *
+ * Returns memory aligned to ARENA_ALIGN, or NULL if the arena was full and couldn't grow
+ */
+void *arena_alloc(arena_t *arena, size_t size) {
+	// Every allocation takes a whole number of cache lines, and at least one, so that they all get
+	// an address of their own
+	size_t rounded = size > 0 ? (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN : ARENA_ALIGN;
+	if (rounded <= arena->size - arena->used) {
+		void *ptr = arena->base + arena->used;
+		arena->used += rounded;
+		return ptr;
+	}
+
+	// The first image of a new size won't fit, so it gets blocks of its own for now; the header of
+	// each one takes up a cache line so that what follows is still aligned
+	void *block;
+	if (posix_memalign(&block, ARENA_ALIGN, ARENA_ALIGN + rounded) != 0) {
+		return NULL;
+	}
+	*(void **)block = arena->overflow;
+	arena->overflow = block;
+	arena->overflow_size += rounded;
+
+	return (uint8_t *)block + ARENA_ALIGN;
+}
+
+/* Frees the blocks that an arena allocated because its main block was full
+ *
+ * arena - The arena
+ */
+void free_overflow(arena_t *arena) {
+	while (arena->overflow != NULL) {
+		void *next = *(void **)arena->overflow;
+		free(arena->overflow);
+		arena->overflow = next;
+	}
+	arena->overflow_size = 0;
+}
+
+/* Hands back everything allocated from an arena at once, which only takes a single store unless
+ * the main block overflowed since the last reset; if it did, it's replaced by one big enough for
+ * everything that was allocated, so that the next image the same size fits in it
+ *
+ * arena - The arena
+ */
+void arena_reset(arena_t *arena) {
+	if (arena->overflow != NULL) {
+		size_t needed = arena->used + arena->overflow_size;
+		free_overflow(arena);
+		free(arena->base);
+
+		// If the new block can't be allocated, the arena starts over empty, and later allocations
+		// try again with blocks of their own
+		void *base;
+		if (posix_memalign(&base, ARENA_ALIGN, needed) == 0) {
+			arena->base = base;
+			arena->size = needed;
+		} else {
+			arena->base = NULL;
+			arena->size = 0;
+		}
+	}
+	arena->used = 0;
+}
+
+/* Frees all of an arena's memory, leaving it empty but still usable
+ *
+ * arena - The arena
+ */
+void arena_free(arena_t *arena) {
+	free_overflow(arena);
+	free(arena->base);
+	arena->base = NULL;
+	arena->size = 0;
+	arena->used = 0;
+}
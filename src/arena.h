@@ -0,0 +1,39 @@
+/* Copyright 2014-2015 David Pearson.
+ * All rights reserved.
+ *
+ * A bump allocator for the temporaries that a defogging context needs for each image. Everything
+ * is carved out of one large block that is handed back all at once with arena_reset() before the
+ * next image, so a long run of images of the same size never calls malloc() or faults in fresh
+ * pages after the first one. This is internal to the library.
+ */
+
+#ifndef DEFOG_ARENA_H
+#define DEFOG_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The alignment of every allocation, which is a cache line, so that no two bands' buffers share
+// one and every buffer starts on a boundary that suits any of the SIMD kernels
+#define ARENA_ALIGN 64
+
+// The arena; it starts out empty when zeroed
+typedef struct {
+	// The block that allocations are carved from, its size, and how much of it is in use
+	uint8_t *base;
+	size_t size;
+	size_t used;
+
+	// Blocks of their own for allocations that didn't fit in the main block, in a list threaded
+	// through their first bytes, and their total size; they are freed at the next reset, and the
+	// main block is grown to hold everything that was allocated
+	void *overflow;
+	size_t overflow_size;
+} arena_t;
+
+// Function definitions
+void *arena_alloc(arena_t *arena, size_t size);
+void arena_reset(arena_t *arena);
+void arena_free(arena_t *arena);
+
+#endif
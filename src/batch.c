@@ -0,0 +1,552 @@
+/* Copyright 2014-2015 David Pearson.
+ * All rights reserved.
+ *
+ * Pipelined batch defogging, see batch.h.
+ */
+
+// Directories, strdup(), sysconf(), and clock_gettime() are POSIX rather than C99
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cv.h>
+#include <highgui.h>
+
+#include "batch.h"
+#include "telemetry.h"
+
+// An image on its way through the pipeline, along with its results once they exist
+typedef struct {
+	const char *input;
+	char out_path[FILENAME_MAX];
+	char map_path[FILENAME_MAX];
+	IplImage *img;
+	IplImage *out;
+	IplImage *map;
+
+	// What the image looked like and how long it took, for the telemetry
+	CvSize size;
+	defog_stats_t stats;
+	telemetry_io_t io;
+} batch_job_t;
+
+// A bounded queue of jobs between two stages; pushing blocks while it's full, and popping blocks
+// while it's empty until every producer has finished
+typedef struct {
+	batch_job_t **jobs;
+	int capacity;
+	int head;
+	int count;
+	int producers;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+} batch_queue_t;
+
+// The inputs being defogged and the state shared by every thread
+typedef struct {
+	const defog_params_t *params;
+	const batch_opts_t *opts;
+	char **inputs;
+	int num_inputs;
+
+	// The next input to be decoded, how many images made it through, and whether any failed
+	int next_input;
+	int num_done;
+	int failed;
+	pthread_mutex_t lock;
+
+	batch_queue_t decoded;
+	batch_queue_t defogged;
+} batch_t;
+
+// Function definitions
+int add_input(batch_t *batch, const char *path);
+int add_directory(batch_t *batch, const char *path);
+int add_list(batch_t *batch, const char *path);
+int compare_paths(const void *a, const void *b);
+int init_queue(batch_queue_t *queue, int capacity, int producers);
+void free_queue(batch_queue_t *queue);
+void push_job(batch_queue_t *queue, batch_job_t *job);
+batch_job_t *pop_job(batch_queue_t *queue);
+void finish_producer(batch_queue_t *queue);
+void free_job(batch_job_t *job);
+void record_result(batch_t *batch, int failed);
+void *decode_thread(void *arg);
+void *defog_thread(void *arg);
+void *encode_thread(void *arg);
+
+/* Appends a copy of a path to the list of inputs
+ *
+ * batch - The batch to add the input to
+ * path - The path of the image
+ *
+ * Returns 0 on success or -1 if memory couldn't be allocated
+ */
+int add_input(batch_t *batch, const char *path) {
+	// Grow the list whenever its size reaches a power of two
+	int n = batch->num_inputs;
+	if ((n & (n - 1)) == 0) {
+		char **inputs = (char **)realloc(batch->inputs, (n == 0 ? 1 : 2 * n) * sizeof(char *));
+		if (inputs == NULL) {
+			return -1;
+		}
+		batch->inputs = inputs;
+	}
+
+	batch->inputs[n] = strdup(path);
+	if (batch->inputs[n] == NULL) {
+		return -1;
+	}
+	batch->num_inputs++;
+
+	return 0;
+}
+
+/* Orders two input paths alphabetically, for qsort()
+ *
+ * a - A pointer to the first path
+ * b - A pointer to the second path
+ *
+ * Returns a negative number, zero, or a positive number as a sorts before, with, or after b
+ */
+int compare_paths(const void *a, const void *b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Adds every regular file in a directory (but not its subdirectories or hidden files) to the list
+ * of inputs, in alphabetical order
+ *
+ * batch - The batch to add the inputs to
+ * path - The path of the directory
+ *
+ * Returns 0 on success or -1 if the directory couldn't be read
+ */
+int add_directory(batch_t *batch, const char *path) {
+	DIR *dir = opendir(path);
+	if (dir == NULL) {
+		fprintf(stderr, "Could not read directory %s\n", path);
+		return -1;
+	}
+
+	int first = batch->num_inputs;
+	int failed = 0;
+	struct dirent *entry;
+	while (!failed && (entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+
+		// Join the directory and the name, then skip anything that isn't a regular file
+		char file[FILENAME_MAX];
+		struct stat info;
+		if (snprintf(file, sizeof(file), "%s/%s", path, entry->d_name) >= (int)sizeof(file)) {
+			fprintf(stderr, "Path of %s in %s is too long\n", entry->d_name, path);
+			failed = 1;
+		} else if (stat(file, &info) == 0 && S_ISREG(info.st_mode) && add_input(batch, file) != 0) {
+			failed = 1;
+		}
+	}
+	closedir(dir);
+
+	// readdir() returns the files in no particular order
+	qsort(batch->inputs + first, batch->num_inputs - first, sizeof(char *), compare_paths);
+
+	return failed ? -1 : 0;
+}
+
+/* Adds the inputs listed in a file, one path per line, skipping blank lines
+ *
+ * batch - The batch to add the inputs to
+ * path - The path of the list
+ *
+ * Returns 0 on success or -1 if the list couldn't be read
+ */
+int add_list(batch_t *batch, const char *path) {
+	FILE *list = fopen(path, "r");
+	if (list == NULL) {
+		fprintf(stderr, "Could not read list %s\n", path);
+		return -1;
+	}
+
+	int failed = 0;
+	char line[FILENAME_MAX];
+	while (!failed && fgets(line, sizeof(line), list) != NULL) {
+		size_t len = strcspn(line, "\r\n");
+		if (line[len] == '\0' && !feof(list)) {
+			fprintf(stderr, "Path in list %s is too long\n", path);
+			failed = 1;
+		} else if (len > 0) {
+			line[len] = '\0';
+			failed = add_input(batch, line) != 0;
+		}
+	}
+	if (ferror(list)) {
+		fprintf(stderr, "Could not read list %s\n", path);
+		failed = 1;
+	}
+	fclose(list);
+
+	return failed ? -1 : 0;
+}
+
+/* Allocates the slots of a queue and its synchronization primitives
+ *
+ * queue - The queue to initialize
+ * capacity - The most jobs that can wait in the queue
+ * producers - The number of threads that push jobs onto the queue
+ *
+ * Returns 0 on success or -1 if the queue couldn't be created
+ */
+int init_queue(batch_queue_t *queue, int capacity, int producers) {
+	queue->jobs = (batch_job_t **)malloc(capacity * sizeof(batch_job_t *));
+	if (queue->jobs == NULL) {
+		return -1;
+	}
+	queue->capacity = capacity;
+	queue->head = 0;
+	queue->count = 0;
+	queue->producers = producers;
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->not_empty, NULL);
+	pthread_cond_init(&queue->not_full, NULL);
+
+	return 0;
+}
+
+/* Frees a queue, which must be empty
+ *
+ * queue - The queue to free
+ */
+void free_queue(batch_queue_t *queue) {
+	pthread_cond_destroy(&queue->not_full);
+	pthread_cond_destroy(&queue->not_empty);
+	pthread_mutex_destroy(&queue->lock);
+	free(queue->jobs);
+}
+
+/* Adds a job to the back of a queue, waiting for a slot to free up if it's full
+ *
+ * queue - The queue to add the job to
+ * job - The job to add
+ */
+void push_job(batch_queue_t *queue, batch_job_t *job) {
+	pthread_mutex_lock(&queue->lock);
+	while (queue->count == queue->capacity) {
+		pthread_cond_wait(&queue->not_full, &queue->lock);
+	}
+	queue->jobs[(queue->head + queue->count) % queue->capacity] = job;
+	queue->count++;
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+/* Takes the job at the front of a queue, waiting for one to arrive if it's empty
+ *
+ * queue - The queue to take the job from
+ *
+ * Returns the job, or NULL if the queue is empty and every producer has finished
+ */
+batch_job_t *pop_job(batch_queue_t *queue) {
+	pthread_mutex_lock(&queue->lock);
+	while (queue->count == 0 && queue->producers > 0) {
+		pthread_cond_wait(&queue->not_empty, &queue->lock);
+	}
+
+	batch_job_t *job = NULL;
+	if (queue->count > 0) {
+		job = queue->jobs[queue->head];
+		queue->head = (queue->head + 1) % queue->capacity;
+		queue->count--;
+		pthread_cond_signal(&queue->not_full);
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	return job;
+}
+
+/* Records that one of a queue's producers won't push any more jobs, waking every consumer once the
+ * last one has finished so that they can see that the queue is closed
+ *
+ * queue - The queue that the producer was pushing onto
+ */
+void finish_producer(batch_queue_t *queue) {
+	pthread_mutex_lock(&queue->lock);
+	if (--queue->producers == 0) {
+		pthread_cond_broadcast(&queue->not_empty);
+	}
+	pthread_mutex_unlock(&queue->lock);
+}
+
+/* Releases a job and whichever of its images exist
+ *
+ * job - The job to free
+ */
+void free_job(batch_job_t *job) {
+	if (job->img != NULL) {
+		cvReleaseImage(&job->img);
+	}
+	if (job->out != NULL) {
+		cvReleaseImage(&job->out);
+	}
+	if (job->map != NULL) {
+		cvReleaseImage(&job->map);
+	}
+	free(job);
+}
+
+/* Counts an image that has left the pipeline
+ *
+ * batch - The batch that the image belonged to
+ * failed - Whether the image couldn't be read, defogged, or written
+ */
+void record_result(batch_t *batch, int failed) {
+	pthread_mutex_lock(&batch->lock);
+	if (failed) {
+		batch->failed = 1;
+	} else {
+		batch->num_done++;
+	}
+	pthread_mutex_unlock(&batch->lock);
+}
+
+/* The first stage of the pipeline, which reads and decodes the inputs in turn and queues them to
+ * be defogged
+ *
+ * arg - The batch
+ *
+ * Returns NULL
+ */
+void *decode_thread(void *arg) {
+	batch_t *batch = (batch_t *)arg;
+
+	while (1) {
+		// Claim the next input
+		pthread_mutex_lock(&batch->lock);
+		int i = batch->next_input++;
+		pthread_mutex_unlock(&batch->lock);
+		if (i >= batch->num_inputs) {
+			break;
+		}
+
+		batch_job_t *job = (batch_job_t *)calloc(1, sizeof(batch_job_t));
+		if (job == NULL) {
+			fprintf(stderr, "Could not allocate memory for image %s\n", batch->inputs[i]);
+			record_result(batch, 1);
+			continue;
+		}
+		job->input = batch->inputs[i];
+
+		// Read in the image, keeping 16-bit and floating point images at their own depth
+		double start = telemetry_time();
+		job->img = (IplImage *)cvLoadImage(job->input, CV_LOAD_IMAGE_COLOR | CV_LOAD_IMAGE_ANYDEPTH);
+		job->io.decode_time = telemetry_time() - start;
+		if (job->img == NULL) {
+			fprintf(stderr, "Could not read image %s\n", job->input);
+			free_job(job);
+			record_result(batch, 1);
+			continue;
+		}
+
+		// Then work out where the results go, which depends on the depth of the image, before it's
+		// defogged
+		if (batch->opts->paths(job->input, job->img->depth, job->out_path, job->map_path, batch->opts->paths_arg) != 0) {
+			free_job(job);
+			record_result(batch, 1);
+			continue;
+		}
+
+		push_job(&batch->decoded, job);
+	}
+
+	finish_producer(&batch->decoded);
+	return NULL;
+}
+
+/* The second stage of the pipeline, which defogs decoded images with a context of its own and
+ * queues the results to be written
+ *
+ * arg - The batch
+ *
+ * Returns NULL
+ */
+void *defog_thread(void *arg) {
+	batch_t *batch = (batch_t *)arg;
+
+	// Contexts keep their buffers between images, so each worker needs its own. A worker without
+	// one still drains the queue, so that the decoders never wait on it forever
+	defog_ctx_t *ctx = defog_create(batch->params, 0, 0);
+	if (ctx == NULL) {
+		fprintf(stderr, "Could not create a defogging context\n");
+	}
+
+	batch_job_t *job;
+	while ((job = pop_job(&batch->decoded)) != NULL) {
+		if (ctx == NULL) {
+			free_job(job);
+			record_result(batch, 1);
+			continue;
+		}
+
+		// Create empty images for the transmission map (if it's needed) and the output image
+		CvSize size = cvGetSize(job->img);
+		job->size = size;
+		job->out = cvCreateImage(size, job->img->depth, job->img->nChannels);
+		job->map = batch->opts->write_map ? cvCreateImage(size, IPL_DEPTH_8U, 1) : NULL;
+
+		if (defog_process(ctx, job->img, job->out, job->map) != 0) {
+			fprintf(stderr, "Could not defog image %s\n", job->input);
+			if (batch->opts->telemetry != NULL) {
+				telemetry_write_json(batch->opts->telemetry, job->input, -1, size.width, size.height, 1, NULL, &job->io);
+			}
+			free_job(job);
+			record_result(batch, 1);
+			continue;
+		}
+
+		// The input isn't needed any more, so don't hold on to it while the results are written
+		defog_get_stats(ctx, &job->stats);
+		cvReleaseImage(&job->img);
+		push_job(&batch->defogged, job);
+	}
+
+	if (ctx != NULL) {
+		defog_destroy(ctx);
+	}
+	finish_producer(&batch->defogged);
+	return NULL;
+}
+
+/* The last stage of the pipeline, which encodes and writes the results of each defogged image
+ *
+ * arg - The batch
+ *
+ * Returns NULL
+ */
+void *encode_thread(void *arg) {
+	batch_t *batch = (batch_t *)arg;
+
+	batch_job_t *job;
+	while ((job = pop_job(&batch->defogged)) != NULL) {
+		int failed = 0;
+		double start = telemetry_time();
+		if (job->map != NULL && !cvSaveImage(job->map_path, job->map, 0)) {
+			fprintf(stderr, "Could not write image %s\n", job->map_path);
+			failed = 1;
+		}
+		if (!cvSaveImage(job->out_path, job->out, 0)) {
+			fprintf(stderr, "Could not write image %s\n", job->out_path);
+			failed = 1;
+		}
+		job->io.encode_time = telemetry_time() - start;
+
+		// The line is written once the image is finished with, so it has every stage's time
+		if (batch->opts->telemetry != NULL) {
+			telemetry_write_json(batch->opts->telemetry, job->input, -1, job->size.width, job->size.height, 0, &job->stats,
+				&job->io);
+		}
+		free_job(job);
+		record_result(batch, failed);
+	}
+
+	return NULL;
+}
+
+/* Defogs a batch of images through a pipeline of decoding, defogging, and encoding threads. Each
+ * input is either an image or a directory of them, and more can be listed in opts->list; inputs
+ * that can't be processed are reported and skipped
+ *
+ * params - The parameters that every image is defogged with
+ * opts - How the pipeline is laid out and where its results go; workers and queue_size default to
+ *        one context per params->num_threads cores and twice the number of workers if they're 0
+ * inputs - The paths of the images and directories to defog
+ * num_inputs - The number of paths in inputs
+ *
+ * Returns 0 if every image was defogged and written, or 1 otherwise
+ */
+int run_batch(const defog_params_t *params, const batch_opts_t *opts, const char *const *inputs, int num_inputs) {
+	// Unless told otherwise, keep every core busy with workers, and give each stage enough slack to
+	// carry on while another one stalls on a slow image
+	batch_opts_t layout = *opts;
+	if (layout.workers < 1) {
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		layout.workers = cores > params->num_threads ? (int)(cores / params->num_threads) : 1;
+	}
+	if (layout.queue_size < 1) {
+		layout.queue_size = 2 * layout.workers;
+	}
+	opts = &layout;
+
+	batch_t batch;
+	memset(&batch, 0, sizeof(batch));
+	batch.params = params;
+	batch.opts = opts;
+
+	// Expand the inputs into a flat list of images, giving up on the bad ones
+	int failed = 0;
+	for (int i = 0; i < num_inputs; i++) {
+		struct stat info;
+		if (stat(inputs[i], &info) == 0 && S_ISDIR(info.st_mode)) {
+			failed |= add_directory(&batch, inputs[i]) != 0;
+		} else if (add_input(&batch, inputs[i]) != 0) {
+			failed = 1;
+		}
+	}
+	if (opts->list != NULL && add_list(&batch, opts->list) != 0) {
+		failed = 1;
+	}
+
+	// Then run every image through the pipeline, with each stage closing the next one's queue when
+	// its last thread finishes
+	int num_threads = opts->decoders + opts->workers + opts->encoders;
+	pthread_t *threads = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+	if (threads == NULL || init_queue(&batch.decoded, opts->queue_size, opts->decoders) != 0) {
+		fprintf(stderr, "Could not allocate memory for the batch\n");
+		free(threads);
+		failed = 1;
+		num_threads = 0;
+	} else if (init_queue(&batch.defogged, opts->queue_size, opts->workers) != 0) {
+		fprintf(stderr, "Could not allocate memory for the batch\n");
+		free_queue(&batch.decoded);
+		free(threads);
+		failed = 1;
+		num_threads = 0;
+	} else {
+		pthread_mutex_init(&batch.lock, NULL);
+
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (int i = 0; i < num_threads; i++) {
+			void *(*stage)(void *) = i < opts->decoders ? decode_thread :
+				i < opts->decoders + opts->workers ? defog_thread : encode_thread;
+			pthread_create(&threads[i], NULL, stage, &batch);
+		}
+		for (int i = 0; i < num_threads; i++) {
+			pthread_join(threads[i], NULL);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		printf("Defogged %d of %d images in %.2f s\n", batch.num_done, batch.num_inputs,
+			(end.tv_sec - start.tv_sec) + 1e-9 * (end.tv_nsec - start.tv_nsec));
+		failed |= batch.failed || batch.num_done < batch.num_inputs;
+
+		pthread_mutex_destroy(&batch.lock);
+		free_queue(&batch.defogged);
+		free_queue(&batch.decoded);
+		free(threads);
+	}
+
+	for (int i = 0; i < batch.num_inputs; i++) {
+		free(batch.inputs[i]);
+	}
+	free(batch.inputs);
+
+	return failed;
+}
@@ -0,0 +1,61 @@
+/* Copyright 2014-2015 David Pearson.
+ * All rights reserved.
+ *
+ * Batch defogging of many images, which are decoded, defogged, and encoded by separate pools of
+ * threads connected by bounded queues, so that disk I/O overlaps with the computation and every
+ * core is kept busy.
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+
+#include "defog.h"
+
+/* Builds the paths that the results for an input image are written to
+ *
+ * input - The path of the input image
+ * depth - The depth of the decoded input image, which the output has too
+ * out_path - The buffer of FILENAME_MAX bytes to write the output path to
+ * map_path - The buffer of FILENAME_MAX bytes to write the transmission map path to, which is only
+ *            used if maps are being written
+ * arg - The argument given in batch_opts_t
+ *
+ * Returns 0 on success or non-zero if the paths couldn't be built or can't hold the output
+ */
+typedef int (*batch_paths_fn)(const char *input, int depth, char *out_path, char *map_path, void *arg);
+
+// How a batch is spread across threads and where its results go
+typedef struct {
+	// The number of threads reading and decoding input images
+	int decoders;
+
+	// The number of threads defogging images, each with its own context (and so its own
+	// params->num_threads bands)
+	int workers;
+
+	// The number of threads encoding and writing the results
+	int encoders;
+
+	// How many images may wait between two stages; this bounds the memory used, since no more
+	// images are held at once than there are threads and queue slots
+	int queue_size;
+
+	// Whether the transmission map of each image is written alongside it
+	int write_map;
+
+	// A file listing further inputs, one path per line, or NULL
+	const char *list;
+
+	// Builds the output paths of each input image once it has been decoded
+	batch_paths_fn paths;
+	void *paths_arg;
+
+	// Where a JSON line is written for each image, or NULL
+	FILE *telemetry;
+} batch_opts_t;
+
+int run_batch(const defog_params_t *params, const batch_opts_t *opts, const char *const *inputs, int num_inputs);
+
+#endif
@@ -0,0 +1,270 @@
+/* Copyright 2014-2015 David Pearson.
+ * All rights reserved.
+ *
+ * A benchmark for the defogging pipeline, see bench.h.
+ */
+
+// clock_gettime() is POSIX rather than C99
+#define _POSIX_C_SOURCE 200112L
+
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <cv.h>
+#include <highgui.h>
+
+#include "bench.h"
+
+// The totals of each stage's time over all of the runs of one benchmark
+typedef struct {
+	double convert;
+	double pyramid;
+	double light;
+	double dark;
+	double refine;
+	double recover;
+	double total;
+	double sharpness;
+	double dft;
+	double encode;
+} bench_times_t;
+
+// The sizes that synthetic images are generated at, from VGA up to 4K
+static const CvSize bench_sizes[] = {
+	{640, 480},
+	{1280, 720},
+	{1920, 1080},
+	{3840, 2160}
+};
+
+// The dark channel window widths that every image is benchmarked with: the ones that
+// running_min() has its own unrolled copies for, and one that takes its generic path
+static const int bench_windows[] = {15, 20, 21, 30, 31};
+
+#define COUNT(array) ((int)(sizeof(array) / sizeof((array)[0])))
+
+// Function definitions
+double bench_time(void);
+double light_error(const defog_params_t *params, IplImage *img);
+int bench_image(const defog_params_t *params, int runs, const char *name, IplImage *img);
+void print_bench_header(const defog_params_t *params, int runs);
+
+/* Reads a monotonic clock, for timing the stages that happen outside the library
+ *
+ * Returns the current time in seconds
+ */
+double bench_time(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+/* Generates a foggy test image, so that benchmarks can be run at any size without needing real
+ * images; the scene is a noisy pattern of colored blocks that fades into a bright haze towards
+ * the top of the image, as a distant horizon would
+ *
+ * size - The size of the image
+ *
+ * Returns the new 8-bit BGR image, which must be released with cvReleaseImage(), or NULL
+ */
+IplImage *make_synthetic(CvSize size) {
+	IplImage *img = cvCreateImage(size, IPL_DEPTH_8U, 3);
+	if (img == NULL) {
+		return NULL;
+	}
+
+	// A fixed seed keeps every run of the benchmark on exactly the same pixels
+	uint32_t seed = 12345;
+	const double light = 230.0;
+
+	for (int y = 0; y < size.height; y++) {
+		uint8_t *row = (uint8_t *)(img->imageData + (size_t)y * img->widthStep);
+
+		// The scene gets further away, and so foggier, towards the top
+		double transmission = 0.15 + 0.8 * y / size.height;
+
+		for (int x = 0; x < size.width; x++) {
+			int block = (x / 48) * 7 + (y / 48) * 13;
+			for (int c = 0; c < 3; c++) {
+				seed = seed * 1103515245 + 12345;
+				double scene = (block * (c + 3) * 37) % 200 + (seed >> 16) % 24;
+				double val = scene * transmission + light * (1.0 - transmission);
+				row[x * 3 + c] = (uint8_t)(val > 255.0 ? 255.0 : val);
+			}
+		}
+	}
+
+	return img;
+}
+
+/* Measures how far the atmospheric light estimated with the benchmark's sampling step is from
+ * the one found from every pixel
+ *
+ * params - The parameters being benchmarked
+ * img - The 8-bit BGR image
+ *
+ * Returns the largest absolute difference between the two lights in any channel, or -1 if either
+ * couldn't be estimated
+ */
+double light_error(const defog_params_t *params, IplImage *img) {
+	defog_params_t exact_params = *params;
+	exact_params.light_step = 1;
+	defog_ctx_t *sampled = defog_create(params, 0, 0);
+	defog_ctx_t *exact = defog_create(&exact_params, 0, 0);
+	double error = -1.0;
+	if (sampled != NULL && exact != NULL) {
+		defog_light_t sampled_light;
+		defog_light_t exact_light;
+		if (defog_estimate_light(sampled, img, &sampled_light) == 0 && defog_estimate_light(exact, img, &exact_light) == 0) {
+			error = 0.0;
+			for (int c = 0; c < 3; c++) {
+				error = fmax(error, fabs(sampled_light.bgr[c] - exact_light.bgr[c]));
+			}
+		}
+	}
+	defog_destroy(sampled);
+	defog_destroy(exact);
+
+	return error;
+}
+
+/* Benchmarks one image at every window width, printing a line of results for each
+ *
+ * params - The parameters to defog with; the window is overridden for each line
+ * runs - How many times the image is defogged for each window
+ * name - The name to print for the image
+ * img - The 8-bit BGR image
+ *
+ * Returns 0 on success or 1 if the image couldn't be defogged
+ */
+int bench_image(const defog_params_t *params, int runs, const char *name, IplImage *img) {
+	CvSize size = cvGetSize(img);
+	IplImage *map = cvCreateImage(size, IPL_DEPTH_8U, 1);
+	IplImage *out = cvCreateImage(size, IPL_DEPTH_8U, 3);
+	double megapixels = size.width * (double)size.height * 1e-6;
+	double light_err = light_error(params, img);
+	int failed = 0;
+
+	for (int w = 0; w < COUNT(bench_windows) && !failed; w++) {
+		// With planar set, each window is timed with the image interleaved and then planar, so the
+		// two can be compared
+		for (int l = 0; l < (params->planar ? 2 : 1) && !failed; l++) {
+			defog_params_t bench_params = *params;
+			bench_params.window = bench_windows[w];
+			bench_params.planar = params->planar && l == 1;
+			defog_ctx_t *ctx = defog_create(&bench_params, size.width, size.height);
+
+			// Run once before timing anything, so that caches and page tables are warmed up
+			if (ctx == NULL || defog_process(ctx, img, out, map) != 0) {
+				fprintf(stderr, "Could not defog %s\n", name);
+				defog_destroy(ctx);
+				failed = 1;
+				break;
+			}
+
+			bench_times_t times;
+			memset(&times, 0, sizeof(times));
+			for (int i = 0; i < runs; i++) {
+				// The library times its own stages
+				defog_stats_t stats;
+				defog_process(ctx, img, out, map);
+				defog_get_stats(ctx, &stats);
+				times.convert += stats.convert_time;
+				times.pyramid += stats.pyramid_time;
+				times.light += stats.light_time;
+				times.dark += stats.dark_time;
+				times.refine += stats.refine_time;
+				times.recover += stats.recover_time;
+				times.total += stats.total_time;
+
+				// Then time the stages that happen around it
+				double start = bench_time();
+				defog_sharpness(ctx, out);
+				double sharpened = bench_time();
+				defog_evaluate(ctx, out);
+				double evaluated = bench_time();
+				CvMat *encoded = cvEncodeImage(".png", out, NULL);
+				times.encode += bench_time() - evaluated;
+				times.dft += evaluated - sharpened;
+				times.sharpness += sharpened - start;
+				if (encoded != NULL) {
+					cvReleaseMat(&encoded);
+				}
+			}
+
+			// Report the mean time of each stage in milliseconds, and the defogging throughput
+			double scale = 1000.0 / runs;
+			printf("%-20s %5dx%-5d %6d %-7s %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f %8.1f %9.0f\n",
+				name, size.width, size.height, bench_windows[w], bench_params.planar ? "planar" : "bgr", times.convert * scale,
+				times.pyramid * scale, times.light * scale, times.dark * scale,
+				times.refine * scale, times.recover * scale, times.sharpness * scale, times.dft * scale, times.encode * scale,
+				times.total * scale, megapixels * runs / times.total, light_err);
+
+			defog_destroy(ctx);
+		}
+	}
+
+	cvReleaseImage(&map);
+	cvReleaseImage(&out);
+
+	return failed;
+}
+
+/* Prints what is being benchmarked and the column headings for the results
+ *
+ * params - The parameters being benchmarked
+ * runs - How many times each image is defogged
+ */
+void print_bench_header(const defog_params_t *params, int runs) {
+	printf("%d runs per line, %d thread(s), SIMD %s, GPU %s, refinement radius %d, %d pyramid level(s), light step %d;\n",
+		runs, params->num_threads, params->use_simd ? "on" : "off", params->use_gpu ? "requested" : "off", params->refine_radius,
+		params->pyramid_levels, params->light_step);
+	printf("times are means in ms. The dark channel, refinement, and recovery times are summed across threads;\n");
+	printf("the total is the wall time of defog_process(), which the throughput is based on. The light error is\n");
+	printf("how far the sampled atmospheric light is from the one found from every pixel. The layout is how the\n");
+	printf("image is laid out while it's defogged; with --planar, splitting it into planes is the convert time\n\n");
+	printf("%-20s %11s %6s %-7s %9s %9s %9s %9s %9s %9s %9s %9s %9s %9s %8s %9s\n", "image", "size", "window", "layout",
+		"convert", "pyramid", "light", "dark", "refine", "recover", "sharpness", "dft", "encode", "total", "MP/s", "light_err");
+}
+
+/* Runs the benchmark over synthetic images at several sizes and then over real images, printing
+ * the time taken by each stage
+ *
+ * params - The parameters to defog with
+ * runs - How many times each image is defogged at each window width
+ * files - The paths of real color images to benchmark
+ * num_files - The number of paths in files, which may be 0
+ *
+ * Returns 0 on success or 1 if any image couldn't be read or defogged
+ */
+int run_bench(const defog_params_t *params, int runs, const char *const *files, int num_files) {
+	print_bench_header(params, runs);
+	int failed = 0;
+
+	for (int i = 0; i < COUNT(bench_sizes); i++) {
+		IplImage *img = make_synthetic(bench_sizes[i]);
+		if (img == NULL) {
+			fprintf(stderr, "Could not create a %dx%d image\n", bench_sizes[i].width, bench_sizes[i].height);
+			failed = 1;
+			continue;
+		}
+		failed |= bench_image(params, runs, "synthetic", img);
+		cvReleaseImage(&img);
+	}
+
+	for (int i = 0; i < num_files; i++) {
+		IplImage *img = (IplImage *)cvLoadImage(files[i], CV_LOAD_IMAGE_COLOR);
+		if (img == NULL) {
+			fprintf(stderr, "Could not read image %s\n", files[i]);
+			failed = 1;
+			continue;
+		}
+		failed |= bench_image(params, runs, files[i], img);
+		cvReleaseImage(&img);
+	}
+
+	return failed;
+}
@@ -0,0 +1,17 @@
+/* Copyright 2014-2015 David Pearson.
+ * All rights reserved.
+ *
+ * A benchmark for the defogging pipeline, which times each stage over synthetic and real images.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <cv.h>
+
+#include "defog.h"
+
+IplImage *make_synthetic(CvSize size);
+int run_bench(const defog_params_t *params, int runs, const char *const *files, int num_files);
+
+#endif
@@ -1,56 +1,377 @@
 /* Copyright 2014-2015 David Pearson.
  * All rights reserved.
  *
- * Compilation: gcc -o defog defog.c `pkg-config --libs --cflags opencv` -std=c99 -lm
- * Usage: ./defog RGB_IMAGE_FILE
+ * The defogging pipeline, see defog.h for the public interface.
  */
 
+// clock_gettime() is POSIX rather than C99
+#define _POSIX_C_SOURCE 200112L
+
+#include <pthread.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include <cv.h>
-#include <highgui.h>
 
-// Color channel definitions for convenience
-typedef enum {
-	BLUE,
-	GREEN,
-	RED
-} channel_t;
+#include "arena.h"
+#include "defog.h"
+#include "gpu.h"
+#include "kernels.h"
+
+// A running minimum that streams down an image (or a strip of its columns) a row at a time. Rows
+// are grouped into blocks of one window's height, and the stream keeps two of them: the one being
+// filled, and the one before it, which holds the minimum from each of its rows to the end of the
+// block. Together with the minimum from the start of the current block, that's enough to finish
+// one output row per input row, so the stream never needs more than two windows' worth of rows
+typedef struct {
+	int width;
+	int window;
+	int window_height;
+	int count;
+
+	// Two blocks of window rows
+	uint16_t *blocks;
+
+	// The minimum from the start of the current block
+	uint16_t *prefix;
+
+	// The finished output row
+	uint16_t *out;
+
+	// The per-pixel keys of the row being pushed, before they're filtered
+	uint16_t *keys;
+
+	// Scratch space for filtering each row with running_min()
+	uint16_t *scratch;
+
+	// The fastest kernels for finding the keys of each row, from interleaved pixels or from planes
+	dark_keys_fn dark_keys;
+	dark_keys_planar_fn dark_keys_planar;
+} dark_stream_t;
+
+// The full-image planes used to refine the transmission map with a guided filter, which are
+// shared by every band. Each stage of the filter reads rows from around its own band, so the
+// planes are filled in a stage at a time across all of the bands. In pyramid mode, the planes are
+// at the resolution of the smallest level of the pyramid instead
+typedef struct {
+	int radius;
+	double eps;
+
+	// How many times the image was halved to get to the resolution of the planes
+	int levels;
+
+	// The grayscale guide image, scaled to [0, 1]
+	float *guide;
+
+	// The raw transmission, which is replaced by the refined transmission
+	float *transmission;
+
+	// The coefficients of the filter's local linear model
+	float *coef_a;
+	float *coef_b;
+} refine_t;
+
+// A band of rows of an image that is defogged by a single thread
+typedef struct {
+	IplImage *img;
+	IplImage *map;
+	IplImage *out;
+	const double *light;
+
+	// The image that the output is recovered from, which is img itself unless img is the 8-bit
+	// copy of an image deeper than 8 bits, and the kernels for the output's depth
+	IplImage *src;
+	const depth_kernels_t *depth;
+
+	const recovery_lut_t *lut;
+	recover_row_fn recover;
+	recover_refined_fn recover_refined;
+	double floor;
+
+	// When the image has been split into planes, the planes (each of which is a full image's worth
+	// of pixels, plane_size apart), the kernels that split and recover them, or NULL otherwise
+	const uint8_t *planes;
+	size_t plane_size;
+	split_row_fn split;
+	recover_planar_fn recover_planar;
+
+	int window;
+	int window_height;
+	int y1;
+	int y2;
+	dark_stream_t stream;
+
+	// In light grid mode, the atmospheric light of each tile of the grid (which has grid_size
+	// tiles along each side), the light of each pixel in the row being defogged (which images
+	// deeper than 8 bits need too), and the range of tiles whose light the band estimates
+	defog_light_t *grid;
+	int grid_size;
+	float *light_row;
+	int first_tile;
+	int last_tile;
+	int light_step;
+	int light_per_channel;
+
+	// The planes used to refine the transmission map, or NULL if it isn't refined, and the running
+	// sums used to filter them
+	refine_t *refine;
+	double *sums;
+
+	// In pyramid mode, a row of the full-resolution transmission, the coefficients interpolated
+	// between two rows of the planes, and where each column falls between the planes' columns
+	float *t_row;
+	float *coef_rows;
+	int *x_index;
+	float *x_frac;
 
-// Representation of a pixel in the dark channel used when computing the transmission map
+	// How long the band spent on each stage, for defog_get_stats()
+	double dark_time;
+	double refine_time;
+	double recover_time;
+
+	// How many times each 8-bit transmission turned up in the rows sampled for defog_get_stats(),
+	// and a row to write the transmission of a sampled row to when there's no map to write it to
+	int samples[UINT8_MAX + 1];
+	uint8_t *sample_row;
+
+	// When rendering a preview, the preview, and room to find the dark channel of one of its tiles
+	// in (whose range of tiles is first_tile to last_tile)
+	defog_preview_t *preview;
+	uint16_t *tile_buf;
+} band_t;
+
+// The number of cells along each side of the thumbnails used to detect scene changes in videos
+#define THUMB_SIZE 8
+
+// A thread that runs one of the bands (its index, which is never 0) of every stage handed to the
+// context's workers, from defog_create() until defog_destroy()
 typedef struct {
-	int x;
-	int y;
-	double val;
-	double intensity;
-} channel_value_t;
+	defog_ctx_t *ctx;
+	int index;
+	pthread_t thread;
+} worker_t;
+
+// The state kept between images, along with the arena that each image's buffers are carved from
+struct defog_ctx {
+	defog_params_t params;
+
+	// The fastest recovery kernels that can be used, and for planar images, the kernels that split
+	// and recover them, which are NULL unless the planar parameter is set and can apply
+	recover_row_fn recover;
+	recover_refined_fn recover_refined;
+	split_row_fn split;
+	recover_planar_fn recover_planar;
+
+	// The recovery table for the atmospheric light of the most recent image, which is only rebuilt
+	// when the light or the floor changes
+	recovery_lut_t lut;
+	int lut_valid;
+
+	// The GPU backend, or NULL if it's disabled or unavailable, and whether the current image has
+	// been loaded onto it
+	gpu_ctx_t *gpu;
+	int gpu_loaded;
 
-// The width of the window used in finding the dark channel in the vicinity of a particular pixel
+	// One band for each thread requested in the parameters, and the workers that process all but
+	// the first of them (which is processed on the calling thread), of which num_workers could be
+	// started
+	band_t *bands;
+	worker_t *workers;
+	int num_workers;
+
+	// The stage that the workers are running and how many bands it has, how many workers have yet
+	// to finish their bands of it, and a count of the stages handed out, which a worker waits for
+	// to change; workers_ready is set once the lock and the conditions have been initialized
+	pthread_mutex_t workers_lock;
+	pthread_cond_t stage_ready;
+	pthread_cond_t stage_done;
+	void *(*stage)(void *);
+	int stage_bands;
+	int stage_pending;
+	unsigned stage_count;
+	int workers_quit;
+	int workers_ready;
+
+	// Where every buffer that only lasts for one image comes from, which is reset as each image
+	// starts, so that only the first image of a larger size allocates anything
+	arena_t arena;
+
+	// The planes used to refine the transmission map
+	refine_t refine;
+
+	// The downsampled copies of the image used in pyramid mode, each of which is half the size of
+	// the one before, and the headers that lay them out in the arena
+	IplImage *pyramid[DEFOG_MAX_PYRAMID_LEVELS];
+	IplImage pyramid_headers[DEFOG_MAX_PYRAMID_LEVELS];
+
+	// The kernels for the depth of the current image and, if it's deeper than 8 bits, the image
+	// itself (or NULL) and the 8-bit copy of it that everything but the recovery works from, which
+	// is laid out in the arena
+	const depth_kernels_t *depth;
+	IplImage *source;
+	IplImage *estimate;
+	IplImage estimate_header;
+
+	// The state carried between the frames of a video: the atmospheric light in use, how many
+	// frames it has been used for, and a thumbnail of the previous frame
+	int frame_count;
+	int frames_since_light;
+	defog_light_t frame_light;
+	double thumb[THUMB_SIZE * THUMB_SIZE];
+
+	// In light grid mode, the atmospheric light of each tile of the most recent image, and the
+	// lights of the tiles that are carried between the frames of a video
+	defog_light_t *grid;
+	defog_light_t *frame_grid;
+
+	// How long each stage of the most recent image took
+	defog_stats_t stats;
+};
+
+// The default width of the window used in finding the dark channel in the vicinity of a
+// particular pixel
 #define MAP_WIDTH 20
 
+// How much of the cache (a typical L2) the blocks of a dark channel stream should fit in
+#define DARK_STRIP_BYTES (256 * 1024)
+
+// How far apart the rows are whose transmission is sampled for defog_get_stats()
+#define SAMPLE_ROW_STEP 8
+
+// The number of pixels along each side of the tiles that a preview finds the dark channel of, only
+// once each tile first comes into view
+#define PREVIEW_TILE 256
+
+// The state kept while an image is previewed with different windows and floors: everything that a
+// change doesn't affect is kept, so a new floor only reruns the recovery, and a new window only
+// refinds the dark channel of the tiles that are in view
+struct defog_preview {
+	defog_ctx_t *ctx;
+
+	// The image, which belongs to the caller, and the kernels for its depth
+	IplImage *in;
+	const depth_kernels_t *depth;
+
+	// The atmospheric light and, in light grid mode, the light of each tile of the grid, neither of
+	// which depends on the window or the floor
+	defog_light_t light;
+	defog_light_t *grid;
+
+	// The dark channel key of every individual pixel, from the 8-bit copy of an image deeper than
+	// 8 bits
+	uint16_t *keys;
+
+	// The window that the dark channel is taken over, and the dark channel keys for that window
+	// around every pixel, which are only valid for the tiles whose flags are set
+	int window;
+	int window_height;
+	uint16_t *dark;
+	uint8_t *tile_valid;
+	int tiles_x;
+	int tiles_y;
+
+	// The tiles that the current render has to find the dark channel of, and the part of the image
+	// that it recovers
+	int *pending;
+	CvRect view;
+
+	// The floor that the output is recovered with, and the recovery table for it
+	double floor;
+	recovery_lut_t lut;
+	int lut_valid;
+};
+
 // Function definitions
-int scalar_min(CvScalar sc, int num_vals);
-double find_light_intensity(IplImage *img, IplImage *gray, int x1, int y1, int x2, int y2);
-int find_dark_channel(IplImage *img, int x1, int y1, int x2, int y2);
+double current_time(void);
+double clamp_floor(double floor);
+int pixel_min(const uint8_t *pixel, int num_vals);
+void find_light(IplImage *img, int x1, int y1, int x2, int y2, int step, int per_channel, defog_light_t *light);
+void running_min(const uint16_t *src, int src_stride, uint16_t *dst, int dst_stride, int len, int before, int after, uint16_t *scratch);
+int reserve_dark_stream(dark_stream_t *stream, arena_t *arena, int width, int window, int window_height);
+void reset_dark_stream(dark_stream_t *stream, int width, int window, int window_height);
+int strip_width(int width, int window, int window_height);
+const uint16_t *push_dark_keys(dark_stream_t *stream, const uint16_t *keys);
+const uint16_t *push_dark_stream(dark_stream_t *stream, const uint8_t *row);
+const uint16_t *push_dark_planes(dark_stream_t *stream, const uint8_t *plane_row, size_t plane_size);
+void *light_band(void *arg);
+void fill_light_row(const defog_light_t *grid, int grid_size, int y, CvSize size, int x1, int x2, float *light_row);
+const float *band_light_row(band_t *band, int y, CvSize size, int x1, int x2);
+uint8_t *sample_row(band_t *band, uint8_t *map_row, int y, int x);
+void count_samples(int *samples, const uint8_t *row, int width);
+void summarize_samples(defog_stats_t *stats, const int *samples, double floor);
+void *split_band(void *arg);
+void *defog_band(void *arg);
+void *transmission_band(void *arg);
+void add_row_sums(double *sums, const float *x_row, const float *y_row, int width, int products, double sign);
+void prefix_sums(const double *sums, double *prefix, int num_sums, int width);
+void *coefficients_band(void *arg);
+void *refined_band(void *arg);
+void *upsampled_band(void *arg);
+void *preview_keys_band(void *arg);
+void *dark_tiles_band(void *arg);
+void *preview_band(void *arg);
+int count_bands(const defog_ctx_t *ctx, int height);
+void *band_worker(void *arg);
+int start_workers(defog_ctx_t *ctx);
+void stop_workers(defog_ctx_t *ctx);
+void run_bands(defog_ctx_t *ctx, int num_bands, void *(*stage)(void *));
+int setup_bands(defog_ctx_t *ctx, IplImage *img, IplImage *map, IplImage *out, int window, int window_height, defog_light_t *grid);
+void split_planes(defog_ctx_t *ctx, IplImage *img, int num_bands);
+double update_lut(defog_ctx_t *ctx, recovery_lut_t *lut, int *lut_valid, const defog_light_t *light, double floor);
+void defog_image(defog_ctx_t *ctx, IplImage *img, const defog_light_t *light, defog_light_t *grid, IplImage *map, IplImage *out);
+IplImage *arena_image(arena_t *arena, IplImage *header, CvSize size, int depth, int channels);
+int reserve_buffers(defog_ctx_t *ctx, int width, int height);
+int check_images(IplImage *in, IplImage *out, IplImage *map);
+void *quantize_band(void *arg);
+IplImage *prepare_estimate(defog_ctx_t *ctx, IplImage *in);
+void load_gpu(defog_ctx_t *ctx, IplImage *in);
+void estimate_light(defog_ctx_t *ctx, IplImage *in, defog_light_t *light, defog_light_t *grid);
+IplImage *build_pyramid(defog_ctx_t *ctx, IplImage *in);
+double make_thumbnail(IplImage *img, double *thumb);
+
+/* Reads a monotonic clock, for timing the stages of the pipeline
+ *
+ * Returns the current time in seconds
+ */
+double current_time(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
 
-/* Find the minimum value in a CvScalar
+/* Keeps a transmission floor within the range that the kernels support
  *
- * sc - The scalar to find the minimum value of
- * num_vals - The number of values in the scalar, which must be >= 1
+ * floor - The floor
  *
- * Returns the index of the minimum value
+ * Returns the floor, clamped to between DEFOG_MIN_TRANSMISSION_FLOOR and 1
  */
-int scalar_min(CvScalar sc, int num_vals) {
-	// Get all values
-	double *vals = sc.val;
+double clamp_floor(double floor) {
+	// NaN fails every comparison, so it ends up at the lowest floor rather than getting through
+	if (!(floor >= DEFOG_MIN_TRANSMISSION_FLOOR)) {
+		return DEFOG_MIN_TRANSMISSION_FLOOR;
+	}
+
+	return floor < 1.0 ? floor : 1.0;
+}
 
+/* Find the minimum channel value of a pixel
+ *
+ * pixel - The channel values of the pixel
+ * num_vals - The number of channels in the pixel, which must be >= 1
+ *
+ * Returns the index of the minimum value
+ */
+int pixel_min(const uint8_t *pixel, int num_vals) {
 	// Initially assume that the first value is the minimum
-	double min = vals[0];
+	uint8_t min = pixel[0];
 	int min_in = 0;
 
 	// Iterate through, swapping the minimum value and index if necessary
 	for (int i = 1; i < num_vals; i++) {
-		double val = vals[i];
+		uint8_t val = pixel[i];
 		if (val < min) {
 			min = val;
 			min_in = i;
@@ -60,243 +381,2402 @@ int scalar_min(CvScalar sc, int num_vals) {
 	return min_in;
 }
 
-/* Finds the light intensity of an area of an image
+/* Finds the atmospheric light of an area of an image
  *
- * img - The original BGR image
- * gray - The grayscaler version of the original BGR image
+ * img - The original 8-bit BGR image
  * x1 - The left edge of the area, which will be searched
  * y1 - The upper edge of the area, which will be searched
  * x2 - The right edge of the area, which will *not* be searched
  * y2 - The lower edge of the area, which will *not* be searched
- *
- * Returns the intensity value for the atmospheric light in the image area
- */
-double find_light_intensity(IplImage *img, IplImage *gray, int x1, int y1, int x2, int y2) {
-	// Initialize an array for the top 0.1% of pixels
-	int top_num = (x2 - x1) * (y2 - y1) * 0.001;
-	channel_value_t *top = malloc(top_num * sizeof(channel_value_t));
-	for (int i = 0; i < top_num; i++) {
-		top[i].x = -1;
-		top[i].y = -1;
-		top[i].val = -1.0;
-		top[i].intensity = -1.0;
-	}
-
-	// Get the dark channel of the area
-	channel_t dark_channel = find_dark_channel(img, x1, y1, x2, y2);
-
-	// Then iterate through the region
-	for (int y = y1; y < y2; y++) {
-		for (int x = x1; x < x2; x++) {
-			// Find the dark channel value and the intensity
-			double val = cvGet2D(img, y, x).val[dark_channel];
-			double intensity = cvGet2D(gray, y, x).val[0];
-
-			// Attempt to place the pixel in the array of the brightest pixels
-			for (int i = 0; i < top_num; i++) {
-				// Compare to the pixel in the current bucket, using intensity as a tiebreaker
-				if (top[i].val < val || (top[i].val == val && top[i].intensity < intensity)) {
-					// Set values
-					top[i].x = x;
-					top[i].y = y;
-					top[i].val = val;
-					top[i].intensity = intensity;
-
-					// Then break out of the loop
-					break;
+ * step - How far apart the sampled pixels are, both along rows and between them, or 1 to use
+ *        every pixel
+ * per_channel - Whether each channel gets the light of the brightest hazy pixel's own value in
+ *               that channel, rather than its intensity
+ * light - Where the atmospheric light of the area is written
+ */
+void find_light(IplImage *img, int x1, int y1, int x2, int y2, int step, int per_channel, defog_light_t *light) {
+	// The dark channel of the area (the channel of its first darkest pixel) isn't known until every
+	// pixel has been seen, so build a histogram for each channel at once; that way the image is
+	// only read once, and the grayscale intensity can be worked out as it goes
+	light_bin_t bins[3][UINT8_MAX + 1];
+	memset(bins, 0, sizeof(bins));
+	int dark_val = UINT8_MAX + 1;
+	channel_t dark_channel = BLUE;
+	int num_pixels = 0;
+
+	for (int y = y1; y < y2; y += step) {
+		const uint8_t *row = PIXEL_ROW(img, y);
+
+		// Each sampled row starts one pixel further along than the one before, so that the samples
+		// form a diagonal lattice rather than a grid, which would alias with the rows and columns
+		// of regular structures like buildings
+		for (int x = x1 + (y - y1) / step % step; x < x2; x += step) {
+			const uint8_t *pixel = row + x * img->nChannels;
+
+			// Keep track of the darkest pixel so far
+			int channel = pixel_min(pixel, 3);
+			if (pixel[channel] < dark_val) {
+				dark_val = pixel[channel];
+				dark_channel = channel;
+			}
+
+			// Then place the pixel in the histogram for each channel
+			int intensity = gray_value(pixel);
+			for (int c = 0; c < 3; c++) {
+				light_bin_t *bin = &bins[c][pixel[c]];
+				bin->count++;
+				if (intensity > bin->max_intensity) {
+					bin->max_intensity = intensity;
+					memcpy(bin->color, pixel, 3);
 				}
 			}
+			num_pixels++;
 		}
 	}
 
-	// Find the max intensity value in the array
-	channel_value_t *max = malloc(sizeof(channel_value_t));
-	max->intensity = -1.0;
-	for (int i = 0; i < top_num; i++) {
-		if (top[i].intensity > max->intensity) {
-			memcpy(max, &top[i], sizeof(channel_value_t));
+	uint8_t color[3];
+	double light_intensity = light_from_bins(bins[dark_channel], num_pixels, color);
+	for (int c = 0; c < 3; c++) {
+		// A channel with no light at all, as in an entirely black area, would make the
+		// transmission infinite
+		double value = !per_channel ? light_intensity : color[c];
+		light->bgr[c] = value >= 1.0 ? value : 1.0;
+	}
+}
+
+/* The body of running_min(), which is inlined into a copy for each common window shape, so that
+ * those copies' blocks have a constant length that the compiler can unroll
+ *
+ * See running_min() for the parameters
+ */
+static inline __attribute__((always_inline)) void running_min_body(const uint16_t *src, int src_stride, uint16_t *dst,
+		int dst_stride, int len, int before, int after, uint16_t *scratch) {
+	int window = before + after + 1;
+
+	// Pad the array on both sides so that out-of-bounds positions never win a comparison, and
+	// round its length up to a whole number of windows
+	int padded_len = (len + window - 1 + window - 1) / window * window;
+	uint16_t *padded = scratch;
+	uint16_t *prefix = scratch + padded_len;
+	uint16_t *suffix = prefix + padded_len;
+	for (int i = 0; i < padded_len; i++) {
+		int src_i = i - before;
+		padded[i] = src_i >= 0 && src_i < len ? src[src_i * src_stride] : DARK_KEY_MAX;
+	}
+
+	// Compute the minimum from the start of each block up to every position, and from every
+	// position to the end of each block
+	for (int block = 0; block < padded_len; block += window) {
+		prefix[block] = padded[block];
+		for (int i = block + 1; i < block + window; i++) {
+			prefix[i] = padded[i] < prefix[i - 1] ? padded[i] : prefix[i - 1];
+		}
+
+		suffix[block + window - 1] = padded[block + window - 1];
+		for (int i = block + window - 2; i >= block; i--) {
+			suffix[i] = padded[i] < suffix[i + 1] ? padded[i] : suffix[i + 1];
 		}
 	}
 
-	// Grab the value to return
-	double ret_val = max->intensity;
+	// Every window spans the tail of one block and the head of the next (or exactly one block),
+	// so its minimum is the smaller of a suffix value and a prefix value
+	for (int i = 0; i < len; i++) {
+		uint16_t tail = suffix[i];
+		uint16_t head = prefix[i + window - 1];
+		dst[i * dst_stride] = tail < head ? tail : head;
+	}
+}
+
+/* Computes a running minimum over a one-dimensional array using the van Herk/Gil-Werman
+ * algorithm, which needs about three comparisons per element regardless of the window size
+ *
+ * src - The values to filter
+ * src_stride - The distance, in elements, between consecutive values in src
+ * dst - Where the filtered values will be written
+ * dst_stride - The distance, in elements, between consecutive values in dst
+ * len - The number of values in src and dst
+ * before - The number of values before each position that are included in its window
+ * after - The number of values after each position that are included in its window
+ * scratch - Temporary storage for at least 3 * (len + 2 * (before + after + 1)) values
+ *
+ * Windows are clamped to the array, so dst[i] is the minimum of src[max(i - before, 0)]
+ * through src[min(i + after, len - 1)]
+ */
+void running_min(const uint16_t *src, int src_stride, uint16_t *dst, int dst_stride, int len, int before, int after, uint16_t *scratch) {
+	// The default width of 20, and the centered windows of radius 7, 10, and 15
+	if (before == 10 && after == 9) {
+		running_min_body(src, src_stride, dst, dst_stride, len, 10, 9, scratch);
+	} else if (before == 7 && after == 7) {
+		running_min_body(src, src_stride, dst, dst_stride, len, 7, 7, scratch);
+	} else if (before == 10 && after == 10) {
+		running_min_body(src, src_stride, dst, dst_stride, len, 10, 10, scratch);
+	} else if (before == 15 && after == 15) {
+		running_min_body(src, src_stride, dst, dst_stride, len, 15, 15, scratch);
+	} else {
+		running_min_body(src, src_stride, dst, dst_stride, len, before, after, scratch);
+	}
+}
 
-	// Clean up
-	free(top);
-	free(max);
+/* Allocates a dark channel stream's buffers for an image
+ *
+ * stream - The stream
+ * arena - The arena that the buffers are carved from
+ * width - The width of the widest area that will be streamed
+ * window - The width of the window used around each pixel
+ * window_height - The height of the window
+ *
+ * Returns 0 on success or -1 if a buffer couldn't be allocated
+ */
+int reserve_dark_stream(dark_stream_t *stream, arena_t *arena, int width, int window, int window_height) {
+	size_t row_size = (size_t)width * sizeof(uint16_t);
+	stream->blocks = arena_alloc(arena, 2 * (size_t)window_height * row_size);
+	stream->prefix = arena_alloc(arena, row_size);
+	stream->out = arena_alloc(arena, row_size);
+	stream->keys = arena_alloc(arena, row_size);
+	stream->scratch = arena_alloc(arena, 3 * (width + 2 * (window + 1)) * sizeof(uint16_t));
+	if (stream->blocks == NULL || stream->prefix == NULL || stream->out == NULL || stream->keys == NULL ||
+			stream->scratch == NULL) {
+		return -1;
+	}
 
-	return ret_val;
+	return 0;
 }
 
-/* Finds the dark channel in an area of an image
+/* Starts a dark channel stream at the top of a new area
  *
- * img - The original BGR image
- * x1 - The left edge of the area, which will be searched
- * y1 - The upper edge of the area, which will be searched
- * x2 - The right edge of the area, which will *not* be searched
- * y2 - The lower edge of the area, which will *not* be searched
+ * stream - The stream, whose buffers must have been reserved for the area
+ * width - The width of the area
+ * window - The width of the window used around each pixel
+ * window_height - The height of the window
+ */
+void reset_dark_stream(dark_stream_t *stream, int width, int window, int window_height) {
+	stream->width = width;
+	stream->window = window;
+	stream->window_height = window_height;
+	stream->count = 0;
+}
+
+/* Works out how many columns of an image a band streams through at once. The stream keeps two
+ * blocks of rows of keys, which are read over and over, so on wide images the columns are split
+ * into strips whose blocks fit in DARK_STRIP_BYTES; each strip also streams the columns that its
+ * edge windows reach into, so strips are kept wide enough for those to be a small overhead
+ *
+ * width - The width of the image
+ * window - The width of the window used around each pixel
+ * window_height - The height of the window
+ *
+ * Returns the width of each strip, which is the width of the image if it only needs one
+ */
+int strip_width(int width, int window, int window_height) {
+	int strip = DARK_STRIP_BYTES / (2 * window_height * (int)sizeof(uint16_t));
+	if (strip < 16 * window) {
+		strip = 16 * window;
+	}
+
+	return strip < width ? strip : width;
+}
+
+/* Pushes the keys of the next row of an image into a dark channel stream, finishing the dark
+ * channel of the windows that end on that row
+ *
+ * stream - The stream
+ * keys - The dark channel key of each pixel in the row, or NULL for a row above or below the
+ *        image, which never wins a comparison
  *
- * Returns the scalar index of the dark channel in the image area
+ * Windows cover [x - WINDOW_BEFORE(window), x + WINDOW_AFTER(window)] along the rows and the same
+ * for window_height down the columns, which for the default even width is [x - window / 2,
+ * x + window / 2) as main() has always built them, and are clamped to the image. Once a window's
+ * height of rows has been pushed, every push finishes a row of the dark channel map: pushing image
+ * row y finishes row y - WINDOW_AFTER(window_height).
+ *
+ * Returns the dark channel keys of the finished row, which stay valid until the next push, or
+ * NULL if no row has been finished yet; use DARK_KEY_CHANNEL() to get the channel index from a key
  */
-int find_dark_channel(IplImage *img, int x1, int y1, int x2, int y2) {
-	// Assume that the top left pixel has the minimum value temporarily
-	CvScalar min_pixel = cvGet2D(img, y1, x1);
+const uint16_t *push_dark_keys(dark_stream_t *stream, const uint16_t *keys) {
+	int width = stream->width;
+
+	int rows = WINDOW_BEFORE(stream->window_height) + WINDOW_AFTER(stream->window_height) + 1;
 
-	// Get the minimum channel value for the top left pixel
-	int min = scalar_min(min_pixel, 3);
+	// Work out where the row goes in the current block
+	int slot = stream->count % rows;
+	uint16_t *block = stream->blocks + (size_t)((stream->count / rows) % 2) * rows * width;
+	uint16_t *filtered = block + (size_t)slot * width;
+
+	// Filter the row
+	if (keys != NULL) {
+		running_min(keys, 1, filtered, 1, width, WINDOW_BEFORE(stream->window), WINDOW_AFTER(stream->window),
+			stream->scratch);
+	} else {
+		for (int x = 0; x < width; x++) {
+			filtered[x] = DARK_KEY_MAX;
+		}
+	}
 
-	// Iterate through the area
-	for (int y = y1; y < y2; y++) {
-		for (int x = x1; x < x2; x++) {
-			// Get a new pixel and minimum channel value
-			CvScalar curr_pixel = cvGet2D(img, y, x);
-			int curr_min = scalar_min(curr_pixel, 3);
+	// Keep track of the minimum from the start of the block
+	uint16_t *prefix = stream->prefix;
+	for (int x = 0; x < width; x++) {
+		prefix[x] = slot == 0 || filtered[x] < prefix[x] ? filtered[x] : prefix[x];
+	}
 
-			// Compare the current pixel to the minimum pixel
-			if (curr_pixel.val[curr_min] < min_pixel.val[min]) {
-				// Swap them if necessary
-				min_pixel = curr_pixel;
-				min = curr_min;
+	// Once the block is full, turn each of its rows into the minimum from that row to the end of
+	// the block
+	if (slot == rows - 1) {
+		for (int i = rows - 2; i >= 0; i--) {
+			uint16_t *curr = block + (size_t)i * width;
+			const uint16_t *next = curr + width;
+			for (int x = 0; x < width; x++) {
+				curr[x] = next[x] < curr[x] ? next[x] : curr[x];
 			}
 		}
 	}
 
-	return min;
+	stream->count++;
+	if (stream->count < rows) {
+		return NULL;
+	}
+
+	// The window that just finished starts in either this block or the one before it, so its
+	// minimum is the smaller of its first row's suffix and this block's prefix
+	int start = stream->count - rows;
+	const uint16_t *suffix = stream->blocks + ((size_t)((start / rows) % 2) * rows + start % rows) * width;
+	for (int x = 0; x < width; x++) {
+		stream->out[x] = suffix[x] < prefix[x] ? suffix[x] : prefix[x];
+	}
+
+	return stream->out;
 }
 
-/* Calculates the number of high-frequency pixels in an image, which was used
- * as an evaluation metric for the defogging process.
- * In theory, a higher number of high-intensity pixels should correlate to a reduced
- * amount of fog.
+/* Pushes the next row of an image into a dark channel stream, finding the darkest channel of
+ * every individual pixel once on the way
  *
- * img - The BGR image to evaluate
+ * stream - The stream
+ * row - The next row of the 8-bit BGR image, or NULL for a row above or below the image
  *
- * Returns the number of pixels in the real component of the
- * DFT result that are greater than 127
+ * See push_dark_keys() for the windows and the return value
  */
-int evaluate(IplImage *img) {
-	// Get the size of the image
-	CvSize size = cvGetSize(img);
+const uint16_t *push_dark_stream(dark_stream_t *stream, const uint8_t *row) {
+	if (row == NULL) {
+		return push_dark_keys(stream, NULL);
+	}
 
-	// Convert the color image to grayscale
-	IplImage *gray_tmp = cvCreateImage(size, img->depth, 1);
-	cvCvtColor(img, gray_tmp, CV_RGB2GRAY);
+	stream->dark_keys(row, stream->keys, stream->width);
+	return push_dark_keys(stream, stream->keys);
+}
 
-	// Create a new image at the required depth for the DFT (IPL_DEPTH_32F)
-	IplImage *gray = cvCreateImage(size, IPL_DEPTH_32F, 1);
+/* Pushes the next row of a planar image into a dark channel stream, as push_dark_stream() does for
+ * interleaved rows
+ *
+ * stream - The stream
+ * plane_row - The next row of the blue plane, which the other planes follow, or NULL for a row
+ *             above or below the image
+ * plane_size - The distance between the planes
+ *
+ * See push_dark_keys() for the windows and the return value
+ */
+const uint16_t *push_dark_planes(dark_stream_t *stream, const uint8_t *plane_row, size_t plane_size) {
+	if (plane_row == NULL) {
+		return push_dark_keys(stream, NULL);
+	}
 
-	// Then copy all pixel values
-	for (int y = 0; y < size.height; y++) {
-		for (int x = 0; x < size.width; x++) {
-			cvSet2D(gray, y, x, cvGet2D(gray_tmp, y, x));
+	stream->dark_keys_planar(plane_row, plane_size, stream->keys, stream->width);
+	return push_dark_keys(stream, stream->keys);
+}
+
+/* Estimates the atmospheric light of a range of the tiles in the light grid
+ *
+ * arg - The band_t whose tiles to estimate
+ *
+ * Returns NULL, so that it can be used as a thread's start routine
+ */
+void *light_band(void *arg) {
+	band_t *band = arg;
+	CvSize size = cvGetSize(band->img);
+	int n = band->grid_size;
+
+	for (int i = band->first_tile; i < band->last_tile; i++) {
+		int tile_x = i % n;
+		int tile_y = i / n;
+		defog_light_t *light = &band->grid[i];
+		find_light(band->img, size.width * tile_x / n, size.height * tile_y / n, size.width * (tile_x + 1) / n,
+			size.height * (tile_y + 1) / n, band->light_step, band->light_per_channel, light);
+	}
+
+	return NULL;
+}
+
+/* Interpolates the atmospheric light of every pixel in a row from the light grid, bilinearly
+ * between the centers of the four tiles around each pixel; pixels beyond the outermost centers
+ * take the light of the nearest ones
+ *
+ * grid - The light of each tile of the grid, row by row
+ * grid_size - The number of tiles along each side of the grid
+ * y - The row, which can be at any resolution of the image
+ * size - The size of the image at that resolution
+ * x1 - The first column to interpolate
+ * x2 - The column after the last one to interpolate
+ * light_row - Where the BGR light of each pixel from x1 to x2 is written
+ */
+void fill_light_row(const defog_light_t *grid, int grid_size, int y, CvSize size, int x1, int x2, float *light_row) {
+	// Blend the two rows of tiles around the row first, so that only one blend is left per pixel
+	double grid_y = (y + 0.5) * grid_size / size.height - 0.5;
+	grid_y = grid_y > 0.0 ? grid_y < grid_size - 1 ? grid_y : grid_size - 1 : 0.0;
+	int tile_y = (int)grid_y;
+	int next_y = tile_y + 1 < grid_size ? tile_y + 1 : tile_y;
+	double frac_y = grid_y - tile_y;
+
+	double cols[DEFOG_MAX_LIGHT_GRID][3];
+	for (int i = 0; i < grid_size; i++) {
+		const double *upper = grid[tile_y * grid_size + i].bgr;
+		const double *lower = grid[next_y * grid_size + i].bgr;
+		for (int c = 0; c < 3; c++) {
+			cols[i][c] = upper[c] + frac_y * (lower[c] - upper[c]);
 		}
 	}
 
-	// Free the original grayscale image
-	cvReleaseImage(&gray_tmp);
+	for (int x = x1; x < x2; x++) {
+		double grid_x = (x + 0.5) * grid_size / size.width - 0.5;
+		grid_x = grid_x > 0.0 ? grid_x < grid_size - 1 ? grid_x : grid_size - 1 : 0.0;
+		int tile_x = (int)grid_x;
+		int next_x = tile_x + 1 < grid_size ? tile_x + 1 : tile_x;
+		double frac_x = grid_x - tile_x;
+		for (int c = 0; c < 3; c++) {
+			light_row[(x - x1) * 3 + c] = (float)(cols[tile_x][c] + frac_x * (cols[next_x][c] - cols[tile_x][c]));
+		}
+	}
+}
 
-	// Create a new image to hold the results of the DFT
-	IplImage *real = cvCreateImage(size, IPL_DEPTH_32F, 1);
-	//IplImage *cmpx = cvCreateImage(size, IPL_DEPTH_32F, 1);
+/* Fills in the atmospheric light of every pixel in part of a row for the kernels that take one for
+ * each pixel, from the light grid or else the single light
+ *
+ * band - The band that the row is in, whose light row is filled in
+ * y - The row
+ * size - The size of the image
+ * x1 - The first column
+ * x2 - The column after the last one
+ *
+ * Returns the band's light row, which starts at column x1
+ */
+const float *band_light_row(band_t *band, int y, CvSize size, int x1, int x2) {
+	if (band->grid != NULL) {
+		fill_light_row(band->grid, band->grid_size, y, size, x1, x2, band->light_row);
+	} else {
+		for (int x = 0; x < x2 - x1; x++) {
+			for (int c = 0; c < 3; c++) {
+				band->light_row[x * 3 + c] = (float)band->light[c];
+			}
+		}
+	}
 
-	// And perform the transoformation
-	cvDFT(gray, real, 32, 0);
-	//cvDFT(gray, cmpx, 16, 0);
+	return band->light_row;
+}
 
-	// Perform thresholding to get high-intensity pixels from the DFT real results
-	cvThreshold(real, real, 127, 255, CV_THRESH_BINARY);
+/* Picks where the transmission of a row is written if the row is sampled for defog_get_stats();
+ * every SAMPLE_ROW_STEP-th row is sampled, whether or not there's a map, so that the statistics
+ * cost the same in every mode
+ *
+ * band - The band that the row is in
+ * map_row - The row of the map starting at column x, or NULL if there's no map
+ * y - The row
+ * x - The first column of the part of the row being recovered
+ *
+ * Returns where the transmission should be written and then counted, or NULL if the row isn't
+ * sampled
+ */
+uint8_t *sample_row(band_t *band, uint8_t *map_row, int y, int x) {
+	if (y % SAMPLE_ROW_STEP != 0) {
+		return NULL;
+	}
 
-	// Count nonzero pixels
-	int nonzero = cvCountNonZero(real);
+	return map_row != NULL ? map_row : band->sample_row + x;
+}
 
-	// Clean up after ourselves
-	cvReleaseImage(&gray);
-	cvReleaseImage(&real);
-	//cvReleaseImage(&cmpx);
+/* Adds a row of 8-bit transmission values to a histogram
+ *
+ * samples - The histogram, with a count for each value
+ * row - The transmission values
+ * width - The number of values in the row
+ */
+void count_samples(int *samples, const uint8_t *row, int width) {
+	for (int x = 0; x < width; x++) {
+		samples[row[x]]++;
+	}
+}
 
-	return nonzero;
+/* Summarizes the histogram of the sampled transmission values in the stats of an image
+ *
+ * stats - The stats, whose transmission fields are filled in
+ * samples - How many times each 8-bit transmission was sampled
+ * floor - The lowest transmission that the output was recovered with
+ */
+void summarize_samples(defog_stats_t *stats, const int *samples, double floor) {
+	// The floor is compared with the 8-bit values, which are rounded, so values just below it can
+	// land on either side
+	int floor_val = (int)ceil(floor * UINT8_MAX);
+	double sum = 0.0;
+	int floored = 0;
+	memset(stats->transmission_histogram, 0, sizeof(stats->transmission_histogram));
+	stats->transmission_samples = 0;
+	for (int val = 0; val <= UINT8_MAX; val++) {
+		stats->transmission_histogram[val * DEFOG_TRANSMISSION_BINS / (UINT8_MAX + 1)] += samples[val];
+		stats->transmission_samples += samples[val];
+		sum += (double)val * samples[val];
+		if (val < floor_val) {
+			floored += samples[val];
+		}
+	}
+
+	int total = stats->transmission_samples;
+	stats->transmission_mean = total > 0 ? sum / ((double)UINT8_MAX * total) : 0.0;
+	stats->transmission_floored = total > 0 ? (double)floored / total : 0.0;
+}
+
+/* Splits a band of rows of an 8-bit image into the planes of a planar image, before its dark
+ * channel is found
+ *
+ * arg - The band_t describing the rows to split
+ *
+ * Returns NULL, so that it can be used as a thread's start routine
+ */
+void *split_band(void *arg) {
+	band_t *band = arg;
+	int width = band->img->width;
+	uint8_t *planes = (uint8_t *)band->planes;
+
+	for (int y = band->y1; y < band->y2; y++) {
+		band->split(PIXEL_ROW(band->img, y), planes + (size_t)y * width, band->plane_size, width);
+	}
+
+	return NULL;
 }
 
-int main(int argc, const char * argv[]) {
-	// Read in the image to defog
-	IplImage *img = (IplImage *)cvLoadImage(argv[1], CV_LOAD_IMAGE_COLOR);
+/* Estimates the transmission map and recovers the defogged output for a band of rows
+ *
+ * arg - The band_t describing the rows to process
+ *
+ * Returns NULL, so that it can be used as a thread's start routine
+ */
+void *defog_band(void *arg) {
+	band_t *band = arg;
+	IplImage *img = band->img;
+	IplImage *map = band->map;
+	IplImage *out = band->out;
+	CvSize size = cvGetSize(img);
+	int left = WINDOW_BEFORE(band->window);
+	int right = WINDOW_AFTER(band->window);
+	int above = WINDOW_BEFORE(band->window_height);
+	int below = WINDOW_AFTER(band->window_height);
+	int strip = strip_width(size.width, band->window, band->window_height);
+
+	for (int x1 = 0; x1 < size.width; x1 += strip) {
+		// Windows near the edges of the strip and the band reach into the columns and rows around
+		// them (the halo), so stream those in as well; rows outside the image are pushed as padding
+		int x2 = x1 + strip < size.width ? x1 + strip : size.width;
+		int halo_x1 = x1 - left > 0 ? x1 - left : 0;
+		int halo_x2 = x2 + right < size.width ? x2 + right : size.width;
+		reset_dark_stream(&band->stream, halo_x2 - halo_x1, band->window, band->window_height);
 
-	// Run an initial high-frequency pixel count
-	printf("Number of high-frequency pixels in the original image: %d\n", evaluate(img));
+		for (int y = band->y1 - above; y < band->y2 + below; y++) {
+			double start = current_time();
+			const uint16_t *dark_row;
+			if (band->planes != NULL) {
+				const uint8_t *plane_row = y >= 0 && y < size.height ? band->planes + (size_t)y * size.width + halo_x1 : NULL;
+				dark_row = push_dark_planes(&band->stream, plane_row, band->plane_size);
+			} else {
+				const uint8_t *row = y >= 0 && y < size.height ? PIXEL_ROW(img, y) + halo_x1 * 3 : NULL;
+				dark_row = push_dark_stream(&band->stream, row);
+			}
+			double pushed = current_time();
+			band->dark_time += pushed - start;
 
-	// Create a window for displaying input, output, and intermediary steps
-	cvNamedWindow("disp", CV_WINDOW_AUTOSIZE);
+			// As soon as a row of the dark channel map is ready, estimate the transmission and
+			// recover the output for it
+			if (dark_row != NULL) {
+				int out_y = y - below;
+				const uint8_t *img_row = PIXEL_ROW(img, out_y) + x1 * 3;
+				uint8_t *map_row = map != NULL ? PIXEL_ROW(map, out_y) + x1 : NULL;
+				uint8_t *out_row = PIXEL_AT(out, out_y, x1);
+				uint8_t *sample = sample_row(band, map_row, out_y, x1);
+				dark_row += x1 - halo_x1;
+				if (band->grid != NULL || band->src != img) {
+					band->depth->recover_field(PIXEL_AT(band->src, out_y, x1), dark_row, sample != NULL ? sample : map_row,
+						PIXEL_AT(out, out_y, x1), x2 - x1, band_light_row(band, out_y, size, x1, x2), band->floor);
+				} else if (band->planes != NULL) {
+					band->recover_planar(band->planes + (size_t)out_y * size.width + x1, band->plane_size, dark_row,
+						sample != NULL ? sample : map_row, out_row, x2 - x1, band->lut);
+				} else {
+					band->recover(img_row, dark_row, sample != NULL ? sample : map_row, out_row, x2 - x1, band->lut);
+				}
+				if (sample != NULL) {
+					count_samples(band->samples, sample, x2 - x1);
+				}
+				band->recover_time += current_time() - pushed;
+			}
+		}
+	}
 
-	// Display the original image
-	cvShowImage("disp", img);
-	cvWaitKey(0);
+	return NULL;
+}
 
-	// Convert the input image to grayscale
+/* Estimates the raw transmission map and the guide image for a band of rows, which is the first
+ * stage of refining the transmission map
+ *
+ * arg - The band_t describing the rows to process
+ *
+ * Returns NULL, so that it can be used as a thread's start routine
+ */
+void *transmission_band(void *arg) {
+	band_t *band = arg;
+	IplImage *img = band->img;
+	refine_t *refine = band->refine;
 	CvSize size = cvGetSize(img);
-	IplImage *gray = cvCreateImage(size, img->depth, 1);
-	cvCvtColor(img, gray, CV_RGB2GRAY);
+	int left = WINDOW_BEFORE(band->window);
+	int right = WINDOW_AFTER(band->window);
+	int above = WINDOW_BEFORE(band->window_height);
+	int below = WINDOW_AFTER(band->window_height);
+	int strip = strip_width(size.width, band->window, band->window_height);
 
-	// Calculate the light intensity for the image
-	double light_intensity = find_light_intensity(img, gray, 0, 0, size.width, size.height);
+	// The band is streamed a strip of columns at a time, just as defog_band() does
+	for (int x1 = 0; x1 < size.width; x1 += strip) {
+		int x2 = x1 + strip < size.width ? x1 + strip : size.width;
+		int halo_x1 = x1 - left > 0 ? x1 - left : 0;
+		int halo_x2 = x2 + right < size.width ? x2 + right : size.width;
+		reset_dark_stream(&band->stream, halo_x2 - halo_x1, band->window, band->window_height);
 
-	// Create empty images for the transmission map and the output (defogged) image
-	IplImage *map = cvCreateImage(size, img->depth, 1);
-	IplImage *out = cvCreateImage(size, img->depth, img->nChannels);
+		for (int y = band->y1 - above; y < band->y2 + below; y++) {
+			double start = current_time();
+			const uint8_t *row = y >= 0 && y < size.height ? PIXEL_ROW(img, y) + halo_x1 * 3 : NULL;
+			const uint16_t *dark_row = push_dark_stream(&band->stream, row);
+			double pushed = current_time();
+			band->dark_time += pushed - start;
 
-	// Iterate through the input image
-	for (int y = 0; y < size.height; y++) {
-		for (int x = 0; x < size.width; x++) {
-			// Calculate the bounds of the window used to determine the dark channel, falling
-			// back on simply using the image bounds if the window can't fit
-			int x_low = x - (MAP_WIDTH / 2) > 0 ? x - (MAP_WIDTH / 2) : 0;
-			int y_low = y - (MAP_WIDTH / 2) > 0 ? y - (MAP_WIDTH / 2) : 0;
-			int x_high = x + (MAP_WIDTH / 2) <= size.width ? x + (MAP_WIDTH / 2) : size.width;
-			int y_high = y + (MAP_WIDTH / 2) <= size.height ? y + (MAP_WIDTH / 2) : size.height;
-
-			// Find the dark channel for the window
-			channel_t dark_channel = find_dark_channel(img, x_low, y_low, x_high, y_high);
-
-			// Estimate t(x)
-			double t = 1 - (cvGet2D(img, y, x).val[dark_channel] / light_intensity);
-
-			// Then store it in the transmission map image
-			cvSet2D(map, y, x, cvScalar(t * 255.0, 0.0, 0.0, 0.0));
-
-			// Use the transmission map and light intensity to calculate channel values for the pixel in
-			// the output image
-			CvScalar out_pixel = cvScalarAll(0.0);
-			for (int i = 0; i < out->nChannels; i++) {
-				// Calculate the actual pixel value
-				// The constant value was derived by attempting to maximize the evaluation metric
-				out_pixel.val[i] = (cvGet2D(img, y, x).val[i] - light_intensity) / fmax(t, 0.54) + light_intensity;
+			if (dark_row != NULL) {
+				int out_y = y - below;
+				const uint8_t *img_row = PIXEL_ROW(img, out_y) + x1 * 3;
+				size_t offset = (size_t)out_y * size.width + x1;
+				dark_row += x1 - halo_x1;
+				if (band->grid != NULL) {
+					fill_light_row(band->grid, band->grid_size, out_y, size, x1, x2, band->light_row);
+					estimate_transmission_row_field(img_row, dark_row, refine->transmission + offset,
+						refine->guide + offset, x2 - x1, band->light_row);
+				} else {
+					estimate_transmission_row(img_row, dark_row, refine->transmission + offset, refine->guide + offset,
+						x2 - x1, band->light);
+				}
+				band->refine_time += current_time() - pushed;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/* Adds a row of two planes to, or removes it from, the running column sums of a box filter
+ *
+ * sums - The column sums of x, y, and then (if products is set) x * x and x * y, each of which
+ *        is width values long
+ * x_row - The row of the first plane
+ * y_row - The row of the second plane
+ * width - The number of values in each row
+ * products - Whether the sums of the products are kept as well
+ * sign - 1 to add the row or -1 to remove it
+ */
+void add_row_sums(double *sums, const float *x_row, const float *y_row, int width, int products, double sign) {
+	for (int x = 0; x < width; x++) {
+		sums[x] += sign * x_row[x];
+		sums[width + x] += sign * y_row[x];
+	}
+
+	if (products) {
+		for (int x = 0; x < width; x++) {
+			sums[2 * width + x] += sign * x_row[x] * x_row[x];
+			sums[3 * width + x] += sign * x_row[x] * y_row[x];
+		}
+	}
+}
+
+/* Computes the prefix sums along a row of column sums, so that the sum over any range of columns
+ * can be found with a single subtraction
+ *
+ * sums - The column sums, as num_sums arrays of width values
+ * prefix - Where the prefix sums are written, as num_sums arrays of width + 1 values
+ * num_sums - The number of arrays
+ * width - The number of values in each array of column sums
+ */
+void prefix_sums(const double *sums, double *prefix, int num_sums, int width) {
+	for (int i = 0; i < num_sums; i++) {
+		const double *src = sums + (size_t)i * width;
+		double *dst = prefix + (size_t)i * (width + 1);
+
+		dst[0] = 0.0;
+		for (int x = 0; x < width; x++) {
+			dst[x + 1] = dst[x] + src[x];
+		}
+	}
+}
+
+/* Computes the coefficients of the guided filter's local linear model for a band of rows, which is
+ * the second stage of refining the transmission map. Box filters are built from running column
+ * sums and prefix sums along each row, so they cost the same for any radius
+ *
+ * arg - The band_t describing the rows to process
+ *
+ * Returns NULL, so that it can be used as a thread's start routine
+ */
+void *coefficients_band(void *arg) {
+	band_t *band = arg;
+	refine_t *refine = band->refine;
+	CvSize size = cvGetSize(band->img);
+	int width = size.width;
+	int radius = refine->radius;
+	double start = current_time();
+
+	// Start with the column sums over the rows above and below the first row of the band; the
+	// sums hold the guide, the transmission, and their products
+	double *sums = band->sums;
+	double *prefix = sums + 4 * (size_t)width;
+	memset(sums, 0, 4 * (size_t)width * sizeof(double));
+	int top = band->y1 - radius > 0 ? band->y1 - radius : 0;
+	int bottom = band->y1 + radius < size.height - 1 ? band->y1 + radius : size.height - 1;
+	for (int y = top; y <= bottom; y++) {
+		size_t offset = (size_t)y * width;
+		add_row_sums(sums, refine->guide + offset, refine->transmission + offset, width, 1, 1.0);
+	}
+
+	for (int y = band->y1; y < band->y2; y++) {
+		// Slide the window down a row
+		if (y > band->y1) {
+			if (y + radius < size.height) {
+				size_t offset = (size_t)(y + radius) * width;
+				add_row_sums(sums, refine->guide + offset, refine->transmission + offset, width, 1, 1.0);
+			}
+			if (y - radius - 1 >= 0) {
+				size_t offset = (size_t)(y - radius - 1) * width;
+				add_row_sums(sums, refine->guide + offset, refine->transmission + offset, width, 1, -1.0);
 			}
+		}
+		int rows = (y + radius < size.height - 1 ? y + radius : size.height - 1) - (y - radius > 0 ? y - radius : 0) + 1;
+		prefix_sums(sums, prefix, 4, width);
+
+		const double *guide_sums = prefix;
+		const double *t_sums = prefix + (width + 1);
+		const double *guide_sq_sums = prefix + 2 * (width + 1);
+		const double *cross_sums = prefix + 3 * (width + 1);
+		float *a_row = refine->coef_a + (size_t)y * width;
+		float *b_row = refine->coef_b + (size_t)y * width;
 
-			// Set the calculated pixel value in the output image
-			cvSet2D(out, y, x, out_pixel);
+		for (int x = 0; x < width; x++) {
+			int x1 = x - radius > 0 ? x - radius : 0;
+			int x2 = x + radius + 1 < width ? x + radius + 1 : width;
+			double count = (double)(x2 - x1) * rows;
+
+			// Fit t = a * guide + b over the window, with eps keeping a from growing too large
+			// where the guide is flat
+			double mean_guide = (guide_sums[x2] - guide_sums[x1]) / count;
+			double mean_t = (t_sums[x2] - t_sums[x1]) / count;
+			double var_guide = (guide_sq_sums[x2] - guide_sq_sums[x1]) / count - mean_guide * mean_guide;
+			double cov = (cross_sums[x2] - cross_sums[x1]) / count - mean_guide * mean_t;
+			double a = cov / (var_guide + refine->eps);
+			a_row[x] = (float)a;
+			b_row[x] = (float)(mean_t - a * mean_guide);
 		}
 	}
 
-	// Show the map image
-	cvSaveImage("map.png", map, 0);
-	cvShowImage("disp", map);
-	cvWaitKey(0);
+	band->refine_time += current_time() - start;
+
+	return NULL;
+}
+
+/* Refines the transmission map for a band of rows by averaging the coefficients of every window
+ * that covers each pixel, and then recovers the output from it, which is the last stage of
+ * refining the transmission map
+ *
+ * arg - The band_t describing the rows to process
+ *
+ * Returns NULL, so that it can be used as a thread's start routine
+ */
+void *refined_band(void *arg) {
+	band_t *band = arg;
+	refine_t *refine = band->refine;
+	IplImage *img = band->img;
+	IplImage *map = band->map;
+	IplImage *out = band->out;
+	CvSize size = cvGetSize(img);
+	int width = size.width;
+	int radius = refine->radius;
+
+	// The same box filter as coefficients_band(), but over the coefficients
+	double *sums = band->sums;
+	double *prefix = sums + 4 * (size_t)width;
+	memset(sums, 0, 2 * (size_t)width * sizeof(double));
+	int top = band->y1 - radius > 0 ? band->y1 - radius : 0;
+	int bottom = band->y1 + radius < size.height - 1 ? band->y1 + radius : size.height - 1;
+	for (int y = top; y <= bottom; y++) {
+		size_t offset = (size_t)y * width;
+		add_row_sums(sums, refine->coef_a + offset, refine->coef_b + offset, width, 0, 1.0);
+	}
 
-	// Count the number of high-frequency pixels in the output image
-	printf("Number of high-frequency pixels in the defogged image: %d\n", evaluate(out));
+	for (int y = band->y1; y < band->y2; y++) {
+		double start = current_time();
+		if (y > band->y1) {
+			if (y + radius < size.height) {
+				size_t offset = (size_t)(y + radius) * width;
+				add_row_sums(sums, refine->coef_a + offset, refine->coef_b + offset, width, 0, 1.0);
+			}
+			if (y - radius - 1 >= 0) {
+				size_t offset = (size_t)(y - radius - 1) * width;
+				add_row_sums(sums, refine->coef_a + offset, refine->coef_b + offset, width, 0, -1.0);
+			}
+		}
+		int rows = (y + radius < size.height - 1 ? y + radius : size.height - 1) - (y - radius > 0 ? y - radius : 0) + 1;
+		prefix_sums(sums, prefix, 2, width);
 
-	// Then show the output image
-	cvSaveImage("out.png", out, 0);
-	cvShowImage("disp", out);
-	cvWaitKey(0);
+		// The coefficients for this row won't be read by any other band, so the refined
+		// transmission can overwrite the raw transmission in place
+		const double *a_sums = prefix;
+		const double *b_sums = prefix + (width + 1);
+		const float *guide_row = refine->guide + (size_t)y * width;
+		float *t_row = refine->transmission + (size_t)y * width;
+		for (int x = 0; x < width; x++) {
+			int x1 = x - radius > 0 ? x - radius : 0;
+			int x2 = x + radius + 1 < width ? x + radius + 1 : width;
+			double count = (double)(x2 - x1) * rows;
+			t_row[x] = (float)(((a_sums[x2] - a_sums[x1]) * guide_row[x] + (b_sums[x2] - b_sums[x1])) / count);
+		}
+		double refined = current_time();
+		band->refine_time += refined - start;
 
-	// Release all images
-	cvReleaseImage(&img);
-	cvReleaseImage(&gray);
-	cvReleaseImage(&map);
-	cvReleaseImage(&out);
+		uint8_t *map_row = map != NULL ? PIXEL_ROW(map, y) : NULL;
+		uint8_t *sample = sample_row(band, map_row, y, 0);
+		if (sample != NULL) {
+			map_row = sample;
+		}
+		if (band->grid != NULL || band->src != img) {
+			band->depth->recover_refined_field(PIXEL_ROW(band->src, y), t_row, map_row, PIXEL_ROW(out, y), width,
+				band_light_row(band, y, size, 0, width), band->floor);
+		} else {
+			band->recover_refined(PIXEL_ROW(img, y), t_row, map_row, PIXEL_ROW(out, y), width, band->light, band->floor);
+		}
+		if (sample != NULL) {
+			count_samples(band->samples, sample, width);
+		}
+		band->recover_time += current_time() - refined;
+	}
 
-	// Destroy the window used to display images
-	cvDestroyAllWindows();
+	return NULL;
+}
 
-	return 0;
+/* Recovers the output for a band of rows at full resolution in pyramid mode, upsampling the
+ * coefficients of the guided filter that were computed at the pyramid's resolution and applying
+ * them to the full-resolution intensity, so that the transmission follows the edges of the full
+ * image rather than the blurred ones of the pyramid
+ *
+ * arg - The band_t describing the rows to process
+ *
+ * Returns NULL, so that it can be used as a thread's start routine
+ */
+void *upsampled_band(void *arg) {
+	band_t *band = arg;
+	refine_t *refine = band->refine;
+	IplImage *img = band->img;
+	IplImage *map = band->map;
+	IplImage *out = band->out;
+	CvSize size = cvGetSize(img);
+	int scale = 1 << refine->levels;
+	double start = current_time();
+
+	// The planes are the size of the smallest level of the pyramid, which rounds up at every level
+	int small_width = size.width;
+	int small_height = size.height;
+	for (int l = 0; l < refine->levels; l++) {
+		small_width = (small_width + 1) / 2;
+		small_height = (small_height + 1) / 2;
+	}
+
+	// Work out where every column falls between the planes' columns once, measuring between pixel
+	// centers; the interpolated rows have an extra copy of their last value, so the column to the
+	// right can always be read
+	for (int x = 0; x < size.width; x++) {
+		double sx = (x + 0.5) / scale - 0.5;
+		sx = sx < 0.0 ? 0.0 : sx > small_width - 1 ? small_width - 1 : sx;
+		band->x_index[x] = (int)sx;
+		band->x_frac[x] = (float)(sx - (int)sx);
+	}
+	float *a_row = band->coef_rows;
+	float *b_row = band->coef_rows + small_width + 1;
+	band->refine_time += current_time() - start;
+
+	for (int y = band->y1; y < band->y2; y++) {
+		start = current_time();
+
+		// Interpolate the coefficients between the rows of the planes above and below the row
+		double sy = (y + 0.5) / scale - 0.5;
+		sy = sy < 0.0 ? 0.0 : sy > small_height - 1 ? small_height - 1 : sy;
+		int y0 = (int)sy;
+		int y1 = y0 + 1 < small_height ? y0 + 1 : y0;
+		float fy = (float)(sy - y0);
+		const float *a0 = refine->coef_a + (size_t)y0 * small_width;
+		const float *a1 = refine->coef_a + (size_t)y1 * small_width;
+		const float *b0 = refine->coef_b + (size_t)y0 * small_width;
+		const float *b1 = refine->coef_b + (size_t)y1 * small_width;
+		for (int x = 0; x < small_width; x++) {
+			a_row[x] = a0[x] + (a1[x] - a0[x]) * fy;
+			b_row[x] = b0[x] + (b1[x] - b0[x]) * fy;
+		}
+		a_row[small_width] = a_row[small_width - 1];
+		b_row[small_width] = b_row[small_width - 1];
+
+		// Then between the columns, applying the coefficients to each pixel's intensity
+		const uint8_t *row = PIXEL_ROW(img, y);
+		for (int x = 0; x < size.width; x++) {
+			int x0 = band->x_index[x];
+			float fx = band->x_frac[x];
+			float a = a_row[x0] + (a_row[x0 + 1] - a_row[x0]) * fx;
+			float b = b_row[x0] + (b_row[x0 + 1] - b_row[x0]) * fx;
+			band->t_row[x] = a * gray_value(row + x * 3) * (1.0f / 255.0f) + b;
+		}
+		double upsampled = current_time();
+		band->refine_time += upsampled - start;
+
+		uint8_t *map_row = map != NULL ? PIXEL_ROW(map, y) : NULL;
+		uint8_t *sample = sample_row(band, map_row, y, 0);
+		if (sample != NULL) {
+			map_row = sample;
+		}
+		if (band->grid != NULL || band->src != img) {
+			band->depth->recover_refined_field(PIXEL_ROW(band->src, y), band->t_row, map_row, PIXEL_ROW(out, y), size.width,
+				band_light_row(band, y, size, 0, size.width), band->floor);
+		} else {
+			band->recover_refined(row, band->t_row, map_row, PIXEL_ROW(out, y), size.width, band->light, band->floor);
+		}
+		if (sample != NULL) {
+			count_samples(band->samples, sample, size.width);
+		}
+		band->recover_time += current_time() - upsampled;
+	}
+
+	return NULL;
+}
+
+/* Finds the dark channel key of every individual pixel in a band of rows of an image being
+ * previewed, which is all that the dark channel of any window over it needs
+ *
+ * arg - The band_t describing the rows to process, whose img is the 8-bit image
+ *
+ * Returns NULL, so that it can be used as a thread's start routine
+ */
+void *preview_keys_band(void *arg) {
+	band_t *band = arg;
+	int width = cvGetSize(band->img).width;
+
+	for (int y = band->y1; y < band->y2; y++) {
+		band->stream.dark_keys(PIXEL_ROW(band->img, y), band->preview->keys + (size_t)y * width, width);
+	}
+
+	return NULL;
+}
+
+/* Finds the dark channel of a range of a preview's pending tiles from its keys, along each row of
+ * the tile and the rows around it that its windows reach into, and then down each column; the
+ * windows are clamped to the image, so this gives exactly what streaming the whole image would
+ *
+ * arg - The band_t whose tiles to find the dark channel of
+ *
+ * Returns NULL, so that it can be used as a thread's start routine
+ */
+void *dark_tiles_band(void *arg) {
+	band_t *band = arg;
+	defog_preview_t *preview = band->preview;
+	CvSize size = cvGetSize(preview->in);
+	int left = WINDOW_BEFORE(preview->window);
+	int right = WINDOW_AFTER(preview->window);
+	int above = WINDOW_BEFORE(preview->window_height);
+	int below = WINDOW_AFTER(preview->window_height);
+	double start = current_time();
+
+	// The buffer holds the rows of the tile filtered along the rows, one row of the tile's halo
+	// before it's cut down to the tile's columns, and scratch space for running_min()
+	uint16_t *rows = band->tile_buf;
+	uint16_t *line = rows + (size_t)(PREVIEW_TILE + preview->window_height) * PREVIEW_TILE;
+	uint16_t *scratch = line + PREVIEW_TILE + preview->window;
+
+	for (int i = band->first_tile; i < band->last_tile; i++) {
+		int tile = preview->pending[i];
+		int x1 = tile % preview->tiles_x * PREVIEW_TILE;
+		int y1 = tile / preview->tiles_x * PREVIEW_TILE;
+		int x2 = x1 + PREVIEW_TILE < size.width ? x1 + PREVIEW_TILE : size.width;
+		int y2 = y1 + PREVIEW_TILE < size.height ? y1 + PREVIEW_TILE : size.height;
+		int halo_x1 = x1 - left > 0 ? x1 - left : 0;
+		int halo_x2 = x2 + right < size.width ? x2 + right : size.width;
+		int halo_y1 = y1 - above > 0 ? y1 - above : 0;
+		int halo_y2 = y2 + below < size.height ? y2 + below : size.height;
+		int tile_width = x2 - x1;
+
+		for (int y = halo_y1; y < halo_y2; y++) {
+			running_min(preview->keys + (size_t)y * size.width + halo_x1, 1, line, 1, halo_x2 - halo_x1, left, right, scratch);
+			memcpy(rows + (size_t)(y - halo_y1) * tile_width, line + (x1 - halo_x1), tile_width * sizeof(uint16_t));
+		}
+
+		// running_min() copies its input before writing anything, so the columns can be filtered in
+		// place
+		for (int x = 0; x < tile_width; x++) {
+			running_min(rows + x, tile_width, rows + x, tile_width, halo_y2 - halo_y1, above, below, scratch);
+		}
+		for (int y = y1; y < y2; y++) {
+			memcpy(preview->dark + (size_t)y * size.width + x1, rows + (size_t)(y - halo_y1) * tile_width,
+				tile_width * sizeof(uint16_t));
+		}
+	}
+
+	band->dark_time += current_time() - start;
+
+	return NULL;
+}
+
+/* Estimates the transmission and recovers the output for a band of rows of a preview's view, from
+ * the dark channel of its tiles
+ *
+ * arg - The band_t describing the rows to process
+ *
+ * Returns NULL, so that it can be used as a thread's start routine
+ */
+void *preview_band(void *arg) {
+	band_t *band = arg;
+	defog_preview_t *preview = band->preview;
+	IplImage *in = band->src;
+	IplImage *map = band->map;
+	IplImage *out = band->out;
+	CvSize size = cvGetSize(in);
+	int x1 = preview->view.x;
+	int x2 = preview->view.x + preview->view.width;
+	double start = current_time();
+
+	for (int y = band->y1; y < band->y2; y++) {
+		const uint16_t *dark_row = preview->dark + (size_t)y * size.width + x1;
+		uint8_t *map_row = map != NULL ? PIXEL_ROW(map, y) + x1 : NULL;
+		uint8_t *sample = sample_row(band, map_row, y, x1);
+		if (sample != NULL) {
+			map_row = sample;
+		}
+		if (band->grid != NULL || band->depth->quantize != NULL) {
+			band->depth->recover_field(PIXEL_AT(in, y, x1), dark_row, map_row, PIXEL_AT(out, y, x1), x2 - x1,
+				band_light_row(band, y, size, x1, x2), band->floor);
+		} else {
+			band->recover(PIXEL_ROW(in, y) + x1 * 3, dark_row, map_row, PIXEL_ROW(out, y) + x1 * 3, x2 - x1, band->lut);
+		}
+		if (sample != NULL) {
+			count_samples(band->samples, sample, x2 - x1);
+		}
+	}
+
+	band->recover_time += current_time() - start;
+
+	return NULL;
+}
+
+/* Works out how many bands an image is split into
+ *
+ * ctx - The defogging context
+ * height - The height of the image
+ *
+ * Returns the number of bands, which is between 1 and the number of threads in the parameters
+ */
+int count_bands(const defog_ctx_t *ctx, int height) {
+	// Don't bother splitting the image into bands that are thinner than the window
+	int num_bands = ctx->params.num_threads;
+	int window = ctx->params.window_height;
+	if (num_bands > height / window) {
+		num_bands = height / window > 1 ? height / window : 1;
+	}
+
+	return num_bands;
+}
+
+/* Runs the bands of every stage handed to the context's workers that fall to one of them, until
+ * the context is destroyed
+ *
+ * arg - The worker_t of the thread
+ *
+ * Returns NULL, so that it can be used as a thread's start routine
+ */
+void *band_worker(void *arg) {
+	worker_t *worker = arg;
+	defog_ctx_t *ctx = worker->ctx;
+	unsigned seen = 0;
+
+	pthread_mutex_lock(&ctx->workers_lock);
+	for (;;) {
+		while (ctx->stage_count == seen && !ctx->workers_quit) {
+			pthread_cond_wait(&ctx->stage_ready, &ctx->workers_lock);
+		}
+		if (ctx->workers_quit) {
+			break;
+		}
+		seen = ctx->stage_count;
+
+		// A stage with fewer bands than there are workers leaves the rest idle
+		if (worker->index < ctx->stage_bands) {
+			void *(*stage)(void *) = ctx->stage;
+			pthread_mutex_unlock(&ctx->workers_lock);
+			stage(&ctx->bands[worker->index]);
+			pthread_mutex_lock(&ctx->workers_lock);
+			if (--ctx->stage_pending == 0) {
+				pthread_cond_signal(&ctx->stage_done);
+			}
+		}
+	}
+	pthread_mutex_unlock(&ctx->workers_lock);
+
+	return NULL;
+}
+
+/* Starts a worker for every band but the first, so that the threads are only created once per
+ * context rather than for every stage of every image
+ *
+ * ctx - The defogging context, whose bands have been allocated
+ *
+ * Returns 0 on success, or -1 if the lock or the conditions couldn't be initialized; if only some
+ * of the workers could be started, the bands of the rest are run on the calling thread
+ */
+int start_workers(defog_ctx_t *ctx) {
+	if (pthread_mutex_init(&ctx->workers_lock, NULL) != 0) {
+		return -1;
+	}
+	if (pthread_cond_init(&ctx->stage_ready, NULL) != 0) {
+		pthread_mutex_destroy(&ctx->workers_lock);
+		return -1;
+	}
+	if (pthread_cond_init(&ctx->stage_done, NULL) != 0) {
+		pthread_cond_destroy(&ctx->stage_ready);
+		pthread_mutex_destroy(&ctx->workers_lock);
+		return -1;
+	}
+	ctx->workers_ready = 1;
+
+	for (int i = 1; i < ctx->params.num_threads; i++) {
+		worker_t *worker = &ctx->workers[i];
+		worker->ctx = ctx;
+		worker->index = i;
+		if (pthread_create(&worker->thread, NULL, band_worker, worker) != 0) {
+			break;
+		}
+		ctx->num_workers++;
+	}
+
+	return 0;
+}
+
+/* Tells the context's workers to finish and waits for them to
+ *
+ * ctx - The defogging context, which isn't running a stage
+ */
+void stop_workers(defog_ctx_t *ctx) {
+	if (!ctx->workers_ready) {
+		return;
+	}
+
+	pthread_mutex_lock(&ctx->workers_lock);
+	ctx->workers_quit = 1;
+	pthread_cond_broadcast(&ctx->stage_ready);
+	pthread_mutex_unlock(&ctx->workers_lock);
+	for (int i = 1; i <= ctx->num_workers; i++) {
+		pthread_join(ctx->workers[i].thread, NULL);
+	}
+
+	pthread_cond_destroy(&ctx->stage_done);
+	pthread_cond_destroy(&ctx->stage_ready);
+	pthread_mutex_destroy(&ctx->workers_lock);
+	ctx->workers_ready = 0;
+}
+
+/* Runs a stage of the pipeline over every band of an image, processing the first band on this
+ * thread and the rest on the context's workers; it returns once every band has finished
+ *
+ * ctx - The defogging context, whose bands have been set up for the image
+ * num_bands - The number of bands
+ * stage - The function that processes a band, which is passed its band_t
+ */
+void run_bands(defog_ctx_t *ctx, int num_bands, void *(*stage)(void *)) {
+	// Bands without a worker, because it couldn't be started, fall back on this thread
+	int handed_out = num_bands - 1 < ctx->num_workers ? num_bands - 1 : ctx->num_workers;
+	if (handed_out > 0) {
+		pthread_mutex_lock(&ctx->workers_lock);
+		ctx->stage = stage;
+		ctx->stage_bands = handed_out + 1;
+		ctx->stage_pending = handed_out;
+		ctx->stage_count++;
+		pthread_cond_broadcast(&ctx->stage_ready);
+		pthread_mutex_unlock(&ctx->workers_lock);
+	}
+
+	for (int i = handed_out + 1; i < num_bands; i++) {
+		stage(&ctx->bands[i]);
+	}
+	stage(&ctx->bands[0]);
+
+	if (handed_out > 0) {
+		pthread_mutex_lock(&ctx->workers_lock);
+		while (ctx->stage_pending > 0) {
+			pthread_cond_wait(&ctx->stage_done, &ctx->workers_lock);
+		}
+		pthread_mutex_unlock(&ctx->workers_lock);
+	}
+}
+
+/* Splits an image into bands of rows, as evenly as possible, ready for run_bands()
+ *
+ * ctx - The defogging context, whose buffers must have been reserved for the image
+ * img - The 8-bit BGR image to process, whose light the recovery table must have been built for;
+ *       if it's the 8-bit copy of an image deeper than 8 bits, the output is recovered from that
+ *       image instead
+ * map - The 8-bit single channel image that the transmission map will be written to, or NULL
+ * out - The BGR image, at the depth of the image being defogged, that the output will be
+ *       written to, or NULL if the stages that will be run don't write any output
+ * window - The width of the dark channel window at the resolution of img
+ * window_height - The height of the window at that resolution
+ * grid - The light grid that the stages estimate or recover with, or NULL to use the single light
+ *        that the recovery table was built for
+ *
+ * Returns the number of bands
+ */
+int setup_bands(defog_ctx_t *ctx, IplImage *img, IplImage *map, IplImage *out, int window, int window_height, defog_light_t *grid) {
+	int height = cvGetSize(img).height;
+	int num_bands = count_bands(ctx, height);
+	band_t *bands = ctx->bands;
+	int refine = ctx->params.refine_radius > 0 || ctx->params.pyramid_levels > 0;
+
+	for (int i = 0; i < num_bands; i++) {
+		bands[i].img = img;
+		bands[i].map = map;
+		bands[i].out = out;
+		bands[i].light = ctx->lut.light;
+		bands[i].src = ctx->source != NULL && img == ctx->estimate ? ctx->source : img;
+		bands[i].depth = ctx->depth;
+		bands[i].lut = &ctx->lut;
+		bands[i].recover = ctx->recover;
+		bands[i].recover_refined = ctx->recover_refined;
+		bands[i].floor = ctx->params.transmission_floor;
+		bands[i].window = window;
+		bands[i].window_height = window_height;
+		bands[i].grid = grid;
+		bands[i].grid_size = ctx->params.light_grid;
+		bands[i].light_step = ctx->params.light_step;
+		bands[i].light_per_channel = ctx->params.light_per_channel;
+		bands[i].y1 = height * i / num_bands;
+		bands[i].y2 = height * (i + 1) / num_bands;
+		bands[i].refine = refine ? &ctx->refine : NULL;
+		bands[i].planes = NULL;
+	}
+
+	return num_bands;
+}
+
+/* Splits an 8-bit image into planes in the context's arena, a band at a time in parallel, and
+ * hands them to the bands that were set up for it
+ *
+ * ctx - The defogging context, whose stats are updated with the time taken
+ * img - The 8-bit BGR image, which is what the bands were set up with
+ * num_bands - The number of bands
+ *
+ * If the planes can't be allocated, the bands are left to work on the interleaved image.
+ */
+void split_planes(defog_ctx_t *ctx, IplImage *img, int num_bands) {
+	double start = current_time();
+	size_t plane_size = (size_t)img->width * img->height;
+	uint8_t *planes = arena_alloc(&ctx->arena, 3 * plane_size);
+	if (planes == NULL) {
+		return;
+	}
+
+	for (int i = 0; i < num_bands; i++) {
+		ctx->bands[i].planes = planes;
+		ctx->bands[i].plane_size = plane_size;
+		ctx->bands[i].split = ctx->split;
+		ctx->bands[i].recover_planar = ctx->recover_planar;
+	}
+	run_bands(ctx, num_bands, split_band);
+	ctx->stats.convert_time += current_time() - start;
+}
+
+/* Makes sure that a recovery table is built for an atmospheric light and a floor, which the bands
+ * also take the light from
+ *
+ * ctx - The defogging context, whose kernels the table is built for
+ * lut - The table, which is the context's own unless it belongs to a preview
+ * lut_valid - Whether the table has been built yet, which is set once it has
+ * light - The atmospheric light
+ * floor - The lowest transmission that the output is recovered with
+ *
+ * Returns how long the table took to build, or 0 if it didn't need rebuilding
+ */
+double update_lut(defog_ctx_t *ctx, recovery_lut_t *lut, int *lut_valid, const defog_light_t *light, double floor) {
+	// Consecutive video frames usually share the same light, so the table rarely needs rebuilding
+	if (*lut_valid && lut->floor == floor && memcmp(lut->light, light->bgr, sizeof(lut->light)) == 0) {
+		return 0.0;
+	}
+
+	// The fixed point kernel only needs its own small part of the table
+	double start = current_time();
+	if (ctx->recover == recover_row_fixed) {
+		build_fixed_recovery(lut, light->bgr, floor);
+	} else {
+		build_recovery_lut(lut, light->bgr, floor);
+	}
+	*lut_valid = 1;
+
+	return current_time() - start;
+}
+
+/* Estimates the transmission map and recovers the defogged output for an entire image, splitting
+ * it into bands of rows that are processed in parallel
+ *
+ * ctx - The defogging context, whose buffers must have been reserved for the image, and whose
+ *       pyramid must have been built from it in pyramid mode
+ * img - The original 8-bit BGR image, or the 8-bit copy of an image deeper than 8 bits
+ * light - The atmospheric light, as found by find_light()
+ * grid - The light of each tile of the light grid, which is used instead of light, or NULL
+ * map - The 8-bit single channel image that the transmission map will be written to, or NULL
+ * out - The BGR image, at the depth of the image being defogged, that the output is written to
+ */
+void defog_image(defog_ctx_t *ctx, IplImage *img, const defog_light_t *light, defog_light_t *grid, IplImage *map, IplImage *out) {
+	band_t *bands = ctx->bands;
+	int levels = ctx->params.pyramid_levels;
+	int window = ctx->params.window;
+	int window_height = ctx->params.window_height;
+
+	int samples[UINT8_MAX + 1] = {0};
+	ctx->stats.light = *light;
+
+	// The GPU has already found the dark channel, so only the recovery is left; if that fails, the
+	// CPU starts over from the beginning. Its transmission can only be sampled from the map
+	if (ctx->gpu_loaded) {
+		double start = current_time();
+		update_lut(ctx, &ctx->lut, &ctx->lut_valid, light, ctx->params.transmission_floor);
+		if (gpu_recover(ctx->gpu, &ctx->lut, out, map) == 0) {
+			for (int y = 0; map != NULL && y < map->height; y += SAMPLE_ROW_STEP) {
+				count_samples(samples, PIXEL_ROW(map, y), map->width);
+			}
+			summarize_samples(&ctx->stats, samples, ctx->params.transmission_floor);
+			ctx->stats.refine_time = 0.0;
+			ctx->stats.recover_time = current_time() - start;
+			return;
+		}
+	}
+
+	for (int i = 0; i < ctx->params.num_threads; i++) {
+		bands[i].dark_time = 0.0;
+		bands[i].refine_time = 0.0;
+		bands[i].recover_time = 0.0;
+		memset(bands[i].samples, 0, sizeof(bands[i].samples));
+	}
+	if (grid == NULL) {
+		bands[0].recover_time += update_lut(ctx, &ctx->lut, &ctx->lut_valid, light, ctx->params.transmission_floor);
+	}
+
+	// In pyramid mode, the transmission and the guided filter are worked out on the smallest level
+	// of the pyramid, with the window shrunk to match, and only the recovery is done at full
+	// resolution. Otherwise, without refinement, each band is defogged in a single pass; with it,
+	// every stage of the guided filter has to finish across the whole image before the next one
+	// can start
+	if (levels > 0) {
+		int small_window = window >> levels > 1 ? window >> levels : 1;
+		int small_height = window_height >> levels > 1 ? window_height >> levels : 1;
+		int num_bands = setup_bands(ctx, ctx->pyramid[levels - 1], NULL, NULL, small_window, small_height, grid);
+		run_bands(ctx, num_bands, transmission_band);
+		run_bands(ctx, num_bands, coefficients_band);
+		num_bands = setup_bands(ctx, img, map, out, window, window_height, grid);
+		run_bands(ctx, num_bands, upsampled_band);
+	} else if (ctx->params.refine_radius > 0) {
+		int num_bands = setup_bands(ctx, img, map, out, window, window_height, grid);
+		run_bands(ctx, num_bands, transmission_band);
+		run_bands(ctx, num_bands, coefficients_band);
+		run_bands(ctx, num_bands, refined_band);
+	} else {
+		// Planes only help the kernels for a single light at 8 bits
+		int num_bands = setup_bands(ctx, img, map, out, window, window_height, grid);
+		if (ctx->recover_planar != NULL && grid == NULL && ctx->source == NULL) {
+			split_planes(ctx, img, num_bands);
+		}
+		run_bands(ctx, num_bands, defog_band);
+	}
+
+	// Add up the time that every band spent on each stage
+	ctx->stats.dark_time = 0.0;
+	ctx->stats.refine_time = 0.0;
+	ctx->stats.recover_time = 0.0;
+	for (int i = 0; i < ctx->params.num_threads; i++) {
+		ctx->stats.dark_time += bands[i].dark_time;
+		ctx->stats.refine_time += bands[i].refine_time;
+		ctx->stats.recover_time += bands[i].recover_time;
+		for (int val = 0; val <= UINT8_MAX; val++) {
+			samples[val] += bands[i].samples[val];
+		}
+	}
+	summarize_samples(&ctx->stats, samples, ctx->params.transmission_floor);
+}
+
+/* Lays out an image in an arena, so that it lasts until the arena is next reset and never needs to
+ * be released
+ *
+ * arena - The arena
+ * header - The header to fill in
+ * size - The size of the image
+ * depth - The IPL depth of the image
+ * channels - The number of channels of each pixel
+ *
+ * Returns header, or NULL if the arena couldn't grow
+ */
+IplImage *arena_image(arena_t *arena, IplImage *header, CvSize size, int depth, int channels) {
+	cvInitImageHeader(header, size, depth, channels, IPL_ORIGIN_TL, 4);
+	void *data = arena_alloc(arena, (size_t)header->imageSize);
+	if (data == NULL) {
+		return NULL;
+	}
+	cvSetData(header, data, header->widthStep);
+
+	return header;
+}
+
+/* Starts a new image by handing every buffer of the last one back to the arena and carving out
+ * the buffers for this one, which costs nothing once the arena has grown to fit
+ *
+ * ctx - The defogging context
+ * width - The width of the image
+ * height - The height of the image
+ *
+ * Returns 0 on success or -1 if a buffer couldn't be allocated
+ */
+int reserve_buffers(defog_ctx_t *ctx, int width, int height) {
+	arena_t *arena = &ctx->arena;
+	arena_reset(arena);
+
+	// Each band streams down its rows, so only needs buffers for a couple of windows' worth of rows
+	int num_bands = count_bands(ctx, height);
+	for (int i = 0; i < num_bands; i++) {
+		if (reserve_dark_stream(&ctx->bands[i].stream, arena, width, ctx->params.window, ctx->params.window_height) != 0) {
+			return -1;
+		}
+	}
+
+	// Without a map, the sampled rows of the transmission are written to a row of their own, and in
+	// light grid mode or for images deeper than 8 bits, each band lays out the light of a row at a
+	// time; that row is never touched otherwise, so it costs nothing to always have it
+	for (int i = 0; i < num_bands; i++) {
+		band_t *band = &ctx->bands[i];
+		band->sample_row = arena_alloc(arena, (size_t)width);
+		band->light_row = arena_alloc(arena, 3 * (size_t)width * sizeof(float));
+		if (band->sample_row == NULL || band->light_row == NULL) {
+			return -1;
+		}
+	}
+
+	int plane_width = width;
+	int plane_height = height;
+	for (int l = 0; l < ctx->params.pyramid_levels; l++) {
+		plane_width = (plane_width + 1) / 2;
+		plane_height = (plane_height + 1) / 2;
+		ctx->pyramid[l] = arena_image(arena, &ctx->pyramid_headers[l], cvSize(plane_width, plane_height), IPL_DEPTH_8U, 3);
+		if (ctx->pyramid[l] == NULL) {
+			return -1;
+		}
+	}
+
+	// Refining the transmission map needs planes the size of the image (or the smallest level of
+	// the pyramid), and each band needs the column and prefix sums of four planes
+	if (ctx->params.refine_radius > 0 || ctx->params.pyramid_levels > 0) {
+		refine_t *refine = &ctx->refine;
+		size_t plane_size = (size_t)plane_width * plane_height * sizeof(float);
+		refine->guide = arena_alloc(arena, plane_size);
+		refine->transmission = arena_alloc(arena, plane_size);
+		refine->coef_a = arena_alloc(arena, plane_size);
+		refine->coef_b = arena_alloc(arena, plane_size);
+		if (refine->guide == NULL || refine->transmission == NULL || refine->coef_a == NULL || refine->coef_b == NULL) {
+			return -1;
+		}
+		for (int i = 0; i < num_bands; i++) {
+			band_t *band = &ctx->bands[i];
+			band->sums = arena_alloc(arena, (4 * (size_t)plane_width + 4 * ((size_t)plane_width + 1)) * sizeof(double));
+			band->t_row = arena_alloc(arena, (size_t)width * sizeof(float));
+			band->coef_rows = arena_alloc(arena, 2 * ((size_t)plane_width + 1) * sizeof(float));
+			band->x_index = arena_alloc(arena, (size_t)width * sizeof(int));
+			band->x_frac = arena_alloc(arena, (size_t)width * sizeof(float));
+			if (band->sums == NULL || band->t_row == NULL || band->coef_rows == NULL || band->x_index == NULL ||
+					band->x_frac == NULL) {
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* Fills in the default defogging parameters
+ *
+ * params - The parameters to fill in
+ */
+void defog_default_params(defog_params_t *params) {
+	params->num_threads = 1;
+	params->window = MAP_WIDTH;
+	params->window_height = 0;
+	params->use_simd = 1;
+	params->fixed_point = 0;
+	params->planar = 0;
+	params->light_interval = 30;
+	params->light_smoothing = 0.2;
+	params->light_step = 1;
+	params->light_per_channel = 0;
+	params->transmission_floor = TRANSMISSION_FLOOR;
+	params->light_grid = 0;
+	params->scene_threshold = 24.0;
+	params->refine_radius = 0;
+	params->refine_eps = 1e-3;
+	params->pyramid_levels = 0;
+	params->use_gpu = 0;
+}
+
+/* Creates a defogging context, which can be reused for any number of images
+ *
+ * params - The parameters to defog images with, or NULL to use the defaults
+ * max_width - The width of the largest image expected, or 0 if it isn't known
+ * max_height - The height of the largest image expected, or 0 if it isn't known
+ *
+ * Buffers are allocated up front for images up to max_width x max_height; larger images are
+ * still handled, but the buffers will have to grow when they are processed
+ *
+ * Returns the new context, which must be freed with defog_destroy(), or NULL on failure
+ */
+defog_ctx_t *defog_create(const defog_params_t *params, int max_width, int max_height) {
+	defog_ctx_t *ctx = calloc(1, sizeof(defog_ctx_t));
+	if (ctx == NULL) {
+		return NULL;
+	}
+
+	// Copy the parameters, making sure there is always at least one thread
+	if (params != NULL) {
+		ctx->params = *params;
+	} else {
+		defog_default_params(&ctx->params);
+	}
+	if (ctx->params.num_threads < 1) {
+		ctx->params.num_threads = 1;
+	}
+	if (ctx->params.window < 1) {
+		ctx->params.window = MAP_WIDTH;
+	}
+	if (ctx->params.window_height < 1) {
+		ctx->params.window_height = ctx->params.window;
+	}
+	if (ctx->params.light_interval < 1) {
+		ctx->params.light_interval = 1;
+	}
+	if (ctx->params.light_step < 1) {
+		ctx->params.light_step = 1;
+	}
+	if (ctx->params.refine_radius < 0) {
+		ctx->params.refine_radius = 0;
+	}
+	if (ctx->params.pyramid_levels < 0) {
+		ctx->params.pyramid_levels = 0;
+	} else if (ctx->params.pyramid_levels > DEFOG_MAX_PYRAMID_LEVELS) {
+		ctx->params.pyramid_levels = DEFOG_MAX_PYRAMID_LEVELS;
+	}
+	if (ctx->params.light_grid < 0) {
+		ctx->params.light_grid = 0;
+	} else if (ctx->params.light_grid > DEFOG_MAX_LIGHT_GRID) {
+		ctx->params.light_grid = DEFOG_MAX_LIGHT_GRID;
+	}
+	ctx->params.transmission_floor = clamp_floor(ctx->params.transmission_floor);
+
+	// In pyramid mode the guided filter always runs, since it's what upsamples the transmission;
+	// its radius shrinks along with the image, and defaults to the width of the window
+	ctx->refine.radius = ctx->params.refine_radius;
+	ctx->refine.eps = ctx->params.refine_eps;
+	ctx->refine.levels = ctx->params.pyramid_levels;
+	if (ctx->params.pyramid_levels > 0) {
+		int radius = ctx->params.refine_radius > 0 ? ctx->params.refine_radius : ctx->params.window;
+		radius >>= ctx->params.pyramid_levels;
+		ctx->refine.radius = radius > 1 ? radius : 1;
+	}
+
+	// Only the double precision kernels can use a different light for each channel
+	if (ctx->params.light_per_channel) {
+		ctx->recover = recover_row;
+		ctx->recover_refined = recover_row_refined;
+	} else {
+		ctx->recover = ctx->params.fixed_point ? recover_row_fixed : select_recover_row(ctx->params.use_simd);
+		ctx->recover_refined = select_recover_row_refined(ctx->params.use_simd);
+	}
+	if (ctx->params.planar && ctx->recover != recover_row && ctx->recover != recover_row_fixed &&
+			ctx->params.refine_radius == 0 && ctx->params.pyramid_levels == 0) {
+		ctx->split = select_split_row(ctx->params.use_simd);
+		ctx->recover_planar = select_recover_planar(ctx->params.use_simd);
+	}
+
+	// Not having a GPU isn't an error, since the CPU can always do the work instead
+	if (ctx->params.use_gpu) {
+		ctx->gpu = gpu_create();
+	}
+
+	// Allocate the bands and their workers, and then buffers for the largest expected image
+	ctx->bands = calloc(ctx->params.num_threads, sizeof(band_t));
+	ctx->workers = calloc(ctx->params.num_threads, sizeof(worker_t));
+	if (ctx->bands == NULL || ctx->workers == NULL) {
+		defog_destroy(ctx);
+		return NULL;
+	}
+	if (ctx->params.light_grid > 0) {
+		int num_tiles = ctx->params.light_grid * ctx->params.light_grid;
+		ctx->grid = calloc(num_tiles, sizeof(defog_light_t));
+		ctx->frame_grid = calloc(num_tiles, sizeof(defog_light_t));
+		if (ctx->grid == NULL || ctx->frame_grid == NULL) {
+			defog_destroy(ctx);
+			return NULL;
+		}
+	}
+	for (int i = 0; i < ctx->params.num_threads; i++) {
+		ctx->bands[i].stream.dark_keys = select_dark_keys(ctx->params.use_simd);
+		ctx->bands[i].stream.dark_keys_planar = select_dark_keys_planar(ctx->params.use_simd);
+	}
+	ctx->depth = select_depth_kernels(IPL_DEPTH_8U);
+	if (max_width > 0 && max_height > 0) {
+		// Resetting the arena straight away gathers everything into a single block
+		if (reserve_buffers(ctx, max_width, max_height) != 0) {
+			defog_destroy(ctx);
+			return NULL;
+		}
+		arena_reset(&ctx->arena);
+	}
+
+	// The workers are started last, once nothing else can fail
+	if (start_workers(ctx) != 0) {
+		defog_destroy(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+/* Frees a defogging context and all of its buffers
+ *
+ * ctx - The context to free, which may be NULL
+ */
+void defog_destroy(defog_ctx_t *ctx) {
+	if (ctx == NULL) {
+		return;
+	}
+
+	stop_workers(ctx);
+
+	// Every buffer that belongs to an image, including the pyramid and the 8-bit copy, is in the
+	// arena
+	arena_free(&ctx->arena);
+	gpu_destroy(ctx->gpu);
+
+	free(ctx->grid);
+	free(ctx->frame_grid);
+	free(ctx->bands);
+	free(ctx->workers);
+	free(ctx);
+}
+
+/* Reports whether a context runs on the GPU, since use_gpu is only a request
+ *
+ * ctx - The defogging context
+ *
+ * Returns 1 if a GPU was found when the context was created or 0 if everything runs on the CPU
+ */
+int defog_using_gpu(const defog_ctx_t *ctx) {
+	return ctx->gpu != NULL;
+}
+
+/* Makes sure that a set of images can be passed to the defogging kernels
+ *
+ * in - The image to defog, which must be BGR and 8-bit, 16-bit, or floating point
+ * out - The output image, which must be BGR and the same depth and size as in
+ * map - The transmission map, which must be 8-bit single channel and the same size as in, or NULL
+ *
+ * Returns 0 if the images are usable or -1 if not
+ */
+int check_images(IplImage *in, IplImage *out, IplImage *map) {
+	CvSize size = cvGetSize(in);
+	if (select_depth_kernels(in->depth) == NULL || in->nChannels != 3 ||
+			out->depth != in->depth || out->nChannels != 3 ||
+			cvGetSize(out).width != size.width || cvGetSize(out).height != size.height) {
+		return -1;
+	}
+	if (map != NULL && (map->depth != IPL_DEPTH_8U || map->nChannels != 1 ||
+			cvGetSize(map).width != size.width || cvGetSize(map).height != size.height)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Converts a band of rows of an image deeper than 8 bits to its 8-bit copy
+ *
+ * arg - The band_t describing the rows to convert, whose src is the image and img the copy
+ *
+ * Returns NULL, so that it can be used as a thread's start routine
+ */
+void *quantize_band(void *arg) {
+	band_t *band = arg;
+	int len = cvGetSize(band->img).width * 3;
+
+	for (int y = band->y1; y < band->y2; y++) {
+		band->depth->quantize(PIXEL_ROW(band->src, y), PIXEL_ROW(band->img, y), len);
+	}
+
+	return NULL;
+}
+
+/* Gets an image ready to be defogged at its own depth. The atmospheric light, the dark channel,
+ * and the transmission are always estimated at 8 bits (the map only has 8 bits anyway), so an
+ * image that's deeper than that is converted to an 8-bit copy for them, a band at a time in
+ * parallel; only the recovery reads the original values, so the output keeps their full range
+ *
+ * ctx - The defogging context, whose buffers must have been reserved for the image and whose
+ *       stats are updated with the time taken
+ * in - The BGR image, which is 8-bit, 16-bit, or floating point
+ *
+ * Returns the image that everything but the recovery works from, which is in itself if it's
+ * 8-bit, or NULL if a buffer couldn't be allocated
+ */
+IplImage *prepare_estimate(defog_ctx_t *ctx, IplImage *in) {
+	ctx->depth = select_depth_kernels(in->depth);
+	ctx->source = NULL;
+	ctx->stats.convert_time = 0.0;
+	if (ctx->depth->quantize == NULL) {
+		return in;
+	}
+
+	// The copy comes from the arena along with the image's other buffers
+	double start = current_time();
+	ctx->estimate = arena_image(&ctx->arena, &ctx->estimate_header, cvGetSize(in), IPL_DEPTH_8U, 3);
+	if (ctx->estimate == NULL) {
+		return NULL;
+	}
+
+	ctx->source = in;
+	int num_bands = setup_bands(ctx, ctx->estimate, NULL, NULL, ctx->params.window, ctx->params.window_height, NULL);
+	run_bands(ctx, num_bands, quantize_band);
+	ctx->stats.convert_time = current_time() - start;
+
+	return ctx->estimate;
+}
+
+/* Uploads an image to the GPU and finds its dark channel there, if the context has a GPU; the GPU
+ * has no guided filter, per-channel light, or output deeper than 8 bits, so those always run on
+ * the CPU
+ *
+ * ctx - The defogging context, whose stats are updated with the time taken
+ * in - The 8-bit BGR image
+ */
+void load_gpu(defog_ctx_t *ctx, IplImage *in) {
+	ctx->gpu_loaded = 0;
+	if (ctx->gpu == NULL || ctx->source != NULL || ctx->params.refine_radius > 0 || ctx->params.pyramid_levels > 0 ||
+			ctx->params.light_per_channel || ctx->params.fixed_point || ctx->params.light_grid > 0) {
+		return;
+	}
+
+	double start = current_time();
+	ctx->gpu_loaded = gpu_load(ctx->gpu, in, ctx->params.window, ctx->params.window_height) == 0;
+	ctx->stats.dark_time = current_time() - start;
+}
+
+/* Estimates the atmospheric light of a whole image, on the GPU if the image has been loaded onto
+ * it, or of each tile of the light grid
+ *
+ * ctx - The defogging context, whose stats are updated with the time taken
+ * in - The 8-bit BGR image
+ * light - Where the light is written, as found by find_light(); with a grid, it's the light of
+ *         the brightest tile, which stands in for the light of the whole image
+ * grid - Where the light of each tile of the light grid is written, or NULL to only estimate a
+ *        single light
+ */
+void estimate_light(defog_ctx_t *ctx, IplImage *in, defog_light_t *light, defog_light_t *grid) {
+	double start = current_time();
+	double light_intensity;
+	if (grid != NULL) {
+		// Each tile is searched with the same histograms as a whole image, so splitting the tiles
+		// between the bands reads every pixel once, just as a single light does
+		int num_tiles = ctx->params.light_grid * ctx->params.light_grid;
+		int num_bands = setup_bands(ctx, in, NULL, NULL, ctx->params.window, ctx->params.window_height, grid);
+		for (int i = 0; i < num_bands; i++) {
+			ctx->bands[i].first_tile = num_tiles * i / num_bands;
+			ctx->bands[i].last_tile = num_tiles * (i + 1) / num_bands;
+		}
+		run_bands(ctx, num_bands, light_band);
+
+		int brightest = 0;
+		for (int i = 1; i < num_tiles; i++) {
+			const double *bgr = grid[i].bgr;
+			const double *max_bgr = grid[brightest].bgr;
+			if (bgr[BLUE] + bgr[GREEN] + bgr[RED] > max_bgr[BLUE] + max_bgr[GREEN] + max_bgr[RED]) {
+				brightest = i;
+			}
+		}
+		*light = grid[brightest];
+	} else if (ctx->gpu_loaded && gpu_estimate_light(ctx->gpu, &light_intensity) == 0) {
+		// An entirely black image has no light at all, which find_light() takes as 1 too
+		light_intensity = light_intensity >= 1.0 ? light_intensity : 1.0;
+		light->bgr[BLUE] = light->bgr[GREEN] = light->bgr[RED] = light_intensity;
+	} else {
+		CvSize size = cvGetSize(in);
+		find_light(in, 0, 0, size.width, size.height, ctx->params.light_step, ctx->params.light_per_channel, light);
+	}
+	ctx->stats.light_time = current_time() - start;
+}
+
+/* Builds the pyramid of downsampled copies of an image used in pyramid mode
+ *
+ * ctx - The defogging context, whose buffers must have been reserved for the image and whose
+ *       stats are updated with the time taken
+ * in - The 8-bit BGR image
+ *
+ * Returns the smallest level of the pyramid, or the image itself if pyramid mode is off
+ */
+IplImage *build_pyramid(defog_ctx_t *ctx, IplImage *in) {
+	double start = current_time();
+	IplImage *level = in;
+	for (int l = 0; l < ctx->params.pyramid_levels; l++) {
+		cvPyrDown(level, ctx->pyramid[l], CV_GAUSSIAN_5x5);
+		level = ctx->pyramid[l];
+	}
+	ctx->stats.pyramid_time = current_time() - start;
+
+	return level;
+}
+
+/* Builds a coarse thumbnail of an image, which is cheap enough to make for every frame of a
+ * video and is compared between frames to detect scene changes
+ *
+ * img - The 8-bit BGR image
+ * thumb - Where the THUMB_SIZE x THUMB_SIZE mean channel values of the image are written
+ *
+ * Returns the mean absolute difference between the new thumbnail and the one previously in thumb
+ */
+double make_thumbnail(IplImage *img, double *thumb) {
+	CvSize size = cvGetSize(img);
+	double sums[THUMB_SIZE * THUMB_SIZE] = {0.0};
+	int counts[THUMB_SIZE * THUMB_SIZE] = {0};
+
+	// Only sample every fourth pixel of every fourth row, which is plenty to notice a cut
+	for (int y = 0; y < size.height; y += 4) {
+		const uint8_t *row = PIXEL_ROW(img, y);
+		int cell_y = y * THUMB_SIZE / size.height;
+
+		for (int x = 0; x < size.width; x += 4) {
+			const uint8_t *pixel = row + x * img->nChannels;
+			int cell = cell_y * THUMB_SIZE + x * THUMB_SIZE / size.width;
+			sums[cell] += (pixel[BLUE] + pixel[GREEN] + pixel[RED]) / 3.0;
+			counts[cell]++;
+		}
+	}
+
+	// Replace the previous thumbnail, measuring how far each cell has moved
+	double diff = 0.0;
+	for (int i = 0; i < THUMB_SIZE * THUMB_SIZE; i++) {
+		double val = counts[i] > 0 ? sums[i] / counts[i] : 0.0;
+		diff += fabs(val - thumb[i]);
+		thumb[i] = val;
+	}
+
+	return diff / (THUMB_SIZE * THUMB_SIZE);
+}
+
+/* Defogs an image
+ *
+ * ctx - The defogging context
+ * in - The BGR image to defog, which is 8-bit, 16-bit, or floating point (nominally in [0, 1])
+ * out - The BGR image, the same depth and size as in, that the defogged image is written to
+ * map - The 8-bit single channel image, the same size as in, that the transmission map is
+ *       written to, or NULL if it isn't needed
+ *
+ * Images deeper than 8 bits are estimated from an 8-bit copy, but recovered from their own values,
+ * so the output keeps the input's full range
+ *
+ * Returns 0 on success, or -1 if the images aren't compatible or buffers couldn't be allocated
+ */
+int defog_process(defog_ctx_t *ctx, IplImage *in, IplImage *out, IplImage *map) {
+	double start = current_time();
+
+	// Make sure that all of the images are in the formats that the kernels expect
+	CvSize size = cvGetSize(in);
+	if (check_images(in, out, map) != 0 || reserve_buffers(ctx, size.width, size.height) != 0) {
+		return -1;
+	}
+	IplImage *estimate = prepare_estimate(ctx, in);
+	if (estimate == NULL) {
+		return -1;
+	}
+
+	// Calculate the atmospheric light for the image (at the pyramid's resolution, in pyramid mode),
+	// then estimate the transmission map and recover the output
+	IplImage *small = build_pyramid(ctx, estimate);
+	load_gpu(ctx, estimate);
+	defog_light_t light;
+	estimate_light(ctx, small, &light, ctx->grid);
+	defog_image(ctx, estimate, &light, ctx->grid, map, out);
+	ctx->stats.total_time = current_time() - start;
+
+	return 0;
+}
+
+/* Defogs the next frame of a video, which works like defog_process() except that the atmospheric
+ * light is only re-estimated every few frames (as set by the light_interval parameter) or when
+ * the scene changes; new estimates are blended with the previous one, which also stops the
+ * output from flickering
+ *
+ * ctx - The defogging context, which should only be used for frames from one video at a time
+ * in - The BGR frame to defog, which is 8-bit, 16-bit, or floating point
+ * out - The BGR image, the same depth and size as in, that the defogged frame is written to
+ * map - The 8-bit single channel image, the same size as in, that the transmission map is
+ *       written to, or NULL if it isn't needed
+ *
+ * Returns 0 on success, or -1 if the images aren't compatible or buffers couldn't be allocated
+ */
+int defog_process_frame(defog_ctx_t *ctx, IplImage *in, IplImage *out, IplImage *map) {
+	double start = current_time();
+
+	// Make sure that all of the images are in the formats that the kernels expect
+	CvSize size = cvGetSize(in);
+	if (check_images(in, out, map) != 0 || reserve_buffers(ctx, size.width, size.height) != 0) {
+		return -1;
+	}
+	IplImage *estimate = prepare_estimate(ctx, in);
+	if (estimate == NULL) {
+		return -1;
+	}
+	ctx->stats.light_time = 0.0;
+
+	// A cut to a new scene makes the previous estimate useless, so it is replaced outright; other
+	// estimates are blended in gradually
+	IplImage *small = build_pyramid(ctx, estimate);
+	load_gpu(ctx, estimate);
+	double scene_diff = make_thumbnail(estimate, ctx->thumb);
+	int num_tiles = ctx->params.light_grid * ctx->params.light_grid;
+	if (ctx->frame_count == 0 || scene_diff > ctx->params.scene_threshold) {
+		estimate_light(ctx, small, &ctx->frame_light, ctx->frame_grid);
+		ctx->frames_since_light = 0;
+	} else if (ctx->frames_since_light >= ctx->params.light_interval) {
+		// The tiles of the grid are each blended in the same way as a single light
+		defog_light_t light;
+		estimate_light(ctx, small, &light, ctx->grid);
+		for (int c = 0; c < 3; c++) {
+			ctx->frame_light.bgr[c] += ctx->params.light_smoothing * (light.bgr[c] - ctx->frame_light.bgr[c]);
+			for (int i = 0; i < num_tiles; i++) {
+				ctx->frame_grid[i].bgr[c] += ctx->params.light_smoothing * (ctx->grid[i].bgr[c] - ctx->frame_grid[i].bgr[c]);
+			}
+		}
+		ctx->frames_since_light = 0;
+	}
+	ctx->frame_count++;
+	ctx->frames_since_light++;
+
+	// Then estimate the transmission map and recover the output
+	defog_image(ctx, estimate, &ctx->frame_light, ctx->frame_grid, map, out);
+	ctx->stats.total_time = current_time() - start;
+
+	return 0;
+}
+
+/* Estimates the atmospheric light of an image on its own, so that it can be reused for other
+ * images with defog_process_with_light(); this is how an image too large to hold in memory is
+ * defogged, by estimating the light from a downsampled copy and then defogging it a tile at a time
+ *
+ * ctx - The defogging context, whose stats are updated with the time taken
+ * in - The BGR image, which is 8-bit, 16-bit, or floating point
+ *
+ * light - Where the atmospheric light is written, which is at the 8-bit scale (0 to 255) whatever
+ *         the depth of the image
+ *
+ * Returns 0 on success, or -1 if the image isn't BGR at a supported depth or buffers couldn't be
+ * allocated
+ */
+int defog_estimate_light(defog_ctx_t *ctx, IplImage *in, defog_light_t *light) {
+	CvSize size = cvGetSize(in);
+	if (select_depth_kernels(in->depth) == NULL || in->nChannels != 3 || reserve_buffers(ctx, size.width, size.height) != 0) {
+		return -1;
+	}
+	IplImage *estimate = prepare_estimate(ctx, in);
+	if (estimate == NULL) {
+		return -1;
+	}
+
+	// The image on the GPU, if any, is a different one; otherwise this works just as
+	// defog_process() does, at the pyramid's resolution in pyramid mode
+	ctx->gpu_loaded = 0;
+
+	estimate_light(ctx, build_pyramid(ctx, estimate), light, NULL);
+
+	return 0;
+}
+
+/* Defogs an image with an atmospheric light that has already been estimated, which works like
+ * defog_process() otherwise
+ *
+ * ctx - The defogging context
+ * in - The BGR image to defog, which is 8-bit, 16-bit, or floating point
+ * light - The atmospheric light, as found by defog_estimate_light(); each channel is clamped to
+ *         the 8-bit range of 1 to 255 that an estimated one is always in
+ * out - The BGR image, the same depth and size as in, that the defogged image is written to
+ * map - The 8-bit single channel image, the same size as in, that the transmission map is
+ *       written to, or NULL if it isn't needed
+ *
+ * Returns 0 on success, or -1 if the images aren't compatible or buffers couldn't be allocated
+ */
+int defog_process_with_light(defog_ctx_t *ctx, IplImage *in, const defog_light_t *light, IplImage *out, IplImage *map) {
+	double start = current_time();
+
+	// Make sure that all of the images are in the formats that the kernels expect
+	CvSize size = cvGetSize(in);
+	if (check_images(in, out, map) != 0 || reserve_buffers(ctx, size.width, size.height) != 0) {
+		return -1;
+	}
+	IplImage *estimate = prepare_estimate(ctx, in);
+	if (estimate == NULL) {
+		return -1;
+	}
+	ctx->stats.light_time = 0.0;
+
+	// The recovery divides by the light, so none of its channels can be 0, and the fixed point
+	// kernels only stay within their integer ranges for lights at the 8-bit scale
+	defog_light_t clamped;
+	for (int c = 0; c < 3; c++) {
+		double value = light->bgr[c] >= 1.0 ? light->bgr[c] : 1.0;
+		clamped.bgr[c] = value <= UINT8_MAX ? value : UINT8_MAX;
+	}
+
+	build_pyramid(ctx, estimate);
+	load_gpu(ctx, estimate);
+	defog_image(ctx, estimate, &clamped, NULL, map, out);
+	ctx->stats.total_time = current_time() - start;
+
+	return 0;
+}
+
+/* Wraps a buffer that belongs to the caller in an image header, without copying it, so that it can
+ * be passed to the library or to OpenCV
+ *
+ * header - The header to fill in, which can live on the stack; it doesn't own the pixels and
+ *          mustn't be released with cvReleaseImage()
+ * width - The width of the image in pixels
+ * height - The height of the image in pixels
+ * channels - The number of 8-bit channels of each pixel, which is 3 (BGR) or 1
+ * buf - The pixels, which must outlive the header
+ *
+ * Returns header
+ */
+IplImage *defog_wrap_buffer(IplImage *header, int width, int height, int channels, const defog_buffer_t *buf) {
+	cvInitImageHeader(header, cvSize(width, height), IPL_DEPTH_8U, channels, IPL_ORIGIN_TL, 4);
+	cvSetData(header, buf->data, buf->stride > 0 ? buf->stride : width * channels);
+
+	return header;
+}
+
+/* Defogs an image that is already in memory, such as a frame from a capture service or a shared
+ * memory segment, writing the results straight into the caller's buffers with no copying or
+ * encoding; otherwise this works like defog_process(), or defog_process_frame() for frames
+ *
+ * ctx - The defogging context
+ * width - The width of the images in pixels
+ * height - The height of the images in pixels
+ * in - The 8-bit BGR image to defog, which is only read
+ * out - The 8-bit BGR buffer, which mustn't overlap in, that the defogged image is written to
+ * map - The 8-bit single channel buffer that the transmission map is written to, or NULL if it
+ *       isn't needed
+ * is_frame - Whether the image is the next frame of a video, whose atmospheric light is carried
+ *            over from earlier frames
+ *
+ * Returns 0 on success, or -1 if the buffers are too small or buffers couldn't be allocated
+ */
+int defog_process_buffer(defog_ctx_t *ctx, int width, int height, const defog_buffer_t *in, const defog_buffer_t *out,
+		const defog_buffer_t *map, int is_frame) {
+	if (width < 1 || height < 1 || (in->stride != 0 && in->stride < width * 3) ||
+			(out->stride != 0 && out->stride < width * 3) ||
+			(map != NULL && map->stride != 0 && map->stride < width)) {
+		return -1;
+	}
+
+	IplImage in_img;
+	IplImage out_img;
+	IplImage map_img;
+	defog_wrap_buffer(&in_img, width, height, 3, in);
+	defog_wrap_buffer(&out_img, width, height, 3, out);
+	IplImage *map_ptr = map != NULL ? defog_wrap_buffer(&map_img, width, height, 1, map) : NULL;
+
+	return is_frame ? defog_process_frame(ctx, &in_img, &out_img, map_ptr) :
+		defog_process(ctx, &in_img, &out_img, map_ptr);
+}
+
+/* Forgets the state carried between frames by defog_process_frame(), so that a context can be
+ * reused for another video
+ *
+ * ctx - The defogging context
+ */
+void defog_reset_frames(defog_ctx_t *ctx) {
+	ctx->frame_count = 0;
+	ctx->frames_since_light = 0;
+	memset(&ctx->frame_light, 0, sizeof(ctx->frame_light));
+	if (ctx->frame_grid != NULL) {
+		memset(ctx->frame_grid, 0, ctx->params.light_grid * ctx->params.light_grid * sizeof(defog_light_t));
+	}
+	memset(ctx->thumb, 0, sizeof(ctx->thumb));
+}
+
+/* Starts previewing an image, for tuning the window and the floor interactively: the atmospheric
+ * light and the darkest channel of every pixel are found once here, and each render only redoes
+ * what has changed since the last one, for the part of the image in view
+ *
+ * ctx - The defogging context, which the preview shares its threads and kernels with, so it
+ *       mustn't defog anything else while the preview is rendering
+ * in - The BGR image to preview, which is 8-bit, 16-bit, or floating point, and which must
+ *      outlive the preview
+ *
+ * Previews start with the context's window and floor. They are never refined or downsampled, so
+ * refine_radius and pyramid_levels are ignored, and they always run on the CPU; otherwise a
+ * render gives exactly what defog_process() would for the same part of the image, apart from the
+ * single step that the SIMD kernels can differ by at the edges of the view.
+ *
+ * Returns the new preview, which must be freed with defog_preview_destroy() before the context
+ * is, or NULL if the image isn't BGR at a supported depth or buffers couldn't be allocated
+ */
+defog_preview_t *defog_preview_create(defog_ctx_t *ctx, IplImage *in) {
+	CvSize size = cvGetSize(in);
+	if (select_depth_kernels(in->depth) == NULL || in->nChannels != 3 || reserve_buffers(ctx, size.width, size.height) != 0) {
+		return NULL;
+	}
+
+	defog_preview_t *preview = calloc(1, sizeof(defog_preview_t));
+	if (preview == NULL) {
+		return NULL;
+	}
+	preview->ctx = ctx;
+	preview->in = in;
+	preview->window = ctx->params.window;
+	preview->window_height = ctx->params.window_height;
+	preview->floor = ctx->params.transmission_floor;
+	preview->tiles_x = (size.width + PREVIEW_TILE - 1) / PREVIEW_TILE;
+	preview->tiles_y = (size.height + PREVIEW_TILE - 1) / PREVIEW_TILE;
+
+	// Both planes of keys cover the whole image, so that panning around never has to throw any of
+	// them away
+	size_t num_pixels = (size_t)size.width * size.height;
+	int num_tiles = preview->tiles_x * preview->tiles_y;
+	preview->keys = malloc(num_pixels * sizeof(uint16_t));
+	preview->dark = malloc(num_pixels * sizeof(uint16_t));
+	preview->tile_valid = calloc(num_tiles, sizeof(uint8_t));
+	preview->pending = malloc(num_tiles * sizeof(int));
+	if (ctx->params.light_grid > 0) {
+		preview->grid = malloc(ctx->params.light_grid * ctx->params.light_grid * sizeof(defog_light_t));
+	}
+	if (preview->keys == NULL || preview->dark == NULL || preview->tile_valid == NULL || preview->pending == NULL ||
+			(ctx->params.light_grid > 0 && preview->grid == NULL)) {
+		defog_preview_destroy(preview);
+		return NULL;
+	}
+
+	IplImage *estimate = prepare_estimate(ctx, in);
+	if (estimate == NULL) {
+		defog_preview_destroy(preview);
+		return NULL;
+	}
+	preview->depth = ctx->depth;
+
+	// The light is always estimated at full resolution, since there's no pyramid
+	ctx->gpu_loaded = 0;
+	estimate_light(ctx, estimate, &preview->light, preview->grid);
+
+	// The 8-bit copy is reused by the context, so its keys are found now while it's still there
+	int num_bands = setup_bands(ctx, estimate, NULL, NULL, preview->window, preview->window_height, NULL);
+	for (int i = 0; i < num_bands; i++) {
+		ctx->bands[i].preview = preview;
+	}
+	run_bands(ctx, num_bands, preview_keys_band);
+
+	return preview;
+}
+
+/* Changes the window that a preview's dark channel is taken over, which is found again for each
+ * tile as it comes into view
+ *
+ * preview - The preview
+ * window - The width of the window, as in defog_params_t, or 0 for the default
+ * window_height - The height of the window, or 0 for a square window
+ */
+void defog_preview_set_window(defog_preview_t *preview, int window, int window_height) {
+	window = window >= 1 ? window : MAP_WIDTH;
+	window_height = window_height >= 1 ? window_height : window;
+	if (window == preview->window && window_height == preview->window_height) {
+		return;
+	}
+
+	preview->window = window;
+	preview->window_height = window_height;
+	memset(preview->tile_valid, 0, (size_t)preview->tiles_x * preview->tiles_y);
+}
+
+/* Changes the floor that a preview recovers its output with, which only needs the recovery to be
+ * rerun
+ *
+ * preview - The preview
+ * floor - The lowest transmission, as in defog_params_t
+ */
+void defog_preview_set_floor(defog_preview_t *preview, double floor) {
+	preview->floor = clamp_floor(floor);
+}
+
+/* Renders part of a preview, finding the dark channel of any of its tiles that haven't been found
+ * for the current window, and then recovering just that part with the current floor; the rest of
+ * the output and the map are left as they were
+ *
+ * preview - The preview
+ * roi - The part of the image to render, which is clamped to the image
+ * out - The BGR image, the same depth and size as the image, that the output is written to
+ * map - The 8-bit single channel image, the same size as the image, that the transmission map is
+ *       written to, or NULL if it isn't needed
+ *
+ * The context's stats are those of the render, with the rows of the part sampled for its
+ * transmission; the light is cached, so its time is always 0.
+ *
+ * Returns 0 on success, or -1 if the images aren't compatible, no part of roi is in the image,
+ * or buffers couldn't be allocated
+ */
+int defog_preview_render(defog_preview_t *preview, CvRect roi, IplImage *out, IplImage *map) {
+	double start = current_time();
+	defog_ctx_t *ctx = preview->ctx;
+	IplImage *in = preview->in;
+	CvSize size = cvGetSize(in);
+	if (check_images(in, out, map) != 0) {
+		return -1;
+	}
+
+	int x1 = roi.x > 0 ? roi.x : 0;
+	int y1 = roi.y > 0 ? roi.y : 0;
+	int x2 = roi.x + roi.width < size.width ? roi.x + roi.width : size.width;
+	int y2 = roi.y + roi.height < size.height ? roi.y + roi.height : size.height;
+	if (x1 >= x2 || y1 >= y2) {
+		return -1;
+	}
+	preview->view = cvRect(x1, y1, x2 - x1, y2 - y1);
+
+	// The context may have defogged other images since the last render, so the buffers are carved
+	// out again; every band's tile buffer is laid out as dark_tiles_band() expects, and a tile's
+	// halo is larger for a larger window
+	if (reserve_buffers(ctx, size.width, size.height) != 0) {
+		return -1;
+	}
+	int reach = preview->window > preview->window_height ? preview->window : preview->window_height;
+	size_t tile_len = (size_t)(PREVIEW_TILE + preview->window_height) * PREVIEW_TILE + PREVIEW_TILE + preview->window +
+		3 * ((size_t)PREVIEW_TILE + reach + 2 * (reach + 1));
+	band_t *bands = ctx->bands;
+	for (int i = 0; i < ctx->params.num_threads; i++) {
+		bands[i].tile_buf = arena_alloc(&ctx->arena, tile_len * sizeof(uint16_t));
+		if (bands[i].tile_buf == NULL) {
+			return -1;
+		}
+		bands[i].preview = preview;
+		bands[i].dark_time = 0.0;
+		bands[i].recover_time = 0.0;
+		memset(bands[i].samples, 0, sizeof(bands[i].samples));
+	}
+
+	// Spread the tiles in view that are missing their dark channel between the bands
+	int num_pending = 0;
+	for (int tile_y = y1 / PREVIEW_TILE; tile_y <= (y2 - 1) / PREVIEW_TILE; tile_y++) {
+		for (int tile_x = x1 / PREVIEW_TILE; tile_x <= (x2 - 1) / PREVIEW_TILE; tile_x++) {
+			int tile = tile_y * preview->tiles_x + tile_x;
+			if (!preview->tile_valid[tile]) {
+				preview->pending[num_pending++] = tile;
+			}
+		}
+	}
+	if (num_pending > 0) {
+		int num_bands = num_pending < ctx->params.num_threads ? num_pending : ctx->params.num_threads;
+		for (int i = 0; i < num_bands; i++) {
+			bands[i].first_tile = num_pending * i / num_bands;
+			bands[i].last_tile = num_pending * (i + 1) / num_bands;
+		}
+		run_bands(ctx, num_bands, dark_tiles_band);
+		for (int i = 0; i < num_pending; i++) {
+			preview->tile_valid[preview->pending[i]] = 1;
+		}
+	}
+
+	// Then recover the view a band of its rows at a time
+	bands[0].recover_time += update_lut(ctx, &preview->lut, &preview->lut_valid, &preview->light, preview->floor);
+	int num_bands = count_bands(ctx, y2 - y1);
+	for (int i = 0; i < num_bands; i++) {
+		band_t *band = &bands[i];
+		band->img = in;
+		band->src = in;
+		band->map = map;
+		band->out = out;
+		band->light = preview->light.bgr;
+		band->depth = preview->depth;
+		band->lut = &preview->lut;
+		band->recover = ctx->recover;
+		band->floor = preview->floor;
+		band->grid = preview->grid;
+		band->grid_size = ctx->params.light_grid;
+		band->y1 = y1 + (y2 - y1) * i / num_bands;
+		band->y2 = y1 + (y2 - y1) * (i + 1) / num_bands;
+	}
+	run_bands(ctx, num_bands, preview_band);
+
+	int samples[UINT8_MAX + 1] = {0};
+	memset(&ctx->stats, 0, sizeof(ctx->stats));
+	ctx->stats.light = preview->light;
+	for (int i = 0; i < ctx->params.num_threads; i++) {
+		ctx->stats.dark_time += bands[i].dark_time;
+		ctx->stats.recover_time += bands[i].recover_time;
+		for (int val = 0; val <= UINT8_MAX; val++) {
+			samples[val] += bands[i].samples[val];
+		}
+	}
+	summarize_samples(&ctx->stats, samples, preview->floor);
+	ctx->stats.total_time = current_time() - start;
+
+	return 0;
+}
+
+/* Frees a preview and its cached planes
+ *
+ * preview - The preview to free, which may be NULL
+ */
+void defog_preview_destroy(defog_preview_t *preview) {
+	if (preview == NULL) {
+		return;
+	}
+
+	free(preview->keys);
+	free(preview->dark);
+	free(preview->tile_valid);
+	free(preview->pending);
+	free(preview->grid);
+	free(preview);
+}
+
+/* Reports how long each stage of defogging the most recent image or frame took
+ *
+ * ctx - The defogging context
+ * stats - Where the times are written; they are all 0 if nothing has been defogged yet
+ */
+void defog_get_stats(const defog_ctx_t *ctx, defog_stats_t *stats) {
+	*stats = ctx->stats;
+}
+
+/* Calculates the number of high-frequency pixels in an image, which was used
+ * as an evaluation metric for the defogging process.
+ * In theory, a higher number of high-intensity pixels should correlate to a reduced
+ * amount of fog.
+ *
+ * ctx - The defogging context whose arena the temporary images are carved from, which hands back
+ *       the buffers of the last image it defogged, or NULL to allocate them just for this call
+ * img - The BGR image to evaluate
+ *
+ * This costs about as much as defogging the image, so defog_sharpness() is a better choice
+ * wherever the exact metric isn't needed.
+ *
+ * Returns the number of pixels in the real component of the
+ * DFT result that are greater than 127, or -1 if a buffer couldn't be allocated
+ */
+int defog_evaluate(defog_ctx_t *ctx, IplImage *img) {
+	// Get the size of the image
+	CvSize size = cvGetSize(img);
+	arena_t local = {0};
+	arena_t *arena = ctx != NULL ? &ctx->arena : &local;
+	arena_reset(arena);
+
+	// The DFT is much faster for sizes that only have small prime factors, so the image is
+	// zero-padded up to the nearest such size as it's converted to the depth the DFT needs
+	CvSize dft_size = cvSize(cvGetOptimalDFTSize(size.width), cvGetOptimalDFTSize(size.height));
+	IplImage gray_header;
+	IplImage real_header;
+	IplImage *gray = arena_image(arena, &gray_header, size, img->depth, 1);
+	IplImage *real = arena_image(arena, &real_header, dft_size, IPL_DEPTH_32F, 1);
+	if (gray == NULL || real == NULL) {
+		arena_free(&local);
+		return -1;
+	}
+
+	// Convert the color image to grayscale
+	cvCvtColor(img, gray, CV_RGB2GRAY);
+	cvZero(real);
+	cvSetImageROI(real, cvRect(0, 0, size.width, size.height));
+	cvConvert(gray, real);
+	cvResetImageROI(real);
+
+	// And perform the transformation in place; the input is real, so the output is packed into
+	// a single real image, and the padding rows below the image can be skipped
+	cvDFT(real, real, CV_DXT_FORWARD, size.height);
+
+	// Perform thresholding to get high-intensity pixels from the DFT real results
+	cvThreshold(real, real, 127, 255, CV_THRESH_BINARY);
+
+	// Count nonzero pixels
+	int nonzero = cvCountNonZero(real);
+
+	// Clean up after ourselves, if there's no context to hold on to the buffers
+	arena_free(&local);
+
+	return nonzero;
+}
+
+/* Measures the sharpness of an image as the variance of the Laplacian of its grayscale
+ * intensity, which is a much cheaper stand-in for defog_evaluate(): removing haze restores
+ * contrast in fine detail, which raises the variance
+ *
+ * ctx - The defogging context whose arena the rows are carved from, as in defog_evaluate(), or NULL
+ * img - The 8-bit BGR image to evaluate
+ *
+ * Returns the variance, which is 0 for images smaller than 3x3, or -1 if the image isn't 8-bit or
+ * a buffer couldn't be allocated
+ */
+double defog_sharpness(defog_ctx_t *ctx, IplImage *img) {
+	CvSize size = cvGetSize(img);
+	if (img->depth != IPL_DEPTH_8U) {
+		return -1.0;
+	}
+	if (size.width < 3 || size.height < 3) {
+		return 0.0;
+	}
+
+	// Keep the grayscale intensity of three consecutive rows, so that every pixel is only
+	// converted once
+	arena_t local = {0};
+	arena_t *arena = ctx != NULL ? &ctx->arena : &local;
+	arena_reset(arena);
+	uint8_t *gray = arena_alloc(arena, 3 * (size_t)size.width);
+	if (gray == NULL) {
+		return -1.0;
+	}
+
+	int64_t sum = 0;
+	int64_t sum_sq = 0;
+	for (int y = 0; y < size.height; y++) {
+		const uint8_t *row = PIXEL_ROW(img, y);
+		uint8_t *gray_row = gray + (size_t)(y % 3) * size.width;
+		for (int x = 0; x < size.width; x++) {
+			gray_row[x] = gray_value(row + x * 3);
+		}
+
+		// Once three rows are available, take the Laplacian of the middle one
+		if (y < 2) {
+			continue;
+		}
+		const uint8_t *above = gray + (size_t)((y - 2) % 3) * size.width;
+		const uint8_t *mid = gray + (size_t)((y - 1) % 3) * size.width;
+		for (int x = 1; x < size.width - 1; x++) {
+			int laplacian = above[x] + gray_row[x] + mid[x - 1] + mid[x + 1] - 4 * mid[x];
+			sum += laplacian;
+			sum_sq += laplacian * laplacian;
+		}
+	}
+
+	arena_free(&local);
+
+	double count = (size.width - 2) * (double)(size.height - 2);
+	double mean = sum / count;
+
+	return sum_sq / count - mean * mean;
 }
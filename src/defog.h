@@ -0,0 +1,218 @@
+/* Copyright 2014-2015 David Pearson.
+ * All rights reserved.
+ *
+ * A library for removing fog and haze from images. Create a context once with defog_create(),
+ * then pass any number of images through defog_process(); the context keeps its scratch buffers
+ * between images, so they are only reallocated when an image is larger than any seen before.
+ * Frames of a video should go through defog_process_frame() instead, which reuses the estimate
+ * of the atmospheric light across frames. Images that are already in memory, such as frames from a
+ * capture service, can be defogged where they are with defog_process_buffer(). Images can be
+ * 8-bit, 16-bit, or floating point; the output is always written at the depth of the input.
+ * While the window and the floor are being tuned, defog_preview_create() keeps what doesn't
+ * change between renders, so each one only redoes what it has to for the part of the image in view.
+ */
+
+#ifndef DEFOG_H
+#define DEFOG_H
+
+#include <stdint.h>
+
+#include <cv.h>
+
+// The most times that the image can be halved in pyramid mode
+#define DEFOG_MAX_PYRAMID_LEVELS 2
+
+// The most tiles along each side of the grid that the atmospheric light can be estimated on
+#define DEFOG_MAX_LIGHT_GRID 16
+
+// The number of bins in the histogram of the transmission map kept in defog_stats_t
+#define DEFOG_TRANSMISSION_BINS 16
+
+// The lowest transmission floor that can be set; anything lower would overflow the fixed point
+// kernel, and amplifies haze into noise anyway
+#define DEFOG_MIN_TRANSMISSION_FLOOR 0.2
+
+// Parameters that control how images are defogged
+typedef struct {
+	// The number of threads used to defog each image
+	int num_threads;
+
+	// The width of the window around each pixel that its dark channel is taken over; odd widths
+	// are centered on the pixel, and even ones reach one pixel further before it than after it
+	int window;
+
+	// The height of the window, or 0 for a square window; the minimum is taken along the rows and
+	// then down the columns, so any rectangle costs the same. Windows that are 15, 20, 21, or 31
+	// pixels wide have their own specialized filters
+	int window_height;
+
+	// Whether SIMD kernels are used where the CPU supports them; they work in single precision, so
+	// output values may differ by one step from the scalar kernels
+	int use_simd;
+
+	// Whether the transmission and the output are computed with integer-only Q16 fixed point
+	// arithmetic instead of the recovery table or the SIMD kernels; the results are within one step
+	// of the exact ones, it needs far less cache, and a new atmospheric light costs almost nothing
+	// to switch to, which suits CPUs with slow floating point. It doesn't apply to refinement,
+	// pyramid mode, or light_per_channel, and never runs on the GPU
+	int fixed_point;
+
+	// Whether an 8-bit image is split into a plane for each channel before its dark channel is
+	// found, so that the dark channel and recovery kernels load whole vectors of one channel
+	// rather than picking the channels out of interleaved pixels; the output is interleaved again
+	// as it's written, and is exactly the same either way. Splitting costs an extra pass over the
+	// image and three bytes per pixel of memory, so whether it pays off depends on the CPU (see
+	// --bench). It only applies when an image is defogged in a single pass with a single light, so
+	// not to refinement, pyramid mode, the light grid, light_per_channel, fixed_point, images
+	// deeper than 8 bits, previews, or the GPU
+	int planar;
+
+	// How far apart the pixels that the atmospheric light is estimated from are, along rows and
+	// between them, or 1 to use every pixel; the light is a single value, so sampling every few
+	// pixels usually finds the same one. The GPU always uses every pixel
+	int light_step;
+
+	// Whether each channel gets its own atmospheric light, taken from the color of the brightest
+	// hazy pixel, rather than all of them sharing its intensity; this removes the color cast left
+	// by haze that isn't gray, but is only supported by the exact double precision kernels, so it
+	// is slower and never runs on the GPU
+	int light_per_channel;
+
+	// The lowest transmission that the output is recovered with (between
+	// DEFOG_MIN_TRANSMISSION_FLOOR and 1), which keeps dense haze from being amplified into noise;
+	// lower floors remove more of the haze, and higher ones leave the image closer to the input
+	double transmission_floor;
+
+	// The number of tiles along each side of a grid over the image whose atmospheric lights are
+	// estimated separately (up to DEFOG_MAX_LIGHT_GRID), or 0 for a single light; each pixel's
+	// light is then interpolated between the centers of the tiles around it, which suits scenes
+	// where the haze is uneven. The tiles are estimated in parallel from their own pixels, so this
+	// costs no more than a single light, but the recovery is done in double precision and never
+	// on the GPU. defog_process_with_light() always uses the light it's given
+	int light_grid;
+
+	// How many frames of a video the atmospheric light is reused for before it is re-estimated
+	int light_interval;
+
+	// How much weight (between 0 and 1) a new estimate of a video's atmospheric light is given
+	// when it is blended with the previous one
+	double light_smoothing;
+
+	// How much consecutive frames of a video have to differ, as a mean absolute difference in
+	// channel values between their thumbnails, to count as a new scene
+	double scene_threshold;
+
+	// The radius of the guided filter that smooths the blocky transmission map along the edges in
+	// the image, or 0 to leave the map unrefined; the filter costs the same for any radius, but
+	// needs four full-image planes of floats
+	int refine_radius;
+
+	// How strongly the guided filter is regularized; larger values smooth over more of the edges
+	// in the guide, which is the grayscale image scaled to [0, 1]
+	double refine_eps;
+
+	// How many times the image is halved with cvPyrDown() before the atmospheric light and the
+	// transmission are estimated (up to DEFOG_MAX_PYRAMID_LEVELS), or 0 to work at full
+	// resolution. The transmission is brought back up to full resolution by a guided filter, whose
+	// radius is refine_radius (or the window width, if that's 0) scaled down to match
+	int pyramid_levels;
+
+	// Whether the dark channel, the atmospheric light, and the recovery are run on a GPU, if the
+	// library was built with OpenCL and one can be found; refinement and pyramid mode always run
+	// on the CPU, as does everything else if there is no GPU
+	int use_gpu;
+} defog_params_t;
+
+// The atmospheric light of each channel of an image, in BGR order; they are all the same unless
+// light_per_channel is set
+typedef struct {
+	double bgr[3];
+} defog_light_t;
+
+// How long each stage of defogging the most recent image took, in seconds. The dark channel and
+// recovery stages run together on every thread, so their times are summed across threads and can
+// add up to more than the total
+typedef struct {
+	// Converting an image deeper than 8 bits to the 8-bit copy that it's estimated from, or
+	// splitting an 8-bit image into planes
+	double convert_time;
+
+	// Downsampling the image in pyramid mode
+	double pyramid_time;
+
+	// Estimating the atmospheric light, including converting the image to grayscale; this is 0 for
+	// video frames that reuse an earlier estimate
+	double light_time;
+
+	// Finding the dark channel around each pixel
+	double dark_time;
+
+	// Refining the transmission map, including estimating the raw transmission and the guide; this
+	// is 0 unless refinement is enabled
+	double refine_time;
+
+	// Estimating the transmission and recovering the output
+	double recover_time;
+
+	// The wall time of the whole call, from checking the images onwards
+	double total_time;
+
+	// The atmospheric light that the image was defogged with, at the 8-bit scale whatever the
+	// image's depth; in light grid mode, this is the light of its brightest tile
+	defog_light_t light;
+
+	// The transmission of every eighth row of the image (which on the GPU is only known if the map
+	// was requested): how many pixels were sampled, how many fell in each equal slice of the 8-bit
+	// range, their mean in [0, 1], and the fraction of them below the floor that the transmission
+	// is clamped to when recovering the output
+	int transmission_samples;
+	int transmission_histogram[DEFOG_TRANSMISSION_BINS];
+	double transmission_mean;
+	double transmission_floored;
+} defog_stats_t;
+
+// An 8-bit image in memory that belongs to the caller, which is wrapped in an IplImage header
+// rather than copied; it must hold a whole stride for every row, including the last
+typedef struct {
+	// The first pixel of the first row
+	uint8_t *data;
+
+	// The number of bytes from the start of one row to the start of the next, or 0 if the rows are
+	// packed one after another
+	int stride;
+} defog_buffer_t;
+
+// The state kept between images; its contents are private to the library
+typedef struct defog_ctx defog_ctx_t;
+
+// The state kept while one image is previewed with different windows and floors; its contents are
+// private to the library
+typedef struct defog_preview defog_preview_t;
+
+// Context management
+void defog_default_params(defog_params_t *params);
+defog_ctx_t *defog_create(const defog_params_t *params, int max_width, int max_height);
+void defog_destroy(defog_ctx_t *ctx);
+int defog_using_gpu(const defog_ctx_t *ctx);
+
+// Defogging and evaluation
+int defog_process(defog_ctx_t *ctx, IplImage *in, IplImage *out, IplImage *map);
+int defog_process_frame(defog_ctx_t *ctx, IplImage *in, IplImage *out, IplImage *map);
+int defog_estimate_light(defog_ctx_t *ctx, IplImage *in, defog_light_t *light);
+int defog_process_with_light(defog_ctx_t *ctx, IplImage *in, const defog_light_t *light, IplImage *out, IplImage *map);
+int defog_process_buffer(defog_ctx_t *ctx, int width, int height, const defog_buffer_t *in, const defog_buffer_t *out,
+	const defog_buffer_t *map, int is_frame);
+IplImage *defog_wrap_buffer(IplImage *header, int width, int height, int channels, const defog_buffer_t *buf);
+void defog_reset_frames(defog_ctx_t *ctx);
+void defog_get_stats(const defog_ctx_t *ctx, defog_stats_t *stats);
+int defog_evaluate(defog_ctx_t *ctx, IplImage *img);
+double defog_sharpness(defog_ctx_t *ctx, IplImage *img);
+
+// Interactive previews
+defog_preview_t *defog_preview_create(defog_ctx_t *ctx, IplImage *in);
+void defog_preview_set_window(defog_preview_t *preview, int window, int window_height);
+void defog_preview_set_floor(defog_preview_t *preview, double floor);
+int defog_preview_render(defog_preview_t *preview, CvRect roi, IplImage *out, IplImage *map);
+void defog_preview_destroy(defog_preview_t *preview);
+
+#endif
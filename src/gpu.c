@@ -0,0 +1,535 @@
+/* Copyright 2014-2015 David Pearson.
+ * All rights reserved.
+ *
+ * The OpenCL backend, see gpu.h.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cv.h>
+
+#include "gpu.h"
+#include "kernels.h"
+
+#ifdef DEFOG_OPENCL
+
+#define CL_TARGET_OPENCL_VERSION 120
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+// The width and height of the work-groups used to build the light histogram, each of which
+// builds its own histogram in local memory before adding it to the global one
+#define HIST_GROUP 16
+
+// The kernels, which do exactly what the CPU pipeline does: the dark channel keys, the window
+// minimum (one direction at a time), the search for the first darkest pixel, the histogram of the
+// dark channel, and the table-driven recovery
+static const char *gpu_source =
+	"__kernel void dark_keys(__global const uchar *img, int stride, int width, __global ushort *keys) {\n"
+	"	int x = get_global_id(0);\n"
+	"	int y = get_global_id(1);\n"
+	"	__global const uchar *pixel = img + (size_t)y * stride + x * 3;\n"
+	"	int channel = pixel[1] < pixel[0] ? 1 : 0;\n"
+	"	channel = pixel[2] < pixel[channel] ? 2 : channel;\n"
+	"	keys[(size_t)y * width + x] = (ushort)((pixel[channel] << 2) | channel);\n"
+	"}\n"
+	"\n"
+	"__kernel void row_min(__global const ushort *src, __global ushort *dst, int width, int before, int after) {\n"
+	"	int x = get_global_id(0);\n"
+	"	int y = get_global_id(1);\n"
+	"	__global const ushort *row = src + (size_t)y * width;\n"
+	"	int x2 = min(x + after, width - 1);\n"
+	"	ushort val = row[x2];\n"
+	"	for (int i = max(x - before, 0); i < x2; i++) {\n"
+	"		val = min(val, row[i]);\n"
+	"	}\n"
+	"	dst[(size_t)y * width + x] = val;\n"
+	"}\n"
+	"\n"
+	"__kernel void col_min(__global const ushort *src, __global ushort *dst, int width, int height, int before, int after) {\n"
+	"	int x = get_global_id(0);\n"
+	"	int y = get_global_id(1);\n"
+	"	int y2 = min(y + after, height - 1);\n"
+	"	ushort val = src[(size_t)y2 * width + x];\n"
+	"	for (int i = max(y - before, 0); i < y2; i++) {\n"
+	"		val = min(val, src[(size_t)i * width + x]);\n"
+	"	}\n"
+	"	dst[(size_t)y * width + x] = val;\n"
+	"}\n"
+	"\n"
+	"__kernel void find_darkest(__global const uchar *img, int stride, __global uint *darkest) {\n"
+	"	__global const uchar *pixel = img + (size_t)get_global_id(1) * stride + get_global_id(0) * 3;\n"
+	"	atomic_min(&darkest[0], (uint)min(min(pixel[0], pixel[1]), pixel[2]));\n"
+	"}\n"
+	"\n"
+	"__kernel void find_first_darkest(__global const uchar *img, int stride, int width, __global uint *darkest) {\n"
+	"	int x = get_global_id(0);\n"
+	"	int y = get_global_id(1);\n"
+	"	__global const uchar *pixel = img + (size_t)y * stride + x * 3;\n"
+	"	if (min(min(pixel[0], pixel[1]), pixel[2]) == darkest[0]) {\n"
+	"		atomic_min(&darkest[1], (uint)((size_t)y * width + x));\n"
+	"	}\n"
+	"}\n"
+	"\n"
+	"__kernel void light_histogram(__global const uchar *img, int stride, int width, int height, int channel, __global uint *hist) {\n"
+	"	__local uint counts[256];\n"
+	"	__local uint max_gray[256];\n"
+	"	int id = get_local_id(1) * get_local_size(0) + get_local_id(0);\n"
+	"	int group_size = get_local_size(0) * get_local_size(1);\n"
+	"	for (int i = id; i < 256; i += group_size) {\n"
+	"		counts[i] = 0;\n"
+	"		max_gray[i] = 0;\n"
+	"	}\n"
+	"	barrier(CLK_LOCAL_MEM_FENCE);\n"
+	"\n"
+	"	int x = get_global_id(0);\n"
+	"	int y = get_global_id(1);\n"
+	"	if (x < width && y < height) {\n"
+	"		__global const uchar *pixel = img + (size_t)y * stride + x * 3;\n"
+	"		uint gray = (pixel[0] * 4899 + pixel[1] * 9617 + pixel[2] * 1868 + (1 << 13)) >> 14;\n"
+	"		atomic_inc(&counts[pixel[channel]]);\n"
+	"		atomic_max(&max_gray[pixel[channel]], gray);\n"
+	"	}\n"
+	"	barrier(CLK_LOCAL_MEM_FENCE);\n"
+	"\n"
+	"	for (int i = id; i < 256; i += group_size) {\n"
+	"		if (counts[i] > 0) {\n"
+	"			atomic_add(&hist[i], counts[i]);\n"
+	"			atomic_max(&hist[256 + i], max_gray[i]);\n"
+	"		}\n"
+	"	}\n"
+	"}\n"
+	"\n"
+	"__kernel void recover(__global const uchar *img, int stride, int width, __global const ushort *keys, __global const uchar *lut,\n"
+	"		__global uchar *out, int out_stride, __global uchar *map, int map_stride, int write_map) {\n"
+	"	int x = get_global_id(0);\n"
+	"	int y = get_global_id(1);\n"
+	"	__global const uchar *pixel = img + (size_t)y * stride + x * 3;\n"
+	"	uint dark = pixel[keys[(size_t)y * width + x] & 3];\n"
+	"	__global const uchar *vals = lut + 256 + dark * 256;\n"
+	"	__global uchar *out_pixel = out + (size_t)y * out_stride + x * 3;\n"
+	"	out_pixel[0] = vals[pixel[0]];\n"
+	"	out_pixel[1] = vals[pixel[1]];\n"
+	"	out_pixel[2] = vals[pixel[2]];\n"
+	"	if (write_map) {\n"
+	"		map[(size_t)y * map_stride + x] = lut[dark];\n"
+	"	}\n"
+	"}\n";
+
+struct gpu_ctx {
+	cl_context context;
+	cl_command_queue queue;
+	cl_program program;
+
+	cl_kernel dark_keys;
+	cl_kernel row_min;
+	cl_kernel col_min;
+	cl_kernel find_darkest;
+	cl_kernel find_first_darkest;
+	cl_kernel light_histogram;
+	cl_kernel recover;
+
+	// The image, its dark channel keys, and the window minimum in one direction, which are only
+	// reallocated when an image is larger than any seen before
+	cl_mem img;
+	size_t img_size;
+	cl_mem keys;
+	size_t keys_size;
+	cl_mem tmp;
+	size_t tmp_size;
+
+	// The darkest value and the index of the first pixel with it, the light histogram as counts
+	// followed by the brightest intensity in each bin, and the recovery table
+	cl_mem darkest;
+	cl_mem hist;
+	cl_mem lut;
+
+	// The outputs
+	cl_mem out;
+	size_t out_size;
+	cl_mem map;
+	size_t map_size;
+
+	// The image that is currently on the device
+	IplImage *in;
+	int width;
+	int height;
+
+	// The light and the floor that the recovery table on the device was built for
+	double lut_light;
+	double lut_floor;
+	int lut_valid;
+};
+
+// Function definitions
+int reserve_device_buffer(gpu_ctx_t *gpu, cl_mem *buf, size_t *size, size_t needed, cl_mem_flags flags);
+cl_int run_kernel(gpu_ctx_t *gpu, cl_kernel kernel, size_t width, size_t height, const size_t *local);
+
+/* Makes sure that a device buffer is at least a certain size, replacing it if needed
+ *
+ * gpu - The GPU context
+ * buf - The buffer, which may be NULL if it hasn't been created yet
+ * size - The current size of the buffer in bytes, which is updated if it's replaced
+ * needed - The size that the buffer needs to be in bytes
+ * flags - How the kernels use the buffer
+ *
+ * Returns 0 on success or -1 if the buffer couldn't be created
+ */
+int reserve_device_buffer(gpu_ctx_t *gpu, cl_mem *buf, size_t *size, size_t needed, cl_mem_flags flags) {
+	if (needed <= *size) {
+		return 0;
+	}
+
+	// The old contents are never needed, so there's no point copying them
+	if (*buf != NULL) {
+		clReleaseMemObject(*buf);
+		*buf = NULL;
+		*size = 0;
+	}
+
+	cl_int err;
+	*buf = clCreateBuffer(gpu->context, flags, needed, NULL, &err);
+	if (err != CL_SUCCESS) {
+		*buf = NULL;
+		return -1;
+	}
+	*size = needed;
+
+	return 0;
+}
+
+/* Queues a kernel over a two-dimensional range, whose arguments have already been set
+ *
+ * gpu - The GPU context
+ * kernel - The kernel
+ * width - The global size in x
+ * height - The global size in y
+ * local - The work-group size, which the global size must be a multiple of, or NULL to let the
+ *         implementation choose
+ *
+ * Returns the OpenCL status
+ */
+cl_int run_kernel(gpu_ctx_t *gpu, cl_kernel kernel, size_t width, size_t height, const size_t *local) {
+	size_t global[2] = {width, height};
+	return clEnqueueNDRangeKernel(gpu->queue, kernel, 2, NULL, global, local, 0, NULL, NULL);
+}
+
+/* Opens the first GPU that OpenCL can find and compiles the kernels for it
+ *
+ * Returns the new context, which must be freed with gpu_destroy(), or NULL if there is no usable
+ * GPU
+ */
+gpu_ctx_t *gpu_create(void) {
+	gpu_ctx_t *gpu = calloc(1, sizeof(gpu_ctx_t));
+	if (gpu == NULL) {
+		return NULL;
+	}
+
+	// Use the first GPU of the first platform that has one
+	cl_platform_id platforms[8];
+	cl_uint num_platforms = 0;
+	cl_device_id device = NULL;
+	if (clGetPlatformIDs(8, platforms, &num_platforms) != CL_SUCCESS) {
+		num_platforms = 0;
+	}
+	for (cl_uint i = 0; i < num_platforms && i < 8 && device == NULL; i++) {
+		if (clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_GPU, 1, &device, NULL) != CL_SUCCESS) {
+			device = NULL;
+		}
+	}
+	if (device == NULL) {
+		free(gpu);
+		return NULL;
+	}
+
+	// Then build everything that doesn't depend on the size of the images
+	cl_int err;
+	gpu->context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
+	if (err == CL_SUCCESS) {
+		gpu->queue = clCreateCommandQueue(gpu->context, device, 0, &err);
+	}
+	if (err == CL_SUCCESS) {
+		gpu->program = clCreateProgramWithSource(gpu->context, 1, &gpu_source, NULL, &err);
+	}
+	if (err == CL_SUCCESS) {
+		err = clBuildProgram(gpu->program, 1, &device, NULL, NULL, NULL);
+	}
+
+	const char *names[] = {"dark_keys", "row_min", "col_min", "find_darkest", "find_first_darkest", "light_histogram", "recover"};
+	cl_kernel *kernels[] = {&gpu->dark_keys, &gpu->row_min, &gpu->col_min, &gpu->find_darkest, &gpu->find_first_darkest, &gpu->light_histogram, &gpu->recover};
+	for (int i = 0; i < 7 && err == CL_SUCCESS; i++) {
+		*kernels[i] = clCreateKernel(gpu->program, names[i], &err);
+	}
+
+	if (err == CL_SUCCESS) {
+		gpu->darkest = clCreateBuffer(gpu->context, CL_MEM_READ_WRITE, 2 * sizeof(cl_uint), NULL, &err);
+	}
+	if (err == CL_SUCCESS) {
+		gpu->hist = clCreateBuffer(gpu->context, CL_MEM_READ_WRITE, 2 * (UINT8_MAX + 1) * sizeof(cl_uint), NULL, &err);
+	}
+	if (err == CL_SUCCESS) {
+		gpu->lut = clCreateBuffer(gpu->context, CL_MEM_READ_ONLY, (UINT8_MAX + 1) * (UINT8_MAX + 2), NULL, &err);
+	}
+
+	if (err != CL_SUCCESS) {
+		gpu_destroy(gpu);
+		return NULL;
+	}
+
+	return gpu;
+}
+
+/* Frees a GPU context and everything on the device
+ *
+ * gpu - The context to free, which may be NULL
+ */
+void gpu_destroy(gpu_ctx_t *gpu) {
+	if (gpu == NULL) {
+		return;
+	}
+
+	cl_mem bufs[] = {gpu->img, gpu->keys, gpu->tmp, gpu->darkest, gpu->hist, gpu->lut, gpu->out, gpu->map};
+	for (int i = 0; i < 8; i++) {
+		if (bufs[i] != NULL) {
+			clReleaseMemObject(bufs[i]);
+		}
+	}
+
+	cl_kernel kernels[] = {gpu->dark_keys, gpu->row_min, gpu->col_min, gpu->find_darkest, gpu->find_first_darkest, gpu->light_histogram, gpu->recover};
+	for (int i = 0; i < 7; i++) {
+		if (kernels[i] != NULL) {
+			clReleaseKernel(kernels[i]);
+		}
+	}
+
+	if (gpu->program != NULL) {
+		clReleaseProgram(gpu->program);
+	}
+	if (gpu->queue != NULL) {
+		clReleaseCommandQueue(gpu->queue);
+	}
+	if (gpu->context != NULL) {
+		clReleaseContext(gpu->context);
+	}
+	free(gpu);
+}
+
+/* Uploads an image and finds the dark channel in the window around each pixel, leaving both on
+ * the device for the later stages
+ *
+ * gpu - The GPU context
+ * in - The 8-bit BGR image, which must stay unchanged until the image has been recovered
+ * window - The width of the window used around each pixel
+ * window_height - The height of the window
+ *
+ * Returns 0 on success or -1 on failure
+ */
+int gpu_load(gpu_ctx_t *gpu, IplImage *in, int window, int window_height) {
+	CvSize size = cvGetSize(in);
+	size_t keys_size = (size_t)size.width * size.height * sizeof(cl_ushort);
+	if (reserve_device_buffer(gpu, &gpu->img, &gpu->img_size, in->imageSize, CL_MEM_READ_ONLY) != 0 ||
+			reserve_device_buffer(gpu, &gpu->keys, &gpu->keys_size, keys_size, CL_MEM_READ_WRITE) != 0 ||
+			reserve_device_buffer(gpu, &gpu->tmp, &gpu->tmp_size, keys_size, CL_MEM_READ_WRITE) != 0) {
+		return -1;
+	}
+	gpu->in = in;
+	gpu->width = size.width;
+	gpu->height = size.height;
+
+	cl_int stride = in->widthStep;
+	cl_int width = size.width;
+	cl_int height = size.height;
+	cl_int before = WINDOW_BEFORE(window);
+	cl_int after = WINDOW_AFTER(window);
+	cl_int above = WINDOW_BEFORE(window_height);
+	cl_int below = WINDOW_AFTER(window_height);
+
+	cl_int err = clEnqueueWriteBuffer(gpu->queue, gpu->img, CL_TRUE, 0, in->imageSize, in->imageData, 0, NULL, NULL);
+
+	// Find the darkest channel of every pixel
+	err |= clSetKernelArg(gpu->dark_keys, 0, sizeof(cl_mem), &gpu->img);
+	err |= clSetKernelArg(gpu->dark_keys, 1, sizeof(cl_int), &stride);
+	err |= clSetKernelArg(gpu->dark_keys, 2, sizeof(cl_int), &width);
+	err |= clSetKernelArg(gpu->dark_keys, 3, sizeof(cl_mem), &gpu->keys);
+	err |= run_kernel(gpu, gpu->dark_keys, size.width, size.height, NULL);
+
+	// Then take the minimum along the rows, and then down the columns
+	err |= clSetKernelArg(gpu->row_min, 0, sizeof(cl_mem), &gpu->keys);
+	err |= clSetKernelArg(gpu->row_min, 1, sizeof(cl_mem), &gpu->tmp);
+	err |= clSetKernelArg(gpu->row_min, 2, sizeof(cl_int), &width);
+	err |= clSetKernelArg(gpu->row_min, 3, sizeof(cl_int), &before);
+	err |= clSetKernelArg(gpu->row_min, 4, sizeof(cl_int), &after);
+	err |= run_kernel(gpu, gpu->row_min, size.width, size.height, NULL);
+
+	err |= clSetKernelArg(gpu->col_min, 0, sizeof(cl_mem), &gpu->tmp);
+	err |= clSetKernelArg(gpu->col_min, 1, sizeof(cl_mem), &gpu->keys);
+	err |= clSetKernelArg(gpu->col_min, 2, sizeof(cl_int), &width);
+	err |= clSetKernelArg(gpu->col_min, 3, sizeof(cl_int), &height);
+	err |= clSetKernelArg(gpu->col_min, 4, sizeof(cl_int), &above);
+	err |= clSetKernelArg(gpu->col_min, 5, sizeof(cl_int), &below);
+	err |= run_kernel(gpu, gpu->col_min, size.width, size.height, NULL);
+
+	return err == CL_SUCCESS ? 0 : -1;
+}
+
+/* Estimates the atmospheric light of the image on the device, exactly as find_light()
+ * does for a whole image
+ *
+ * gpu - The GPU context, which an image has been loaded into
+ * light_intensity - Where the light intensity is written
+ *
+ * Returns 0 on success or -1 on failure
+ */
+int gpu_estimate_light(gpu_ctx_t *gpu, double *light_intensity) {
+	cl_int stride = gpu->in->widthStep;
+	cl_int width = gpu->width;
+	cl_int height = gpu->height;
+
+	// Find the darkest value in the image, and then the first pixel that has it; the darkest
+	// channel of that pixel is the dark channel of the whole image
+	cl_uint darkest[2] = {UINT32_MAX, UINT32_MAX};
+	cl_int err = clEnqueueWriteBuffer(gpu->queue, gpu->darkest, CL_TRUE, 0, sizeof(darkest), darkest, 0, NULL, NULL);
+	err |= clSetKernelArg(gpu->find_darkest, 0, sizeof(cl_mem), &gpu->img);
+	err |= clSetKernelArg(gpu->find_darkest, 1, sizeof(cl_int), &stride);
+	err |= clSetKernelArg(gpu->find_darkest, 2, sizeof(cl_mem), &gpu->darkest);
+	err |= run_kernel(gpu, gpu->find_darkest, width, height, NULL);
+	err |= clSetKernelArg(gpu->find_first_darkest, 0, sizeof(cl_mem), &gpu->img);
+	err |= clSetKernelArg(gpu->find_first_darkest, 1, sizeof(cl_int), &stride);
+	err |= clSetKernelArg(gpu->find_first_darkest, 2, sizeof(cl_int), &width);
+	err |= clSetKernelArg(gpu->find_first_darkest, 3, sizeof(cl_mem), &gpu->darkest);
+	err |= run_kernel(gpu, gpu->find_first_darkest, width, height, NULL);
+	err |= clEnqueueReadBuffer(gpu->queue, gpu->darkest, CL_TRUE, 0, sizeof(darkest), darkest, 0, NULL, NULL);
+	if (err != CL_SUCCESS) {
+		return -1;
+	}
+
+	// The image is still on the host, so look the pixel up there rather than reading it back
+	const uint8_t *pixel = PIXEL_ROW(gpu->in, darkest[1] / width) + (darkest[1] % width) * 3;
+	cl_int channel = pixel[GREEN] < pixel[BLUE] ? GREEN : BLUE;
+	channel = pixel[RED] < pixel[channel] ? RED : channel;
+
+	// Then build the histogram of that channel, with each work-group covering a tile of the image
+	static const cl_uint zeros[2 * (UINT8_MAX + 1)] = {0};
+	size_t local[2] = {HIST_GROUP, HIST_GROUP};
+	size_t padded_width = (width + HIST_GROUP - 1) / HIST_GROUP * HIST_GROUP;
+	size_t padded_height = (height + HIST_GROUP - 1) / HIST_GROUP * HIST_GROUP;
+	cl_uint hist[2 * (UINT8_MAX + 1)];
+	err = clEnqueueWriteBuffer(gpu->queue, gpu->hist, CL_TRUE, 0, sizeof(zeros), zeros, 0, NULL, NULL);
+	err |= clSetKernelArg(gpu->light_histogram, 0, sizeof(cl_mem), &gpu->img);
+	err |= clSetKernelArg(gpu->light_histogram, 1, sizeof(cl_int), &stride);
+	err |= clSetKernelArg(gpu->light_histogram, 2, sizeof(cl_int), &width);
+	err |= clSetKernelArg(gpu->light_histogram, 3, sizeof(cl_int), &height);
+	err |= clSetKernelArg(gpu->light_histogram, 4, sizeof(cl_int), &channel);
+	err |= clSetKernelArg(gpu->light_histogram, 5, sizeof(cl_mem), &gpu->hist);
+	err |= run_kernel(gpu, gpu->light_histogram, padded_width, padded_height, local);
+	err |= clEnqueueReadBuffer(gpu->queue, gpu->hist, CL_TRUE, 0, sizeof(hist), hist, 0, NULL, NULL);
+	if (err != CL_SUCCESS) {
+		return -1;
+	}
+
+	light_bin_t bins[UINT8_MAX + 1];
+	for (int i = 0; i <= UINT8_MAX; i++) {
+		bins[i].count = hist[i];
+		bins[i].max_intensity = hist[UINT8_MAX + 1 + i];
+	}
+	*light_intensity = light_from_bins(bins, width * height, NULL);
+
+	return 0;
+}
+
+/* Recovers the output for the image on the device and downloads it
+ *
+ * gpu - The GPU context, which an image has been loaded into
+ * lut - The recovery table for the atmospheric light and the floor, which is only uploaded when
+ *       either changes
+ * out - The 8-bit BGR image, the same size as the input, that the output is written to
+ * map - The 8-bit single channel image, the same size as the input, that the transmission map is
+ *       written to, or NULL if it isn't needed
+ *
+ * Returns 0 on success or -1 on failure
+ */
+int gpu_recover(gpu_ctx_t *gpu, const recovery_lut_t *lut, IplImage *out, IplImage *map) {
+	if (reserve_device_buffer(gpu, &gpu->out, &gpu->out_size, out->imageSize, CL_MEM_WRITE_ONLY) != 0 ||
+			(map != NULL && reserve_device_buffer(gpu, &gpu->map, &gpu->map_size, map->imageSize, CL_MEM_WRITE_ONLY) != 0)) {
+		return -1;
+	}
+
+	cl_int err = CL_SUCCESS;
+	if (!gpu->lut_valid || gpu->lut_light != lut->light[0] || gpu->lut_floor != lut->floor) {
+		err |= clEnqueueWriteBuffer(gpu->queue, gpu->lut, CL_TRUE, 0, sizeof(lut->map), lut->map, 0, NULL, NULL);
+		err |= clEnqueueWriteBuffer(gpu->queue, gpu->lut, CL_TRUE, sizeof(lut->map), sizeof(lut->out), lut->out, 0, NULL, NULL);
+		gpu->lut_valid = err == CL_SUCCESS;
+		gpu->lut_light = lut->light[0];
+		gpu->lut_floor = lut->floor;
+	}
+
+	// Without a map, the output buffer stands in for it, but is never written through
+	cl_int stride = gpu->in->widthStep;
+	cl_int width = gpu->width;
+	cl_int out_stride = out->widthStep;
+	cl_int map_stride = map != NULL ? map->widthStep : 0;
+	cl_int write_map = map != NULL;
+	cl_mem map_buf = map != NULL ? gpu->map : gpu->out;
+	err |= clSetKernelArg(gpu->recover, 0, sizeof(cl_mem), &gpu->img);
+	err |= clSetKernelArg(gpu->recover, 1, sizeof(cl_int), &stride);
+	err |= clSetKernelArg(gpu->recover, 2, sizeof(cl_int), &width);
+	err |= clSetKernelArg(gpu->recover, 3, sizeof(cl_mem), &gpu->keys);
+	err |= clSetKernelArg(gpu->recover, 4, sizeof(cl_mem), &gpu->lut);
+	err |= clSetKernelArg(gpu->recover, 5, sizeof(cl_mem), &gpu->out);
+	err |= clSetKernelArg(gpu->recover, 6, sizeof(cl_int), &out_stride);
+	err |= clSetKernelArg(gpu->recover, 7, sizeof(cl_mem), &map_buf);
+	err |= clSetKernelArg(gpu->recover, 8, sizeof(cl_int), &map_stride);
+	err |= clSetKernelArg(gpu->recover, 9, sizeof(cl_int), &write_map);
+	err |= run_kernel(gpu, gpu->recover, gpu->width, gpu->height, NULL);
+
+	// Only the results come back
+	err |= clEnqueueReadBuffer(gpu->queue, gpu->out, CL_TRUE, 0, out->imageSize, out->imageData, 0, NULL, NULL);
+	if (map != NULL) {
+		err |= clEnqueueReadBuffer(gpu->queue, gpu->map, CL_TRUE, 0, map->imageSize, map->imageData, 0, NULL, NULL);
+	}
+
+	return err == CL_SUCCESS ? 0 : -1;
+}
+
+#else
+
+/* Without OpenCL there is never a GPU to use
+ *
+ * Returns NULL
+ */
+gpu_ctx_t *gpu_create(void) {
+	return NULL;
+}
+
+void gpu_destroy(gpu_ctx_t *gpu) {
+	(void)gpu;
+}
+
+int gpu_load(gpu_ctx_t *gpu, IplImage *in, int window, int window_height) {
+	(void)gpu;
+	(void)in;
+	(void)window;
+	(void)window_height;
+	return -1;
+}
+
+int gpu_estimate_light(gpu_ctx_t *gpu, double *light_intensity) {
+	(void)gpu;
+	(void)light_intensity;
+	return -1;
+}
+
+int gpu_recover(gpu_ctx_t *gpu, const recovery_lut_t *lut, IplImage *out, IplImage *map) {
+	(void)gpu;
+	(void)lut;
+	(void)out;
+	(void)map;
+	return -1;
+}
+
+#endif
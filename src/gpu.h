@@ -0,0 +1,31 @@
+/* Copyright 2014-2015 David Pearson.
+ * All rights reserved.
+ *
+ * An OpenCL backend for the defogging pipeline, which runs the dark channel, the atmospheric light
+ * estimate, and the recovery on a GPU. Each image is uploaded once and stays on the device for
+ * every stage, so only the input, the small light histogram, and the results cross the bus.
+ *
+ * The backend is only compiled in when DEFOG_OPENCL is defined (and the program is linked with
+ * -lOpenCL); otherwise gpu_create() always fails, and the CPU pipeline is used instead. This is
+ * internal to the library.
+ */
+
+#ifndef DEFOG_GPU_H
+#define DEFOG_GPU_H
+
+#include <cv.h>
+
+#include "kernels.h"
+
+// The OpenCL device, its compiled kernels, and the buffers that images are kept in; its contents
+// are private to gpu.c
+typedef struct gpu_ctx gpu_ctx_t;
+
+// Function definitions
+gpu_ctx_t *gpu_create(void);
+void gpu_destroy(gpu_ctx_t *gpu);
+int gpu_load(gpu_ctx_t *gpu, IplImage *in, int window, int window_height);
+int gpu_estimate_light(gpu_ctx_t *gpu, double *light_intensity);
+int gpu_recover(gpu_ctx_t *gpu, const recovery_lut_t *lut, IplImage *out, IplImage *map);
+
+#endif
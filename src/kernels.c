@@ -0,0 +1,1225 @@
+/* Copyright 2014-2015 David Pearson.
+ * All rights reserved.
+ *
+ * Per-pixel kernels shared by the defogging pipeline, with SIMD versions that are picked at
+ * runtime based on what the CPU supports.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <cv.h>
+
+#include "kernels.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define DEFOG_X86_KERNELS
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define DEFOG_NEON_KERNELS
+#endif
+
+/* Picks the atmospheric light out of a histogram of an area's dark channel values
+ *
+ * bins - The histogram of the dark channel, with one bin for each 8-bit value
+ * num_pixels - The number of pixels in the area
+ * color - Where the BGR color of that pixel is written, or NULL if it isn't needed, in which case
+ *         the bins' colors don't need to have been tracked
+ *
+ * Returns the intensity of the brightest pixel among the top 0.1% of the area
+ */
+double light_from_bins(const light_bin_t *bins, int num_pixels, uint8_t *color) {
+	// The atmospheric light is estimated from the top 0.1% of pixels, ranked by their value in the
+	// dark channel of the area and then by intensity; always use at least one pixel
+	int top_num = num_pixels * 0.001;
+	if (top_num < 1) {
+		top_num = 1;
+	}
+
+	// Walk down from the brightest bin until the top pixels have all been seen; the only bin that
+	// is partially included is ranked by intensity, so its brightest pixel is always among them
+	int max_intensity = 0;
+	int brightest = UINT8_MAX;
+	int seen = 0;
+	for (int val = UINT8_MAX; val >= 0 && seen < top_num; val--) {
+		if (bins[val].count > 0 && bins[val].max_intensity > max_intensity) {
+			max_intensity = bins[val].max_intensity;
+			brightest = val;
+		}
+		seen += bins[val].count;
+	}
+
+	if (color != NULL) {
+		memcpy(color, bins[brightest].color, 3);
+	}
+
+	return max_intensity;
+}
+
+/* Finds the darkest channel of every pixel in a row, as dark channel keys; ties go to the earlier
+ * channel, as in pixel_min()
+ *
+ * See dark_keys_fn in kernels.h for the parameters
+ */
+void dark_keys_row(const uint8_t *img_row, uint16_t *keys, int width) {
+	for (int x = 0; x < width; x++) {
+		const uint8_t *pixel = img_row + x * 3;
+		int channel = pixel[GREEN] < pixel[BLUE] ? GREEN : BLUE;
+		channel = pixel[RED] < pixel[channel] ? RED : channel;
+		keys[x] = DARK_KEY(pixel[channel], channel);
+	}
+}
+
+/* Estimates the transmission and recovers the output for a row of pixels, one channel at a time
+ * in double precision; this is the reference that the SIMD versions are measured against
+ *
+ * See recover_row_fn in kernels.h for the parameters
+ */
+void recover_row(const uint8_t *img_row, const uint16_t *dark_row, uint8_t *map_row, uint8_t *out_row, int width, const recovery_lut_t *lut) {
+	const double *light = lut->light;
+
+	for (int x = 0; x < width; x++) {
+		const uint8_t *pixel = img_row + x * 3;
+		uint8_t *out_pixel = out_row + x * 3;
+
+		// Look up the dark channel for the window
+		channel_t dark_channel = DARK_KEY_CHANNEL(dark_row[x]);
+
+		// Estimate t(x), relative to the light of the dark channel
+		double t = 1 - (pixel[dark_channel] / light[dark_channel]);
+
+		// Then store it in the transmission map image
+		if (map_row != NULL) {
+			map_row[x] = saturate_u8(t * 255.0);
+		}
+
+		// Use the transmission map and light intensity to calculate channel values for the pixel in
+		// the output image
+		for (int i = 0; i < 3; i++) {
+			out_pixel[i] = saturate_u8((pixel[i] - light[i]) / fmax(t, lut->floor) + light[i]);
+		}
+	}
+}
+
+/* Fills in the recovery table for an atmospheric light, using exactly the same arithmetic as
+ * recover_row(), so that recover_row_lut() gives the same results
+ *
+ * lut - The table to fill in
+ * light - The atmospheric light of each channel, of which only the first is used for the table
+ * min_t - The lowest transmission that the output is recovered with
+ */
+void build_recovery_lut(recovery_lut_t *lut, const double *light, double min_t) {
+	memcpy(lut->light, light, sizeof(lut->light));
+	lut->floor = min_t;
+	double light_intensity = light[0];
+
+	for (int dark = 0; dark <= UINT8_MAX; dark++) {
+		double t = 1 - (dark / light_intensity);
+		double floored = fmax(t, min_t);
+		lut->map[dark] = saturate_u8(t * 255.0);
+
+		for (int val = 0; val <= UINT8_MAX; val++) {
+			lut->out[dark][val] = saturate_u8((val - light_intensity) / floored + light_intensity);
+		}
+	}
+}
+
+/* Estimates the transmission and recovers the output for a row of pixels by looking every value
+ * up in the recovery table, which replaces the division for each channel with a load from a
+ * single 256-byte row of the table
+ *
+ * See recover_row_fn in kernels.h for the parameters
+ */
+void recover_row_lut(const uint8_t *img_row, const uint16_t *dark_row, uint8_t *map_row, uint8_t *out_row, int width, const recovery_lut_t *lut) {
+	for (int x = 0; x < width; x++) {
+		const uint8_t *pixel = img_row + x * 3;
+		uint8_t *out_pixel = out_row + x * 3;
+		uint8_t dark = pixel[DARK_KEY_CHANNEL(dark_row[x])];
+		const uint8_t *out_vals = lut->out[dark];
+
+		if (map_row != NULL) {
+			map_row[x] = lut->map[dark];
+		}
+		out_pixel[BLUE] = out_vals[pixel[BLUE]];
+		out_pixel[GREEN] = out_vals[pixel[GREEN]];
+		out_pixel[RED] = out_vals[pixel[RED]];
+	}
+}
+
+/* Splits a row of interleaved BGR pixels into a row of each of the planes of a planar image
+ *
+ * See split_row_fn in kernels.h for the parameters
+ */
+void split_row(const uint8_t *img_row, uint8_t *plane_row, size_t plane_size, int width) {
+	uint8_t *blue = plane_row;
+	uint8_t *green = plane_row + plane_size;
+	uint8_t *red = plane_row + 2 * plane_size;
+
+	for (int x = 0; x < width; x++) {
+		blue[x] = img_row[x * 3 + BLUE];
+		green[x] = img_row[x * 3 + GREEN];
+		red[x] = img_row[x * 3 + RED];
+	}
+}
+
+/* Finds the darkest channel of every pixel in a row of a planar image, as dark channel keys; ties
+ * go to the earlier channel, as in dark_keys_row()
+ *
+ * See dark_keys_planar_fn in kernels.h for the parameters
+ */
+void dark_keys_planar(const uint8_t *plane_row, size_t plane_size, uint16_t *keys, int width) {
+	const uint8_t *blue = plane_row;
+	const uint8_t *green = plane_row + plane_size;
+	const uint8_t *red = plane_row + 2 * plane_size;
+
+	// Selects rather than branches, so that the compiler can vectorize the loop
+	for (int x = 0; x < width; x++) {
+		int val = green[x] < blue[x] ? green[x] : blue[x];
+		int channel = green[x] < blue[x] ? GREEN : BLUE;
+		channel = red[x] < val ? RED : channel;
+		val = red[x] < val ? red[x] : val;
+		keys[x] = DARK_KEY(val, channel);
+	}
+}
+
+/* Estimates the transmission and recovers the output for a row of a planar image by looking up
+ * each pixel in the recovery table, giving exactly the same results as recover_row_lut()
+ *
+ * See recover_planar_fn in kernels.h for the parameters
+ */
+void recover_planar_lut(const uint8_t *plane_row, size_t plane_size, const uint16_t *dark_row, uint8_t *map_row,
+		uint8_t *out_row, int width, const recovery_lut_t *lut) {
+	for (int x = 0; x < width; x++) {
+		uint8_t *out_pixel = out_row + x * 3;
+		uint8_t dark = plane_row[DARK_KEY_CHANNEL(dark_row[x]) * plane_size + x];
+		const uint8_t *out_vals = lut->out[dark];
+
+		if (map_row != NULL) {
+			map_row[x] = lut->map[dark];
+		}
+		for (int c = 0; c < 3; c++) {
+			out_pixel[c] = out_vals[plane_row[c * plane_size + x]];
+		}
+	}
+}
+
+/* Fills in the fixed point half of the recovery table for an atmospheric light, which only takes
+ * 256 integer divisions, rather than the 65536 in double precision that build_recovery_lut() does
+ *
+ * lut - The table to fill in
+ * light - The atmospheric light of each channel, of which only the first is used, and which is
+ *         always between 1 and 255
+ * min_t - The lowest transmission that the output is recovered with
+ */
+void build_fixed_recovery(recovery_lut_t *lut, const double *light, double min_t) {
+	memcpy(lut->light, light, sizeof(lut->light));
+	lut->floor = min_t;
+	lut->light_recip = (int32_t)(FIXED_ONE / light[0] + 0.5);
+	lut->light_q4 = (int32_t)(light[0] * 16 + 0.5);
+
+	// Every transmission that recover_row_fixed() can estimate comes from one of the dark channel
+	// values, so its reciprocal can be taken ahead of time
+	int32_t t_floor = (int32_t)(min_t * FIXED_ONE + 0.5);
+	for (int dark = 0; dark <= UINT8_MAX; dark++) {
+		int32_t t = FIXED_ONE - dark * lut->light_recip;
+		int64_t floored = t > t_floor ? t : t_floor;
+		lut->inv_t[dark] = (int32_t)((((int64_t)FIXED_ONE << 16) + floored / 2) / floored);
+	}
+}
+
+/* Estimates the transmission and recovers the output for a row of pixels using only integer
+ * arithmetic, with the transmission in Q16 fixed point; the results are within one step of
+ * recover_row(), and its tables take up 1 KB rather than the 64 KB that recover_row_lut() reads
+ * from, which matters on CPUs with small caches or slow floating point
+ *
+ * See recover_row_fn in kernels.h for the parameters
+ */
+void recover_row_fixed(const uint8_t *img_row, const uint16_t *dark_row, uint8_t *map_row, uint8_t *out_row, int width, const recovery_lut_t *lut) {
+	int32_t light_recip = lut->light_recip;
+	int32_t light_q4 = lut->light_q4;
+
+	for (int x = 0; x < width; x++) {
+		const uint8_t *pixel = img_row + x * 3;
+		uint8_t *out_pixel = out_row + x * 3;
+		int dark = pixel[DARK_KEY_CHANNEL(dark_row[x])];
+
+		// t(x) = 1 - dark / light, in Q16; it's clamped before it's scaled, since pixels brighter in
+		// the dark channel than the light would overflow
+		if (map_row != NULL) {
+			int32_t t = FIXED_ONE - dark * light_recip;
+			map_row[x] = fixed_to_u8((t > 0 ? t : 0) * UINT8_MAX, 16);
+		}
+
+		// With the input and the light in Q4, and 1 / t(x) in Q16, every product fits in 32 bits as
+		// long as the floor is at least DEFOG_MIN_TRANSMISSION_FLOOR
+		int32_t inv_t = lut->inv_t[dark];
+		int32_t base = light_q4 << 16;
+		out_pixel[BLUE] = fixed_to_u8((pixel[BLUE] * 16 - light_q4) * inv_t + base, 20);
+		out_pixel[GREEN] = fixed_to_u8((pixel[GREEN] * 16 - light_q4) * inv_t + base, 20);
+		out_pixel[RED] = fixed_to_u8((pixel[RED] * 16 - light_q4) * inv_t + base, 20);
+	}
+}
+
+/* Estimates the raw transmission of a row of pixels, along with the grayscale intensity used to
+ * guide its refinement, without recovering any output
+ *
+ * img_row - The row of the original 8-bit BGR image
+ * dark_row - The dark channel keys for the window around each pixel in the row
+ * t_row - Where the transmission of each pixel is written, exactly as recover_row() estimates it
+ * guide_row - Where the grayscale intensity of each pixel is written, scaled to [0, 1]
+ * width - The number of pixels in the row
+ * light - The atmospheric light of each channel, in BGR order
+ */
+void estimate_transmission_row(const uint8_t *img_row, const uint16_t *dark_row, float *t_row, float *guide_row, int width, const double *light) {
+	for (int x = 0; x < width; x++) {
+		const uint8_t *pixel = img_row + x * 3;
+		channel_t dark_channel = DARK_KEY_CHANNEL(dark_row[x]);
+		t_row[x] = (float)(1 - (pixel[dark_channel] / light[dark_channel]));
+		guide_row[x] = gray_value(pixel) / 255.0f;
+	}
+}
+
+/* Recovers the output for a row of pixels from a transmission map that has already been estimated
+ * (and refined), rather than from the dark channel; this is the double precision reference
+ *
+ * See recover_refined_fn in kernels.h for the parameters
+ */
+void recover_row_refined(const uint8_t *img_row, const float *t_row, uint8_t *map_row, uint8_t *out_row, int width, const double *light, double min_t) {
+	for (int x = 0; x < width; x++) {
+		const uint8_t *pixel = img_row + x * 3;
+		uint8_t *out_pixel = out_row + x * 3;
+		double t = t_row[x];
+
+		if (map_row != NULL) {
+			map_row[x] = saturate_u8(t * 255.0);
+		}
+
+		for (int i = 0; i < 3; i++) {
+			out_pixel[i] = saturate_u8((pixel[i] - light[i]) / fmax(t, min_t) + light[i]);
+		}
+	}
+}
+
+/* The bodies of recover_row_field() and recover_row_refined_field(), which are specialized for each
+ * depth at compile time, so the 8-bit versions are exactly what they were before other depths were
+ * supported. The light is always at the 8-bit scale that it's estimated at (see DEPTH_SCALE_16U)
+ *
+ * field_fn - The name of the kernel that estimates the transmission from the dark channel
+ * refined_fn - The name of the kernel that takes an estimated transmission
+ * type - The type of each channel value
+ * saturate - Rounds and clamps a double to the range of type
+ * scale - The float that a value at the 8-bit scale is multiplied by to get to the depth's scale
+ */
+#define DEFINE_FIELD_KERNELS(field_fn, refined_fn, type, saturate, scale) \
+void field_fn(const void *img_row, const uint16_t *dark_row, uint8_t *map_row, void *out_row, int width, const float *light_row, double min_t) { \
+	for (int x = 0; x < width; x++) { \
+		const type *pixel = (const type *)img_row + x * 3; \
+		const float *light = light_row + x * 3; \
+		type *out_pixel = (type *)out_row + x * 3; \
+		channel_t dark_channel = DARK_KEY_CHANNEL(dark_row[x]); \
+		double t = 1 - (pixel[dark_channel] / (double)(light[dark_channel] * (scale))); \
+\
+		if (map_row != NULL) { \
+			map_row[x] = saturate_u8(t * 255.0); \
+		} \
+\
+		for (int i = 0; i < 3; i++) { \
+			out_pixel[i] = saturate((pixel[i] - light[i] * (scale)) / fmax(t, min_t) + light[i] * (scale)); \
+		} \
+	} \
+} \
+\
+void refined_fn(const void *img_row, const float *t_row, uint8_t *map_row, void *out_row, int width, const float *light_row, double min_t) { \
+	for (int x = 0; x < width; x++) { \
+		const type *pixel = (const type *)img_row + x * 3; \
+		const float *light = light_row + x * 3; \
+		type *out_pixel = (type *)out_row + x * 3; \
+		double t = t_row[x]; \
+\
+		if (map_row != NULL) { \
+			map_row[x] = saturate_u8(t * 255.0); \
+		} \
+\
+		for (int i = 0; i < 3; i++) { \
+			out_pixel[i] = saturate((pixel[i] - light[i] * (scale)) / fmax(t, min_t) + light[i] * (scale)); \
+		} \
+	} \
+}
+
+/* recover_row_field() estimates the transmission and recovers the output for a row of pixels
+ * whose atmospheric light varies from pixel to pixel, in double precision as recover_row() does,
+ * and recover_row_refined_field() does the same from a transmission map that has already been
+ * estimated, as recover_row_refined() does; the _u16 and _f32 versions handle 16-bit and floating
+ * point images, whose transmission is still written to an 8-bit map
+ *
+ * See recover_field_fn and recover_refined_field_fn in kernels.h for the parameters
+ */
+DEFINE_FIELD_KERNELS(recover_row_field, recover_row_refined_field, uint8_t, saturate_u8, 1.0f)
+DEFINE_FIELD_KERNELS(recover_row_field_u16, recover_row_refined_field_u16, uint16_t, saturate_u16, DEPTH_SCALE_16U)
+DEFINE_FIELD_KERNELS(recover_row_field_f32, recover_row_refined_field_f32, float, saturate_f32, DEPTH_SCALE_32F)
+
+/* Estimates the raw transmission of a row of pixels whose atmospheric light varies from pixel to
+ * pixel, along with the guide, as estimate_transmission_row() does
+ *
+ * See estimate_transmission_row() and recover_row_field() for the parameters
+ */
+void estimate_transmission_row_field(const uint8_t *img_row, const uint16_t *dark_row, float *t_row, float *guide_row, int width, const float *light_row) {
+	for (int x = 0; x < width; x++) {
+		const uint8_t *pixel = img_row + x * 3;
+		channel_t dark_channel = DARK_KEY_CHANNEL(dark_row[x]);
+		t_row[x] = (float)(1 - (pixel[dark_channel] / (double)light_row[x * 3 + dark_channel]));
+		guide_row[x] = gray_value(pixel) / 255.0f;
+	}
+}
+
+/* Converts a row of 16-bit channel values to 8 bits, rounding to the nearest
+ *
+ * See quantize_row_fn in kernels.h for the parameters
+ */
+void quantize_row_u16(const void *src_row, uint8_t *dst_row, int len) {
+	const uint16_t *src = src_row;
+	for (int i = 0; i < len; i++) {
+		dst_row[i] = (uint8_t)((src[i] + 128) / 257);
+	}
+}
+
+/* Converts a row of floating point channel values, nominally in [0, 1], to 8 bits, rounding to the
+ * nearest and clamping anything outside that range (including NaNs, which become 0)
+ *
+ * See quantize_row_fn in kernels.h for the parameters
+ */
+void quantize_row_f32(const void *src_row, uint8_t *dst_row, int len) {
+	const float *src = src_row;
+	for (int i = 0; i < len; i++) {
+		float val = src[i] * 255.0f;
+		dst_row[i] = val > 0.0f ? val < 255.0f ? (uint8_t)(val + 0.5f) : UINT8_MAX : 0;
+	}
+}
+
+#ifdef DEFOG_X86_KERNELS
+
+/* Splits 16 interleaved BGR pixels into one vector per channel
+ *
+ * src - The 48 bytes of pixels
+ * b, g, r - Where the channels are written
+ */
+__attribute__((target("sse4.1")))
+static inline void deinterleave_bgr(const uint8_t *src, __m128i *b, __m128i *g, __m128i *r) {
+	__m128i in0 = _mm_loadu_si128((const __m128i *)src);
+	__m128i in1 = _mm_loadu_si128((const __m128i *)(src + 16));
+	__m128i in2 = _mm_loadu_si128((const __m128i *)(src + 32));
+
+	// Each channel takes a few bytes from each of the three input vectors
+	*b = _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(in0, _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+		_mm_shuffle_epi8(in1, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1))),
+		_mm_shuffle_epi8(in2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13)));
+	*g = _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(in0, _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+		_mm_shuffle_epi8(in1, _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1))),
+		_mm_shuffle_epi8(in2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14)));
+	*r = _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(in0, _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+		_mm_shuffle_epi8(in1, _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1))),
+		_mm_shuffle_epi8(in2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15)));
+}
+
+/* Merges one vector per channel back into 16 interleaved BGR pixels
+ *
+ * dst - Where the 48 bytes of pixels are written
+ * b, g, r - The channels
+ */
+__attribute__((target("sse4.1")))
+static inline void interleave_bgr(uint8_t *dst, __m128i b, __m128i g, __m128i r) {
+	__m128i out0 = _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(b, _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5)),
+		_mm_shuffle_epi8(g, _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1))),
+		_mm_shuffle_epi8(r, _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1)));
+	__m128i out1 = _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(b, _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1)),
+		_mm_shuffle_epi8(g, _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10))),
+		_mm_shuffle_epi8(r, _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1)));
+	__m128i out2 = _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(b, _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1)),
+		_mm_shuffle_epi8(g, _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1))),
+		_mm_shuffle_epi8(r, _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15)));
+
+	_mm_storeu_si128((__m128i *)dst, out0);
+	_mm_storeu_si128((__m128i *)(dst + 16), out1);
+	_mm_storeu_si128((__m128i *)(dst + 32), out2);
+}
+
+/* Picks out the value of each pixel in the channel named by its dark channel key
+ *
+ * dark_row - The 16 dark channel keys
+ * b, g, r - The channels of the 16 pixels
+ *
+ * Returns the 16 dark channel values
+ */
+__attribute__((target("sse4.1")))
+static inline __m128i select_dark_channel(const uint16_t *dark_row, __m128i b, __m128i g, __m128i r) {
+	__m128i mask = _mm_set1_epi16(3);
+	__m128i keys0 = _mm_and_si128(_mm_loadu_si128((const __m128i *)dark_row), mask);
+	__m128i keys1 = _mm_and_si128(_mm_loadu_si128((const __m128i *)(dark_row + 8)), mask);
+	__m128i channels = _mm_packus_epi16(keys0, keys1);
+
+	__m128i val = _mm_blendv_epi8(r, g, _mm_cmpeq_epi8(channels, _mm_set1_epi8(GREEN)));
+	return _mm_blendv_epi8(val, b, _mm_cmpeq_epi8(channels, _mm_set1_epi8(BLUE)));
+}
+
+/* Widens 16 8-bit values into four vectors of four single precision values
+ *
+ * val - The 8-bit values
+ * quads - Where the widened values are written
+ */
+__attribute__((target("sse4.1")))
+static inline void widen_quads(__m128i val, __m128 *quads) {
+	__m128i zero = _mm_setzero_si128();
+	__m128i low = _mm_unpacklo_epi8(val, zero);
+	__m128i high = _mm_unpackhi_epi8(val, zero);
+
+	quads[0] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(low, zero));
+	quads[1] = _mm_cvtepi32_ps(_mm_unpackhi_epi16(low, zero));
+	quads[2] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(high, zero));
+	quads[3] = _mm_cvtepi32_ps(_mm_unpackhi_epi16(high, zero));
+}
+
+/* Narrows four vectors of rounded 32-bit values into 16 saturated 8-bit values
+ *
+ * quads - The 32-bit values
+ *
+ * Returns the 8-bit values
+ */
+__attribute__((target("sse4.1")))
+static inline __m128i narrow_quads(const __m128i *quads) {
+	return _mm_packus_epi16(_mm_packs_epi32(quads[0], quads[1]), _mm_packs_epi32(quads[2], quads[3]));
+}
+
+/* Recovers four values of one channel, given the reciprocal of their (floored) transmission
+ *
+ * val - The channel values
+ * recip - The reciprocals of the transmissions
+ * light - The atmospheric light
+ *
+ * Returns the rounded (but not yet saturated) output values
+ */
+__attribute__((target("sse4.1")))
+static inline __m128i recover_quad(__m128 val, __m128 recip, __m128 light) {
+	return _mm_cvtps_epi32(_mm_add_ps(_mm_mul_ps(_mm_sub_ps(val, light), recip), light));
+}
+
+/* Estimates the transmission and recovers the output for 16 pixels in single precision using
+ * SSE4.1, once their channels have been split apart
+ *
+ * b, g, r - The channels of the pixels
+ * dark_row - The dark channel keys of the pixels
+ * map_row - Where the 8-bit transmission of the pixels is written, or NULL
+ * out_row - Where the interleaved 8-bit BGR output of the pixels is written
+ * light - The atmospheric light
+ * inv_light - The reciprocal of the light
+ * t_floor - The lowest transmission
+ */
+__attribute__((target("sse4.1")))
+static inline void recover_block_sse41(__m128i b, __m128i g, __m128i r, const uint16_t *dark_row, uint8_t *map_row,
+		uint8_t *out_row, __m128 light, __m128 inv_light, __m128 t_floor) {
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 full = _mm_set1_ps(255.0f);
+	__m128i dark = select_dark_channel(dark_row, b, g, r);
+
+	__m128 dark_vals[4], b_vals[4], g_vals[4], r_vals[4];
+	widen_quads(dark, dark_vals);
+	widen_quads(b, b_vals);
+	widen_quads(g, g_vals);
+	widen_quads(r, r_vals);
+
+	__m128i map_quads[4], b_quads[4], g_quads[4], r_quads[4];
+	for (int q = 0; q < 4; q++) {
+		// Estimate t(x), and take a single reciprocal of it for all three channels
+		__m128 t = _mm_sub_ps(one, _mm_mul_ps(dark_vals[q], inv_light));
+		__m128 recip = _mm_div_ps(one, _mm_max_ps(t, t_floor));
+
+		map_quads[q] = _mm_cvtps_epi32(_mm_mul_ps(t, full));
+		b_quads[q] = recover_quad(b_vals[q], recip, light);
+		g_quads[q] = recover_quad(g_vals[q], recip, light);
+		r_quads[q] = recover_quad(r_vals[q], recip, light);
+	}
+
+	// Saturate everything back down to 8 bits
+	if (map_row != NULL) {
+		_mm_storeu_si128((__m128i *)map_row, narrow_quads(map_quads));
+	}
+	interleave_bgr(out_row, narrow_quads(b_quads), narrow_quads(g_quads), narrow_quads(r_quads));
+}
+
+/* Estimates the transmission and recovers the output for a row of pixels, 16 pixels at a time in
+ * single precision using SSE4.1
+ *
+ * See recover_row_fn in kernels.h for the parameters
+ */
+__attribute__((target("sse4.1")))
+static void recover_row_sse41(const uint8_t *img_row, const uint16_t *dark_row, uint8_t *map_row, uint8_t *out_row, int width, const recovery_lut_t *lut) {
+	double light_intensity = lut->light[0];
+	__m128 light = _mm_set1_ps((float)light_intensity);
+	__m128 inv_light = _mm_set1_ps((float)(1.0 / light_intensity));
+	__m128 t_floor = _mm_set1_ps((float)lut->floor);
+
+	int x = 0;
+	for (; x + 16 <= width; x += 16) {
+		__m128i b, g, r;
+		deinterleave_bgr(img_row + x * 3, &b, &g, &r);
+		recover_block_sse41(b, g, r, dark_row + x, map_row != NULL ? map_row + x : NULL, out_row + x * 3, light, inv_light,
+			t_floor);
+	}
+
+	// Finish off whatever doesn't fill a vector
+	recover_row_lut(img_row + x * 3, dark_row + x, map_row != NULL ? map_row + x : NULL, out_row + x * 3, width - x, lut);
+}
+
+/* Estimates the transmission and recovers the output for a row of a planar image with SSE4.1,
+ * which is recover_row_sse41() without having to split up the pixels first
+ *
+ * See recover_planar_fn in kernels.h for the parameters
+ */
+__attribute__((target("sse4.1")))
+static void recover_planar_sse41(const uint8_t *plane_row, size_t plane_size, const uint16_t *dark_row, uint8_t *map_row,
+		uint8_t *out_row, int width, const recovery_lut_t *lut) {
+	double light_intensity = lut->light[0];
+	__m128 light = _mm_set1_ps((float)light_intensity);
+	__m128 inv_light = _mm_set1_ps((float)(1.0 / light_intensity));
+	__m128 t_floor = _mm_set1_ps((float)lut->floor);
+
+	int x = 0;
+	for (; x + 16 <= width; x += 16) {
+		__m128i b = _mm_loadu_si128((const __m128i *)(plane_row + x));
+		__m128i g = _mm_loadu_si128((const __m128i *)(plane_row + plane_size + x));
+		__m128i r = _mm_loadu_si128((const __m128i *)(plane_row + 2 * plane_size + x));
+		recover_block_sse41(b, g, r, dark_row + x, map_row != NULL ? map_row + x : NULL, out_row + x * 3, light, inv_light,
+			t_floor);
+	}
+
+	recover_planar_lut(plane_row + x, plane_size, dark_row + x, map_row != NULL ? map_row + x : NULL, out_row + x * 3,
+		width - x, lut);
+}
+
+/* Recovers eight values of one channel, given the reciprocal of their (floored) transmission
+ *
+ * chan - The channel values, in the low eight bytes of a vector
+ * recip - The reciprocals of the transmissions
+ * light - The atmospheric light
+ *
+ * Returns the rounded output values, saturated to 16 bits
+ */
+__attribute__((target("avx2")))
+static inline __m128i recover_octet(__m128i chan, __m256 recip, __m256 light) {
+	__m256 val = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(chan));
+	__m256i out = _mm256_cvtps_epi32(_mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(val, light), recip), light));
+	return _mm_packs_epi32(_mm256_castsi256_si128(out), _mm256_extracti128_si256(out, 1));
+}
+
+/* Estimates the transmission and recovers the output for 16 pixels in single precision using AVX2
+ * for the arithmetic, once their channels have been split apart
+ *
+ * See recover_block_sse41() for the parameters
+ */
+__attribute__((target("avx2")))
+static inline void recover_block_avx2(__m128i b, __m128i g, __m128i r, const uint16_t *dark_row, uint8_t *map_row,
+		uint8_t *out_row, __m256 light, __m256 inv_light, __m256 t_floor) {
+	__m256 one = _mm256_set1_ps(1.0f);
+	__m256 full = _mm256_set1_ps(255.0f);
+	__m128i dark = select_dark_channel(dark_row, b, g, r);
+
+	__m128i map_octets[2], b_octets[2], g_octets[2], r_octets[2];
+	for (int o = 0; o < 2; o++) {
+		// Move the half being worked on into the low eight bytes
+		__m128i dark_half = o == 0 ? dark : _mm_unpackhi_epi64(dark, dark);
+		__m128i b_half = o == 0 ? b : _mm_unpackhi_epi64(b, b);
+		__m128i g_half = o == 0 ? g : _mm_unpackhi_epi64(g, g);
+		__m128i r_half = o == 0 ? r : _mm_unpackhi_epi64(r, r);
+
+		// Estimate t(x), and take a single reciprocal of it for all three channels
+		__m256 val = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(dark_half));
+		__m256 t = _mm256_sub_ps(one, _mm256_mul_ps(val, inv_light));
+		__m256 recip = _mm256_div_ps(one, _mm256_max_ps(t, t_floor));
+
+		__m256i map = _mm256_cvtps_epi32(_mm256_mul_ps(t, full));
+		map_octets[o] = _mm_packs_epi32(_mm256_castsi256_si128(map), _mm256_extracti128_si256(map, 1));
+		b_octets[o] = recover_octet(b_half, recip, light);
+		g_octets[o] = recover_octet(g_half, recip, light);
+		r_octets[o] = recover_octet(r_half, recip, light);
+	}
+
+	// Saturate everything back down to 8 bits
+	if (map_row != NULL) {
+		_mm_storeu_si128((__m128i *)map_row, _mm_packus_epi16(map_octets[0], map_octets[1]));
+	}
+	interleave_bgr(out_row,
+		_mm_packus_epi16(b_octets[0], b_octets[1]),
+		_mm_packus_epi16(g_octets[0], g_octets[1]),
+		_mm_packus_epi16(r_octets[0], r_octets[1]));
+}
+
+/* Estimates the transmission and recovers the output for a row of pixels, 16 pixels at a time in
+ * single precision using AVX2 for the arithmetic
+ *
+ * See recover_row_fn in kernels.h for the parameters
+ */
+__attribute__((target("avx2")))
+static void recover_row_avx2(const uint8_t *img_row, const uint16_t *dark_row, uint8_t *map_row, uint8_t *out_row, int width, const recovery_lut_t *lut) {
+	double light_intensity = lut->light[0];
+	__m256 light = _mm256_set1_ps((float)light_intensity);
+	__m256 inv_light = _mm256_set1_ps((float)(1.0 / light_intensity));
+	__m256 t_floor = _mm256_set1_ps((float)lut->floor);
+
+	int x = 0;
+	for (; x + 16 <= width; x += 16) {
+		__m128i b, g, r;
+		deinterleave_bgr(img_row + x * 3, &b, &g, &r);
+		recover_block_avx2(b, g, r, dark_row + x, map_row != NULL ? map_row + x : NULL, out_row + x * 3, light, inv_light,
+			t_floor);
+	}
+
+	// Finish off whatever doesn't fill a vector
+	recover_row_lut(img_row + x * 3, dark_row + x, map_row != NULL ? map_row + x : NULL, out_row + x * 3, width - x, lut);
+}
+
+/* Estimates the transmission and recovers the output for a row of a planar image with AVX2, which
+ * is recover_row_avx2() without having to split up the pixels first
+ *
+ * See recover_planar_fn in kernels.h for the parameters
+ */
+__attribute__((target("avx2")))
+static void recover_planar_avx2(const uint8_t *plane_row, size_t plane_size, const uint16_t *dark_row, uint8_t *map_row,
+		uint8_t *out_row, int width, const recovery_lut_t *lut) {
+	double light_intensity = lut->light[0];
+	__m256 light = _mm256_set1_ps((float)light_intensity);
+	__m256 inv_light = _mm256_set1_ps((float)(1.0 / light_intensity));
+	__m256 t_floor = _mm256_set1_ps((float)lut->floor);
+
+	int x = 0;
+	for (; x + 16 <= width; x += 16) {
+		__m128i b = _mm_loadu_si128((const __m128i *)(plane_row + x));
+		__m128i g = _mm_loadu_si128((const __m128i *)(plane_row + plane_size + x));
+		__m128i r = _mm_loadu_si128((const __m128i *)(plane_row + 2 * plane_size + x));
+		recover_block_avx2(b, g, r, dark_row + x, map_row != NULL ? map_row + x : NULL, out_row + x * 3, light, inv_light,
+			t_floor);
+	}
+
+	recover_planar_lut(plane_row + x, plane_size, dark_row + x, map_row != NULL ? map_row + x : NULL, out_row + x * 3,
+		width - x, lut);
+}
+
+/* Recovers the output for a row of pixels from an estimated transmission, 16 pixels at a time in
+ * single precision using SSE4.1
+ *
+ * See recover_refined_fn in kernels.h for the parameters
+ */
+__attribute__((target("sse4.1")))
+static void recover_row_refined_sse41(const uint8_t *img_row, const float *t_row, uint8_t *map_row, uint8_t *out_row, int width, const double *light_bgr, double min_t) {
+	__m128 light = _mm_set1_ps((float)light_bgr[0]);
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 full = _mm_set1_ps(255.0f);
+	__m128 t_floor = _mm_set1_ps((float)min_t);
+
+	int x = 0;
+	for (; x + 16 <= width; x += 16) {
+		__m128i b, g, r;
+		deinterleave_bgr(img_row + x * 3, &b, &g, &r);
+
+		__m128 b_vals[4], g_vals[4], r_vals[4];
+		widen_quads(b, b_vals);
+		widen_quads(g, g_vals);
+		widen_quads(r, r_vals);
+
+		__m128i map_quads[4], b_quads[4], g_quads[4], r_quads[4];
+		for (int q = 0; q < 4; q++) {
+			__m128 t = _mm_loadu_ps(t_row + x + q * 4);
+			__m128 recip = _mm_div_ps(one, _mm_max_ps(t, t_floor));
+
+			map_quads[q] = _mm_cvtps_epi32(_mm_mul_ps(t, full));
+			b_quads[q] = recover_quad(b_vals[q], recip, light);
+			g_quads[q] = recover_quad(g_vals[q], recip, light);
+			r_quads[q] = recover_quad(r_vals[q], recip, light);
+		}
+
+		if (map_row != NULL) {
+			_mm_storeu_si128((__m128i *)(map_row + x), narrow_quads(map_quads));
+		}
+		interleave_bgr(out_row + x * 3, narrow_quads(b_quads), narrow_quads(g_quads), narrow_quads(r_quads));
+	}
+
+	// Finish off whatever doesn't fill a vector
+	recover_row_refined(img_row + x * 3, t_row + x, map_row != NULL ? map_row + x : NULL, out_row + x * 3, width - x, light_bgr, min_t);
+}
+
+/* Finds the dark channel keys of 16 pixels whose channels have been split apart; this is exact,
+ * since it only compares and packs integers
+ *
+ * b, g, r - The channels of the pixels
+ * keys - Where the key of each pixel is written
+ */
+__attribute__((target("sse4.1")))
+static inline void dark_keys_block_sse41(__m128i b, __m128i g, __m128i r, uint16_t *keys) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ones = _mm_set1_epi8(-1);
+
+	// Green only wins if it is strictly darker than blue, and red only if it is strictly darker
+	// than both, so ties go to the earlier channel
+	__m128i blue_green = _mm_min_epu8(b, g);
+	__m128i val = _mm_min_epu8(blue_green, r);
+	__m128i channel = _mm_andnot_si128(_mm_cmpeq_epi8(blue_green, b), _mm_set1_epi8(GREEN));
+	__m128i red_wins = _mm_xor_si128(_mm_cmpeq_epi8(val, blue_green), ones);
+	channel = _mm_blendv_epi8(channel, _mm_set1_epi8(RED), red_wins);
+
+	// Then widen to 16 bits and pack the channel below the value
+	__m128i lo = _mm_or_si128(_mm_slli_epi16(_mm_unpacklo_epi8(val, zero), 2), _mm_unpacklo_epi8(channel, zero));
+	__m128i hi = _mm_or_si128(_mm_slli_epi16(_mm_unpackhi_epi8(val, zero), 2), _mm_unpackhi_epi8(channel, zero));
+	_mm_storeu_si128((__m128i *)keys, lo);
+	_mm_storeu_si128((__m128i *)(keys + 8), hi);
+}
+
+/* Finds the dark channel keys of 16 pixels at a time
+ *
+ * See dark_keys_fn in kernels.h for the parameters
+ */
+__attribute__((target("sse4.1")))
+static void dark_keys_row_sse41(const uint8_t *img_row, uint16_t *keys, int width) {
+	int x = 0;
+
+	for (; x + 16 <= width; x += 16) {
+		__m128i b, g, r;
+		deinterleave_bgr(img_row + x * 3, &b, &g, &r);
+		dark_keys_block_sse41(b, g, r, keys + x);
+	}
+
+	dark_keys_row(img_row + x * 3, keys + x, width - x);
+}
+
+/* Finds the dark channel keys of a row of a planar image 16 pixels at a time, straight from the
+ * planes
+ *
+ * See dark_keys_planar_fn in kernels.h for the parameters
+ */
+__attribute__((target("sse4.1")))
+static void dark_keys_planar_sse41(const uint8_t *plane_row, size_t plane_size, uint16_t *keys, int width) {
+	int x = 0;
+
+	for (; x + 16 <= width; x += 16) {
+		__m128i b = _mm_loadu_si128((const __m128i *)(plane_row + x));
+		__m128i g = _mm_loadu_si128((const __m128i *)(plane_row + plane_size + x));
+		__m128i r = _mm_loadu_si128((const __m128i *)(plane_row + 2 * plane_size + x));
+		dark_keys_block_sse41(b, g, r, keys + x);
+	}
+
+	dark_keys_planar(plane_row + x, plane_size, keys + x, width - x);
+}
+
+/* Finds the dark channel keys of a row of a planar image 32 pixels at a time using AVX2, which the
+ * interleaved kernels can't do, since splitting up 32 pixels takes shuffles across the halves of
+ * each vector
+ *
+ * See dark_keys_planar_fn in kernels.h for the parameters
+ */
+__attribute__((target("avx2")))
+static void dark_keys_planar_avx2(const uint8_t *plane_row, size_t plane_size, uint16_t *keys, int width) {
+	const __m256i ones = _mm256_set1_epi8(-1);
+	int x = 0;
+
+	for (; x + 32 <= width; x += 32) {
+		__m256i b = _mm256_loadu_si256((const __m256i *)(plane_row + x));
+		__m256i g = _mm256_loadu_si256((const __m256i *)(plane_row + plane_size + x));
+		__m256i r = _mm256_loadu_si256((const __m256i *)(plane_row + 2 * plane_size + x));
+
+		// Ties go to the earlier channel, as in dark_keys_block_sse41()
+		__m256i blue_green = _mm256_min_epu8(b, g);
+		__m256i val = _mm256_min_epu8(blue_green, r);
+		__m256i channel = _mm256_andnot_si256(_mm256_cmpeq_epi8(blue_green, b), _mm256_set1_epi8(GREEN));
+		__m256i red_wins = _mm256_xor_si256(_mm256_cmpeq_epi8(val, blue_green), ones);
+		channel = _mm256_blendv_epi8(channel, _mm256_set1_epi8(RED), red_wins);
+
+		// Widening each half on its own keeps the keys in order
+		for (int h = 0; h < 2; h++) {
+			__m128i val_half = h == 0 ? _mm256_castsi256_si128(val) : _mm256_extracti128_si256(val, 1);
+			__m128i channel_half = h == 0 ? _mm256_castsi256_si128(channel) : _mm256_extracti128_si256(channel, 1);
+			__m256i key = _mm256_or_si256(_mm256_slli_epi16(_mm256_cvtepu8_epi16(val_half), 2), _mm256_cvtepu8_epi16(channel_half));
+			_mm256_storeu_si256((__m256i *)(keys + x + h * 16), key);
+		}
+	}
+
+	dark_keys_planar_sse41(plane_row + x, plane_size, keys + x, width - x);
+}
+
+/* Splits a row of interleaved BGR pixels into planes 16 pixels at a time
+ *
+ * See split_row_fn in kernels.h for the parameters
+ */
+__attribute__((target("sse4.1")))
+static void split_row_sse41(const uint8_t *img_row, uint8_t *plane_row, size_t plane_size, int width) {
+	int x = 0;
+
+	for (; x + 16 <= width; x += 16) {
+		__m128i b, g, r;
+		deinterleave_bgr(img_row + x * 3, &b, &g, &r);
+		_mm_storeu_si128((__m128i *)(plane_row + x), b);
+		_mm_storeu_si128((__m128i *)(plane_row + plane_size + x), g);
+		_mm_storeu_si128((__m128i *)(plane_row + 2 * plane_size + x), r);
+	}
+
+	split_row(img_row + x * 3, plane_row + x, plane_size, width - x);
+}
+
+#endif
+
+#ifdef DEFOG_NEON_KERNELS
+
+/* Recovers four values of one channel, given the reciprocal of their (floored) transmission
+ *
+ * chan - The channel values, widened to 32 bits
+ * recip - The reciprocals of the transmissions
+ * light - The atmospheric light
+ *
+ * Returns the rounded output values, saturated to 16 bits
+ */
+static inline uint16x4_t recover_quad_neon(uint32x4_t chan, float32x4_t recip, float32x4_t light) {
+	float32x4_t val = vcvtq_f32_u32(chan);
+	return vqmovun_s32(vcvtnq_s32_f32(vaddq_f32(vmulq_f32(vsubq_f32(val, light), recip), light)));
+}
+
+/* Estimates the transmission and recovers the output for 16 pixels in single precision using NEON,
+ * once their channels have been split apart
+ *
+ * px - The channels of the pixels
+ * dark_row - The dark channel keys of the pixels
+ * map_row - Where the 8-bit transmission of the pixels is written, or NULL
+ * out_row - Where the interleaved 8-bit BGR output of the pixels is written
+ * light - The atmospheric light
+ * inv_light - The reciprocal of the light
+ * t_floor - The lowest transmission
+ */
+static inline void recover_block_neon(uint8x16x3_t px, const uint16_t *dark_row, uint8_t *map_row, uint8_t *out_row,
+		float32x4_t light, float32x4_t inv_light, float32x4_t t_floor) {
+	float32x4_t one = vdupq_n_f32(1.0f);
+	float32x4_t full = vdupq_n_f32(255.0f);
+
+	// Pick out the value of each pixel in its dark channel
+	uint16x8_t mask = vdupq_n_u16(3);
+	uint8x16_t channels = vcombine_u8(vmovn_u16(vandq_u16(vld1q_u16(dark_row), mask)),
+		vmovn_u16(vandq_u16(vld1q_u16(dark_row + 8), mask)));
+	uint8x16_t dark = vbslq_u8(vceqq_u8(channels, vdupq_n_u8(GREEN)), px.val[GREEN], px.val[RED]);
+	dark = vbslq_u8(vceqq_u8(channels, vdupq_n_u8(BLUE)), px.val[BLUE], dark);
+
+	// Widen everything to 32 bits, four pixels at a time
+	uint16x8_t dark_halves[2] = {vmovl_u8(vget_low_u8(dark)), vmovl_u8(vget_high_u8(dark))};
+	uint16x8_t chan_halves[3][2];
+	for (int c = 0; c < 3; c++) {
+		chan_halves[c][0] = vmovl_u8(vget_low_u8(px.val[c]));
+		chan_halves[c][1] = vmovl_u8(vget_high_u8(px.val[c]));
+	}
+
+	uint16x4_t map_quads[4];
+	uint16x4_t out_quads[3][4];
+	for (int q = 0; q < 4; q++) {
+		uint16x8_t dark_half = dark_halves[q / 2];
+		uint32x4_t dark_quad = vmovl_u16(q % 2 == 0 ? vget_low_u16(dark_half) : vget_high_u16(dark_half));
+
+		// Estimate t(x), and take a single reciprocal of it for all three channels
+		float32x4_t t = vsubq_f32(one, vmulq_f32(vcvtq_f32_u32(dark_quad), inv_light));
+		float32x4_t recip = vdivq_f32(one, vmaxq_f32(t, t_floor));
+
+		map_quads[q] = vqmovun_s32(vcvtnq_s32_f32(vmulq_f32(t, full)));
+		for (int c = 0; c < 3; c++) {
+			uint16x8_t chan_half = chan_halves[c][q / 2];
+			uint32x4_t chan_quad = vmovl_u16(q % 2 == 0 ? vget_low_u16(chan_half) : vget_high_u16(chan_half));
+			out_quads[c][q] = recover_quad_neon(chan_quad, recip, light);
+		}
+	}
+
+	// Saturate everything back down to 8 bits
+	if (map_row != NULL) {
+		vst1q_u8(map_row, vcombine_u8(vqmovn_u16(vcombine_u16(map_quads[0], map_quads[1])),
+			vqmovn_u16(vcombine_u16(map_quads[2], map_quads[3]))));
+	}
+	uint8x16x3_t out;
+	for (int c = 0; c < 3; c++) {
+		out.val[c] = vcombine_u8(vqmovn_u16(vcombine_u16(out_quads[c][0], out_quads[c][1])),
+			vqmovn_u16(vcombine_u16(out_quads[c][2], out_quads[c][3])));
+	}
+	vst3q_u8(out_row, out);
+}
+
+/* Estimates the transmission and recovers the output for a row of pixels, 16 pixels at a time in
+ * single precision using NEON
+ *
+ * See recover_row_fn in kernels.h for the parameters
+ */
+static void recover_row_neon(const uint8_t *img_row, const uint16_t *dark_row, uint8_t *map_row, uint8_t *out_row, int width, const recovery_lut_t *lut) {
+	double light_intensity = lut->light[0];
+	float32x4_t light = vdupq_n_f32((float)light_intensity);
+	float32x4_t inv_light = vdupq_n_f32((float)(1.0 / light_intensity));
+	float32x4_t t_floor = vdupq_n_f32((float)lut->floor);
+
+	int x = 0;
+	for (; x + 16 <= width; x += 16) {
+		recover_block_neon(vld3q_u8(img_row + x * 3), dark_row + x, map_row != NULL ? map_row + x : NULL, out_row + x * 3,
+			light, inv_light, t_floor);
+	}
+
+	// Finish off whatever doesn't fill a vector
+	recover_row_lut(img_row + x * 3, dark_row + x, map_row != NULL ? map_row + x : NULL, out_row + x * 3, width - x, lut);
+}
+
+/* Estimates the transmission and recovers the output for a row of a planar image with NEON
+ *
+ * See recover_planar_fn in kernels.h for the parameters
+ */
+static void recover_planar_neon(const uint8_t *plane_row, size_t plane_size, const uint16_t *dark_row, uint8_t *map_row,
+		uint8_t *out_row, int width, const recovery_lut_t *lut) {
+	double light_intensity = lut->light[0];
+	float32x4_t light = vdupq_n_f32((float)light_intensity);
+	float32x4_t inv_light = vdupq_n_f32((float)(1.0 / light_intensity));
+	float32x4_t t_floor = vdupq_n_f32((float)lut->floor);
+
+	int x = 0;
+	for (; x + 16 <= width; x += 16) {
+		uint8x16x3_t px;
+		for (int c = 0; c < 3; c++) {
+			px.val[c] = vld1q_u8(plane_row + c * plane_size + x);
+		}
+		recover_block_neon(px, dark_row + x, map_row != NULL ? map_row + x : NULL, out_row + x * 3, light, inv_light, t_floor);
+	}
+
+	recover_planar_lut(plane_row + x, plane_size, dark_row + x, map_row != NULL ? map_row + x : NULL, out_row + x * 3,
+		width - x, lut);
+}
+
+/* Finds the dark channel keys of 16 pixels whose channels have been split apart; this is exact,
+ * since it only compares and packs integers
+ *
+ * pixels - The channels of the pixels
+ * keys - Where the key of each pixel is written
+ */
+static inline void dark_keys_block_neon(uint8x16x3_t pixels, uint16_t *keys) {
+	// Ties go to the earlier channel, as in pixel_min()
+	uint8x16_t blue_green = vminq_u8(pixels.val[BLUE], pixels.val[GREEN]);
+	uint8x16_t val = vminq_u8(blue_green, pixels.val[RED]);
+	uint8x16_t channel = vandq_u8(vcltq_u8(pixels.val[GREEN], pixels.val[BLUE]), vdupq_n_u8(GREEN));
+	channel = vbslq_u8(vcltq_u8(pixels.val[RED], blue_green), vdupq_n_u8(RED), channel);
+
+	vst1q_u16(keys, vorrq_u16(vshll_n_u8(vget_low_u8(val), 2), vmovl_u8(vget_low_u8(channel))));
+	vst1q_u16(keys + 8, vorrq_u16(vshll_n_u8(vget_high_u8(val), 2), vmovl_u8(vget_high_u8(channel))));
+}
+
+/* Finds the dark channel keys of 16 pixels at a time
+ *
+ * See dark_keys_fn in kernels.h for the parameters
+ */
+static void dark_keys_row_neon(const uint8_t *img_row, uint16_t *keys, int width) {
+	int x = 0;
+
+	for (; x + 16 <= width; x += 16) {
+		dark_keys_block_neon(vld3q_u8(img_row + x * 3), keys + x);
+	}
+
+	dark_keys_row(img_row + x * 3, keys + x, width - x);
+}
+
+/* Finds the dark channel keys of a row of a planar image 16 pixels at a time
+ *
+ * See dark_keys_planar_fn in kernels.h for the parameters
+ */
+static void dark_keys_planar_neon(const uint8_t *plane_row, size_t plane_size, uint16_t *keys, int width) {
+	int x = 0;
+
+	for (; x + 16 <= width; x += 16) {
+		uint8x16x3_t pixels;
+		for (int c = 0; c < 3; c++) {
+			pixels.val[c] = vld1q_u8(plane_row + c * plane_size + x);
+		}
+		dark_keys_block_neon(pixels, keys + x);
+	}
+
+	dark_keys_planar(plane_row + x, plane_size, keys + x, width - x);
+}
+
+/* Splits a row of interleaved BGR pixels into planes 16 pixels at a time
+ *
+ * See split_row_fn in kernels.h for the parameters
+ */
+static void split_row_neon(const uint8_t *img_row, uint8_t *plane_row, size_t plane_size, int width) {
+	int x = 0;
+
+	for (; x + 16 <= width; x += 16) {
+		uint8x16x3_t pixels = vld3q_u8(img_row + x * 3);
+		for (int c = 0; c < 3; c++) {
+			vst1q_u8(plane_row + c * plane_size + x, pixels.val[c]);
+		}
+	}
+
+	split_row(img_row + x * 3, plane_row + x, plane_size, width - x);
+}
+
+#endif
+
+/* Picks the fastest recovery kernel that the CPU supports
+ *
+ * use_simd - Whether SIMD kernels may be used at all
+ *
+ * Returns the kernel; the SIMD kernels may produce values up to one step away from recover_row()
+ * because they work in single precision, while recover_row_lut(), which is used otherwise,
+ * matches it exactly
+ */
+recover_row_fn select_recover_row(int use_simd) {
+	if (!use_simd) {
+		return recover_row_lut;
+	}
+
+#if defined(DEFOG_X86_KERNELS)
+	if (__builtin_cpu_supports("avx2")) {
+		return recover_row_avx2;
+	}
+	if (__builtin_cpu_supports("sse4.1")) {
+		return recover_row_sse41;
+	}
+#elif defined(DEFOG_NEON_KERNELS)
+	return recover_row_neon;
+#endif
+
+	return recover_row_lut;
+}
+
+/* Picks the fastest kernel for recovering the output from an estimated transmission that the CPU
+ * supports
+ *
+ * use_simd - Whether SIMD kernels may be used at all
+ *
+ * Returns the kernel, which may produce values up to one step away from recover_row_refined()
+ * because it works in single precision
+ */
+recover_refined_fn select_recover_row_refined(int use_simd) {
+#if defined(DEFOG_X86_KERNELS)
+	if (use_simd && __builtin_cpu_supports("sse4.1")) {
+		return recover_row_refined_sse41;
+	}
+#endif
+
+	return recover_row_refined;
+}
+
+/* Picks the fastest kernel for finding the dark channel keys of each pixel that the CPU supports
+ *
+ * use_simd - Whether SIMD kernels may be used at all
+ *
+ * Returns the kernel; every kernel gives exactly the same keys as dark_keys_row()
+ */
+dark_keys_fn select_dark_keys(int use_simd) {
+	if (!use_simd) {
+		return dark_keys_row;
+	}
+
+#if defined(DEFOG_X86_KERNELS)
+	if (__builtin_cpu_supports("sse4.1")) {
+		return dark_keys_row_sse41;
+	}
+#elif defined(DEFOG_NEON_KERNELS)
+	return dark_keys_row_neon;
+#endif
+
+	return dark_keys_row;
+}
+
+/* Picks the fastest kernel for splitting rows into planes that the CPU supports
+ *
+ * use_simd - Whether SIMD kernels may be used at all
+ *
+ * Returns the kernel; every kernel gives exactly the same planes
+ */
+split_row_fn select_split_row(int use_simd) {
+	if (!use_simd) {
+		return split_row;
+	}
+
+#if defined(DEFOG_X86_KERNELS)
+	if (__builtin_cpu_supports("sse4.1")) {
+		return split_row_sse41;
+	}
+#elif defined(DEFOG_NEON_KERNELS)
+	return split_row_neon;
+#endif
+
+	return split_row;
+}
+
+/* Picks the fastest kernel for finding the dark channel keys of each pixel of a planar image that
+ * the CPU supports
+ *
+ * use_simd - Whether SIMD kernels may be used at all
+ *
+ * Returns the kernel; every kernel gives exactly the same keys as dark_keys_row()
+ */
+dark_keys_planar_fn select_dark_keys_planar(int use_simd) {
+	if (!use_simd) {
+		return dark_keys_planar;
+	}
+
+#if defined(DEFOG_X86_KERNELS)
+	if (__builtin_cpu_supports("avx2")) {
+		return dark_keys_planar_avx2;
+	}
+	if (__builtin_cpu_supports("sse4.1")) {
+		return dark_keys_planar_sse41;
+	}
+#elif defined(DEFOG_NEON_KERNELS)
+	return dark_keys_planar_neon;
+#endif
+
+	return dark_keys_planar;
+}
+
+/* Picks the fastest recovery kernel for planar images that the CPU supports
+ *
+ * use_simd - Whether SIMD kernels may be used at all
+ *
+ * Returns the kernel, which gives exactly the same output as the kernel that select_recover_row()
+ * picks for interleaved images
+ */
+recover_planar_fn select_recover_planar(int use_simd) {
+	if (!use_simd) {
+		return recover_planar_lut;
+	}
+
+#if defined(DEFOG_X86_KERNELS)
+	if (__builtin_cpu_supports("avx2")) {
+		return recover_planar_avx2;
+	}
+	if (__builtin_cpu_supports("sse4.1")) {
+		return recover_planar_sse41;
+	}
+#elif defined(DEFOG_NEON_KERNELS)
+	return recover_planar_neon;
+#endif
+
+	return recover_planar_lut;
+}
+
+// The kernels for each depth that images can be defogged at
+static const depth_kernels_t depth_kernels[] = {
+	{IPL_DEPTH_8U, NULL, recover_row_field, recover_row_refined_field},
+	{IPL_DEPTH_16U, quantize_row_u16, recover_row_field_u16, recover_row_refined_field_u16},
+	{IPL_DEPTH_32F, quantize_row_f32, recover_row_field_f32, recover_row_refined_field_f32}
+};
+
+/* Looks up the kernels for images of a depth
+ *
+ * depth - The IPL depth of the images
+ *
+ * Returns the kernels, or NULL if images of that depth can't be defogged
+ */
+const depth_kernels_t *select_depth_kernels(int depth) {
+	for (size_t i = 0; i < sizeof(depth_kernels) / sizeof(depth_kernels[0]); i++) {
+		if (depth_kernels[i].depth == depth) {
+			return &depth_kernels[i];
+		}
+	}
+
+	return NULL;
+}
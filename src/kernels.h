@@ -0,0 +1,289 @@
+/* Copyright 2014-2015 David Pearson.
+ * All rights reserved.
+ *
+ * Per-pixel kernels shared by the defogging pipeline. These work directly on the rows of 8-bit
+ * images, or on the planes that they are split into, apart from the recovery kernels for other
+ * depths, and are internal to the library.
+ */
+
+#ifndef DEFOG_KERNELS_H
+#define DEFOG_KERNELS_H
+
+#include <stdint.h>
+
+#include <cv.h>
+
+// Color channel definitions for convenience
+typedef enum {
+	BLUE,
+	GREEN,
+	RED
+} channel_t;
+
+// Dark channel keys pack a channel value and its channel index as (value << 2) | index, so that
+// comparing keys orders pixels by value first and then by channel index, just like pixel_min()
+#define DARK_KEY(val, channel) ((uint16_t)(((val) << 2) | (channel)))
+#define DARK_KEY_CHANNEL(key) ((channel_t)((key) & 3))
+#define DARK_KEY_MAX UINT16_MAX
+
+// The default lowest transmission used when recovering the output, which keeps dense haze from
+// being amplified into noise; the value was derived by attempting to maximize the evaluation
+// metric, and can be changed with the transmission_floor parameter
+#define TRANSMISSION_FLOOR 0.54
+
+// How far the dark channel window of a given width reaches before and after each pixel along one
+// axis: odd widths are centered on the pixel, and even widths reach one pixel further back, so
+// the default width of 20 covers [x - 10, x + 10)
+#define WINDOW_BEFORE(width) ((width) / 2)
+#define WINDOW_AFTER(width) (((width) - 1) / 2)
+
+// One in the Q16 fixed point format used by recover_row_fixed()
+#define FIXED_ONE (1 << 16)
+
+// Raw access to the rows of an 8-bit image, which avoids the bounds checks and conversions to
+// CvScalar done by cvGet2D() and cvSet2D()
+#define PIXEL_ROW(img, y) ((uint8_t *)((img)->imageData + (size_t)(y) * (img)->widthStep))
+
+// The address of a pixel in an image of any depth, whose low bits are its number of bits per channel
+#define PIXEL_AT(img, y, x) (PIXEL_ROW(img, y) + (size_t)(x) * (img)->nChannels * (((img)->depth & 0xff) / 8))
+
+// Images deeper than 8 bits are estimated from an 8-bit copy, which holds 16-bit values divided by
+// 257 and floating point values (nominally in [0, 1]) multiplied by 255, so the atmospheric light
+// is always at the 8-bit scale; these take it back to each depth's own scale
+#define DEPTH_SCALE_16U 257.0f
+#define DEPTH_SCALE_32F (1.0f / 255.0f)
+
+// A bin in the histogram of dark channel values used when estimating the atmospheric light, which
+// tracks the brightest (grayscale) pixel that has fallen into it, and that pixel's color
+typedef struct {
+	int count;
+	int max_intensity;
+	uint8_t color[3];
+} light_bin_t;
+
+// Once the atmospheric light is known, the transmission of a pixel only depends on its 8-bit value
+// in the dark channel, and each output value only depends on that and the 8-bit input value, so
+// every possible result fits in a table; see build_recovery_lut()
+typedef struct {
+	// The atmospheric light of each channel (in BGR order) that the table was built for; only the
+	// first is used for the table, since it is only used when they are all the same
+	double light[3];
+
+	// The lowest transmission that the table was built for
+	double floor;
+
+	// The 8-bit transmission for each dark channel value
+	uint8_t map[UINT8_MAX + 1];
+
+	// The output value for each dark channel value and then each input value
+	uint8_t out[UINT8_MAX + 1][UINT8_MAX + 1];
+
+	// The same recovery in fixed point, for recover_row_fixed(): the reciprocal of the light in
+	// Q16, the light itself in Q4, and the reciprocal of the floored transmission for each dark
+	// channel value in Q16; see build_fixed_recovery()
+	int32_t light_recip;
+	int32_t light_q4;
+	int32_t inv_t[UINT8_MAX + 1];
+} recovery_lut_t;
+
+/* Estimates the transmission and recovers the output for a row of pixels
+ *
+ * img_row - The row of the original 8-bit BGR image
+ * dark_row - The dark channel keys for the window around each pixel in the row
+ * map_row - Where the 8-bit transmission of each pixel is written, or NULL
+ * out_row - Where the 8-bit BGR output is written
+ * width - The number of pixels in the row
+ * lut - The recovery table for the atmospheric light, which kernels that don't use the table
+ *       only take the light from; only recover_row() supports a different light for each channel
+ */
+typedef void (*recover_row_fn)(const uint8_t *img_row, const uint16_t *dark_row, uint8_t *map_row, uint8_t *out_row, int width, const recovery_lut_t *lut);
+
+/* Recovers the output for a row of pixels from a transmission map that has already been estimated
+ *
+ * img_row - The row of the original 8-bit BGR image
+ * t_row - The transmission of each pixel
+ * map_row - Where the 8-bit transmission of each pixel is written, or NULL
+ * out_row - Where the 8-bit BGR output is written
+ * width - The number of pixels in the row
+ * light - The atmospheric light of each channel, in BGR order; only recover_row_refined() supports
+ *         a different light for each channel
+ * min_t - The lowest transmission that the output is recovered with
+ */
+typedef void (*recover_refined_fn)(const uint8_t *img_row, const float *t_row, uint8_t *map_row, uint8_t *out_row, int width, const double *light, double min_t);
+
+/* Estimates the transmission and recovers the output for a row of pixels whose atmospheric light
+ * varies from pixel to pixel; there's one of these for each depth
+ *
+ * img_row - The row of the original BGR image, at the kernel's depth
+ * dark_row - The dark channel keys for the window around each pixel in the row, from the image's
+ *            8-bit copy
+ * map_row - Where the 8-bit transmission of each pixel is written, or NULL
+ * out_row - Where the BGR output is written, at the kernel's depth
+ * width - The number of pixels in the row
+ * light_row - The atmospheric light of each channel of each pixel, in BGR order, at the 8-bit scale
+ * min_t - The lowest transmission that the output is recovered with
+ */
+typedef void (*recover_field_fn)(const void *img_row, const uint16_t *dark_row, uint8_t *map_row, void *out_row, int width, const float *light_row, double min_t);
+
+/* Recovers the output for a row of pixels whose atmospheric light varies from pixel to pixel from
+ * a transmission map that has already been estimated; there's one of these for each depth
+ *
+ * t_row - The transmission of each pixel
+ *
+ * See recover_field_fn for the other parameters
+ */
+typedef void (*recover_refined_field_fn)(const void *img_row, const float *t_row, uint8_t *map_row, void *out_row, int width, const float *light_row, double min_t);
+
+/* Converts a row of channel values that are deeper than 8 bits to the 8-bit scale
+ *
+ * src_row - The values
+ * dst_row - Where the 8-bit values are written
+ * len - The number of values, which is three for each BGR pixel
+ */
+typedef void (*quantize_row_fn)(const void *src_row, uint8_t *dst_row, int len);
+
+// The kernels that handle images of one depth
+typedef struct {
+	// The IPL depth of the images
+	int depth;
+
+	// Converts the image to the 8-bit copy that everything is estimated from, or NULL for 8-bit
+	// images, which are estimated from directly
+	quantize_row_fn quantize;
+
+	// Recover the output at the image's own depth
+	recover_field_fn recover_field;
+	recover_refined_field_fn recover_refined_field;
+} depth_kernels_t;
+
+/* Finds the darkest channel of every pixel in a row, as dark channel keys
+ *
+ * img_row - The row of the 8-bit BGR image
+ * keys - Where the key of each pixel is written
+ * width - The number of pixels in the row
+ */
+typedef void (*dark_keys_fn)(const uint8_t *img_row, uint16_t *keys, int width);
+
+/* Splits a row of interleaved BGR pixels into planes. A planar image keeps each channel in a plane
+ * of its own, one after the other, so that the green row of a pixel is plane_size bytes after its
+ * blue row and the red row is as far again
+ *
+ * img_row - The row of the 8-bit BGR image
+ * plane_row - Where the row of the blue plane is written, followed by the others
+ * plane_size - The distance between the planes
+ * width - The number of pixels in the row
+ */
+typedef void (*split_row_fn)(const uint8_t *img_row, uint8_t *plane_row, size_t plane_size, int width);
+
+/* Finds the darkest channel of every pixel in a row of a planar image, as dark channel keys
+ *
+ * plane_row - The row of the blue plane, which the other planes follow
+ * plane_size - The distance between the planes
+ * keys - Where the key of each pixel is written
+ * width - The number of pixels in the row
+ */
+typedef void (*dark_keys_planar_fn)(const uint8_t *plane_row, size_t plane_size, uint16_t *keys, int width);
+
+/* Estimates the transmission and recovers the output for a row of a planar image, which is
+ * interleaved again as it's written
+ *
+ * plane_row - The row of the blue plane, which the other planes follow
+ * plane_size - The distance between the planes
+ *
+ * See recover_row_fn for the other parameters
+ */
+typedef void (*recover_planar_fn)(const uint8_t *plane_row, size_t plane_size, const uint16_t *dark_row, uint8_t *map_row,
+	uint8_t *out_row, int width, const recovery_lut_t *lut);
+
+/* Rounds a value and clamps it to the range of an 8-bit channel, the same way cvSet2D() does
+ *
+ * val - The value to convert
+ *
+ * Returns the saturated 8-bit value
+ */
+static inline uint8_t saturate_u8(double val) {
+	int rounded = cvRound(val);
+	return rounded < 0 ? 0 : rounded > UINT8_MAX ? UINT8_MAX : (uint8_t)rounded;
+}
+
+/* Rounds a value and clamps it to the range of a 16-bit channel
+ *
+ * val - The value to convert
+ *
+ * Returns the saturated 16-bit value
+ */
+static inline uint16_t saturate_u16(double val) {
+	int rounded = cvRound(val);
+	return rounded < 0 ? 0 : rounded > UINT16_MAX ? UINT16_MAX : (uint16_t)rounded;
+}
+
+/* Clamps a value to be a valid floating point channel, which has no upper bound, so that
+ * highlights brighter than 1 are kept
+ *
+ * val - The value to convert
+ *
+ * Returns the value, or 0 if it's negative or NaN
+ */
+static inline float saturate_f32(double val) {
+	return val > 0.0 ? (float)val : 0.0f;
+}
+
+/* Converts a BGR pixel to grayscale with the same fixed-point weights as
+ * cvCvtColor(..., CV_RGB2GRAY), which is how the grayscale image has always been made (so the
+ * first channel is weighted as red)
+ *
+ * pixel - The channel values of the pixel
+ *
+ * Returns the 8-bit intensity
+ */
+static inline uint8_t gray_value(const uint8_t *pixel) {
+	return (uint8_t)((pixel[0] * 4899 + pixel[1] * 9617 + pixel[2] * 1868 + (1 << 13)) >> 14);
+}
+
+/* Rounds a fixed point value to an integer and clamps it to the range of an 8-bit channel
+ *
+ * val - The value to convert
+ * shift - The number of fractional bits in val, which must be >= 1
+ *
+ * Returns the saturated 8-bit value
+ */
+static inline uint8_t fixed_to_u8(int32_t val, int shift) {
+	if (val < 0) {
+		return 0;
+	}
+	int32_t rounded = (val + (1 << (shift - 1))) >> shift;
+	return rounded > UINT8_MAX ? UINT8_MAX : (uint8_t)rounded;
+}
+
+// Function definitions
+double light_from_bins(const light_bin_t *bins, int num_pixels, uint8_t *color);
+void dark_keys_row(const uint8_t *img_row, uint16_t *keys, int width);
+dark_keys_fn select_dark_keys(int use_simd);
+void split_row(const uint8_t *img_row, uint8_t *plane_row, size_t plane_size, int width);
+split_row_fn select_split_row(int use_simd);
+void dark_keys_planar(const uint8_t *plane_row, size_t plane_size, uint16_t *keys, int width);
+dark_keys_planar_fn select_dark_keys_planar(int use_simd);
+void recover_planar_lut(const uint8_t *plane_row, size_t plane_size, const uint16_t *dark_row, uint8_t *map_row,
+	uint8_t *out_row, int width, const recovery_lut_t *lut);
+recover_planar_fn select_recover_planar(int use_simd);
+void recover_row(const uint8_t *img_row, const uint16_t *dark_row, uint8_t *map_row, uint8_t *out_row, int width, const recovery_lut_t *lut);
+void build_recovery_lut(recovery_lut_t *lut, const double *light, double min_t);
+void recover_row_lut(const uint8_t *img_row, const uint16_t *dark_row, uint8_t *map_row, uint8_t *out_row, int width, const recovery_lut_t *lut);
+void build_fixed_recovery(recovery_lut_t *lut, const double *light, double min_t);
+void recover_row_fixed(const uint8_t *img_row, const uint16_t *dark_row, uint8_t *map_row, uint8_t *out_row, int width, const recovery_lut_t *lut);
+recover_row_fn select_recover_row(int use_simd);
+void estimate_transmission_row(const uint8_t *img_row, const uint16_t *dark_row, float *t_row, float *guide_row, int width, const double *light);
+void recover_row_field(const void *img_row, const uint16_t *dark_row, uint8_t *map_row, void *out_row, int width, const float *light_row, double min_t);
+void recover_row_refined_field(const void *img_row, const float *t_row, uint8_t *map_row, void *out_row, int width, const float *light_row, double min_t);
+void recover_row_field_u16(const void *img_row, const uint16_t *dark_row, uint8_t *map_row, void *out_row, int width, const float *light_row, double min_t);
+void recover_row_refined_field_u16(const void *img_row, const float *t_row, uint8_t *map_row, void *out_row, int width, const float *light_row, double min_t);
+void recover_row_field_f32(const void *img_row, const uint16_t *dark_row, uint8_t *map_row, void *out_row, int width, const float *light_row, double min_t);
+void recover_row_refined_field_f32(const void *img_row, const float *t_row, uint8_t *map_row, void *out_row, int width, const float *light_row, double min_t);
+void estimate_transmission_row_field(const uint8_t *img_row, const uint16_t *dark_row, float *t_row, float *guide_row, int width, const float *light_row);
+void quantize_row_u16(const void *src_row, uint8_t *dst_row, int len);
+void quantize_row_f32(const void *src_row, uint8_t *dst_row, int len);
+void recover_row_refined(const uint8_t *img_row, const float *t_row, uint8_t *map_row, uint8_t *out_row, int width, const double *light, double min_t);
+recover_refined_fn select_recover_row_refined(int use_simd);
+const depth_kernels_t *select_depth_kernels(int depth);
+
+#endif
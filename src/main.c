@@ -0,0 +1,831 @@
+/* Copyright 2014-2015 David Pearson.
+ * All rights reserved.
+ *
+ * Compilation: gcc -o defog src/defog.c src/kernels.c src/gpu.c src/arena.c src/bench.c src/verify.c src/tiled.c src/batch.c src/raw.c src/server.c src/telemetry.c src/main.c `pkg-config --libs --cflags opencv` -std=c99 -lm -pthread
+ *              (add -DDEFOG_OPENCL -lOpenCL for the GPU backend)
+ * Usage: ./defog [OPTIONS] RGB_IMAGE_FILE...
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cv.h>
+#include <highgui.h>
+
+#include "batch.h"
+#include "bench.h"
+#include "defog.h"
+#include "raw.h"
+#include "server.h"
+#include "telemetry.h"
+#include "tiled.h"
+#include "verify.h"
+
+// The metrics that can be printed for each image before and after it is defogged
+typedef enum {
+	METRIC_NONE,
+	METRIC_SHARPNESS,
+	METRIC_DFT
+} metric_t;
+
+// Command line options that control how images are processed and where the results go
+typedef struct {
+	defog_params_t params;
+	int headless;
+	int video;
+	int tiled;
+	int tile_size;
+	int raw;
+	int raw_width;
+	int raw_height;
+	int batch;
+	batch_opts_t batch_opts;
+	server_opts_t server_opts;
+	metric_t metric;
+	int bench;
+	int bench_runs;
+	int verify;
+	verify_opts_t verify_opts;
+	const char *out_pattern;
+	const char *float_out_pattern;
+	const char *map_pattern;
+	FILE *telemetry;
+} options_t;
+
+// Function definitions
+int build_output_path(char *dst, size_t len, const char *pattern, const char *input);
+int format_holds_depth(const char *path, int depth);
+int build_output_paths(const options_t *opts, const char *input, int depth, char *out_path, char *map_path);
+int build_batch_paths(const char *input, int depth, char *out_path, char *map_path, void *arg);
+void print_metric(defog_ctx_t *ctx, const char *filename, const char *which, IplImage *img, metric_t metric);
+int defog_file(defog_ctx_t *ctx, const char *filename, const options_t *opts);
+int defog_video(defog_ctx_t *ctx, const char *source, const options_t *opts);
+int defog_tiled_file(defog_ctx_t *ctx, const char *filename, const options_t *opts);
+int defog_raw_file(defog_ctx_t *ctx, const char *source, const options_t *opts);
+void close_telemetry(const options_t *opts);
+void print_usage(const char *name);
+
+/* Builds the path that an output image for an input file is written to
+ *
+ * dst - The buffer to write the path to
+ * len - The size of dst
+ * pattern - The output path, in which every "%s" is replaced by the name of the input file
+ *           without its directory or extension
+ * input - The path of the input file
+ *
+ * Returns 0 on success or -1 if the path doesn't fit in dst
+ */
+int build_output_path(char *dst, size_t len, const char *pattern, const char *input) {
+	// Strip the directory and the extension from the input path
+	const char *name = strrchr(input, '/') != NULL ? strrchr(input, '/') + 1 : input;
+	const char *ext = strrchr(name, '.');
+	size_t name_len = ext != NULL && ext != name ? (size_t)(ext - name) : strlen(name);
+
+	// Then copy the pattern, expanding the name wherever it appears
+	size_t used = 0;
+	for (const char *c = pattern; *c != '\0'; c++) {
+		const char *src = c;
+		size_t src_len = 1;
+		if (c[0] == '%' && c[1] == 's') {
+			src = name;
+			src_len = name_len;
+			c++;
+		}
+
+		if (used + src_len >= len) {
+			return -1;
+		}
+		memcpy(dst + used, src, src_len);
+		used += src_len;
+	}
+	dst[used] = '\0';
+
+	return 0;
+}
+
+/* Decides whether the format that an image is written in, going by the extension of its path, can
+ * hold the depth of the image; OpenCV converts anything else to 8 bits without scaling it, which
+ * leaves floating point images (in [0, 1]) all but black
+ *
+ * path - The path of the image
+ * depth - The depth of the image
+ *
+ * Returns 1 if the format holds the depth or 0 if not
+ */
+int format_holds_depth(const char *path, int depth) {
+	if (depth == IPL_DEPTH_8U) {
+		return 1;
+	}
+
+	// Compare the extension without regard to case
+	const char *name = strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 : path;
+	const char *dot = strrchr(name, '.');
+	char ext[8];
+	size_t len = dot != NULL ? strlen(dot + 1) : 0;
+	if (len == 0 || len >= sizeof(ext)) {
+		return 0;
+	}
+	for (size_t i = 0; i <= len; i++) {
+		ext[i] = (char)tolower((unsigned char)dot[1 + i]);
+	}
+
+	static const char *const deep_exts[] = {"png", "tif", "tiff", "pgm", "ppm", "pnm", "jp2", NULL};
+	static const char *const float_exts[] = {"exr", "pfm", NULL};
+	const char *const *exts = depth == IPL_DEPTH_16U ? deep_exts : depth == IPL_DEPTH_32F ? float_exts : NULL;
+	for (int i = 0; exts != NULL && exts[i] != NULL; i++) {
+		if (strcmp(ext, exts[i]) == 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Builds the paths that the output image and transmission map for an input are written to
+ *
+ * opts - The command line options
+ * input - The path of the input file
+ * depth - The depth of the input image, which the output has too; floating point images go to the
+ *         default floating point path if no output path was given
+ * out_path - A buffer of FILENAME_MAX characters for the path of the output image
+ * map_path - A buffer of FILENAME_MAX characters for the path of the transmission map, which is
+ *            left untouched if the map isn't being written
+ *
+ * Returns 0 on success or 1 if a path is too long or its format can't hold the output's depth
+ */
+int build_output_paths(const options_t *opts, const char *input, int depth, char *out_path, char *map_path) {
+	const char *out_pattern = depth == IPL_DEPTH_32F && opts->float_out_pattern != NULL ? opts->float_out_pattern :
+		opts->out_pattern;
+	if (build_output_path(out_path, FILENAME_MAX, out_pattern, input) != 0 ||
+			(opts->map_pattern != NULL && build_output_path(map_path, FILENAME_MAX, opts->map_pattern, input) != 0)) {
+		fprintf(stderr, "Output path for %s is too long\n", input);
+		return 1;
+	}
+
+	// Maps are always 8-bit, so only the output has to be checked
+	if (!format_holds_depth(out_path, depth)) {
+		fprintf(stderr, "%s can't hold the %s output of %s; write it as .png or .tiff (16-bit) or .exr (floating point)\n",
+			out_path, depth == IPL_DEPTH_32F ? "floating point" : "16-bit", input);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Builds the output paths of an image in a batch, see batch_paths_fn
+ *
+ * input - The path of the input image
+ * depth - The depth of the input image
+ * out_path - The buffer of FILENAME_MAX bytes to write the output path to
+ * map_path - The buffer of FILENAME_MAX bytes to write the transmission map path to
+ * arg - The command line options
+ *
+ * Returns 0 on success or 1 if a path is too long or can't hold the output
+ */
+int build_batch_paths(const char *input, int depth, char *out_path, char *map_path, void *arg) {
+	return build_output_paths((const options_t *)arg, input, depth, out_path, map_path);
+}
+
+/* Prints the evaluation metric for an image, if one was requested
+ *
+ * ctx - The defogging context, whose buffers the metric borrows
+ * filename - The path of the image, which prefixes the output
+ * which - Which image this is, either "original" or "defogged"
+ * img - The BGR image to evaluate; the metrics are only meaningful for 8-bit images
+ * metric - The metric to print
+ */
+void print_metric(defog_ctx_t *ctx, const char *filename, const char *which, IplImage *img, metric_t metric) {
+	if (metric != METRIC_NONE && img->depth != IPL_DEPTH_8U) {
+		printf("%s: the %s image isn't 8-bit, so it isn't evaluated\n", filename, which);
+	} else if (metric == METRIC_SHARPNESS) {
+		printf("%s: sharpness (Laplacian variance) of the %s image: %.2f\n", filename, which, defog_sharpness(ctx, img));
+	} else if (metric == METRIC_DFT) {
+		printf("%s: number of high-frequency pixels in the %s image: %d\n", filename, which, defog_evaluate(ctx, img));
+	}
+}
+
+/* Defogs a single image file, writing the transmission map and the output image to disk
+ *
+ * ctx - The defogging context, which is shared by all images
+ * filename - The path of the color image to defog
+ * opts - The command line options
+ *
+ * Returns 0 on success or 1 if the image couldn't be read, defogged, or written
+ */
+int defog_file(defog_ctx_t *ctx, const char *filename, const options_t *opts) {
+	// Read in the image to defog, keeping 16-bit and floating point images (such as TIFFs and EXRs)
+	// at their own depth, so that the output doesn't lose any of their range
+	telemetry_io_t io = {0.0, 0.0, 0.0, 0.0};
+	double start = telemetry_time();
+	IplImage *img = (IplImage *)cvLoadImage(filename, CV_LOAD_IMAGE_COLOR | CV_LOAD_IMAGE_ANYDEPTH);
+	io.decode_time = telemetry_time() - start;
+	if (img == NULL) {
+		fprintf(stderr, "Could not read image %s\n", filename);
+		return 1;
+	}
+
+	// Work out where the results go, which depends on the depth of the image, before doing anything
+	// expensive
+	char out_path[FILENAME_MAX];
+	char map_path[FILENAME_MAX];
+	if (build_output_paths(opts, filename, img->depth, out_path, map_path) != 0) {
+		cvReleaseImage(&img);
+		return 1;
+	}
+
+	// Evaluate the original image
+	start = telemetry_time();
+	print_metric(ctx, filename, "original", img, opts->metric);
+	io.evaluate_time = telemetry_time() - start;
+
+	// Display the original image
+	if (!opts->headless) {
+		cvShowImage("disp", img);
+		cvWaitKey(0);
+	}
+
+	// Create empty images for the transmission map (if it's needed, which is always 8-bit) and the
+	// output (defogged) image
+	CvSize size = cvGetSize(img);
+	int need_map = opts->map_pattern != NULL || !opts->headless;
+	IplImage *map = need_map ? cvCreateImage(size, IPL_DEPTH_8U, 1) : NULL;
+	IplImage *out = cvCreateImage(size, img->depth, img->nChannels);
+
+	// Then defog the image
+	defog_stats_t stats;
+	if (defog_process(ctx, img, out, map) != 0) {
+		fprintf(stderr, "Could not defog image %s\n", filename);
+		if (opts->telemetry != NULL) {
+			telemetry_write_json(opts->telemetry, filename, -1, size.width, size.height, 1, NULL, &io);
+		}
+		cvReleaseImage(&img);
+		if (map != NULL) {
+			cvReleaseImage(&map);
+		}
+		cvReleaseImage(&out);
+		return 1;
+	}
+
+	defog_get_stats(ctx, &stats);
+
+	// Save and show the map image
+	int failed = 0;
+	start = telemetry_time();
+	if (opts->map_pattern != NULL && !cvSaveImage(map_path, map, 0)) {
+		fprintf(stderr, "Could not write image %s\n", map_path);
+		failed = 1;
+	}
+	io.encode_time = telemetry_time() - start;
+	if (!opts->headless) {
+		cvShowImage("disp", map);
+		cvWaitKey(0);
+	}
+
+	// Evaluate the output image
+	start = telemetry_time();
+	print_metric(ctx, filename, "defogged", out, opts->metric);
+	io.evaluate_time += telemetry_time() - start;
+
+	// Then save and show the output image
+	start = telemetry_time();
+	if (!cvSaveImage(out_path, out, 0)) {
+		fprintf(stderr, "Could not write image %s\n", out_path);
+		failed = 1;
+	}
+	io.encode_time += telemetry_time() - start;
+	if (opts->telemetry != NULL) {
+		telemetry_write_json(opts->telemetry, filename, -1, size.width, size.height, 0, &stats, &io);
+	}
+	if (!opts->headless) {
+		cvShowImage("disp", out);
+		cvWaitKey(0);
+	}
+
+	// Release all images
+	cvReleaseImage(&img);
+	if (map != NULL) {
+		cvReleaseImage(&map);
+	}
+	cvReleaseImage(&out);
+
+	return failed;
+}
+
+/* Defogs every frame of a video or camera stream, writing the transmission map and the output to
+ * video files
+ *
+ * ctx - The defogging context, which is shared by all videos
+ * source - The path of the video to defog, or "camera:N" for the Nth camera
+ * opts - The command line options
+ *
+ * Returns 0 on success or 1 if the video couldn't be read, defogged, or written
+ */
+int defog_video(defog_ctx_t *ctx, const char *source, const options_t *opts) {
+	// Work out where the results go before doing anything expensive
+	char out_path[FILENAME_MAX];
+	char map_path[FILENAME_MAX];
+	if (build_output_paths(opts, source, IPL_DEPTH_8U, out_path, map_path) != 0) {
+		return 1;
+	}
+
+	// Open the video or camera
+	CvCapture *capture = strncmp(source, "camera:", 7) == 0 ?
+		cvCreateCameraCapture(atoi(source + 7)) : cvCreateFileCapture(source);
+	if (capture == NULL) {
+		fprintf(stderr, "Could not open video %s\n", source);
+		return 1;
+	}
+
+	// Cameras don't always report a frame rate, so fall back on something sensible
+	double fps = cvGetCaptureProperty(capture, CV_CAP_PROP_FPS);
+	if (fps <= 0.0) {
+		fps = 25.0;
+	}
+
+	// Start a new video from scratch rather than carrying over the previous one's light
+	defog_reset_frames(ctx);
+
+	IplImage *map = NULL;
+	IplImage *out = NULL;
+	CvVideoWriter *map_writer = NULL;
+	CvVideoWriter *out_writer = NULL;
+	int failed = 0;
+	int frames = 0;
+
+	IplImage *frame;
+	telemetry_io_t io = {0.0, 0.0, 0.0, 0.0};
+	double start = telemetry_time();
+	while (!failed && (frame = cvQueryFrame(capture)) != NULL) {
+		io.decode_time = telemetry_time() - start;
+
+		// The output images and writers can only be set up once the frame size is known
+		CvSize size = cvGetSize(frame);
+		if (out == NULL) {
+			out = cvCreateImage(size, IPL_DEPTH_8U, 3);
+			out_writer = cvCreateVideoWriter(out_path, CV_FOURCC('M', 'J', 'P', 'G'), fps, size, 1);
+			if (opts->map_pattern != NULL || !opts->headless) {
+				map = cvCreateImage(size, IPL_DEPTH_8U, 1);
+			}
+			if (opts->map_pattern != NULL) {
+				map_writer = cvCreateVideoWriter(map_path, CV_FOURCC('M', 'J', 'P', 'G'), fps, size, 0);
+			}
+			if (out_writer == NULL || (opts->map_pattern != NULL && map_writer == NULL)) {
+				fprintf(stderr, "Could not write video %s\n", out_writer == NULL ? out_path : map_path);
+				failed = 1;
+				break;
+			}
+		}
+
+		// Defog the frame, reusing the atmospheric light from earlier frames where possible
+		if (defog_process_frame(ctx, frame, out, map) != 0) {
+			fprintf(stderr, "Could not defog frame %d of %s\n", frames, source);
+			if (opts->telemetry != NULL) {
+				telemetry_write_json(opts->telemetry, source, frames, size.width, size.height, 1, NULL, &io);
+			}
+			failed = 1;
+			break;
+		}
+
+		// Then write out the results
+		start = telemetry_time();
+		cvWriteFrame(out_writer, out);
+		if (map_writer != NULL) {
+			cvWriteFrame(map_writer, map);
+		}
+		io.encode_time = telemetry_time() - start;
+		if (opts->telemetry != NULL) {
+			defog_stats_t stats;
+			defog_get_stats(ctx, &stats);
+			telemetry_write_json(opts->telemetry, source, frames, size.width, size.height, 0, &stats, &io);
+		}
+		frames++;
+
+		// Show the output as it goes, stopping early if a key is pressed
+		if (!opts->headless) {
+			cvShowImage("disp", out);
+			if (cvWaitKey(1) >= 0) {
+				break;
+			}
+		}
+		start = telemetry_time();
+	}
+
+	printf("%s: defogged %d frames\n", source, frames);
+
+	// Clean up
+	if (out_writer != NULL) {
+		cvReleaseVideoWriter(&out_writer);
+	}
+	if (map_writer != NULL) {
+		cvReleaseVideoWriter(&map_writer);
+	}
+	if (out != NULL) {
+		cvReleaseImage(&out);
+	}
+	if (map != NULL) {
+		cvReleaseImage(&map);
+	}
+	cvReleaseCapture(&capture);
+
+	return failed;
+}
+
+/* Defogs an image that is too large to hold in memory a tile at a time, reading and writing
+ * binary PPM files in place
+ *
+ * ctx - The defogging context, which is shared by all images
+ * filename - The path of the binary PPM image to defog
+ * opts - The command line options
+ *
+ * Returns 0 on success or 1 if the image couldn't be read, defogged, or written
+ */
+int defog_tiled_file(defog_ctx_t *ctx, const char *filename, const options_t *opts) {
+	char out_path[FILENAME_MAX];
+	char map_path[FILENAME_MAX];
+	if (build_output_paths(opts, filename, IPL_DEPTH_8U, out_path, map_path) != 0) {
+		return 1;
+	}
+
+	int num_tiles;
+	if (defog_tiled(ctx, &opts->params, opts->tile_size, filename, out_path, opts->map_pattern != NULL ? map_path : NULL,
+			&num_tiles) != 0) {
+		return 1;
+	}
+	printf("%s: defogged in %d tiles\n", filename, num_tiles);
+
+	return 0;
+}
+
+/* Defogs the raw BGR frames in a file or shared memory object, which are mapped into memory
+ * rather than read, as are the outputs
+ *
+ * ctx - The defogging context, which is shared by all inputs
+ * source - The path of the raw frames, or "shm:NAME" for a shared memory object
+ * opts - The command line options
+ *
+ * Returns 0 on success or 1 if the frames couldn't be read, defogged, or written
+ */
+int defog_raw_file(defog_ctx_t *ctx, const char *source, const options_t *opts) {
+	char out_path[FILENAME_MAX];
+	char map_path[FILENAME_MAX];
+	if (build_output_paths(opts, source, IPL_DEPTH_8U, out_path, map_path) != 0) {
+		return 1;
+	}
+
+	return defog_raw(ctx, opts->raw_width, opts->raw_height, source, out_path, opts->map_pattern != NULL ? map_path : NULL,
+		opts->telemetry);
+}
+
+/* Closes the telemetry file, if there is one and it's not stdout
+ *
+ * opts - The options for defogging
+ */
+void close_telemetry(const options_t *opts) {
+	if (opts->telemetry != NULL && opts->telemetry != stdout) {
+		fclose(opts->telemetry);
+	}
+}
+
+/* Prints the command line usage
+ *
+ * name - The name that the program was run as
+ */
+void print_usage(const char *name) {
+	fprintf(stderr, "Usage: %s [OPTIONS] RGB_IMAGE_FILE...\n", name);
+	fprintf(stderr, "       %s --video [OPTIONS] VIDEO_FILE|camera:N...\n", name);
+	fprintf(stderr, "       %s --batch [OPTIONS] RGB_IMAGE_FILE|DIRECTORY...\n", name);
+	fprintf(stderr, "       %s --raw WIDTHxHEIGHT [OPTIONS] BGR_FRAMES_FILE|shm:NAME...\n", name);
+	fprintf(stderr, "       %s --serve SOCKET_PATH|- [OPTIONS]\n", name);
+	fprintf(stderr, "       %s --bench [OPTIONS] [RGB_IMAGE_FILE...]\n", name);
+	fprintf(stderr, "       %s --verify [OPTIONS] [RGB_IMAGE_FILE...]\n", name);
+	fprintf(stderr, "  --threads N           Number of threads to use (default 1)\n");
+	fprintf(stderr, "  --window N            Width of the dark channel window (default 20)\n");
+	fprintf(stderr, "  --window-height N     Height of the dark channel window (default square)\n");
+	fprintf(stderr, "  --radius R            Use a square window of 2R + 1 pixels centered on each pixel\n");
+	fprintf(stderr, "  --floor F             Lowest transmission used to recover the output (default 0.54)\n");
+	fprintf(stderr, "  --refine R            Refine the transmission map with a guided filter of radius R\n");
+	fprintf(stderr, "  --refine-eps E        Regularization of the guided filter (default 0.001)\n");
+	fprintf(stderr, "  --pyramid N           Estimate the transmission at 1/4^N of the pixels (N up to 2)\n");
+	fprintf(stderr, "  --no-simd             Only use the exact scalar kernels\n");
+	fprintf(stderr, "  --fixed-point         Estimate the transmission with integer arithmetic only\n");
+	fprintf(stderr, "  --planar              Split images into a plane per channel before defogging them\n");
+	fprintf(stderr, "  --gpu                 Defog on a GPU with OpenCL, if one is available\n");
+	fprintf(stderr, "  --headless            Don't display any windows\n");
+	fprintf(stderr, "  --out PATH            Where to write the defogged image (default out.png, or out.exr if floating point)\n");
+	fprintf(stderr, "  --map PATH            Where to write the transmission map (default map.png)\n");
+	fprintf(stderr, "  --no-map              Don't write the transmission map\n");
+	fprintf(stderr, "  --metric NAME         Evaluate each image with none (default), sharpness, or dft\n");
+	fprintf(stderr, "  --video               Defog videos or camera streams instead of images\n");
+	fprintf(stderr, "  --light-step N        Estimate the atmospheric light from every Nth pixel (default 1)\n");
+	fprintf(stderr, "  --light-per-channel   Give each channel its own atmospheric light\n");
+	fprintf(stderr, "  --light-grid N        Estimate the atmospheric light on an N x N grid of tiles (N up to 16)\n");
+	fprintf(stderr, "  --light-interval N    Frames to reuse the atmospheric light for (default 30)\n");
+	fprintf(stderr, "  --light-smoothing F   Weight given to each new atmospheric light (default 0.2)\n");
+	fprintf(stderr, "  --tiled               Defog binary PPM images a tile at a time, without loading them\n");
+	fprintf(stderr, "  --tile N              Width and height of each tile in tiled mode (default 1024)\n");
+	fprintf(stderr, "  --raw WIDTHxHEIGHT    Defog packed BGR frames in mapped files or shared memory\n");
+	fprintf(stderr, "  --batch               Decode, defog, and write images on separate pools of threads\n");
+	fprintf(stderr, "  --workers N           Images defogged at once in batch or server mode (default cores / threads)\n");
+	fprintf(stderr, "  --io-threads N        Threads decoding and threads writing in batch mode (default 2)\n");
+	fprintf(stderr, "  --list FILE           Also defog the images listed in FILE in batch mode\n");
+	fprintf(stderr, "  --serve PATH          Defog images sent to a Unix socket, or over stdin and stdout for -\n");
+	fprintf(stderr, "  --telemetry PATH      Append a JSON line of timings and stats per image to PATH, or stdout for -\n");
+	fprintf(stderr, "  --metrics-port N      Serve Prometheus metrics at /metrics on TCP port N in server mode\n");
+	fprintf(stderr, "  --metrics-address A   IPv4 address to serve the metrics on (default 127.0.0.1)\n");
+	fprintf(stderr, "  --bench               Time each stage on synthetic images and any given images\n");
+	fprintf(stderr, "  --bench-runs N        Times to defog each image when benchmarking or verifying (default 5)\n");
+	fprintf(stderr, "  --verify              Check every fast path against the exact kernels, and fail if one diverges\n");
+	fprintf(stderr, "  --baseline FILE       Also fail verification if a fast path is much slower than in FILE\n");
+	fprintf(stderr, "  --save-baseline FILE  Write the throughput of each fast path to FILE when verifying\n");
+	fprintf(stderr, "In output paths, %%s is replaced by the input file's name without its extension;\n");
+	fprintf(stderr, "it is required when defogging more than one image.\n");
+}
+
+int main(int argc, const char * argv[]) {
+	// Parse the command line options
+	options_t opts = {
+		.headless = 0,
+		.video = 0,
+		.tiled = 0,
+		.tile_size = 1024,
+		.raw = 0,
+		.raw_width = 0,
+		.raw_height = 0,
+		.batch = 0,
+		.batch_opts = {
+			.decoders = 2,
+			.workers = 0,
+			.encoders = 2,
+			.queue_size = 0,
+			.list = NULL,
+			.telemetry = NULL
+		},
+		.server_opts = {
+			.socket_path = NULL,
+			.workers = 0,
+			.telemetry = NULL,
+			.metrics_port = 0,
+			.metrics_address = NULL
+		},
+		.metric = METRIC_NONE,
+		.bench = 0,
+		.bench_runs = 5,
+		.verify = 0,
+		.verify_opts = {
+			.runs = 5,
+			.baseline = NULL,
+			.save_baseline = NULL
+		},
+		.out_pattern = NULL,
+		.float_out_pattern = NULL,
+		.map_pattern = NULL,
+		.telemetry = NULL
+	};
+	defog_default_params(&opts.params);
+	int no_map = 0;
+	const char *telemetry_path = NULL;
+	int first_file = argc;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			opts.params.num_threads = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--window") == 0 && i + 1 < argc) {
+			opts.params.window = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--window-height") == 0 && i + 1 < argc) {
+			opts.params.window_height = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--radius") == 0 && i + 1 < argc) {
+			int radius = atoi(argv[++i]);
+			opts.params.window = opts.params.window_height = radius >= 0 ? 2 * radius + 1 : 0;
+		} else if (strcmp(argv[i], "--floor") == 0 && i + 1 < argc) {
+			opts.params.transmission_floor = atof(argv[++i]);
+		} else if (strcmp(argv[i], "--refine") == 0 && i + 1 < argc) {
+			opts.params.refine_radius = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--refine-eps") == 0 && i + 1 < argc) {
+			opts.params.refine_eps = atof(argv[++i]);
+		} else if (strcmp(argv[i], "--pyramid") == 0 && i + 1 < argc) {
+			opts.params.pyramid_levels = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--no-simd") == 0) {
+			opts.params.use_simd = 0;
+		} else if (strcmp(argv[i], "--fixed-point") == 0) {
+			opts.params.fixed_point = 1;
+		} else if (strcmp(argv[i], "--planar") == 0) {
+			opts.params.planar = 1;
+		} else if (strcmp(argv[i], "--gpu") == 0) {
+			opts.params.use_gpu = 1;
+		} else if (strcmp(argv[i], "--headless") == 0) {
+			opts.headless = 1;
+		} else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+			opts.out_pattern = argv[++i];
+		} else if (strcmp(argv[i], "--map") == 0 && i + 1 < argc) {
+			opts.map_pattern = argv[++i];
+		} else if (strcmp(argv[i], "--no-map") == 0) {
+			no_map = 1;
+		} else if (strcmp(argv[i], "--metric") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp(argv[i], "none") == 0) {
+				opts.metric = METRIC_NONE;
+			} else if (strcmp(argv[i], "sharpness") == 0) {
+				opts.metric = METRIC_SHARPNESS;
+			} else if (strcmp(argv[i], "dft") == 0) {
+				opts.metric = METRIC_DFT;
+			} else {
+				first_file = argc;
+				break;
+			}
+		} else if (strcmp(argv[i], "--video") == 0) {
+			opts.video = 1;
+		} else if (strcmp(argv[i], "--light-step") == 0 && i + 1 < argc) {
+			opts.params.light_step = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--light-per-channel") == 0) {
+			opts.params.light_per_channel = 1;
+		} else if (strcmp(argv[i], "--light-grid") == 0 && i + 1 < argc) {
+			opts.params.light_grid = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--light-interval") == 0 && i + 1 < argc) {
+			opts.params.light_interval = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--light-smoothing") == 0 && i + 1 < argc) {
+			opts.params.light_smoothing = atof(argv[++i]);
+		} else if (strcmp(argv[i], "--tiled") == 0) {
+			opts.tiled = 1;
+		} else if (strcmp(argv[i], "--tile") == 0 && i + 1 < argc) {
+			opts.tile_size = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--raw") == 0 && i + 1 < argc) {
+			opts.raw = 1;
+			if (sscanf(argv[++i], "%dx%d", &opts.raw_width, &opts.raw_height) != 2) {
+				first_file = argc;
+				break;
+			}
+		} else if (strcmp(argv[i], "--batch") == 0) {
+			opts.batch = 1;
+		} else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+			opts.batch_opts.workers = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--io-threads") == 0 && i + 1 < argc) {
+			opts.batch_opts.decoders = opts.batch_opts.encoders = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--list") == 0 && i + 1 < argc) {
+			opts.batch_opts.list = argv[++i];
+		} else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+			opts.server_opts.socket_path = argv[++i];
+		} else if (strcmp(argv[i], "--telemetry") == 0 && i + 1 < argc) {
+			telemetry_path = argv[++i];
+		} else if (strcmp(argv[i], "--metrics-port") == 0 && i + 1 < argc) {
+			opts.server_opts.metrics_port = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--metrics-address") == 0 && i + 1 < argc) {
+			opts.server_opts.metrics_address = argv[++i];
+		} else if (strcmp(argv[i], "--bench") == 0) {
+			opts.bench = 1;
+		} else if (strcmp(argv[i], "--bench-runs") == 0 && i + 1 < argc) {
+			opts.bench_runs = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--verify") == 0) {
+			opts.verify = 1;
+		} else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+			opts.verify_opts.baseline = argv[++i];
+		} else if (strcmp(argv[i], "--save-baseline") == 0 && i + 1 < argc) {
+			opts.verify_opts.save_baseline = argv[++i];
+		} else if (strncmp(argv[i], "--", 2) == 0) {
+			first_file = argc;
+			break;
+		} else {
+			first_file = i;
+			break;
+		}
+	}
+	int num_files = argc - first_file;
+	int serve = opts.server_opts.socket_path != NULL;
+	if ((num_files < 1 && !opts.bench && !opts.verify && !serve && opts.batch_opts.list == NULL) || (serve && num_files > 0) ||
+			opts.params.num_threads < 1 || opts.params.window < 1 || opts.params.window_height < 0 || opts.params.refine_radius < 0 ||
+			opts.params.refine_eps <= 0.0 || opts.params.pyramid_levels < 0 ||
+			opts.params.transmission_floor < DEFOG_MIN_TRANSMISSION_FLOOR || opts.params.transmission_floor > 1.0 ||
+			opts.params.pyramid_levels > DEFOG_MAX_PYRAMID_LEVELS || opts.params.light_interval < 1 ||
+			opts.params.light_step < 1 || opts.params.light_grid < 0 ||
+			opts.params.light_grid > DEFOG_MAX_LIGHT_GRID || opts.params.light_smoothing < 0.0 ||
+			opts.params.light_smoothing > 1.0 || opts.bench_runs < 1 || opts.tile_size < 1 ||
+			opts.batch_opts.workers < 0 || opts.batch_opts.decoders < 1 ||
+			(opts.raw && (opts.raw_width < 1 || opts.raw_height < 1)) ||
+			opts.tiled + opts.video + opts.batch + opts.raw + serve > 1 ||
+			(serve && opts.bench) || (opts.batch_opts.list != NULL && !opts.batch) ||
+			(opts.verify && (opts.bench || serve || opts.tiled + opts.video + opts.batch + opts.raw > 0)) ||
+			((opts.verify_opts.baseline != NULL || opts.verify_opts.save_baseline != NULL) && !opts.verify) ||
+			opts.server_opts.metrics_port < 0 || opts.server_opts.metrics_port > 65535 ||
+			(opts.server_opts.metrics_port > 0 && !serve) ||
+			(opts.server_opts.metrics_address != NULL && opts.server_opts.metrics_port == 0) ||
+			(telemetry_path != NULL && (opts.tiled || opts.bench || opts.verify)) ||
+			(telemetry_path != NULL && serve && strcmp(telemetry_path, "-") == 0 &&
+				strcmp(opts.server_opts.socket_path, "-") == 0)) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	// Benchmarks don't write or show anything, and sweep their own window widths
+	if (opts.bench) {
+		return run_bench(&opts.params, opts.bench_runs, argv + first_file, num_files);
+	}
+
+	// Verification exits with a failure if any fast path diverges from the exact kernels or slows
+	// down, so that it can gate a build
+	if (opts.verify) {
+		opts.verify_opts.runs = opts.bench_runs;
+		return run_verify(&opts.params, &opts.verify_opts, argv + first_file, num_files);
+	}
+
+	// Telemetry is appended to, so that runs can share a log
+	if (telemetry_path != NULL) {
+		opts.telemetry = strcmp(telemetry_path, "-") == 0 ? stdout : fopen(telemetry_path, "a");
+		if (opts.telemetry == NULL) {
+			fprintf(stderr, "Could not open %s\n", telemetry_path);
+			return 1;
+		}
+		opts.batch_opts.telemetry = opts.server_opts.telemetry = opts.telemetry;
+	}
+
+	// The server keeps its workers' contexts for as long as it runs, and never writes any files
+	if (serve) {
+		opts.server_opts.workers = opts.batch_opts.workers;
+		int failed = run_server(&opts.params, &opts.server_opts);
+		close_telemetry(&opts);
+		return failed;
+	}
+
+	// Fall back on the traditional output paths for a single image, and on per-image names for
+	// several of them; a batch can always expand to several. PNG holds 8-bit and 16-bit images, but
+	// floating point images need a format of their own
+	int many = num_files > 1 || opts.batch;
+	if (opts.out_pattern == NULL) {
+		opts.out_pattern = opts.video ? (many ? "%s_out.avi" : "out.avi") :
+			opts.tiled ? (many ? "%s_out.ppm" : "out.ppm") :
+			opts.raw ? (many ? "%s_out.bgr" : "out.bgr") :
+			(many ? "%s_out.png" : "out.png");
+		if (!opts.video && !opts.tiled && !opts.raw) {
+			opts.float_out_pattern = many ? "%s_out.exr" : "out.exr";
+		}
+	}
+	if (opts.map_pattern == NULL) {
+		opts.map_pattern = opts.video ? (many ? "%s_map.avi" : "map.avi") :
+			opts.tiled ? (many ? "%s_map.pgm" : "map.pgm") :
+			opts.raw ? (many ? "%s_map.gray" : "map.gray") :
+			(many ? "%s_map.png" : "map.png");
+	}
+	if (no_map) {
+		opts.map_pattern = NULL;
+	}
+	if (many && (strstr(opts.out_pattern, "%s") == NULL ||
+			(opts.map_pattern != NULL && strstr(opts.map_pattern, "%s") == NULL))) {
+		fprintf(stderr, "Output paths must contain %%s when defogging more than one image\n");
+		close_telemetry(&opts);
+		return 1;
+	}
+
+	// Batches are always headless, and give each of their workers a context of its own
+	if (opts.batch) {
+		opts.batch_opts.write_map = opts.map_pattern != NULL;
+		opts.batch_opts.paths = build_batch_paths;
+		opts.batch_opts.paths_arg = &opts;
+		int failed = run_batch(&opts.params, &opts.batch_opts, argv + first_file, argc - first_file);
+		close_telemetry(&opts);
+		return failed;
+	}
+
+	// Create a single context for all of the images, so that buffers are reused between them
+	defog_ctx_t *ctx = defog_create(&opts.params, 0, 0);
+	if (ctx == NULL) {
+		fprintf(stderr, "Could not create a defogging context\n");
+		close_telemetry(&opts);
+		return 1;
+	}
+	if (opts.params.use_gpu && !defog_using_gpu(ctx)) {
+		fprintf(stderr, "No GPU is available, defogging on the CPU instead\n");
+	}
+
+	// Create a window for displaying input, output, and intermediary steps; tiled images are far
+	// too large to show, and raw frames are meant for other programs
+	if (opts.tiled || opts.raw) {
+		opts.headless = 1;
+	}
+	if (!opts.headless) {
+		cvNamedWindow("disp", CV_WINDOW_AUTOSIZE);
+	}
+
+	// Defog every image, carrying on past any that fail
+	int failed = 0;
+	for (int i = first_file; i < argc; i++) {
+		if (opts.video) {
+			failed |= defog_video(ctx, argv[i], &opts);
+		} else if (opts.tiled) {
+			failed |= defog_tiled_file(ctx, argv[i], &opts);
+		} else if (opts.raw) {
+			failed |= defog_raw_file(ctx, argv[i], &opts);
+		} else {
+			failed |= defog_file(ctx, argv[i], &opts);
+		}
+	}
+
+	// Clean up
+	defog_destroy(ctx);
+
+	// Destroy the window used to display images
+	if (!opts.headless) {
+		cvDestroyAllWindows();
+	}
+	close_telemetry(&opts);
+
+	return failed;
+}
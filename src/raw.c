@@ -0,0 +1,221 @@
+/* Copyright 2014-2015 David Pearson.
+ * All rights reserved.
+ *
+ * Defogging raw frames in mapped files and shared memory, see raw.h.
+ */
+
+// mmap() and shm_open() are POSIX rather than C99, and the files can be larger than 2 GB
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "raw.h"
+#include "telemetry.h"
+
+// A file or shared memory object that is mapped into memory
+typedef struct {
+	uint8_t *data;
+	size_t size;
+
+	// Which file it is, so that an output can't be mapped over the input or the other output
+	dev_t dev;
+	ino_t ino;
+} raw_mapping_t;
+
+// Function definitions
+int open_raw(const char *path, int flags);
+int map_raw_input(raw_mapping_t *mapping, const char *path);
+int map_raw_output(raw_mapping_t *mapping, const char *path, size_t size, const raw_mapping_t *const *mapped, int num_mapped);
+void unmap_raw(raw_mapping_t *mapping);
+
+/* Opens a file, or a shared memory object if the path starts with RAW_SHM_PREFIX
+ *
+ * path - The path of the file, or RAW_SHM_PREFIX followed by the name of the object (such as
+ *        "shm:/frames")
+ * flags - The flags to open it with, as for open()
+ *
+ * Returns the file descriptor, or -1 on an error
+ */
+int open_raw(const char *path, int flags) {
+	size_t prefix_len = strlen(RAW_SHM_PREFIX);
+	if (strncmp(path, RAW_SHM_PREFIX, prefix_len) == 0) {
+		return shm_open(path + prefix_len, flags, 0644);
+	}
+
+	return open(path, flags, 0644);
+}
+
+/* Maps the whole of an input file into memory, read-only
+ *
+ * mapping - Where the mapping is written
+ * path - The path of the file or shared memory object, see open_raw()
+ *
+ * Returns 0 on success or -1 if the file couldn't be opened or mapped, or is empty
+ */
+int map_raw_input(raw_mapping_t *mapping, const char *path) {
+	mapping->data = NULL;
+	int fd = open_raw(path, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+		close(fd);
+		return -1;
+	}
+	mapping->size = st.st_size;
+	mapping->dev = st.st_dev;
+	mapping->ino = st.st_ino;
+
+	// The mapping keeps the file open by itself
+	void *data = mmap(NULL, mapping->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return -1;
+	}
+	mapping->data = data;
+
+	// Frames are read from start to end, so the kernel can read ahead and drop them afterwards
+	posix_madvise(mapping->data, mapping->size, POSIX_MADV_SEQUENTIAL);
+
+	return 0;
+}
+
+/* Creates (or replaces) an output file of a given size and maps it into memory, so that whatever
+ * is written to the mapping ends up in the file
+ *
+ * mapping - Where the mapping is written
+ * path - The path of the file or shared memory object, see open_raw()
+ * size - The size of the file in bytes
+ * mapped - The files that are already mapped (the input, and the output if this is the map), which
+ *          the file mustn't be one of
+ * num_mapped - The number of mapped files
+ *
+ * Returns 0 on success or -1 if the file couldn't be created or mapped, or is already mapped
+ */
+int map_raw_output(raw_mapping_t *mapping, const char *path, size_t size, const raw_mapping_t *const *mapped, int num_mapped) {
+	mapping->data = NULL;
+	int fd = open_raw(path, O_RDWR | O_CREAT);
+	if (fd < 0) {
+		return -1;
+	}
+
+	// Truncating a file that is already mapped would pull the frames out from under its mapping
+	struct stat st;
+	int taken = fstat(fd, &st) != 0;
+	for (int i = 0; i < num_mapped && !taken; i++) {
+		taken = st.st_dev == mapped[i]->dev && st.st_ino == mapped[i]->ino;
+	}
+	if (taken || ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0) {
+		close(fd);
+		return -1;
+	}
+	mapping->size = size;
+	mapping->dev = st.st_dev;
+	mapping->ino = st.st_ino;
+
+	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return -1;
+	}
+	mapping->data = data;
+
+	return 0;
+}
+
+/* Unmaps a file, if it was mapped
+ *
+ * mapping - The mapping
+ */
+void unmap_raw(raw_mapping_t *mapping) {
+	if (mapping->data != NULL) {
+		munmap(mapping->data, mapping->size);
+		mapping->data = NULL;
+	}
+}
+
+/* Defogs every frame of a raw video, which is a file or shared memory object holding packed 8-bit
+ * BGR frames one after another. The input and outputs are mapped into memory and the frames are
+ * defogged where they are, as for defog_process_frame(), so nothing is copied or encoded
+ *
+ * ctx - The defogging context
+ * width - The width of each frame in pixels
+ * height - The height of each frame in pixels
+ * in_path - The path of the input, or RAW_SHM_PREFIX followed by the name of a shared memory
+ *           object
+ * out_path - Where the defogged frames are written in the same format, which can also name a
+ *            shared memory object
+ * map_path - Where the 8-bit single channel transmission maps are written, one after another, or
+ *            NULL if they aren't needed
+ * telemetry - Where a JSON line is written for each frame, or NULL
+ *
+ * Returns 0 on success or 1 if the frames couldn't be read, defogged, or written
+ */
+int defog_raw(defog_ctx_t *ctx, int width, int height, const char *in_path, const char *out_path, const char *map_path,
+		FILE *telemetry) {
+	raw_mapping_t in;
+	raw_mapping_t out = {.data = NULL};
+	raw_mapping_t map = {.data = NULL};
+	if (map_raw_input(&in, in_path) != 0) {
+		fprintf(stderr, "Could not map frames %s\n", in_path);
+		return 1;
+	}
+
+	size_t frame_size = (size_t)width * height * 3;
+	size_t num_frames = in.size / frame_size;
+	int failed = 0;
+	if (in.size % frame_size != 0) {
+		fprintf(stderr, "%s is not a whole number of %dx%d BGR frames\n", in_path, width, height);
+		failed = 1;
+	}
+
+	// Neither output can be the input, and the map can't be the output either
+	const raw_mapping_t *mapped[] = {&in, &out};
+	if (!failed && (map_raw_output(&out, out_path, in.size, mapped, 1) != 0 ||
+			(map_path != NULL && map_raw_output(&map, map_path, num_frames * width * height, mapped, 2) != 0))) {
+		fprintf(stderr, "Could not map frames %s\n", out.data == NULL ? out_path : map_path);
+		failed = 1;
+	}
+
+	// Start from scratch rather than carrying over the light of whatever came before
+	defog_reset_frames(ctx);
+
+	size_t frames = 0;
+	for (; frames < num_frames && !failed; frames++) {
+		defog_buffer_t in_buf = {in.data + frames * frame_size, 0};
+		defog_buffer_t out_buf = {out.data + frames * frame_size, 0};
+		defog_buffer_t map_buf = {map.data != NULL ? map.data + frames * width * height : NULL, 0};
+		if (defog_process_buffer(ctx, width, height, &in_buf, &out_buf, map.data != NULL ? &map_buf : NULL, 1) != 0) {
+			fprintf(stderr, "Could not defog frame %zu of %s\n", frames, in_path);
+			failed = 1;
+		}
+
+		// There's no decoding or encoding to time, since the frames are already in place
+		if (telemetry != NULL) {
+			defog_stats_t stats;
+			defog_get_stats(ctx, &stats);
+			telemetry_write_json(telemetry, in_path, (int)frames, width, height, failed, &stats, NULL);
+		}
+	}
+
+	if (!failed) {
+		printf("%s: defogged %zu frames\n", in_path, frames);
+	}
+
+	unmap_raw(&in);
+	unmap_raw(&out);
+	unmap_raw(&map);
+
+	return failed;
+}
@@ -0,0 +1,22 @@
+/* Copyright 2014-2015 David Pearson.
+ * All rights reserved.
+ *
+ * Defogging raw 8-bit BGR frames, stored one after another with no header in a file or a POSIX
+ * shared memory object, which are mapped into memory and defogged where they are, with no copies
+ * and no decoding or encoding.
+ */
+
+#ifndef RAW_H
+#define RAW_H
+
+#include <stdio.h>
+
+#include "defog.h"
+
+// The prefix of paths that name a POSIX shared memory object rather than a file
+#define RAW_SHM_PREFIX "shm:"
+
+int defog_raw(defog_ctx_t *ctx, int width, int height, const char *in_path, const char *out_path, const char *map_path,
+	FILE *telemetry);
+
+#endif
@@ -0,0 +1,722 @@
+/* Copyright 2014-2015 David Pearson.
+ * All rights reserved.
+ *
+ * The defogging server, see server.h.
+ */
+
+// Sockets, poll(), sysconf(), and htonl() are POSIX rather than C99
+#define _POSIX_C_SOURCE 200809L
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cv.h>
+#include <highgui.h>
+
+#include "server.h"
+#include "telemetry.h"
+
+// How often the metrics thread checks whether the server is stopping, in milliseconds
+#define METRICS_POLL_MS 1000
+
+// The number of words in the header of a request and of a response
+#define REQUEST_WORDS 5
+#define RESPONSE_WORDS 6
+
+typedef struct server server_t;
+
+// An image waiting to be defogged, whose buffers belong to the connection that sent it
+typedef struct server_job {
+	int width;
+	int height;
+	defog_buffer_t in;
+	defog_buffer_t out;
+	defog_buffer_t map;
+
+	// Whether the job has been defogged, the status to send back, and when it was read and how it
+	// went, for the telemetry
+	int done;
+	int status;
+	pthread_cond_t done_cond;
+	double start;
+	double decode_time;
+	defog_stats_t stats;
+
+	struct server_job *next;
+} server_job_t;
+
+// A client, along with the buffers that its requests are read into and defogged into, which are
+// kept between requests
+typedef struct {
+	server_t *server;
+	int in_fd;
+	int out_fd;
+	uint8_t *in_buf;
+	size_t in_size;
+	uint8_t *out_buf;
+	size_t out_size;
+	server_job_t job;
+} server_conn_t;
+
+// The queue of jobs and the workers that defog them
+struct server {
+	const server_opts_t *opts;
+	defog_ctx_t **ctxs;
+	pthread_t *threads;
+	int num_threads;
+
+	// The queue of jobs, in the order they arrived, and whether the workers should stop once it's
+	// empty
+	server_job_t *head;
+	server_job_t *tail;
+	int stopping;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+
+	// The number of clients connected to the socket, which the server waits on before it stops
+	int num_conns;
+	pthread_cond_t no_conns;
+
+	// The totals of every request so far, and the socket that they're served on, or -1
+	telemetry_totals_t totals;
+	int metrics_fd;
+};
+
+// A worker thread and the context it defogs with
+typedef struct {
+	server_t *server;
+	defog_ctx_t *ctx;
+} server_worker_t;
+
+// Function definitions
+int read_all(int fd, void *buf, size_t len);
+int write_all(int fd, const void *buf, size_t len);
+int grow_buffer(uint8_t **buf, size_t *size, size_t needed);
+void *worker_thread(void *arg);
+void defog_job(server_t *server, server_job_t *job);
+int read_request(server_conn_t *conn, server_job_t *job, IplImage **decoded);
+int write_response(server_conn_t *conn, const server_job_t *job);
+void serve_connection(server_conn_t *conn);
+void *connection_thread(void *arg);
+void record_request(server_t *server, const server_job_t *job);
+int listen_unix(const char *path);
+int listen_metrics(const char *address, int port);
+void serve_metrics(server_t *server, int fd);
+void *metrics_thread(void *arg);
+
+/* Reads from a file descriptor until a whole buffer has been filled
+ *
+ * fd - The file descriptor
+ * buf - The buffer
+ * len - The number of bytes to read
+ *
+ * Returns 0 on success or -1 on an error or the end of the stream
+ */
+int read_all(int fd, void *buf, size_t len) {
+	uint8_t *dst = buf;
+	while (len > 0) {
+		ssize_t got = read(fd, dst, len);
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		if (got <= 0) {
+			return -1;
+		}
+		dst += got;
+		len -= got;
+	}
+
+	return 0;
+}
+
+/* Writes a whole buffer to a file descriptor
+ *
+ * fd - The file descriptor
+ * buf - The buffer
+ * len - The number of bytes to write
+ *
+ * Returns 0 on success or -1 on an error
+ */
+int write_all(int fd, const void *buf, size_t len) {
+	const uint8_t *src = buf;
+	while (len > 0) {
+		ssize_t put = write(fd, src, len);
+		if (put < 0 && errno == EINTR) {
+			continue;
+		}
+		if (put <= 0) {
+			return -1;
+		}
+		src += put;
+		len -= put;
+	}
+
+	return 0;
+}
+
+/* Makes sure that a buffer is at least a given size, growing it (and losing its contents) if not
+ *
+ * buf - The buffer, which may be NULL
+ * size - The current size of the buffer, which is updated if it grows
+ * needed - The number of bytes needed
+ *
+ * Returns 0 on success or -1 if memory couldn't be allocated
+ */
+int grow_buffer(uint8_t **buf, size_t *size, size_t needed) {
+	if (*size >= needed) {
+		return 0;
+	}
+
+	free(*buf);
+	*buf = (uint8_t *)malloc(needed);
+	*size = *buf != NULL ? needed : 0;
+
+	return *buf != NULL ? 0 : -1;
+}
+
+/* Defogs jobs as they're queued until the server stops, one at a time, so that a burst of images
+ * is spread across every idle worker rather than waiting behind one of them
+ *
+ * arg - The server_worker_t for the thread
+ *
+ * Returns NULL
+ */
+void *worker_thread(void *arg) {
+	server_worker_t *worker = (server_worker_t *)arg;
+	server_t *server = worker->server;
+
+	for (;;) {
+		pthread_mutex_lock(&server->lock);
+		while (server->head == NULL && !server->stopping) {
+			pthread_cond_wait(&server->not_empty, &server->lock);
+		}
+		if (server->head == NULL) {
+			pthread_mutex_unlock(&server->lock);
+			break;
+		}
+
+		server_job_t *job = server->head;
+		server->head = job->next;
+		if (server->head == NULL) {
+			server->tail = NULL;
+		}
+		pthread_mutex_unlock(&server->lock);
+
+		int status = defog_process_buffer(worker->ctx, job->width, job->height, &job->in, &job->out,
+			job->map.data != NULL ? &job->map : NULL, 0) != 0 ? SERVER_FAILED : SERVER_OK;
+		defog_get_stats(worker->ctx, &job->stats);
+
+		pthread_mutex_lock(&server->lock);
+		job->status = status;
+		job->done = 1;
+		pthread_cond_signal(&job->done_cond);
+		pthread_mutex_unlock(&server->lock);
+	}
+
+	return NULL;
+}
+
+/* Queues a job for the workers and waits until it has been defogged
+ *
+ * server - The server
+ * job - The job, whose status is set once it's done
+ */
+void defog_job(server_t *server, server_job_t *job) {
+	pthread_mutex_lock(&server->lock);
+	job->done = 0;
+	job->next = NULL;
+	if (server->tail != NULL) {
+		server->tail->next = job;
+	} else {
+		server->head = job;
+	}
+	server->tail = job;
+	pthread_cond_signal(&server->not_empty);
+
+	while (!job->done) {
+		pthread_cond_wait(&job->done_cond, &server->lock);
+	}
+	pthread_mutex_unlock(&server->lock);
+}
+
+/* Reads the next request from a client and points a job at its pixels, decoding them first if
+ * they're an encoded image
+ *
+ * conn - The connection
+ * job - The job to fill in, whose status is set to SERVER_BAD_REQUEST if the image isn't valid
+ * decoded - Where the decoded image is written, which the caller must release, or NULL if the
+ *           pixels were sent raw
+ *
+ * Returns 0 if a request was read (even a bad one) or -1 if the connection should be closed
+ */
+int read_request(server_conn_t *conn, server_job_t *job, IplImage **decoded) {
+	*decoded = NULL;
+	uint32_t header[REQUEST_WORDS];
+	if (read_all(conn->in_fd, header, sizeof(header)) != 0 || ntohl(header[0]) != SERVER_MAGIC) {
+		return -1;
+	}
+	uint32_t flags = ntohl(header[1]);
+	uint32_t width = ntohl(header[2]);
+	uint32_t height = ntohl(header[3]);
+	uint32_t length = ntohl(header[4]);
+	job->width = 0;
+	job->height = 0;
+	job->decode_time = 0.0;
+
+	// Anything too large to be an image can't be skipped safely, so it ends the connection
+	if (length > (uint32_t)SERVER_MAX_PIXELS * 3 || grow_buffer(&conn->in_buf, &conn->in_size, length) != 0 ||
+			read_all(conn->in_fd, conn->in_buf, length) != 0) {
+		return -1;
+	}
+
+	// Requests are timed from when they've arrived, so that slow clients don't count
+	job->start = telemetry_time();
+	job->status = SERVER_BAD_REQUEST;
+	if (flags & SERVER_ENCODED) {
+		CvMat mat = cvMat(1, length, CV_8UC1, conn->in_buf);
+		*decoded = length > 0 ? cvDecodeImage(&mat, CV_LOAD_IMAGE_COLOR) : NULL;
+		job->decode_time = telemetry_time() - job->start;
+		if (*decoded == NULL) {
+			return 0;
+		}
+		width = (*decoded)->width;
+		height = (*decoded)->height;
+		job->in.data = (uint8_t *)(*decoded)->imageData;
+		job->in.stride = (*decoded)->widthStep;
+	} else {
+		job->in.data = conn->in_buf;
+		job->in.stride = 0;
+	}
+	if (width < 1 || height < 1 || (uint64_t)width * height > SERVER_MAX_PIXELS ||
+			(!(flags & SERVER_ENCODED) && length != (uint64_t)width * height * 3)) {
+		return 0;
+	}
+
+	// The results go straight into the buffer they're sent back from
+	size_t pixels = (size_t)width * height;
+	int want_map = (flags & SERVER_WANT_MAP) != 0;
+	if (grow_buffer(&conn->out_buf, &conn->out_size, pixels * 3 + (want_map ? pixels : 0)) != 0) {
+		job->status = SERVER_FAILED;
+		return 0;
+	}
+	job->width = width;
+	job->height = height;
+	job->out.data = conn->out_buf;
+	job->out.stride = 0;
+	job->map.data = want_map ? conn->out_buf + pixels * 3 : NULL;
+	job->map.stride = 0;
+	job->status = SERVER_OK;
+
+	return 0;
+}
+
+/* Sends the response to a request back to its client
+ *
+ * conn - The connection
+ * job - The job, which has been defogged unless its status says otherwise
+ *
+ * Returns 0 on success or -1 if the connection should be closed
+ */
+int write_response(server_conn_t *conn, const server_job_t *job) {
+	int ok = job->status == SERVER_OK;
+	size_t out_length = ok ? (size_t)job->width * job->height * 3 : 0;
+	size_t map_length = ok && job->map.data != NULL ? (size_t)job->width * job->height : 0;
+	uint32_t header[RESPONSE_WORDS] = {
+		htonl(SERVER_MAGIC),
+		htonl(job->status),
+		htonl(ok ? job->width : 0),
+		htonl(ok ? job->height : 0),
+		htonl(out_length),
+		htonl(map_length)
+	};
+
+	// The map sits right after the output in the same buffer
+	if (write_all(conn->out_fd, header, sizeof(header)) != 0 ||
+			write_all(conn->out_fd, conn->out_buf, out_length + map_length) != 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Answers requests from a client until it disconnects or sends something that isn't a request
+ *
+ * conn - The connection, whose buffers are freed when it ends
+ */
+void serve_connection(server_conn_t *conn) {
+	pthread_cond_init(&conn->job.done_cond, NULL);
+
+	IplImage *decoded;
+	while (read_request(conn, &conn->job, &decoded) == 0) {
+		if (conn->job.status == SERVER_OK) {
+			defog_job(conn->server, &conn->job);
+		}
+		if (decoded != NULL) {
+			cvReleaseImage(&decoded);
+		}
+		record_request(conn->server, &conn->job);
+		if (write_response(conn, &conn->job) != 0) {
+			break;
+		}
+	}
+
+	pthread_cond_destroy(&conn->job.done_cond);
+	free(conn->in_buf);
+	free(conn->out_buf);
+}
+
+/* Serves a client of the Unix domain socket on a thread of its own
+ *
+ * arg - The server_conn_t of the client, which the thread frees along with its socket
+ *
+ * Returns NULL
+ */
+void *connection_thread(void *arg) {
+	server_conn_t *conn = (server_conn_t *)arg;
+	server_t *server = conn->server;
+	serve_connection(conn);
+	close(conn->in_fd);
+	free(conn);
+
+	pthread_mutex_lock(&server->lock);
+	if (--server->num_conns == 0) {
+		pthread_cond_signal(&server->no_conns);
+	}
+	pthread_mutex_unlock(&server->lock);
+
+	return NULL;
+}
+
+/* Adds a request that has been answered (or rejected) to the server's totals, and writes its
+ * telemetry if that was asked for
+ *
+ * server - The server
+ * job - The request's job
+ */
+void record_request(server_t *server, const server_job_t *job) {
+	double latency = telemetry_time() - job->start;
+
+	pthread_mutex_lock(&server->lock);
+	long index = server->totals.ok + server->totals.failed + server->totals.bad;
+	if (job->status == SERVER_OK) {
+		telemetry_add(&server->totals, &job->stats, latency);
+	} else if (job->status == SERVER_FAILED) {
+		server->totals.failed++;
+	} else {
+		server->totals.bad++;
+	}
+	pthread_mutex_unlock(&server->lock);
+
+	// Whatever isn't decoding or defogging was spent waiting for a worker
+	if (server->opts->telemetry != NULL && job->status != SERVER_BAD_REQUEST) {
+		telemetry_io_t io = {0.0, 0.0, 0.0, 0.0};
+		io.decode_time = job->decode_time;
+		io.wait_time = latency - job->decode_time - (job->status == SERVER_OK ? job->stats.total_time : 0.0);
+		io.wait_time = io.wait_time > 0.0 ? io.wait_time : 0.0;
+		telemetry_write_json(server->opts->telemetry, server->opts->socket_path, (int)index, job->width, job->height,
+			job->status != SERVER_OK, &job->stats, &io);
+	}
+}
+
+/* Creates a Unix domain socket and starts listening on it, replacing any stale socket left at the
+ * same path
+ *
+ * path - The path of the socket
+ *
+ * Returns the socket, or -1 on an error
+ */
+int listen_unix(const char *path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	struct stat info;
+	if (stat(path, &info) == 0 && S_ISSOCK(info.st_mode)) {
+		unlink(path);
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Creates a TCP socket for the metrics and starts listening on it
+ *
+ * address - The IPv4 address to listen on, or NULL for the loopback interface
+ * port - The port
+ *
+ * Returns the socket, or -1 on an error or if the address isn't valid
+ */
+int listen_metrics(const char *address, int port) {
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if (address != NULL && inet_pton(AF_INET, address, &addr.sin_addr) != 1) {
+		return -1;
+	}
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	int reuse = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Answers a single HTTP request for the metrics, which is all that Prometheus needs; anything but
+ * a GET of /metrics gets a 404
+ *
+ * server - The server
+ * fd - The client's socket, which is closed afterwards
+ */
+void serve_metrics(server_t *server, int fd) {
+	// Only the request line matters, and it always arrives in the first packet
+	char request[1024];
+	ssize_t got = read(fd, request, sizeof(request) - 1);
+	request[got > 0 ? got : 0] = '\0';
+	int found = strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET /metrics\r", 13) == 0;
+
+	pthread_mutex_lock(&server->lock);
+	telemetry_totals_t totals = server->totals;
+	pthread_mutex_unlock(&server->lock);
+
+	FILE *file = fdopen(fd, "w");
+	if (file == NULL) {
+		close(fd);
+		return;
+	}
+	if (found) {
+		fprintf(file, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+		telemetry_write_prometheus(file, &totals);
+	} else {
+		fprintf(file, "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\nNot found\n");
+	}
+	fclose(file);
+}
+
+/* Serves the metrics, one scrape at a time, until the server stops
+ *
+ * arg - The server
+ *
+ * Returns NULL
+ */
+void *metrics_thread(void *arg) {
+	server_t *server = (server_t *)arg;
+
+	for (;;) {
+		pthread_mutex_lock(&server->lock);
+		int stopping = server->stopping;
+		pthread_mutex_unlock(&server->lock);
+		if (stopping) {
+			break;
+		}
+
+		// Wake up now and then to see whether the server has stopped
+		struct pollfd poll_fd = {server->metrics_fd, POLLIN, 0};
+		if (poll(&poll_fd, 1, METRICS_POLL_MS) <= 0) {
+			continue;
+		}
+		// A scraper that never sends its request mustn't hold up the server stopping
+		int fd = accept(server->metrics_fd, NULL, NULL);
+		if (fd >= 0) {
+			struct timeval timeout = {METRICS_POLL_MS / 1000, 0};
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+			serve_metrics(server, fd);
+		}
+	}
+
+	return NULL;
+}
+
+/* Runs the server until the client on stdin disconnects or, for a socket, until it is killed
+ *
+ * params - The parameters that every image is defogged with
+ * opts - Where to listen and how to spread the work; workers defaults to one context per
+ *        params->num_threads cores if it's 0
+ *
+ * Returns 0 if the server shut down cleanly or 1 if it couldn't start or stopped on an error
+ */
+int run_server(const defog_params_t *params, const server_opts_t *opts) {
+	server_opts_t layout = *opts;
+	if (layout.workers < 1) {
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		layout.workers = cores > params->num_threads ? (int)(cores / params->num_threads) : 1;
+	}
+	opts = &layout;
+
+	// A client that hangs up mid-response should only lose its own connection
+	signal(SIGPIPE, SIG_IGN);
+
+	server_t server;
+	memset(&server, 0, sizeof(server));
+	server.opts = opts;
+	server.ctxs = (defog_ctx_t **)calloc(opts->workers, sizeof(defog_ctx_t *));
+	server.threads = (pthread_t *)malloc(opts->workers * sizeof(pthread_t));
+	server_worker_t *workers = (server_worker_t *)malloc(opts->workers * sizeof(server_worker_t));
+	int failed = server.ctxs == NULL || server.threads == NULL || workers == NULL;
+
+	// Every context is created up front, so that no request pays for it
+	for (int i = 0; i < opts->workers && !failed; i++) {
+		server.ctxs[i] = defog_create(params, 0, 0);
+		failed = server.ctxs[i] == NULL;
+	}
+	if (failed) {
+		fprintf(stderr, "Could not create the server's defogging contexts\n");
+	}
+
+	int use_stdio = strcmp(opts->socket_path, "-") == 0;
+	int listen_fd = -1;
+	if (!failed && !use_stdio) {
+		listen_fd = listen_unix(opts->socket_path);
+		if (listen_fd < 0) {
+			fprintf(stderr, "Could not listen on %s\n", opts->socket_path);
+			failed = 1;
+		}
+	}
+	server.metrics_fd = -1;
+	if (!failed && opts->metrics_port > 0) {
+		server.metrics_fd = listen_metrics(opts->metrics_address, opts->metrics_port);
+		if (server.metrics_fd < 0) {
+			fprintf(stderr, "Could not serve metrics on %s port %d\n",
+				opts->metrics_address != NULL ? opts->metrics_address : "127.0.0.1", opts->metrics_port);
+			failed = 1;
+		}
+	}
+
+	if (!failed) {
+		pthread_mutex_init(&server.lock, NULL);
+		pthread_cond_init(&server.not_empty, NULL);
+		pthread_cond_init(&server.no_conns, NULL);
+		for (int i = 0; i < opts->workers; i++) {
+			workers[i].server = &server;
+			workers[i].ctx = server.ctxs[i];
+			pthread_create(&server.threads[i], NULL, worker_thread, &workers[i]);
+		}
+		server.num_threads = opts->workers;
+		pthread_t metrics;
+		if (server.metrics_fd >= 0) {
+			pthread_create(&metrics, NULL, metrics_thread, &server);
+		}
+
+		if (use_stdio) {
+			server_conn_t conn;
+			memset(&conn, 0, sizeof(conn));
+			conn.server = &server;
+			conn.in_fd = STDIN_FILENO;
+			conn.out_fd = STDOUT_FILENO;
+			serve_connection(&conn);
+		} else {
+			fprintf(stderr, "Serving on %s with %d workers\n", opts->socket_path, opts->workers);
+			for (;;) {
+				// Running out of descriptors or memory passes once a client leaves, so it's only worth
+				// a pause
+				int fd = accept(listen_fd, NULL, NULL);
+				if (fd < 0 && (errno == EINTR || errno == ECONNABORTED)) {
+					continue;
+				} else if (fd < 0 && (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)) {
+					sleep(1);
+					continue;
+				} else if (fd < 0) {
+					fprintf(stderr, "Could not accept a connection on %s\n", opts->socket_path);
+					failed = 1;
+					break;
+				}
+
+				// Each client gets a thread that reads its requests and waits on its results
+				server_conn_t *conn = (server_conn_t *)calloc(1, sizeof(server_conn_t));
+				pthread_t thread;
+				if (conn != NULL) {
+					conn->server = &server;
+					conn->in_fd = conn->out_fd = fd;
+				}
+				pthread_mutex_lock(&server.lock);
+				server.num_conns++;
+				pthread_mutex_unlock(&server.lock);
+				if (conn == NULL || pthread_create(&thread, NULL, connection_thread, conn) != 0) {
+					pthread_mutex_lock(&server.lock);
+					server.num_conns--;
+					pthread_mutex_unlock(&server.lock);
+					close(fd);
+					free(conn);
+					continue;
+				}
+				pthread_detach(thread);
+			}
+			close(listen_fd);
+			unlink(opts->socket_path);
+			listen_fd = -1;
+
+			// The clients still connected keep using the workers until they hang up
+			pthread_mutex_lock(&server.lock);
+			while (server.num_conns > 0) {
+				pthread_cond_wait(&server.no_conns, &server.lock);
+			}
+			pthread_mutex_unlock(&server.lock);
+		}
+
+		// Let the workers finish what's queued, then stop them
+		pthread_mutex_lock(&server.lock);
+		server.stopping = 1;
+		pthread_cond_broadcast(&server.not_empty);
+		pthread_mutex_unlock(&server.lock);
+		for (int i = 0; i < server.num_threads; i++) {
+			pthread_join(server.threads[i], NULL);
+		}
+		if (server.metrics_fd >= 0) {
+			pthread_join(metrics, NULL);
+		}
+		pthread_cond_destroy(&server.no_conns);
+		pthread_cond_destroy(&server.not_empty);
+		pthread_mutex_destroy(&server.lock);
+	}
+
+	for (int i = 0; server.ctxs != NULL && i < opts->workers; i++) {
+		if (server.ctxs[i] != NULL) {
+			defog_destroy(server.ctxs[i]);
+		}
+	}
+	if (listen_fd >= 0) {
+		close(listen_fd);
+		unlink(opts->socket_path);
+	}
+	if (server.metrics_fd >= 0) {
+		close(server.metrics_fd);
+	}
+	free(server.ctxs);
+	free(server.threads);
+	free(workers);
+
+	return failed;
+}
@@ -0,0 +1,69 @@
+/* Copyright 2014-2015 David Pearson.
+ * All rights reserved.
+ *
+ * A long-running defogging server, which keeps a pool of workers (each with its own context) busy
+ * with images sent over a Unix domain socket or through stdin and stdout, so that starting up and
+ * allocating buffers is only paid for once rather than for every image.
+ *
+ * Every request and response starts with a header of 32-bit unsigned integers in network byte
+ * order. A request is
+ *
+ *     SERVER_MAGIC, flags, width, height, length
+ *
+ * followed by length bytes: width x height packed 8-bit BGR pixels, or, with SERVER_ENCODED, an
+ * image file in any format OpenCV reads (whose own width and height are used instead). The
+ * response is
+ *
+ *     SERVER_MAGIC, status, width, height, out_length, map_length
+ *
+ * followed by the defogged image as packed BGR pixels and then, with SERVER_WANT_MAP, the
+ * transmission map as packed 8-bit pixels; both lengths are 0 unless status is SERVER_OK. Any
+ * number of requests can be sent over one connection, each waiting for the previous response.
+ */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdio.h>
+
+#include "defog.h"
+
+// The first word of every request and response, "DFG1"
+#define SERVER_MAGIC 0x44464731
+
+// Request flags: return the transmission map too, and the payload is an encoded image file
+#define SERVER_WANT_MAP 1
+#define SERVER_ENCODED 2
+
+// Response statuses
+#define SERVER_OK 0
+#define SERVER_BAD_REQUEST 1
+#define SERVER_FAILED 2
+
+// The largest image, in pixels, that a request can hold
+#define SERVER_MAX_PIXELS (1 << 26)
+
+// How the server listens and spreads its work
+typedef struct {
+	// The path of the Unix domain socket to listen on, or "-" to serve a single client on stdin
+	// and stdout
+	const char *socket_path;
+
+	// The number of threads defogging images, each with its own context (and so its own
+	// params->num_threads bands)
+	int workers;
+
+	// Where a JSON line is written for each request, or NULL
+	FILE *telemetry;
+
+	// The TCP port that the totals are served on in the Prometheus text format (at /metrics), or 0
+	int metrics_port;
+
+	// The IPv4 address that the metrics are served on, or NULL for the loopback interface only,
+	// since they aren't authenticated
+	const char *metrics_address;
+} server_opts_t;
+
+int run_server(const defog_params_t *params, const server_opts_t *opts);
+
+#endif
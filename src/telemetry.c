@@ -0,0 +1,192 @@
+/* Copyright 2014-2015 David Pearson.
+ * All rights reserved.
+ *
+ * Per-image telemetry and server totals, see telemetry.h.
+ */
+
+// flockfile() and clock_gettime() are POSIX rather than C99
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "telemetry.h"
+
+// The upper bounds of the latency buckets, in seconds, around the 20 ms budget of a 1080p frame
+static const double latency_bounds[TELEMETRY_LATENCY_BUCKETS] = {0.005, 0.01, 0.02, 0.05, 0.1, 0.25, 0.5, 1.0};
+
+// Function definitions
+void write_json_string(FILE *file, const char *str);
+
+/* Reads a monotonic clock, for timing the work done around the library
+ *
+ * Returns the current time in seconds
+ */
+double telemetry_time(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+/* Writes a string as a quoted JSON string, escaping anything that needs it
+ *
+ * file - The file to write to
+ * str - The string
+ */
+void write_json_string(FILE *file, const char *str) {
+	fputc('"', file);
+	for (const unsigned char *c = (const unsigned char *)str; *c != '\0'; c++) {
+		if (*c == '"' || *c == '\\') {
+			fprintf(file, "\\%c", *c);
+		} else if (*c < 0x20) {
+			fprintf(file, "\\u%04x", *c);
+		} else {
+			fputc(*c, file);
+		}
+	}
+	fputc('"', file);
+}
+
+/* Writes the telemetry of one image as a single line of JSON, which is written in one piece even
+ * if other threads share the file
+ *
+ * file - The file to write to
+ * name - The path of the image, or whatever else identifies it
+ * frame - The index of the frame in a video (or of the request to a server), or -1 for a still image
+ * width - The width of the image
+ * height - The height of the image
+ * failed - Whether the image couldn't be defogged, in which case only the I/O times are written
+ * stats - The stats of the image, from defog_get_stats()
+ * io - The time spent around the library, or NULL if none was
+ */
+void telemetry_write_json(FILE *file, const char *name, int frame, int width, int height, int failed,
+		const defog_stats_t *stats, const telemetry_io_t *io) {
+	flockfile(file);
+
+	fprintf(file, "{\"image\":");
+	write_json_string(file, name);
+	if (frame >= 0) {
+		fprintf(file, ",\"frame\":%d", frame);
+	}
+	fprintf(file, ",\"width\":%d,\"height\":%d,\"ok\":%s", width, height, failed ? "false" : "true");
+	if (io != NULL) {
+		fprintf(file, ",\"decode_ms\":%.3f,\"evaluate_ms\":%.3f,\"encode_ms\":%.3f,\"wait_ms\":%.3f",
+			io->decode_time * 1e3, io->evaluate_time * 1e3, io->encode_time * 1e3, io->wait_time * 1e3);
+	}
+
+	if (!failed) {
+		fprintf(file, ",\"convert_ms\":%.3f,\"pyramid_ms\":%.3f,\"light_ms\":%.3f,\"dark_ms\":%.3f,\"refine_ms\":%.3f,\"recover_ms\":%.3f,\"defog_ms\":%.3f",
+			stats->convert_time * 1e3, stats->pyramid_time * 1e3, stats->light_time * 1e3, stats->dark_time * 1e3,
+			stats->refine_time * 1e3, stats->recover_time * 1e3, stats->total_time * 1e3);
+		fprintf(file, ",\"light\":[%.2f,%.2f,%.2f]", stats->light.bgr[0], stats->light.bgr[1], stats->light.bgr[2]);
+		fprintf(file, ",\"transmission_samples\":%d,\"transmission_mean\":%.4f,\"transmission_floored\":%.4f",
+			stats->transmission_samples, stats->transmission_mean, stats->transmission_floored);
+		fprintf(file, ",\"transmission_histogram\":[");
+		for (int i = 0; i < DEFOG_TRANSMISSION_BINS; i++) {
+			fprintf(file, i > 0 ? ",%d" : "%d", stats->transmission_histogram[i]);
+		}
+		fputc(']', file);
+	}
+	fprintf(file, "}\n");
+	fflush(file);
+
+	funlockfile(file);
+}
+
+/* Adds a successfully defogged image to a server's totals
+ *
+ * totals - The totals
+ * stats - The stats of the image, from defog_get_stats()
+ * latency - How long the request took to answer, in seconds
+ */
+void telemetry_add(telemetry_totals_t *totals, const defog_stats_t *stats, double latency) {
+	totals->ok++;
+	totals->convert_time += stats->convert_time;
+	totals->pyramid_time += stats->pyramid_time;
+	totals->light_time += stats->light_time;
+	totals->dark_time += stats->dark_time;
+	totals->refine_time += stats->refine_time;
+	totals->recover_time += stats->recover_time;
+	totals->total_time += stats->total_time;
+
+	for (int i = 0; i < TELEMETRY_LATENCY_BUCKETS; i++) {
+		if (latency <= latency_bounds[i]) {
+			totals->latency_counts[i]++;
+		}
+	}
+	totals->latency_sum += latency;
+
+	for (int i = 0; i < DEFOG_TRANSMISSION_BINS; i++) {
+		totals->transmission_histogram[i] += stats->transmission_histogram[i];
+	}
+	totals->transmission_samples += stats->transmission_samples;
+	totals->transmission_sum += stats->transmission_mean * stats->transmission_samples;
+	totals->transmission_floored += stats->transmission_floored * stats->transmission_samples;
+
+	totals->last_light = stats->light;
+	totals->last_floored = stats->transmission_floored;
+}
+
+/* Writes a server's totals in the Prometheus text exposition format
+ *
+ * file - The file to write to
+ * totals - The totals
+ */
+void telemetry_write_prometheus(FILE *file, const telemetry_totals_t *totals) {
+	fprintf(file, "# HELP defog_requests_total Requests answered, by status.\n");
+	fprintf(file, "# TYPE defog_requests_total counter\n");
+	fprintf(file, "defog_requests_total{status=\"ok\"} %ld\n", totals->ok);
+	fprintf(file, "defog_requests_total{status=\"failed\"} %ld\n", totals->failed);
+	fprintf(file, "defog_requests_total{status=\"bad_request\"} %ld\n", totals->bad);
+
+	// Stages run on every thread, so their times can add up to more than the wall time
+	fprintf(file, "# HELP defog_stage_seconds_total Time spent in each stage of defogging, summed over threads.\n");
+	fprintf(file, "# TYPE defog_stage_seconds_total counter\n");
+	fprintf(file, "defog_stage_seconds_total{stage=\"convert\"} %.6f\n", totals->convert_time);
+	fprintf(file, "defog_stage_seconds_total{stage=\"pyramid\"} %.6f\n", totals->pyramid_time);
+	fprintf(file, "defog_stage_seconds_total{stage=\"light\"} %.6f\n", totals->light_time);
+	fprintf(file, "defog_stage_seconds_total{stage=\"dark\"} %.6f\n", totals->dark_time);
+	fprintf(file, "defog_stage_seconds_total{stage=\"refine\"} %.6f\n", totals->refine_time);
+	fprintf(file, "defog_stage_seconds_total{stage=\"recover\"} %.6f\n", totals->recover_time);
+	fprintf(file, "defog_stage_seconds_total{stage=\"total\"} %.6f\n", totals->total_time);
+
+	fprintf(file, "# HELP defog_request_seconds Time from reading a request to its response being ready.\n");
+	fprintf(file, "# TYPE defog_request_seconds histogram\n");
+	for (int i = 0; i < TELEMETRY_LATENCY_BUCKETS; i++) {
+		fprintf(file, "defog_request_seconds_bucket{le=\"%g\"} %ld\n", latency_bounds[i], totals->latency_counts[i]);
+	}
+	fprintf(file, "defog_request_seconds_bucket{le=\"+Inf\"} %ld\n", totals->ok);
+	fprintf(file, "defog_request_seconds_sum %.6f\n", totals->latency_sum);
+	fprintf(file, "defog_request_seconds_count %ld\n", totals->ok);
+
+	// The bins are cumulative here, as Prometheus expects, and each bound is the highest 8-bit
+	// value in its bin
+	fprintf(file, "# HELP defog_transmission Sampled transmission map values.\n");
+	fprintf(file, "# TYPE defog_transmission histogram\n");
+	long cumulative = 0;
+	for (int i = 0; i < DEFOG_TRANSMISSION_BINS; i++) {
+		cumulative += totals->transmission_histogram[i];
+		if (i < DEFOG_TRANSMISSION_BINS - 1) {
+			double bound = (double)((i + 1) * (UINT8_MAX + 1) / DEFOG_TRANSMISSION_BINS - 1) / UINT8_MAX;
+			fprintf(file, "defog_transmission_bucket{le=\"%.4f\"} %ld\n", bound, cumulative);
+		}
+	}
+	fprintf(file, "defog_transmission_bucket{le=\"+Inf\"} %ld\n", cumulative);
+	fprintf(file, "defog_transmission_sum %.4f\n", totals->transmission_sum);
+	fprintf(file, "defog_transmission_count %ld\n", totals->transmission_samples);
+
+	fprintf(file, "# HELP defog_transmission_floored_total Sampled pixels whose transmission was clamped to the floor.\n");
+	fprintf(file, "# TYPE defog_transmission_floored_total counter\n");
+	fprintf(file, "defog_transmission_floored_total %.0f\n", totals->transmission_floored);
+
+	fprintf(file, "# HELP defog_last_floored_ratio Fraction of the most recent image's transmission at the floor.\n");
+	fprintf(file, "# TYPE defog_last_floored_ratio gauge\n");
+	fprintf(file, "defog_last_floored_ratio %.4f\n", totals->last_floored);
+
+	fprintf(file, "# HELP defog_last_light Atmospheric light of the most recent image, by channel.\n");
+	fprintf(file, "# TYPE defog_last_light gauge\n");
+	fprintf(file, "defog_last_light{channel=\"blue\"} %.2f\n", totals->last_light.bgr[0]);
+	fprintf(file, "defog_last_light{channel=\"green\"} %.2f\n", totals->last_light.bgr[1]);
+	fprintf(file, "defog_last_light{channel=\"red\"} %.2f\n", totals->last_light.bgr[2]);
+}
@@ -0,0 +1,73 @@
+/* Copyright 2014-2015 David Pearson.
+ * All rights reserved.
+ *
+ * Telemetry for defogging in production: a JSON line for each image with the time of every stage,
+ * the atmospheric light, and a summary of the transmission map, and running totals of the same
+ * that a server exposes in the Prometheus text format.
+ */
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdio.h>
+
+#include "defog.h"
+
+// The number of buckets (other than +Inf) in the histogram of request latencies
+#define TELEMETRY_LATENCY_BUCKETS 8
+
+// The time spent on an image outside the library, in seconds, or 0 for anything that wasn't done
+typedef struct {
+	// Reading and decoding the input
+	double decode_time;
+
+	// Evaluating the input and the output with --metric
+	double evaluate_time;
+
+	// Encoding and writing the output and the map
+	double encode_time;
+
+	// Waiting in a queue for a worker to defog the image
+	double wait_time;
+} telemetry_io_t;
+
+// Totals over every image a server has defogged, which the caller guards with a lock of its own
+typedef struct {
+	// Requests answered successfully, requests that couldn't be defogged, and malformed requests
+	long ok;
+	long failed;
+	long bad;
+
+	// The total time of each of the library's stages, as in defog_stats_t
+	double convert_time;
+	double pyramid_time;
+	double light_time;
+	double dark_time;
+	double refine_time;
+	double recover_time;
+	double total_time;
+
+	// How many requests took at most each bucket's bound (from 5 ms up to 1 s) to answer, from
+	// being read to the response being ready, and their total time
+	long latency_counts[TELEMETRY_LATENCY_BUCKETS];
+	double latency_sum;
+
+	// The sampled transmission of every image, as in defog_stats_t, along with the sum of the
+	// samples (in [0, 1]) and the number of them that were below the floor
+	long transmission_histogram[DEFOG_TRANSMISSION_BINS];
+	long transmission_samples;
+	double transmission_sum;
+	double transmission_floored;
+
+	// The atmospheric light and floored fraction of the most recent image, to watch for drift
+	defog_light_t last_light;
+	double last_floored;
+} telemetry_totals_t;
+
+double telemetry_time(void);
+void telemetry_write_json(FILE *file, const char *name, int frame, int width, int height, int failed,
+	const defog_stats_t *stats, const telemetry_io_t *io);
+void telemetry_add(telemetry_totals_t *totals, const defog_stats_t *stats, double latency);
+void telemetry_write_prometheus(FILE *file, const telemetry_totals_t *totals);
+
+#endif
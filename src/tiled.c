@@ -0,0 +1,429 @@
+/* Copyright 2014-2015 David Pearson.
+ * All rights reserved.
+ *
+ * Tiled defogging of images too large to hold in memory, see tiled.h.
+ */
+
+// pread() and pwrite() are POSIX rather than C99, and the files can be larger than 2 GB
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <cv.h>
+
+#include "tiled.h"
+
+// The longest side of the downsampled copy that the atmospheric light is estimated from
+#define SAMPLE_SIZE 2048
+
+// An image stored as raw pixels after a PPM or PGM header, which is read or written in place
+typedef struct {
+	int fd;
+	int width;
+	int height;
+	int channels;
+	off_t data_offset;
+} raw_image_t;
+
+// Function definitions
+int pread_all(int fd, void *buf, size_t len, off_t offset);
+int pwrite_all(int fd, const void *buf, size_t len, off_t offset);
+int open_raw_image(raw_image_t *img, const char *path);
+int create_raw_image(raw_image_t *img, const char *path, int width, int height, int channels);
+int read_pixels(const raw_image_t *img, int x, int y, int count, uint8_t *dst);
+int write_pixels(const raw_image_t *img, int x, int y, int count, uint8_t *src);
+int tile_halo(const defog_params_t *params);
+int sample_light(defog_ctx_t *ctx, const raw_image_t *in, uint8_t *row, int chunk, defog_light_t *light);
+
+/* Reads from a file until a whole buffer has been filled
+ *
+ * fd - The file
+ * buf - The buffer
+ * len - The number of bytes to read
+ * offset - Where in the file to start reading
+ *
+ * Returns 0 on success or -1 on an error or the end of the file
+ */
+int pread_all(int fd, void *buf, size_t len, off_t offset) {
+	uint8_t *dst = buf;
+	while (len > 0) {
+		ssize_t got = pread(fd, dst, len, offset);
+		if (got <= 0) {
+			return -1;
+		}
+		dst += got;
+		len -= got;
+		offset += got;
+	}
+
+	return 0;
+}
+
+/* Writes a whole buffer to a file
+ *
+ * fd - The file
+ * buf - The buffer
+ * len - The number of bytes to write
+ * offset - Where in the file to start writing
+ *
+ * Returns 0 on success or -1 on an error
+ */
+int pwrite_all(int fd, const void *buf, size_t len, off_t offset) {
+	const uint8_t *src = buf;
+	while (len > 0) {
+		ssize_t put = pwrite(fd, src, len, offset);
+		if (put <= 0) {
+			return -1;
+		}
+		src += put;
+		len -= put;
+		offset += put;
+	}
+
+	return 0;
+}
+
+/* Opens a binary PPM image for reading, without reading any of its pixels
+ *
+ * img - Where the image's description is written
+ * path - The path of the image
+ *
+ * Returns 0 on success or -1 if the file couldn't be opened or isn't an 8-bit binary PPM
+ */
+int open_raw_image(raw_image_t *img, const char *path) {
+	img->fd = open(path, O_RDONLY);
+	if (img->fd < 0) {
+		return -1;
+	}
+
+	// The header is plain text, with comments running from # to the end of a line
+	char header[512];
+	ssize_t len = pread(img->fd, header, sizeof(header), 0);
+	int vals[3];
+	ssize_t pos = 2;
+	if (len < 2 || header[0] != 'P' || header[1] != '6') {
+		close(img->fd);
+		return -1;
+	}
+	for (int i = 0; i < 3; i++) {
+		while (pos < len && (isspace((unsigned char)header[pos]) || header[pos] == '#')) {
+			if (header[pos] == '#') {
+				while (pos < len && header[pos] != '\n') {
+					pos++;
+				}
+			} else {
+				pos++;
+			}
+		}
+
+		vals[i] = 0;
+		ssize_t start = pos;
+		while (pos < len && isdigit((unsigned char)header[pos]) && vals[i] < 1000000) {
+			vals[i] = vals[i] * 10 + (header[pos] - '0');
+			pos++;
+		}
+		if (pos == start) {
+			close(img->fd);
+			return -1;
+		}
+	}
+
+	// Exactly one whitespace character separates the header from the pixels
+	if (pos >= len || !isspace((unsigned char)header[pos]) || vals[0] < 1 || vals[1] < 1 || vals[2] != 255) {
+		close(img->fd);
+		return -1;
+	}
+	img->width = vals[0];
+	img->height = vals[1];
+	img->channels = 3;
+	img->data_offset = pos + 1;
+
+	return 0;
+}
+
+/* Creates a binary PPM or PGM image of a given size, whose pixels are written later
+ *
+ * img - Where the image's description is written
+ * path - The path of the image
+ * width - The width of the image
+ * height - The height of the image
+ * channels - 3 for a color (PPM) image or 1 for a grayscale (PGM) image
+ *
+ * Returns 0 on success or -1 if the file couldn't be created
+ */
+int create_raw_image(raw_image_t *img, const char *path, int width, int height, int channels) {
+	img->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (img->fd < 0) {
+		return -1;
+	}
+
+	char header[64];
+	int len = snprintf(header, sizeof(header), "P%d\n%d %d\n255\n", channels == 3 ? 6 : 5, width, height);
+	img->width = width;
+	img->height = height;
+	img->channels = channels;
+	img->data_offset = len;
+
+	// Size the file up front, so that tiles can be written in any order
+	if (pwrite_all(img->fd, header, len, 0) != 0 ||
+			ftruncate(img->fd, img->data_offset + (off_t)width * height * channels) != 0) {
+		close(img->fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Reads part of a row of pixels, converting them from RGB to the BGR order that the rest of the
+ * program uses
+ *
+ * img - The image to read from
+ * x - The first column to read
+ * y - The row to read
+ * count - The number of pixels to read
+ * dst - Where the pixels are written
+ *
+ * Returns 0 on success or -1 on failure
+ */
+int read_pixels(const raw_image_t *img, int x, int y, int count, uint8_t *dst) {
+	off_t offset = img->data_offset + ((off_t)y * img->width + x) * img->channels;
+	if (pread_all(img->fd, dst, (size_t)count * img->channels, offset) != 0) {
+		return -1;
+	}
+
+	if (img->channels == 3) {
+		for (int i = 0; i < count; i++) {
+			uint8_t red = dst[i * 3];
+			dst[i * 3] = dst[i * 3 + 2];
+			dst[i * 3 + 2] = red;
+		}
+	}
+
+	return 0;
+}
+
+/* Writes part of a row of pixels, converting them from BGR to RGB
+ *
+ * img - The image to write to
+ * x - The first column to write
+ * y - The row to write
+ * count - The number of pixels to write
+ * src - The pixels, which are converted in place
+ *
+ * Returns 0 on success or -1 on failure
+ */
+int write_pixels(const raw_image_t *img, int x, int y, int count, uint8_t *src) {
+	if (img->channels == 3) {
+		for (int i = 0; i < count; i++) {
+			uint8_t blue = src[i * 3];
+			src[i * 3] = src[i * 3 + 2];
+			src[i * 3 + 2] = blue;
+		}
+	}
+
+	off_t offset = img->data_offset + ((off_t)y * img->width + x) * img->channels;
+	return pwrite_all(img->fd, src, (size_t)count * img->channels, offset);
+}
+
+/* Works out how far around a tile the pixels that affect it can be, so that each tile is
+ * defogged exactly as it would be as part of the whole image
+ *
+ * params - The defogging parameters
+ *
+ * Returns the width of the halo, in pixels, that each tile needs on every side
+ */
+int tile_halo(const defog_params_t *params) {
+	// The dark channel reaches half a window in each direction, and the guided filter averages
+	// its coefficients over the same radius that it averaged the image over, so it reaches twice
+	// as far; in pyramid mode, the filter always runs
+	int radius = params->refine_radius;
+	if (params->pyramid_levels > 0 && radius == 0) {
+		radius = params->window;
+	}
+	int window = params->window_height > params->window ? params->window_height : params->window;
+	int halo = window / 2 + 2 * radius;
+
+	// In pyramid mode, cvPyrDown()'s 5x5 kernel reaches two more pixels at every level, and the
+	// halo is rounded so that every tile lines up with the grid of the smallest level
+	if (params->pyramid_levels > 0) {
+		int scale = 1 << params->pyramid_levels;
+		halo += 2 * scale;
+		halo = (halo + scale - 1) / scale * scale;
+	}
+
+	return halo;
+}
+
+/* Estimates the atmospheric light of a whole image from a copy of it that has been downsampled by
+ * taking every few pixels of every few rows, which is small enough to hold in memory
+ *
+ * ctx - The defogging context
+ * in - The image
+ * row - A buffer for chunk pixels
+ * chunk - How many pixels of a row are read at once
+ *
+ * light - Where the atmospheric light is written
+ *
+ * Returns 0 on success or -1 on failure
+ */
+int sample_light(defog_ctx_t *ctx, const raw_image_t *in, uint8_t *row, int chunk, defog_light_t *light) {
+	int longest = in->width > in->height ? in->width : in->height;
+	int step = (longest + SAMPLE_SIZE - 1) / SAMPLE_SIZE;
+	CvSize size = cvSize((in->width + step - 1) / step, (in->height + step - 1) / step);
+	IplImage *sample = cvCreateImage(size, IPL_DEPTH_8U, 3);
+	if (sample == NULL) {
+		return -1;
+	}
+
+	for (int y = 0; y < size.height; y++) {
+		uint8_t *dst = (uint8_t *)(sample->imageData + (size_t)y * sample->widthStep);
+		for (int x1 = 0; x1 < in->width; x1 += chunk) {
+			int count = in->width - x1 < chunk ? in->width - x1 : chunk;
+			if (read_pixels(in, x1, y * step, count, row) != 0) {
+				cvReleaseImage(&sample);
+				return -1;
+			}
+
+			// Keep every step-th pixel, starting from the first of the row
+			for (int x = (x1 + step - 1) / step * step; x < x1 + count; x += step) {
+				memcpy(dst + (x / step) * 3, row + (x - x1) * 3, 3);
+			}
+		}
+	}
+
+	int failed = defog_estimate_light(ctx, sample, light);
+	cvReleaseImage(&sample);
+
+	return failed;
+}
+
+/* Defogs a binary PPM image a tile at a time, so that only a few tiles' worth of pixels are ever
+ * in memory; the atmospheric light is estimated from a downsampled first pass over the image, and
+ * each tile is defogged along with a halo of the pixels around it, so that the seams between
+ * tiles don't show
+ *
+ * ctx - The defogging context
+ * params - The parameters that ctx was created with
+ * tile_size - The width and height of each tile, not counting its halo
+ * in_path - The path of the 8-bit binary PPM image to defog
+ * out_path - Where the defogged image is written, as a binary PPM
+ * map_path - Where the transmission map is written, as a binary PGM, or NULL if it isn't needed
+ * num_tiles - Where the number of tiles that the image was split into is written, or NULL
+ *
+ * Returns 0 on success or 1 on failure
+ */
+int defog_tiled(defog_ctx_t *ctx, const defog_params_t *params, int tile_size, const char *in_path, const char *out_path,
+		const char *map_path, int *num_tiles) {
+	raw_image_t in;
+	raw_image_t out = {.fd = -1};
+	raw_image_t map = {.fd = -1};
+	if (open_raw_image(&in, in_path) != 0) {
+		fprintf(stderr, "Could not read image %s, which must be an 8-bit binary PPM\n", in_path);
+		return 1;
+	}
+
+	// In pyramid mode, tiles have to line up with the grid of the smallest level too
+	int halo = tile_halo(params);
+	int scale = 1 << (params->pyramid_levels > 0 ? params->pyramid_levels : 0);
+	tile_size = (tile_size + scale - 1) / scale * scale;
+
+	// Buffers for one tile and its halo, which are all that's kept of the image
+	int span = tile_size + 2 * halo;
+	size_t step = (size_t)span * 3;
+	uint8_t *in_buf = malloc(step * span);
+	uint8_t *out_buf = malloc(step * span);
+	uint8_t *map_buf = malloc((size_t)span * span);
+	int failed = in_buf == NULL || out_buf == NULL || map_buf == NULL;
+	if (failed) {
+		fprintf(stderr, "Could not allocate %dx%d tiles\n", span, span);
+	}
+
+	// Estimate the light for the whole image before any tile is defogged
+	defog_light_t light;
+	if (!failed) {
+		if (sample_light(ctx, &in, in_buf, span * span, &light) != 0) {
+			fprintf(stderr, "Could not estimate the atmospheric light of %s\n", in_path);
+			failed = 1;
+		}
+	}
+
+	if (!failed && (create_raw_image(&out, out_path, in.width, in.height, 3) != 0 ||
+			(map_path != NULL && create_raw_image(&map, map_path, in.width, in.height, 1) != 0))) {
+		fprintf(stderr, "Could not write image %s\n", out.fd < 0 ? out_path : map_path);
+		failed = 1;
+	}
+
+	int tiles = 0;
+	for (int y = 0; y < in.height && !failed; y += tile_size) {
+		for (int x = 0; x < in.width && !failed; x += tile_size) {
+			// The tile, and the tile with its halo, clipped to the image
+			int x2 = x + tile_size < in.width ? x + tile_size : in.width;
+			int y2 = y + tile_size < in.height ? y + tile_size : in.height;
+			int halo_x1 = x - halo > 0 ? x - halo : 0;
+			int halo_y1 = y - halo > 0 ? y - halo : 0;
+			int halo_x2 = x2 + halo < in.width ? x2 + halo : in.width;
+			int halo_y2 = y2 + halo < in.height ? y2 + halo : in.height;
+			CvSize size = cvSize(halo_x2 - halo_x1, halo_y2 - halo_y1);
+
+			for (int row = 0; row < size.height && !failed; row++) {
+				failed = read_pixels(&in, halo_x1, halo_y1 + row, size.width, in_buf + row * step) != 0;
+			}
+			if (failed) {
+				fprintf(stderr, "Could not read image %s\n", in_path);
+				break;
+			}
+
+			// Wrap the buffers in headers, so the library can work on them directly
+			IplImage in_img;
+			IplImage out_img;
+			IplImage map_img;
+			defog_wrap_buffer(&in_img, size.width, size.height, 3, &(defog_buffer_t){in_buf, step});
+			defog_wrap_buffer(&out_img, size.width, size.height, 3, &(defog_buffer_t){out_buf, step});
+			defog_wrap_buffer(&map_img, size.width, size.height, 1, &(defog_buffer_t){map_buf, span});
+			if (defog_process_with_light(ctx, &in_img, &light, &out_img, map_path != NULL ? &map_img : NULL) != 0) {
+				fprintf(stderr, "Could not defog image %s\n", in_path);
+				failed = 1;
+				break;
+			}
+
+			// Then write out the tile without its halo
+			for (int row = y; row < y2 && !failed; row++) {
+				size_t offset = (size_t)(row - halo_y1) * step + (x - halo_x1) * 3;
+				failed = write_pixels(&out, x, row, x2 - x, out_buf + offset) != 0;
+				if (!failed && map_path != NULL) {
+					offset = (size_t)(row - halo_y1) * span + (x - halo_x1);
+					failed = write_pixels(&map, x, row, x2 - x, map_buf + offset) != 0;
+				}
+			}
+			if (failed) {
+				fprintf(stderr, "Could not write image %s\n", out_path);
+			}
+			tiles++;
+		}
+	}
+	if (num_tiles != NULL) {
+		*num_tiles = tiles;
+	}
+
+	// Clean up
+	close(in.fd);
+	if (out.fd >= 0) {
+		close(out.fd);
+	}
+	if (map.fd >= 0) {
+		close(map.fd);
+	}
+	free(in_buf);
+	free(out_buf);
+	free(map_buf);
+
+	return failed;
+}
@@ -0,0 +1,16 @@
+/* Copyright 2014-2015 David Pearson.
+ * All rights reserved.
+ *
+ * Defogging images too large to hold in memory, which are read and written a tile at a time as
+ * binary PPM (and PGM, for the transmission map) files.
+ */
+
+#ifndef TILED_H
+#define TILED_H
+
+#include "defog.h"
+
+int defog_tiled(defog_ctx_t *ctx, const defog_params_t *params, int tile_size, const char *in_path, const char *out_path,
+	const char *map_path, int *num_tiles);
+
+#endif
@@ -0,0 +1,875 @@
+/* Copyright 2014-2015 David Pearson.
+ * All rights reserved.
+ *
+ * A regression check for the fast paths of the defogging pipeline, see verify.h.
+ */
+
+// mkdtemp() is POSIX rather than C99
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cv.h>
+#include <highgui.h>
+
+#include "bench.h"
+#include "telemetry.h"
+#include "tiled.h"
+#include "verify.h"
+
+// The number of threads that the multithreaded variants split each image between
+#define VERIFY_THREADS 4
+
+// The lowest PSNR, in dB, that the output or the map of a variant that's allowed to differ from
+// the reference may have; every value being one step off is about 48 dB
+#define VERIFY_MIN_PSNR 45.0
+
+// The sampling step of the light-step variant, unless --light-step asks for a coarser one
+#define VERIFY_LIGHT_STEP 4
+
+// The largest difference and the lowest PSNR allowed for the light-step variant; a sampled light
+// is only close to the exact one, and each tile of a grid (or a downsampled pyramid level) has few
+// enough pixels that its brightest ones can move by several steps, so this only catches a light
+// that's badly wrong
+#define VERIFY_SAMPLED_MAX_DIFF 32
+#define VERIFY_SAMPLED_MIN_PSNR 30.0
+
+// The fewest pixels that each light has to be sampled from for the light-step variant to be
+// checked; with fewer, the brightest 0.1% of them is only a handful of pixels, and which ones the
+// lattice happens to land on can move the light far more than the tolerance allows
+#define VERIFY_MIN_SAMPLES 10000
+
+// The size of the tiles that the tiled variant defogs each image in, which is small enough that
+// even the smaller synthetic image is split into several, with partial tiles at its edges
+#define VERIFY_TILE_SIZE 256
+
+// The radius, pyramid levels, and grid that the refine, pyramid, and light-grid configurations
+// turn on, unless the command line already asks for them
+#define VERIFY_REFINE_RADIUS 8
+#define VERIFY_PYRAMID_LEVELS 1
+#define VERIFY_LIGHT_GRID 3
+
+// The longest key that a variant's throughput is recorded under in a baseline
+#define VERIFY_KEY_LEN 512
+
+// A faster way of defogging than the reference (the exact scalar kernels on a single thread, with
+// the light estimated from every pixel of the whole 8-bit image), and how far its results may
+// stray from the reference's
+typedef struct {
+	const char *name;
+	int use_simd;
+	int fixed_point;
+	int planar;
+	int num_threads;
+	int use_gpu;
+
+	// How often the light is sampled (1 for every pixel), the depth that the image is converted to
+	// and defogged at (0 for 8 bits), and the size of the tiles that it is defogged in through
+	// PPM files with defog_tiled() (0 to defog it whole)
+	int light_step;
+	int depth;
+	int tile_size;
+
+	// The largest difference allowed in any value of the output or the map, and the lowest PSNR
+	// allowed for either of them when they aren't identical
+	int max_diff;
+	double min_psnr;
+} verify_variant_t;
+
+// The stages that are turned on for every variant, so that each of them is checked against a
+// reference that takes the same slow path
+typedef struct {
+	const char *name;
+	int refine_radius;
+	int pyramid_levels;
+	int light_grid;
+} verify_config_t;
+
+// The throughputs recorded by an earlier run, one line each of the throughput in megapixels per
+// second followed by the key of the variant and the image
+typedef struct {
+	char (*keys)[VERIFY_KEY_LEN];
+	double *throughputs;
+	int count;
+} baseline_t;
+
+static const verify_variant_t verify_reference = {"reference", 0, 0, 0, 1, 0, 1, 0, 0, 0, 0.0};
+
+// The exact kernels have to match the reference exactly however the work is split up, and so do
+// tiles, since each is defogged with a halo that covers everything reaching into it; the single
+// precision, fixed point, and deeper kernels have to stay within a step of it. Sampling the light
+// can find a slightly different one, which shifts every value a little
+static const verify_variant_t verify_variants[] = {
+	{"threads", 0, 0, 0, VERIFY_THREADS, 0, 1, 0, 0, 0, 0.0},
+	{"planar", 0, 0, 1, 1, 0, 1, 0, 0, 0, 0.0},
+	{"simd", 1, 0, 0, 1, 0, 1, 0, 0, 1, VERIFY_MIN_PSNR},
+	{"simd-threads", 1, 0, 0, VERIFY_THREADS, 0, 1, 0, 0, 1, VERIFY_MIN_PSNR},
+	{"simd-planar", 1, 0, 1, 1, 0, 1, 0, 0, 1, VERIFY_MIN_PSNR},
+	{"fixed-point", 0, 1, 0, 1, 0, 1, 0, 0, 1, VERIFY_MIN_PSNR},
+	{"16-bit", 0, 0, 0, 1, 0, 1, IPL_DEPTH_16U, 0, 1, VERIFY_MIN_PSNR},
+	{"float", 0, 0, 0, 1, 0, 1, IPL_DEPTH_32F, 0, 1, VERIFY_MIN_PSNR},
+	{"light-step", 0, 0, 0, 1, 0, VERIFY_LIGHT_STEP, 0, 0, VERIFY_SAMPLED_MAX_DIFF, VERIFY_SAMPLED_MIN_PSNR},
+	{"tiled", 0, 0, 0, 1, 0, 1, 0, VERIFY_TILE_SIZE, 0, 0.0},
+	{"gpu", 1, 0, 0, 1, 1, 1, 0, 0, 1, VERIFY_MIN_PSNR}
+};
+
+// The first configuration is the command line's parameters as they are, and each of the others
+// also turns on one of the stages that have paths of their own
+static const verify_config_t verify_configs[] = {
+	{"", 0, 0, 0},
+	{"refine", VERIFY_REFINE_RADIUS, 0, 0},
+	{"pyramid", 0, VERIFY_PYRAMID_LEVELS, 0},
+	{"light-grid", 0, 0, VERIFY_LIGHT_GRID}
+};
+
+// A render of a preview: the window and floor that are set before it (0 for those of the command
+// line), and the part of the image it renders, as fractions of the image's width and height
+typedef struct {
+	int window;
+	int window_height;
+	double floor;
+	double x;
+	double y;
+	double width;
+	double height;
+} verify_preview_step_t;
+
+// The renders that every preview goes through, each of which has to match defog_process() with
+// the same window and floor exactly, inside the part rendered
+static const verify_preview_step_t verify_preview_steps[] = {
+	// The first view finds the dark channel of the tiles that it covers, and panning over some of
+	// them again only finds the new ones
+	{0, 0, 0.0, 0.0, 0.0, 0.5, 0.45},
+	{0, 0, 0.0, 0.3, 0.2, 0.5, 0.6},
+
+	// A new floor only reruns the recovery, and a new window finds every tile in view again
+	{0, 0, 0.3, 0.3, 0.2, 0.5, 0.6},
+	{15, 7, 0.3, 0.3, 0.2, 0.5, 0.6},
+
+	// A view hanging off the bottom right corner is clamped, and its partial tiles are found too
+	{15, 7, 0.8, 0.6, 0.7, 0.6, 0.5},
+
+	// Going back to the first window mustn't reuse any tiles found for the last one
+	{0, 0, 0.0, 0.0, 0.0, 1.0, 1.0},
+	{31, 31, 0.54, 0.1, 0.1, 0.3, 0.3}
+};
+
+// The sizes that synthetic images are generated at; the first is odd in both directions, so that
+// the SIMD kernels have to finish off partial vectors and the bands can't split it evenly
+static const CvSize verify_sizes[] = {
+	{641, 479},
+	{1920, 1080}
+};
+
+#define COUNT(array) ((int)(sizeof(array) / sizeof((array)[0])))
+
+// Function definitions
+void compare_images(const IplImage *a, const IplImage *b, CvRect rect, int *max_diff, double *psnr);
+int load_baseline(const char *path, baseline_t *baseline);
+double find_baseline(const baseline_t *baseline, const char *key);
+void free_baseline(baseline_t *baseline);
+int compare_times(const void *a, const void *b);
+double median_time(double *times, int count);
+int write_ppm(const char *path, const IplImage *img);
+int defog_tiled_variant(const defog_params_t *params, int tile_size, int runs, IplImage *img, IplImage *out, IplImage *map,
+	double *times);
+int defog_variant(const defog_params_t *params, const verify_variant_t *variant, int runs, IplImage *img, IplImage *out,
+	IplImage *map, double *throughput);
+int apply_config(const defog_params_t *params, const verify_config_t *config, defog_params_t *dst);
+int finish_line(const baseline_t *baseline, FILE *save, const char *key, double throughput, const char *result);
+int verify_preview(const defog_params_t *params, const verify_config_t *config, const verify_opts_t *opts,
+	const baseline_t *baseline, FILE *save, const char *name, IplImage *img);
+int verify_config(const defog_params_t *params, const verify_config_t *config, const verify_opts_t *opts,
+	const baseline_t *baseline, FILE *save, const char *name, IplImage *img);
+int verify_image(const defog_params_t *params, const verify_opts_t *opts, const baseline_t *baseline, FILE *save,
+	const char *name, IplImage *img);
+
+/* Compares part of two 8-bit images of the same size and number of channels
+ *
+ * a - The first image
+ * b - The second image
+ * rect - The part of the images to compare, which must be inside both
+ * max_diff - Where the largest absolute difference between any two values is written
+ * psnr - Where the peak signal-to-noise ratio of b against a is written, in dB, which is infinite
+ *        if they are identical
+ */
+void compare_images(const IplImage *a, const IplImage *b, CvRect rect, int *max_diff, double *psnr) {
+	int row_len = rect.width * a->nChannels;
+	double sum_sq = 0.0;
+	*max_diff = 0;
+
+	for (int y = rect.y; y < rect.y + rect.height; y++) {
+		const uint8_t *a_row = (const uint8_t *)(a->imageData + (size_t)y * a->widthStep) + rect.x * a->nChannels;
+		const uint8_t *b_row = (const uint8_t *)(b->imageData + (size_t)y * b->widthStep) + rect.x * b->nChannels;
+		for (int x = 0; x < row_len; x++) {
+			int diff = abs(a_row[x] - b_row[x]);
+			*max_diff = diff > *max_diff ? diff : *max_diff;
+			sum_sq += (double)diff * diff;
+		}
+	}
+
+	double mse = sum_sq / ((double)row_len * rect.height);
+	*psnr = mse > 0.0 ? 10.0 * log10(UINT8_MAX * UINT8_MAX / mse) : INFINITY;
+}
+
+/* Reads a baseline written by an earlier run
+ *
+ * path - The path of the baseline
+ * baseline - Where the baseline is read to, which must be freed with free_baseline() even if the
+ *            file couldn't be read
+ *
+ * Returns 0 on success or -1 if the file couldn't be read
+ */
+int load_baseline(const char *path, baseline_t *baseline) {
+	memset(baseline, 0, sizeof(*baseline));
+	FILE *file = fopen(path, "r");
+	if (file == NULL) {
+		return -1;
+	}
+
+	char line[VERIFY_KEY_LEN + 64];
+	int capacity = 0;
+	while (fgets(line, sizeof(line), file) != NULL) {
+		// Each line is the throughput, a space, and then the key, which runs to the end of the line
+		char *key;
+		double throughput = strtod(line, &key);
+		if (key == line || *key != ' ') {
+			continue;
+		}
+		key++;
+		key[strcspn(key, "\n")] = '\0';
+
+		if (baseline->count == capacity) {
+			capacity = capacity > 0 ? capacity * 2 : 64;
+			void *keys = realloc(baseline->keys, capacity * sizeof(baseline->keys[0]));
+			if (keys != NULL) {
+				baseline->keys = keys;
+			}
+			void *throughputs = realloc(baseline->throughputs, capacity * sizeof(double));
+			if (throughputs != NULL) {
+				baseline->throughputs = throughputs;
+			}
+			if (keys == NULL || throughputs == NULL) {
+				fclose(file);
+				return -1;
+			}
+		}
+		snprintf(baseline->keys[baseline->count], VERIFY_KEY_LEN, "%s", key);
+		baseline->throughputs[baseline->count] = throughput;
+		baseline->count++;
+	}
+
+	fclose(file);
+	return 0;
+}
+
+/* Looks up the throughput that a baseline recorded for a variant and an image
+ *
+ * baseline - The baseline
+ * key - The key of the variant and the image
+ *
+ * Returns the throughput in megapixels per second, or -1 if the baseline doesn't have it
+ */
+double find_baseline(const baseline_t *baseline, const char *key) {
+	for (int i = 0; i < baseline->count; i++) {
+		if (strcmp(baseline->keys[i], key) == 0) {
+			return baseline->throughputs[i];
+		}
+	}
+
+	return -1.0;
+}
+
+/* Frees a baseline read by load_baseline()
+ *
+ * baseline - The baseline
+ */
+void free_baseline(baseline_t *baseline) {
+	free(baseline->keys);
+	free(baseline->throughputs);
+	memset(baseline, 0, sizeof(*baseline));
+}
+
+/* Orders two times for qsort()
+ *
+ * a - The first time
+ * b - The second time
+ *
+ * Returns a negative number, zero, or a positive number as a is less than, equal to, or greater
+ * than b
+ */
+int compare_times(const void *a, const void *b) {
+	double diff = *(const double *)a - *(const double *)b;
+	return (diff > 0.0) - (diff < 0.0);
+}
+
+/* Finds the median of a set of times, which a single slow run on a busy machine doesn't move the
+ * way it moves the mean
+ *
+ * times - The times, which are sorted in place
+ * count - The number of times, at least 1
+ *
+ * Returns the median time
+ */
+double median_time(double *times, int count) {
+	qsort(times, count, sizeof(double), compare_times);
+	return count % 2 != 0 ? times[count / 2] : 0.5 * (times[count / 2 - 1] + times[count / 2]);
+}
+
+/* Writes an 8-bit BGR image as a binary PPM, the only format that tiled mode reads
+ *
+ * path - Where to write the image
+ * img - The image
+ *
+ * Returns 0 on success or -1 if the file couldn't be written
+ */
+int write_ppm(const char *path, const IplImage *img) {
+	FILE *file = fopen(path, "wb");
+	if (file == NULL) {
+		return -1;
+	}
+
+	// PPMs are RGB, so every pixel is swapped around
+	fprintf(file, "P6\n%d %d\n255\n", img->width, img->height);
+	uint8_t *row = (uint8_t *)malloc((size_t)img->width * 3);
+	int failed = row == NULL;
+	for (int y = 0; y < img->height && !failed; y++) {
+		const uint8_t *src = (const uint8_t *)(img->imageData + (size_t)y * img->widthStep);
+		for (int x = 0; x < img->width; x++) {
+			row[x * 3] = src[x * 3 + 2];
+			row[x * 3 + 1] = src[x * 3 + 1];
+			row[x * 3 + 2] = src[x * 3];
+		}
+		failed = fwrite(row, 3, img->width, file) != (size_t)img->width;
+	}
+	free(row);
+
+	return fclose(file) != 0 || failed ? -1 : 0;
+}
+
+/* Defogs an image a tile at a time with defog_tiled(), through PPM files in a directory of their
+ * own, once to get its results and then as many more times as it takes to measure its throughput
+ *
+ * params - The parameters to defog with
+ * tile_size - The width and height of each tile
+ * runs - How many times the image is defogged to measure the throughput
+ * img - The 8-bit BGR image
+ * out - Where the output is written
+ * map - Where the transmission map is written
+ * times - Where the time of each run, including reading and writing the files, is written
+ *
+ * Returns 0 on success or 1 if the image couldn't be defogged
+ */
+int defog_tiled_variant(const defog_params_t *params, int tile_size, int runs, IplImage *img, IplImage *out, IplImage *map,
+		double *times) {
+	char dir[] = "/tmp/defog-verify-XXXXXX";
+	if (mkdtemp(dir) == NULL) {
+		return 1;
+	}
+	char in_path[sizeof(dir) + 16];
+	char out_path[sizeof(dir) + 16];
+	char map_path[sizeof(dir) + 16];
+	snprintf(in_path, sizeof(in_path), "%s/in.ppm", dir);
+	snprintf(out_path, sizeof(out_path), "%s/out.ppm", dir);
+	snprintf(map_path, sizeof(map_path), "%s/map.pgm", dir);
+
+	defog_ctx_t *ctx = defog_create(params, tile_size, tile_size);
+	int failed = ctx == NULL || write_ppm(in_path, img) != 0;
+
+	// The first run's results are the ones compared, and it warms up the caches for the rest
+	for (int i = -1; i < runs && !failed; i++) {
+		double start = telemetry_time();
+		failed = defog_tiled(ctx, params, tile_size, in_path, out_path, map_path, NULL) != 0;
+		if (i >= 0) {
+			times[i] = telemetry_time() - start;
+		}
+	}
+	if (!failed) {
+		IplImage *tiled_out = (IplImage *)cvLoadImage(out_path, CV_LOAD_IMAGE_COLOR);
+		IplImage *tiled_map = (IplImage *)cvLoadImage(map_path, CV_LOAD_IMAGE_GRAYSCALE);
+		failed = tiled_out == NULL || tiled_map == NULL;
+		if (!failed) {
+			cvCopy(tiled_out, out, NULL);
+			cvCopy(tiled_map, map, NULL);
+		}
+		if (tiled_out != NULL) {
+			cvReleaseImage(&tiled_out);
+		}
+		if (tiled_map != NULL) {
+			cvReleaseImage(&tiled_map);
+		}
+	}
+
+	if (ctx != NULL) {
+		defog_destroy(ctx);
+	}
+	remove(in_path);
+	remove(out_path);
+	remove(map_path);
+	rmdir(dir);
+
+	return failed;
+}
+
+/* Defogs an image with a variant once to get its results, and then as many more times as it
+ * takes to measure its throughput
+ *
+ * params - The parameters to defog with, apart from those that the variant sets
+ * variant - The variant
+ * runs - How many times the image is defogged to measure the throughput
+ * img - The 8-bit BGR image
+ * out - Where the 8-bit output is written
+ * map - Where the transmission map is written
+ * throughput - Where the throughput of the median run, in megapixels per second, is written
+ *
+ * Returns 0 on success, 1 if the image couldn't be defogged, or -1 if the variant asks for a GPU
+ * and none is available
+ */
+int defog_variant(const defog_params_t *params, const verify_variant_t *variant, int runs, IplImage *img, IplImage *out,
+		IplImage *map, double *throughput) {
+	defog_params_t variant_params = *params;
+	variant_params.num_threads = variant->num_threads;
+	variant_params.use_simd = variant->use_simd;
+	variant_params.fixed_point = variant->fixed_point;
+	variant_params.planar = variant->planar;
+	variant_params.use_gpu = variant->use_gpu;
+	variant_params.light_step = variant->light_step;
+
+	double *times = (double *)malloc(runs * sizeof(double));
+	if (times == NULL) {
+		return 1;
+	}
+	if (variant->tile_size > 0) {
+		int failed = defog_tiled_variant(&variant_params, variant->tile_size, runs, img, out, map, times);
+		*throughput = failed ? 0.0 : img->width * (double)img->height * 1e-6 / median_time(times, runs);
+		free(times);
+		return failed;
+	}
+
+	// Deeper variants defog a copy of the image scaled up to their depth, which the 8-bit copy that
+	// their light and transmission are estimated from matches exactly
+	IplImage *in = img;
+	IplImage *deep_out = out;
+	double scale = variant->depth == IPL_DEPTH_16U ? 257.0 : variant->depth == IPL_DEPTH_32F ? 1.0 / 255.0 : 1.0;
+	if (variant->depth != 0) {
+		in = cvCreateImage(cvGetSize(img), variant->depth, 3);
+		deep_out = cvCreateImage(cvGetSize(img), variant->depth, 3);
+		cvConvertScale(img, in, scale, 0.0);
+	}
+
+	defog_ctx_t *ctx = defog_create(&variant_params, img->width, img->height);
+	int status = ctx == NULL;
+	if (ctx != NULL && variant->use_gpu && !defog_using_gpu(ctx)) {
+		status = -1;
+	}
+
+	// The first run's results are the ones compared, and it warms up the caches for the rest
+	if (status == 0 && defog_process(ctx, in, deep_out, map) != 0) {
+		status = 1;
+	}
+	for (int i = 0; i < runs && status == 0; i++) {
+		defog_stats_t stats;
+		defog_process(ctx, in, deep_out, map);
+		defog_get_stats(ctx, &stats);
+		times[i] = stats.total_time;
+	}
+	*throughput = status == 0 ? img->width * (double)img->height * 1e-6 / median_time(times, runs) : 0.0;
+
+	// Then bring the output back down to 8 bits to compare it, rounding and clamping it just as the
+	// 8-bit kernels do
+	if (variant->depth != 0) {
+		if (status == 0) {
+			cvConvertScale(deep_out, out, 1.0 / scale, 0.0);
+		}
+		cvReleaseImage(&in);
+		cvReleaseImage(&deep_out);
+	}
+	if (ctx != NULL) {
+		defog_destroy(ctx);
+	}
+	free(times);
+
+	return status;
+}
+
+/* Turns on a configuration's stages on top of the command line's parameters, leaving any that the
+ * command line already turned on as they are
+ *
+ * params - The command line's parameters
+ * config - The configuration
+ * dst - Where the parameters are written
+ *
+ * Returns 1 if the configuration changed anything (or is the first one) or 0 if it didn't
+ */
+int apply_config(const defog_params_t *params, const verify_config_t *config, defog_params_t *dst) {
+	*dst = *params;
+	int changed = config == &verify_configs[0];
+	if (config->refine_radius > 0 && dst->refine_radius == 0) {
+		dst->refine_radius = config->refine_radius;
+		changed = 1;
+	}
+	if (config->pyramid_levels > 0 && dst->pyramid_levels == 0) {
+		dst->pyramid_levels = config->pyramid_levels;
+		changed = 1;
+	}
+	if (config->light_grid > 0 && dst->light_grid == 0) {
+		dst->light_grid = config->light_grid;
+		changed = 1;
+	}
+
+	return changed;
+}
+
+/* Finishes a line of results with the throughput and the baseline's, and records the throughput
+ * in the new baseline, if one is being written
+ *
+ * baseline - The baseline that the throughput is compared with, which may be empty
+ * save - Where the throughput is written as a new baseline, or NULL
+ * key - The key of the variant and the image
+ * throughput - The throughput, in megapixels per second
+ * result - "ok" if the results matched the reference, or why they didn't
+ *
+ * Returns 1 if the variant failed, by diverging or by being too much slower than the baseline, or
+ * 0 if not
+ */
+int finish_line(const baseline_t *baseline, FILE *save, const char *key, double throughput, const char *result) {
+	double expected = find_baseline(baseline, key);
+	if (expected > 0.0) {
+		printf(" %8.1f %8.1f", throughput, expected);
+		if (throughput < (1.0 - VERIFY_MAX_SLOWDOWN) * expected && strcmp(result, "ok") == 0) {
+			result = "SLOWER";
+		}
+	} else {
+		printf(" %8.1f %8s", throughput, "-");
+	}
+	if (save != NULL) {
+		fprintf(save, "%.2f %s\n", throughput, key);
+	}
+
+	printf(" %s\n", result);
+	return strcmp(result, "ok") != 0;
+}
+
+/* Checks a preview of an image on several threads against defog_process() with the exact kernels
+ * on a single thread, through every render in verify_preview_steps, and prints a line with the
+ * largest differences of any of them; its throughput is that of the renders alone, in the pixels
+ * that they cover
+ *
+ * params - The parameters to defog with, with neither refinement nor a pyramid
+ * config - The configuration that params come from
+ * opts - What is checked and recorded
+ * baseline - The baseline that the throughput is compared with, which may be empty
+ * save - Where the throughput is written as a new baseline, or NULL
+ * name - The name to print for the image
+ * img - The 8-bit BGR image
+ *
+ * Returns 1 if the preview failed or 0 if not
+ */
+int verify_preview(const defog_params_t *params, const verify_config_t *config, const verify_opts_t *opts,
+		const baseline_t *baseline, FILE *save, const char *name, IplImage *img) {
+	CvSize size = cvGetSize(img);
+	char variant_name[64];
+	snprintf(variant_name, sizeof(variant_name), "%s%spreview", config->name, config->name[0] != '\0' ? "/" : "");
+	printf("%-20s %5dx%-5d %-24s", name, size.width, size.height, variant_name);
+
+	// The reference is the exact kernels on a single thread, and the preview splits its tiles and
+	// rows between threads but is otherwise just as exact
+	defog_params_t ref_params = *params;
+	ref_params.num_threads = 1;
+	ref_params.use_simd = 0;
+	ref_params.fixed_point = 0;
+	ref_params.planar = 0;
+	ref_params.use_gpu = 0;
+	ref_params.light_step = 1;
+	defog_params_t preview_params = ref_params;
+	preview_params.num_threads = VERIFY_THREADS;
+
+	IplImage *ref_out = cvCreateImage(size, IPL_DEPTH_8U, 3);
+	IplImage *ref_map = cvCreateImage(size, IPL_DEPTH_8U, 1);
+	IplImage *out = cvCreateImage(size, IPL_DEPTH_8U, 3);
+	IplImage *map = cvCreateImage(size, IPL_DEPTH_8U, 1);
+	double *times = (double *)malloc(opts->runs * sizeof(double));
+	defog_ctx_t *ctx = defog_create(&preview_params, img->width, img->height);
+	int failed = times == NULL || ctx == NULL;
+	int out_diff = 0;
+	int map_diff = 0;
+	double out_psnr = INFINITY;
+	double map_psnr = INFINITY;
+	double pixels = 0.0;
+
+	// The first pass through the renders is the one compared, and it warms up the caches for the
+	// rest; each pass starts from a new preview, so it finds every tile again
+	for (int run = -1; run < opts->runs && !failed; run++) {
+		defog_preview_t *preview = defog_preview_create(ctx, img);
+		failed = preview == NULL;
+		double total = 0.0;
+		for (int i = 0; i < COUNT(verify_preview_steps) && !failed; i++) {
+			const verify_preview_step_t *step = &verify_preview_steps[i];
+			int window = step->window > 0 ? step->window : params->window;
+			int window_height = step->window > 0 ? step->window_height : params->window_height;
+			double floor = step->floor > 0.0 ? step->floor : params->transmission_floor;
+			CvRect roi = cvRect((int)(step->x * size.width), (int)(step->y * size.height),
+				(int)ceil(step->width * size.width), (int)ceil(step->height * size.height));
+
+			defog_stats_t stats;
+			defog_preview_set_window(preview, window, window_height);
+			defog_preview_set_floor(preview, floor);
+			failed = defog_preview_render(preview, roi, out, map) != 0;
+			defog_get_stats(ctx, &stats);
+			total += stats.total_time;
+			if (failed || run >= 0) {
+				continue;
+			}
+
+			// Only the part that was rendered, clamped to the image, is compared
+			CvRect view = roi;
+			view.width = view.x + view.width < size.width ? view.width : size.width - view.x;
+			view.height = view.y + view.height < size.height ? view.height : size.height - view.y;
+			pixels += (double)view.width * view.height;
+
+			ref_params.window = window;
+			ref_params.window_height = window_height;
+			ref_params.transmission_floor = floor;
+			defog_ctx_t *ref_ctx = defog_create(&ref_params, img->width, img->height);
+			failed = ref_ctx == NULL || defog_process(ref_ctx, img, ref_out, ref_map) != 0;
+			if (ref_ctx != NULL) {
+				defog_destroy(ref_ctx);
+			}
+			if (!failed) {
+				int step_out_diff, step_map_diff;
+				double step_out_psnr, step_map_psnr;
+				compare_images(ref_out, out, view, &step_out_diff, &step_out_psnr);
+				compare_images(ref_map, map, view, &step_map_diff, &step_map_psnr);
+				out_diff = step_out_diff > out_diff ? step_out_diff : out_diff;
+				map_diff = step_map_diff > map_diff ? step_map_diff : map_diff;
+				out_psnr = fmin(out_psnr, step_out_psnr);
+				map_psnr = fmin(map_psnr, step_map_psnr);
+			}
+		}
+		if (run >= 0) {
+			times[run] = total;
+		}
+		defog_preview_destroy(preview);
+	}
+
+	if (failed) {
+		printf(" FAILED, could not %s the image\n", ctx == NULL ? "defog" : "preview");
+	} else {
+		printf(" %8d %8d %8.2f %8.2f", out_diff, map_diff, out_psnr, map_psnr);
+		char key[VERIFY_KEY_LEN];
+		snprintf(key, sizeof(key), "%s %dx%d %s", variant_name, size.width, size.height, name);
+		failed = finish_line(baseline, save, key, pixels * 1e-6 / median_time(times, opts->runs),
+			out_diff > 0 || map_diff > 0 ? "DIVERGED" : "ok");
+	}
+
+	if (ctx != NULL) {
+		defog_destroy(ctx);
+	}
+	free(times);
+	cvReleaseImage(&ref_out);
+	cvReleaseImage(&ref_map);
+	cvReleaseImage(&out);
+	cvReleaseImage(&map);
+
+	return failed;
+}
+
+/* Checks every variant against the reference on one image with one configuration, printing a
+ * line for each
+ *
+ * params - The parameters to defog with, apart from those that the configuration and each variant
+ *          set
+ * config - The configuration
+ * opts - What is checked and recorded
+ * baseline - The baseline that the throughput is compared with, which may be empty
+ * save - Where the throughput is written as a new baseline, or NULL
+ * name - The name to print for the image
+ * img - The 8-bit BGR image
+ *
+ * Returns the number of variants that failed, counting the reference as one
+ */
+int verify_config(const defog_params_t *params, const verify_config_t *config, const verify_opts_t *opts,
+		const baseline_t *baseline, FILE *save, const char *name, IplImage *img) {
+	defog_params_t config_params;
+	if (!apply_config(params, config, &config_params)) {
+		return 0;
+	}
+
+	CvSize size = cvGetSize(img);
+	IplImage *ref_out = cvCreateImage(size, IPL_DEPTH_8U, 3);
+	IplImage *ref_map = cvCreateImage(size, IPL_DEPTH_8U, 1);
+	IplImage *out = cvCreateImage(size, IPL_DEPTH_8U, 3);
+	IplImage *map = cvCreateImage(size, IPL_DEPTH_8U, 1);
+	int failed = 0;
+
+	for (int v = -1; v < COUNT(verify_variants); v++) {
+		const verify_variant_t *variant = v >= 0 ? &verify_variants[v] : &verify_reference;
+		char variant_name[64];
+		snprintf(variant_name, sizeof(variant_name), "%s%s%s", config->name, config->name[0] != '\0' ? "/" : "",
+			variant->name);
+		printf("%-20s %5dx%-5d %-24s", name, size.width, size.height, variant_name);
+
+		// Sampling uses the command line's step if it's coarser, and tiled mode always uses a single
+		// light, so it can't match a grid of them
+		verify_variant_t sampled;
+		if (variant->light_step > 1 && params->light_step > variant->light_step) {
+			sampled = *variant;
+			sampled.light_step = params->light_step;
+			variant = &sampled;
+		}
+		if (variant->tile_size > 0 && config_params.light_grid > 0) {
+			printf(" skipped, tiled mode uses a single light\n");
+			continue;
+		}
+
+		// Each light of a grid is only sampled from its own tile, and in pyramid mode from the
+		// smallest level
+		int tiles = config_params.light_grid > 0 ? config_params.light_grid * config_params.light_grid : 1;
+		double samples = (double)(size.width >> config_params.pyramid_levels) * (size.height >> config_params.pyramid_levels) /
+			tiles / ((double)variant->light_step * variant->light_step);
+		if (variant->light_step > 1 && samples < VERIFY_MIN_SAMPLES) {
+			printf(" skipped, too few pixels to sample the light from\n");
+			continue;
+		}
+
+		double throughput = 0.0;
+		int status = defog_variant(&config_params, variant, opts->runs, img, v >= 0 ? out : ref_out, v >= 0 ? map : ref_map,
+			&throughput);
+		if (status != 0) {
+			printf(" %s\n", status < 0 ? "skipped, no GPU is available" : "FAILED, could not defog the image");
+			failed += status > 0;
+
+			// Without the reference, there's nothing to check the variants against
+			if (v < 0) {
+				break;
+			}
+			continue;
+		}
+
+		// Compare the results with the reference's
+		const char *result = "ok";
+		if (v >= 0) {
+			int out_diff, map_diff;
+			double out_psnr, map_psnr;
+			compare_images(ref_out, out, cvRect(0, 0, size.width, size.height), &out_diff, &out_psnr);
+			compare_images(ref_map, map, cvRect(0, 0, size.width, size.height), &map_diff, &map_psnr);
+			printf(" %8d %8d %8.2f %8.2f", out_diff, map_diff, out_psnr, map_psnr);
+			if (out_diff > variant->max_diff || map_diff > variant->max_diff ||
+					(out_diff > 0 && out_psnr < variant->min_psnr) || (map_diff > 0 && map_psnr < variant->min_psnr)) {
+				result = "DIVERGED";
+			}
+		} else {
+			printf(" %8s %8s %8s %8s", "-", "-", "-", "-");
+		}
+
+		// Then the throughput with the baseline's
+		char key[VERIFY_KEY_LEN];
+		snprintf(key, sizeof(key), "%s %dx%d %s", variant_name, size.width, size.height, name);
+		failed += finish_line(baseline, save, key, throughput, result);
+	}
+
+	// Previews are never refined or downsampled, so they can only be checked without either
+	if (config_params.refine_radius == 0 && config_params.pyramid_levels == 0) {
+		failed += verify_preview(&config_params, config, opts, baseline, save, name, img);
+	}
+
+	cvReleaseImage(&ref_out);
+	cvReleaseImage(&ref_map);
+	cvReleaseImage(&out);
+	cvReleaseImage(&map);
+
+	return failed;
+}
+
+/* Checks every variant against the reference on one image, with every configuration
+ *
+ * params - The parameters to defog with, apart from those that each configuration and variant set
+ * opts - What is checked and recorded
+ * baseline - The baseline that the throughput is compared with, which may be empty
+ * save - Where the throughput is written as a new baseline, or NULL
+ * name - The name to print for the image
+ * img - The 8-bit BGR image
+ *
+ * Returns the number of variants that failed
+ */
+int verify_image(const defog_params_t *params, const verify_opts_t *opts, const baseline_t *baseline, FILE *save,
+		const char *name, IplImage *img) {
+	int failed = 0;
+	for (int i = 0; i < COUNT(verify_configs); i++) {
+		failed += verify_config(params, &verify_configs[i], opts, baseline, save, name, img);
+	}
+
+	return failed;
+}
+
+/* Checks every fast path against the reference on synthetic images and then on real images,
+ * printing the differences and the throughput of each
+ *
+ * params - The parameters to defog with; the threads, SIMD, fixed point, planar, GPU, and light
+ *          sampling parameters are set by each variant, and each configuration turns on another
+ *          stage
+ * opts - What is checked and recorded
+ * files - The paths of real color images to check
+ * num_files - The number of paths in files, which may be 0
+ *
+ * Returns 0 if every variant stayed within its tolerance and its baseline, or 1 otherwise
+ */
+int run_verify(const defog_params_t *params, const verify_opts_t *opts, const char *const *files, int num_files) {
+	// A missing baseline isn't an error, so that the first run can be the one that records it
+	baseline_t baseline;
+	if (opts->baseline != NULL && load_baseline(opts->baseline, &baseline) != 0) {
+		fprintf(stderr, "Could not read the baseline %s, so throughput won't be checked\n", opts->baseline);
+	} else if (opts->baseline == NULL) {
+		memset(&baseline, 0, sizeof(baseline));
+	}
+	FILE *save = NULL;
+	if (opts->save_baseline != NULL && (save = fopen(opts->save_baseline, "w")) == NULL) {
+		fprintf(stderr, "Could not write the baseline %s\n", opts->save_baseline);
+		free_baseline(&baseline);
+		return 1;
+	}
+
+	printf("The median of %d runs per variant, after a warm-up run; the reference is the exact scalar kernels on a\n",
+		opts->runs);
+	printf("single thread. Exact variants must match it exactly, and the others must stay within one step at a PSNR\n");
+	printf("of at least %.0f dB; throughput, in MP/s, must stay within %.0f%% of the baseline, if there is one\n\n",
+		VERIFY_MIN_PSNR, VERIFY_MAX_SLOWDOWN * 100.0);
+	printf("%-20s %11s %-24s %8s %8s %8s %8s %8s %8s %s\n", "image", "size", "variant", "out_diff", "map_diff", "out_psnr",
+		"map_psnr", "MP/s", "baseline", "result");
+
+	int failed = 0;
+	for (int i = 0; i < COUNT(verify_sizes); i++) {
+		IplImage *img = make_synthetic(verify_sizes[i]);
+		if (img == NULL) {
+			fprintf(stderr, "Could not create a %dx%d image\n", verify_sizes[i].width, verify_sizes[i].height);
+			failed++;
+			continue;
+		}
+		failed += verify_image(params, opts, &baseline, save, "synthetic", img);
+		cvReleaseImage(&img);
+	}
+
+	for (int i = 0; i < num_files; i++) {
+		IplImage *img = (IplImage *)cvLoadImage(files[i], CV_LOAD_IMAGE_COLOR);
+		if (img == NULL) {
+			fprintf(stderr, "Could not read image %s\n", files[i]);
+			failed++;
+			continue;
+		}
+		failed += verify_image(params, opts, &baseline, save, files[i], img);
+		cvReleaseImage(&img);
+	}
+
+	if (save != NULL) {
+		fclose(save);
+	}
+	free_baseline(&baseline);
+	printf("\n%s\n", failed > 0 ? "FAILED" : "All variants passed");
+
+	return failed > 0;
+}
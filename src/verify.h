@@ -0,0 +1,33 @@
+/* Copyright 2014-2015 David Pearson.
+ * All rights reserved.
+ *
+ * A regression check for the fast paths of the defogging pipeline: every image is defogged with
+ * the exact scalar kernels on a single thread, and then with each of the faster variants, whose
+ * maps and outputs have to stay within a tolerance of the reference, and whose throughput can be
+ * held to a baseline recorded by an earlier run.
+ */
+
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include "defog.h"
+
+// How much each variant's throughput may fall below its baseline, as a fraction of the baseline
+#define VERIFY_MAX_SLOWDOWN 0.25
+
+// What a verification run checks and records
+typedef struct {
+	// How many times each image is defogged with each variant, after a warm-up run, to measure its
+	// throughput, which is taken from the median run
+	int runs;
+
+	// A baseline written by an earlier run that the throughput is compared with, or NULL
+	const char *baseline;
+
+	// Where the throughput of this run is written as a new baseline, or NULL
+	const char *save_baseline;
+} verify_opts_t;
+
+int run_verify(const defog_params_t *params, const verify_opts_t *opts, const char *const *files, int num_files);
+
+#endif
@@ -0,0 +1,18 @@
+# Copyright 2014-2015 David Pearson.
+# All rights reserved.
+#
+# The synthetic hazy scene that the tests defog, shared between them so that they all work from
+# the same image: a pattern of colors with haze that thickens towards the bottom.
+
+
+def hazy_pixel(x, y, height):
+	"""Returns the three channel values of a pixel of the scene, in [0, 255], in the order that
+	they're stored in, for an image of the given height"""
+	haze = 150 * y // height
+	scene = ((x * 7 + y * 3) % 96, (x * 5) % 128, (y * 11 + x) % 80)
+	return tuple(min(255, c + haze) for c in scene)
+
+
+def hazy_image(width, height):
+	"""Returns the scene as packed 8-bit pixels, row by row"""
+	return b''.join(bytes(hazy_pixel(x, y, height)) for y in range(height) for x in range(width))
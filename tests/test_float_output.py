@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+# Copyright 2014-2015 David Pearson.
+# All rights reserved.
+#
+# Checks that floating point images are written in a format that holds them: the default output
+# of a floating point input is an EXR rather than a PNG, an output path that can't hold floating
+# point values is rejected, and a floating point output read back in matches the defogged 8-bit
+# image, rather than having been truncated to 8 bits.
+#
+# Usage: python3 tests/test_float_output.py [PATH_TO_DEFOG]
+
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+
+from synthetic import hazy_image, hazy_pixel
+
+WIDTH = 96
+HEIGHT = 64
+
+# How far the floating point output may be from the 8-bit output, in 8-bit steps, once it's
+# rounded; floating point values above 1 and below 0 aren't clipped, so they're clamped first
+TOLERANCE = 1.0
+
+
+def write_ppm(path):
+	with open(path, 'wb') as f:
+		f.write(b'P6\n%d %d\n255\n' % (WIDTH, HEIGHT))
+		f.write(hazy_image(WIDTH, HEIGHT))
+
+
+def write_pfm(path):
+	"""Writes the same scene as write_ppm() as floating point values in [0, 1]"""
+	with open(path, 'wb') as f:
+		f.write(b'PF\n%d %d\n-1.0\n' % (WIDTH, HEIGHT))
+		# PFM rows run from the bottom up
+		for y in reversed(range(HEIGHT)):
+			for x in range(WIDTH):
+				f.write(struct.pack('<3f', *(c / 255.0 for c in hazy_pixel(x, y, HEIGHT))))
+
+
+def read_header(path, count):
+	"""Returns the first count fields of a PNM-style header and the data that follows it, which starts
+	after the single whitespace byte that ends the last field"""
+	with open(path, 'rb') as f:
+		data = f.read()
+	fields = []
+	pos = 0
+	while len(fields) < count:
+		while data[pos:pos + 1].isspace():
+			pos += 1
+		end = pos
+		while not data[end:end + 1].isspace():
+			end += 1
+		fields.append(data[pos:end])
+		pos = end
+	return fields, data[pos + 1:]
+
+
+def read_ppm(path):
+	"""Returns the rows of RGB values of a binary 8-bit PPM"""
+	fields, pixels = read_header(path, 4)
+	assert fields[0] == b'P6' and fields[3] == b'255', '%s is not an 8-bit PPM' % path
+	width, height = int(fields[1]), int(fields[2])
+	return [[tuple(pixels[(y * width + x) * 3:(y * width + x) * 3 + 3]) for x in range(width)] for y in range(height)]
+
+
+def read_pfm(path):
+	"""Returns the rows of RGB values of a color PFM, from the top down"""
+	fields, pixels = read_header(path, 4)
+	assert fields[0] == b'PF', '%s is not a color PFM' % path
+	width, height, scale = int(fields[1]), int(fields[2]), float(fields[3])
+	endian = '<' if scale < 0 else '>'
+	values = struct.unpack('%s%df' % (endian, width * height * 3), pixels[:width * height * 12])
+	rows = [[tuple(values[(y * width + x) * 3:(y * width + x) * 3 + 3]) for x in range(width)] for y in range(height)]
+	return rows[::-1]
+
+
+def defog(binary, cwd, *args):
+	return subprocess.run([binary, '--headless', '--no-map', '--no-simd'] + list(args), cwd=cwd,
+		stdout=subprocess.PIPE, stderr=subprocess.PIPE).returncode
+
+
+def main():
+	binary = os.path.abspath(sys.argv[1] if len(sys.argv) > 1 else './defog')
+	failures = []
+
+	with tempfile.TemporaryDirectory() as tmp:
+		write_ppm(os.path.join(tmp, 'hazy.ppm'))
+		write_pfm(os.path.join(tmp, 'hazy.pfm'))
+
+		# Without --out, a floating point image goes to an EXR, never to a PNG
+		if defog(binary, tmp, 'hazy.pfm') != 0:
+			failures.append('defogging a floating point image with the default output failed')
+		if not os.path.exists(os.path.join(tmp, 'out.exr')) or os.path.exists(os.path.join(tmp, 'out.png')):
+			failures.append('the default output of a floating point image is not out.exr')
+
+		# An output that can't hold floating point values is refused before anything is written
+		if defog(binary, tmp, '--out', 'float.png', 'hazy.pfm') == 0:
+			failures.append('writing a floating point image to a PNG was not rejected')
+		if os.path.exists(os.path.join(tmp, 'float.png')):
+			failures.append('a rejected PNG output was written anyway')
+
+		# Read back a floating point output and compare it with the 8-bit output of the same scene
+		if defog(binary, tmp, '--out', 'float.pfm', 'hazy.pfm') != 0 or defog(binary, tmp, '--out', 'ref.ppm', 'hazy.ppm') != 0:
+			failures.append('defogging the floating point or the 8-bit image failed')
+		else:
+			out = read_pfm(os.path.join(tmp, 'float.pfm'))
+			ref = read_ppm(os.path.join(tmp, 'ref.ppm'))
+			values = [c for row in out for pixel in row for c in pixel]
+			worst = max(abs(min(255.0, max(0.0, o * 255.0)) - r) for out_row, ref_row in zip(out, ref) for o_px, r_px in zip(out_row, ref_row)
+				for o, r in zip(o_px, r_px))
+			between = sum(1 for v in values if 0.01 < v < 0.99)
+			mean = sum(values) / len(values)
+			print('floating point output: mean %.3f, %d of %d values in (0.01, 0.99), worst difference %.2f steps' %
+				(mean, between, len(values), worst))
+			if len(out) != HEIGHT or len(out[0]) != WIDTH:
+				failures.append('the floating point output is %dx%d rather than %dx%d' % (len(out[0]), len(out), WIDTH, HEIGHT))
+			if between < len(values) // 2 or mean < 0.05:
+				failures.append('the floating point output has been truncated to 0 and 1')
+			if worst > TOLERANCE:
+				failures.append('the floating point output is %.2f steps from the 8-bit output' % worst)
+
+	for failure in failures:
+		print('FAIL: %s' % failure)
+	if not failures:
+		print('PASS')
+	return 1 if failures else 0
+
+
+if __name__ == '__main__':
+	sys.exit(main())
@@ -0,0 +1,128 @@
+#!/usr/bin/env python3
+# Copyright 2014-2015 David Pearson.
+# All rights reserved.
+#
+# Checks that the server spreads concurrent requests across its workers: several clients send
+# small images at once, first to a server with one worker and then to one with a worker per core,
+# and the second has to answer them faster, since no worker should sit idle while images queue up
+# behind another one. Every response is checked against the single worker's too.
+#
+# Usage: python3 tests/test_server_throughput.py [PATH_TO_DEFOG]
+
+import os
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+from synthetic import hazy_image
+
+MAGIC = 0x44464731
+WIDTH = 320
+HEIGHT = 240
+CLIENTS = 4
+REQUESTS = 12
+
+# How much faster a worker per core (up to one per client) has to be than a single worker
+MIN_SPEEDUP = 1.3
+
+
+def read_exactly(sock, length):
+	data = bytearray()
+	while len(data) < length:
+		chunk = sock.recv(length - len(data))
+		if not chunk:
+			raise IOError('the server closed the connection')
+		data += chunk
+	return bytes(data)
+
+
+def run_client(path, image, latencies, outputs, errors):
+	"""Sends REQUESTS images over one connection, one after another, recording how long each took"""
+	try:
+		sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+		sock.connect(path)
+		for _ in range(REQUESTS):
+			start = time.monotonic()
+			sock.sendall(struct.pack('!5I', MAGIC, 0, WIDTH, HEIGHT, len(image)) + image)
+			magic, status, width, height, out_length, map_length = struct.unpack('!6I', read_exactly(sock, 24))
+			out = read_exactly(sock, out_length + map_length)
+			latencies.append(time.monotonic() - start)
+			if magic != MAGIC or status != 0 or (width, height) != (WIDTH, HEIGHT):
+				errors.append('request failed with status %d' % status)
+			outputs.add(out)
+		sock.close()
+	except (IOError, OSError) as e:
+		errors.append(str(e))
+
+
+def measure(binary, workers, image):
+	"""Runs a server with the given number of workers against CLIENTS clients at once
+
+	Returns the number of images defogged per second, the 99th percentile latency, the set of
+	distinct outputs, and any errors"""
+	with tempfile.TemporaryDirectory() as tmp:
+		path = os.path.join(tmp, 'defog.sock')
+		server = subprocess.Popen([binary, '--serve', path, '--workers', str(workers)], stderr=subprocess.DEVNULL)
+		try:
+			for _ in range(100):
+				if os.path.exists(path):
+					break
+				time.sleep(0.05)
+
+			latencies = []
+			outputs = set()
+			errors = []
+			threads = [threading.Thread(target=run_client, args=(path, image, latencies, outputs, errors))
+				for _ in range(CLIENTS)]
+			start = time.monotonic()
+			for thread in threads:
+				thread.start()
+			for thread in threads:
+				thread.join()
+			elapsed = time.monotonic() - start
+		finally:
+			server.terminate()
+			server.wait()
+
+	latencies.sort()
+	p99 = latencies[min(len(latencies) - 1, int(len(latencies) * 0.99))] if latencies else 0.0
+	return len(latencies) / elapsed, p99, outputs, errors
+
+
+def main():
+	binary = os.path.abspath(sys.argv[1] if len(sys.argv) > 1 else './defog')
+	cores = os.cpu_count() or 1
+	workers = min(CLIENTS, cores)
+	image = hazy_image(WIDTH, HEIGHT)
+	failures = []
+
+	single_rate, single_p99, outputs, errors = measure(binary, 1, image)
+	failures += errors
+	print('1 worker: %.1f images/s, p99 latency %.1f ms' % (single_rate, single_p99 * 1000))
+	if workers < 2:
+		print('SKIP: only one core, so the speedup of more workers can\'t be measured')
+	else:
+		rate, p99, more_outputs, errors = measure(binary, workers, image)
+		failures += errors
+		outputs |= more_outputs
+		print('%d workers: %.1f images/s, p99 latency %.1f ms' % (workers, rate, p99 * 1000))
+		if rate < single_rate * MIN_SPEEDUP:
+			failures.append('%d workers are only %.2fx as fast as one' % (workers, rate / single_rate))
+
+	# Every request sent the same image, so every response has to be the same too
+	if len(outputs) != 1:
+		failures.append('the responses differ between requests or workers')
+
+	for failure in failures:
+		print('FAIL: %s' % failure)
+	if not failures:
+		print('PASS')
+	return 1 if failures else 0
+
+
+if __name__ == '__main__':
+	sys.exit(main())